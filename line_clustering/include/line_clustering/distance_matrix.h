@@ -0,0 +1,120 @@
+#ifndef LINE_CLUSTERING_DISTANCE_MATRIX_H_
+#define LINE_CLUSTERING_DISTANCE_MATRIX_H_
+
+#include <cmath>
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+#include <glog/logging.h>
+#include <opencv2/core.hpp>
+
+namespace line_clustering {
+
+// Symmetric matrix of the distances between n elements, with zeros on the
+// diagonal. Only the upper triangle is stored, row after row: the distances
+// (i, j) for j > i are contiguous, therefore the matrix takes
+// n * (n - 1) / 2 floats instead of the n * n of a full cv::Mat. The rows are
+// computed in parallel, with any pairwise metric.
+class PackedDistanceMatrix {
+ public:
+  PackedDistanceMatrix() {}
+  explicit PackedDistanceMatrix(size_t size) { resize(size); }
+
+  // Sets the number of elements. All the distances are set to zero.
+  void resize(size_t size) {
+    size_ = size;
+    distances_.assign(size * (size - (size > 0 ? 1 : 0)) / 2, 0.0f);
+  }
+  size_t size() const { return size_; }
+  // Number of distances stored.
+  size_t numEntries() const { return distances_.size(); }
+
+  // Returns the distance between the elements i and j (in any order).
+  float operator()(size_t i, size_t j) const {
+    if (i == j) return 0.0f;
+    return i < j ? distances_[index(i, j)] : distances_[index(j, i)];
+  }
+  // Sets the distance between the elements i and j (i != j).
+  void set(size_t i, size_t j, float distance) {
+    CHECK_NE(i, j);
+    distances_[i < j ? index(i, j) : index(j, i)] = distance;
+  }
+  // Returns the distances (i, i + 1), ..., (i, size - 1), stored
+  // contiguously.
+  const float* row(size_t i) const { return distances_.data() + rowStart(i); }
+  float* row(size_t i) { return distances_.data() + rowStart(i); }
+
+  // Computes the distances between all the pairs of elements with metric,
+  // a function that returns the distance between two elements (e.g.
+  // computePerpendicularDistanceLines). The rows are distributed among
+  // num_threads threads (0: std::thread::hardware_concurrency()), the result
+  // does not depend on the number of threads.
+  template <typename Element, typename Metric>
+  void compute(const std::vector<Element>& elements, const Metric& metric,
+               size_t num_threads = 1) {
+    resize(elements.size());
+    forEachRow(num_threads, [&](size_t i) {
+      float* distances = row(i);
+      for (size_t j = i + 1; j < size_; ++j) {
+        distances[j - i - 1] = metric(elements[i], elements[j]);
+      }
+    });
+  }
+
+  // Computes the euclidean distances between vectors, e.g. the lines and
+  // hessians of KMeansCluster. The coordinates are first transposed so that
+  // the distances of a row are accumulated dimension after dimension over
+  // contiguous arrays, in loops the compiler vectorizes.
+  template <int kDimension>
+  void computeEuclidean(const std::vector<cv::Vec<float, kDimension>>& vectors,
+                        size_t num_threads = 1) {
+    const size_t n = vectors.size();
+    resize(n);
+    std::vector<float> coordinates(kDimension * n);
+    for (size_t i = 0; i < n; ++i) {
+      for (int k = 0; k < kDimension; ++k) {
+        coordinates[k * n + i] = vectors[i][k];
+      }
+    }
+    forEachRow(num_threads, [&](size_t i) {
+      float* distances = row(i);
+      const size_t length = n - i - 1;
+      for (int k = 0; k < kDimension; ++k) {
+        const float* others = coordinates.data() + k * n + i + 1;
+        const float coordinate = coordinates[k * n + i];
+        for (size_t j = 0; j < length; ++j) {
+          const float difference = others[j] - coordinate;
+          distances[j] += difference * difference;
+        }
+      }
+      for (size_t j = 0; j < length; ++j) {
+        distances[j] = std::sqrt(distances[j]);
+      }
+    });
+  }
+
+  // Conversions from and to a square matrix of type CV_32FC1 of which only
+  // the upper triangle is used (the lower triangle of the returned matrix is
+  // zero), as returned by KMeansCluster::getDistanceMatrix.
+  void fromMat(const cv::Mat& dist_mat);
+  cv::Mat toMat() const;
+
+ private:
+  // Offset of the distance (i, i + 1).
+  size_t rowStart(size_t i) const { return i * (2 * size_ - i - 1) / 2; }
+  // Offset of the distance (i, j), for i < j.
+  size_t index(size_t i, size_t j) const { return rowStart(i) + j - i - 1; }
+  // Runs function on the rows 0 to size - 2, distributed among num_threads
+  // threads. Each thread takes the next row that is not processed yet, so
+  // that the long first rows do not all go to the same thread.
+  void forEachRow(size_t num_threads,
+                  const std::function<void(size_t)>& function);
+
+  size_t size_ = 0;
+  std::vector<float> distances_;
+};
+
+}  // namespace line_clustering
+
+#endif  // LINE_CLUSTERING_DISTANCE_MATRIX_H_
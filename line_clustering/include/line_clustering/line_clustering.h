@@ -2,6 +2,8 @@
 #define LINE_CLUSTERING_LINE_CLUSTERING_H_
 
 #include "line_clustering/common.h"
+#include "line_clustering/distance_matrix.h"
+#include "line_clustering/segment_index.h"
 #include "line_detection/line_detection.h"
 #include "line_detection/line_detection_inl.h"
 
@@ -30,6 +32,7 @@ class KMeansCluster {
   void setNumberOfClusters(unsigned int num_clusters);
   void setLines(const std::vector<cv::Vec6f>& lines3D);
   void setLines(const std::vector<line_detection::LineWithPlanes>& lines3D);
+  void setLines(const line_detection::LineBatch& lines3D);
   // Computes the means of the lines that are used to cluster them.
   void computeLineMeans();
   // Performs the clustering on the means of lines.
@@ -38,7 +41,12 @@ class KMeansCluster {
   // adjacent to the lines.
   void initClusteringWithHessians(double scale_hessians);
   void runOnLinesAndHessians();
-  // Returns distance matrix.
+  // Computes the euclidean distances between the lines and hessians (see
+  // initClusteringWithHessians), with the rows distributed among num_threads
+  // threads (0: one per core).
+  void computeDistanceMatrix(PackedDistanceMatrix* dist_mat,
+                             size_t num_threads = 1);
+  // Returns distance matrix (only the upper triangle is filled).
   cv::Mat getDistanceMatrix();
   // Returns the lines.
   std::vector<cv::Vec6f> getLines();
@@ -55,6 +63,114 @@ class KMeansCluster {
   std::vector<cv::Vec<float, 14>> lines_and_hessians_;
 };
 
+// A class that clusters the lines of a stream of frames with k-means on their
+// means, as KMeansCluster::runLineMeans does. Instead of clustering every
+// frame from scratch, the centers of the previous frame are moved with the
+// camera and refined with a few mini-batch updates (Sculley, "Web-scale
+// k-means clustering", 2010), in which every center moves towards its lines
+// with a step of 1 / (number of lines that updated it so far). Clusters are
+// added where lines appear and removed where they disappear, and a cluster
+// keeps its label as long as it exists.
+class StreamingKMeansCluster {
+ public:
+  StreamingKMeansCluster();
+  StreamingKMeansCluster(unsigned int num_clusters);
+
+  // Sets the number of clusters: as long as there are fewer clusters than
+  // num_clusters, new ones are started on the lines of the frame (sampled as
+  // in k-means++).
+  void setNumberOfClusters(unsigned int num_clusters);
+  // Sets the number of lines of a mini-batch (default 0: all the lines of the
+  // frame) and the maximum number of mini-batch updates per frame (default:
+  // 10).
+  void setMiniBatch(size_t batch_size, size_t num_iterations);
+  // Sets the factor by which the weight of the lines of the previous frames is
+  // multiplied at every new frame (default: 0.5). With 0, the centers are
+  // only used as a starting point, with 1 they move less and less.
+  void setForgettingFactor(double forgetting_factor);
+  // Sets the distance (in m) from every center beyond which a line starts a
+  // new cluster, even if there are already num_clusters clusters (default 0:
+  // never).
+  void setNewClusterDistance(double new_cluster_distance);
+  // Sets the number of consecutive frames a cluster may have no lines before
+  // it is removed (default 0: it is removed in the first frame without
+  // lines).
+  void setMaxFramesWithoutLines(size_t max_frames_without_lines);
+  // Sets the seed of the sampling of the mini-batches and new clusters.
+  void setSeed(unsigned int seed);
+  // Removes all the clusters, e.g. when the stream restarts.
+  void reset();
+
+  // Clusters the lines of a new frame and stores their labels in cluster_idx_.
+  // Input: lines3D:    The lines of the frame, in the camera frame.
+  //
+  //        transform_current_previous: Transformation from the camera frame of
+  //                    the previous call to the one of lines3D, as in
+  //                    line_detection::FrameOptions.
+  void cluster(const std::vector<cv::Vec6f>& lines3D,
+               const cv::Matx44f& transform_current_previous =
+                   cv::Matx44f::eye());
+  void cluster(const std::vector<line_detection::LineWithPlanes>& lines3D,
+               const cv::Matx44f& transform_current_previous =
+                   cv::Matx44f::eye());
+
+  // Returns the number of clusters.
+  size_t getNumberOfClusters() const;
+  // Returns the center of the cluster with the given label.
+  cv::Vec3f getCenter(int label) const;
+  // This array contains the labels of the lines of the last frame. A label is
+  // the index of a cluster: the index of a removed cluster is reused by the
+  // next new one.
+  std::vector<int> cluster_idx_;
+
+ private:
+  // Returns the index of the nearest cluster to point and the squared
+  // distance to its center (-1 and infinity if there is no cluster).
+  int findNearestCluster(const cv::Vec3f& point, float* square_distance) const;
+  // Starts a new cluster at point.
+  void addCluster(const cv::Vec3f& point);
+  // Adds clusters until there are K_ of them (or a cluster for every line),
+  // and for the lines farther than new_cluster_distance_ from every center.
+  void addClusters();
+  // Moves the centers with mini-batch updates.
+  void updateCenters();
+
+  unsigned int K_;
+  bool k_set_;
+  size_t batch_size_ = 0;
+  size_t num_iterations_ = 10;
+  double forgetting_factor_ = 0.5;
+  double new_cluster_distance_ = 0.0;
+  size_t max_frames_without_lines_ = 0;
+  std::default_random_engine generator_;
+  // The means of the lines of the current frame.
+  std::vector<cv::Vec3f> line_means_;
+  // Per cluster: whether it exists, its center, the (faded) number of lines
+  // that updated it and the number of consecutive frames without lines.
+  std::vector<unsigned char> active_;
+  std::vector<cv::Vec3f> centers_;
+  std::vector<double> counts_;
+  std::vector<size_t> frames_without_lines_;
+};
+
+// Algorithm used by KMedoidsCluster::cluster.
+enum class KMedoidsMethod {
+  // Starts from randomly sampled medoids and alternates between assigning
+  // every node to its nearest medoid and moving the medoid of every cluster
+  // to the node with the least summed distance to the others.
+  ALTERNATE = 0,
+  // FasterPAM (Schubert and Rousseeuw, "Fast and eager k-medoids clustering",
+  // 2021), started from medoids sampled as in k-means++. The swaps of a
+  // medoid with a node are evaluated in O(n) (for all the medoids at once)
+  // from the distances of every node to its nearest and second nearest
+  // medoids, which are kept up to date.
+  FASTER_PAM = 1,
+  // CLARA (Kaufman and Rousseeuw): FasterPAM is run on several random
+  // samples of the nodes, and the medoids with the least total distance over
+  // all the nodes are kept. For large numbers of nodes.
+  CLARA = 2
+};
+
 // A class that performs clustering of features based on the kmediods algorithm.
 // The advantage of this method is, that it can use a precomputed distance
 // matrix, that stores the distance between all nodes. This means, an arbitrary
@@ -63,8 +179,21 @@ class KMedoidsCluster {
  public:
   KMedoidsCluster();
   KMedoidsCluster(const cv::Mat& dist_mat, size_t K);
+  KMedoidsCluster(const PackedDistanceMatrix& dist_mat, size_t K);
+  // Sets the distance matrix. Only the upper triangle of a cv::Mat (of type
+  // CV_32FC1) is used; it is copied into a packed matrix.
   void setDistanceMatrix(const cv::Mat& dist_mat);
+  void setDistanceMatrix(const PackedDistanceMatrix& dist_mat);
   void setK(size_t K);
+  // Sets the seed used to sample the initial centers (default: 1). The
+  // clustering of a distance matrix is the same for the same seed.
+  void setSeed(unsigned int seed);
+  // Sets the algorithm used (default: KMedoidsMethod::ALTERNATE).
+  void setMethod(KMedoidsMethod method);
+  // Sets the number of samples drawn by KMedoidsMethod::CLARA and their size
+  // (0: 40 + 2 * K nodes, as suggested by Kaufman and Rousseeuw). The medoids
+  // found so far are always part of the next sample.
+  void setClaraParameters(size_t num_samples, size_t sample_size);
   // Run the clustering.
   void cluster();
   std::vector<size_t> getLabels();
@@ -72,14 +201,17 @@ class KMedoidsCluster {
  protected:
   // Initialize clustering.
   void init();
+  // Runs the algorithm of KMedoidsMethod::ALTERNATE.
+  void clusterAlternate();
+  // Runs KMedoidsMethod::CLARA, and sets centers_.
+  void clusterClara();
   // Assign every node to its nearest center.
   void assignDataPoints();
   // Within a cluster, choose the node as a center so that the sum of all
   // distances to this center is minimized.
   void reasssignMediods();
-  // Reads out the distance matrix. Additionally guarantees that only the upper
-  // triangle of the matrix is accessed.
-  double dist(size_t i, size_t j);
+  // Reads out the distance matrix.
+  double dist(size_t i, size_t j) { return dist_mat_(i, j); }
   // Stores the cluster centers.
   std::vector<size_t> centers_;
   // For every features, this vector stores the index of the if its
@@ -92,13 +224,80 @@ class KMedoidsCluster {
   // Number of clusters.
   size_t K_;
   // Distance matrix. dist_mat(i, j) denotes the distance between node i and j.
-  // It is sufficient if the its a upper triangular matrix.
-  cv::Mat dist_mat_;
+  PackedDistanceMatrix dist_mat_;
   // Number of points equals number of nodes.
   size_t num_points_;
   // These are used to make sure that k and the distance matrix are set before
   // clustering.
   bool k_set_, dist_mat_set_;
+  unsigned int seed_ = 1;
+  KMedoidsMethod method_ = KMedoidsMethod::ALTERNATE;
+  size_t clara_num_samples_ = 5;
+  size_t clara_sample_size_ = 0;
+};
+
+// A class that clusters lines by density, with DBSCAN (Ester et al., 1996):
+// the lines with at least min_num_neighbours neighbours are core lines, the
+// neighbours of a core line are in its cluster, and the lines that are in no
+// cluster are noise. Unlike with KMeansCluster and KMedoidsCluster, the number
+// of clusters does not need to be known. Two lines are neighbours if the
+// distance between their nearest key points (start, end or midpoint, which
+// includes the distances of computeSquareNearestDifferenceLines and
+// computeSquareMeanDifferenceLines) is at most max_distance, and optionally
+// if they are near coplanar (computePerpendicularDistanceLines) and lie on a
+// similar plane. The neighbours are found with a SegmentIndex instead of a
+// distance matrix, which takes O(n log n) for a bounded density of lines.
+class DBSCANCluster {
+ public:
+  // Label of the lines that are in no cluster.
+  static constexpr int kNoise = -1;
+
+  DBSCANCluster();
+  DBSCANCluster(double max_distance, size_t min_num_neighbours);
+
+  void setLines(const std::vector<cv::Vec6f>& lines3D);
+  // With the planes of the lines, setPlaneSimilarity can be used.
+  void setLines(const std::vector<line_detection::LineWithPlanes>& lines3D);
+  // Sets the maximum distance (in m) between the key points of two
+  // neighbours (default: 0.05).
+  void setMaxDistance(double max_distance);
+  // Sets the number of neighbours a line needs to be a core line, itself
+  // not included (default: 2).
+  void setMinNumNeighbours(size_t min_num_neighbours);
+  // Sets the maximum distance between the (infinite) lines through two
+  // neighbours, see computePerpendicularDistanceLines (default: infinity).
+  void setMaxPerpendicularDistance(double max_perpendicular_distance);
+  // Requires two neighbours to have a similar plane: planes whose normals
+  // have an angle with a cosine of at least min_cos_angle (in absolute value)
+  // and whose distances to the origin differ by at most max_offset (in m).
+  // A line without planes (normals of zero) may still have neighbours.
+  // Default: min_cos_angle = 0 (no requirement).
+  void setPlaneSimilarity(double min_cos_angle, double max_offset);
+  // Run the clustering.
+  void cluster();
+  // Returns the label of every line: the index of its cluster, or kNoise.
+  std::vector<int> getLabels();
+  size_t getNumberOfClusters();
+
+ private:
+  // Finds the lines that are neighbours of the given one.
+  void findNeighbours(size_t line, std::vector<size_t>* neighbours) const;
+  // Checks the perpendicular distance and the planes of two lines that have
+  // near key points.
+  bool areNeighbours(size_t line1, size_t line2) const;
+
+  std::vector<cv::Vec6f> lines_;
+  std::vector<std::array<cv::Vec4f, 2>> hessians_;
+  bool lines_set_, hessians_set_;
+  double max_distance_ = 0.05;
+  size_t min_num_neighbours_ = 2;
+  double max_perpendicular_distance_ =
+      std::numeric_limits<double>::infinity();
+  double min_cos_angle_ = 0.0;
+  double max_offset_ = 0.0;
+  SegmentIndex index_;
+  std::vector<int> labels_;
+  size_t num_clusters_ = 0;
 };
 }  // namespace line_clustering
 
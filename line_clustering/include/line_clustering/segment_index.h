@@ -0,0 +1,66 @@
+#ifndef LINE_CLUSTERING_SEGMENT_INDEX_H_
+#define LINE_CLUSTERING_SEGMENT_INDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <glog/logging.h>
+#include <opencv2/core.hpp>
+
+namespace line_clustering {
+
+// Spatial index over the key points of 3D line segments: their start, end and
+// midpoint. The key points are sorted by the cell of a uniform grid in which
+// they lie, so that the key points near a position are found with a few
+// binary searches in the cells around it, instead of by comparing it with
+// every segment. Building the index takes O(n log n), and a query O(log n)
+// plus the number of key points in the cells visited.
+class SegmentIndex {
+ public:
+  SegmentIndex() {}
+
+  // Builds the index of lines (start and end point, as in
+  // line_detection::LineWithPlanes::line). The queries are fastest with a
+  // radius of cell_size.
+  void build(const std::vector<cv::Vec6f>& lines, double cell_size);
+  // Number of lines indexed.
+  size_t size() const { return key_points_.size() / kNumKeyPoints; }
+
+  // Finds the lines that have a key point at most radius away from a key point
+  // of the line with the given index, the line itself excluded.
+  // Output: neighbours: Indices of the lines found, in increasing order.
+  void findNeighbours(size_t line, double radius,
+                      std::vector<size_t>* neighbours) const;
+  // The same for a segment that does not need to be in the index.
+  void findNeighbours(const cv::Vec6f& segment, double radius,
+                      std::vector<size_t>* neighbours) const;
+
+  // Key points per line: start, end and midpoint.
+  static constexpr size_t kNumKeyPoints = 3;
+
+ private:
+  // Appends the key points of segment to key_points.
+  static void appendKeyPoints(const cv::Vec6f& segment,
+                              std::vector<cv::Vec3f>* key_points);
+  // Returns the coordinates of the cell of point along one axis.
+  int64_t cellCoordinate(float coordinate) const;
+  // Returns the key of a cell. The cells that only differ in z have
+  // consecutive keys.
+  static uint64_t cellKey(int64_t x, int64_t y, int64_t z);
+  // Appends to neighbours the lines (other than exclude) with a key point at
+  // most radius away from the given key points.
+  void findNeighbours(const cv::Vec3f* key_points, size_t exclude,
+                      double radius, std::vector<size_t>* neighbours) const;
+
+  double cell_size_ = 1.0;
+  // kNumKeyPoints key points per line.
+  std::vector<cv::Vec3f> key_points_;
+  // Pairs {cell key, index of the key point}, sorted.
+  std::vector<std::pair<uint64_t, size_t>> cells_;
+};
+
+}  // namespace line_clustering
+
+#endif  // LINE_CLUSTERING_SEGMENT_INDEX_H_
@@ -0,0 +1,57 @@
+#include "line_clustering/distance_matrix.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+namespace line_clustering {
+
+void PackedDistanceMatrix::fromMat(const cv::Mat& dist_mat) {
+  CHECK_EQ(dist_mat.cols, dist_mat.rows);
+  CHECK_EQ(dist_mat.type(), CV_32FC1);
+  resize(dist_mat.rows);
+  for (size_t i = 0; i + 1 < size_; ++i) {
+    const float* mat_row = dist_mat.ptr<float>(i);
+    std::copy(mat_row + i + 1, mat_row + size_, row(i));
+  }
+}
+
+cv::Mat PackedDistanceMatrix::toMat() const {
+  cv::Mat dist_mat = cv::Mat::zeros(size_, size_, CV_32FC1);
+  for (size_t i = 0; i + 1 < size_; ++i) {
+    const float* distances = row(i);
+    std::copy(distances, distances + size_ - i - 1,
+              dist_mat.ptr<float>(i) + i + 1);
+  }
+  return dist_mat;
+}
+
+void PackedDistanceMatrix::forEachRow(
+    size_t num_threads, const std::function<void(size_t)>& function) {
+  const size_t num_rows = size_ > 0 ? size_ - 1 : 0;
+  if (num_threads == 0) {
+    num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  num_threads = std::min(num_threads, num_rows);
+  if (num_threads <= 1) {
+    for (size_t i = 0; i < num_rows; ++i) {
+      function(i);
+    }
+    return;
+  }
+  std::atomic<size_t> next_row(0);
+  std::vector<std::thread> workers;
+  workers.reserve(num_threads);
+  for (size_t t = 0; t < num_threads; ++t) {
+    workers.emplace_back([&]() {
+      for (size_t i = next_row++; i < num_rows; i = next_row++) {
+        function(i);
+      }
+    });
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+}
+
+}  // namespace line_clustering
@@ -1,6 +1,180 @@
 #include "line_clustering/line_clustering.h"
 
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <random>
+
 namespace line_clustering {
+namespace {
+
+// Stores the two planes of a line one after the other.
+void concatenateHessians(const std::array<cv::Vec4f, 2>& hessians,
+                         cv::Vec<float, 8>* hessians_out) {
+  CHECK_NOTNULL(hessians_out);
+  for (size_t j = 0; j < 4; ++j) {
+    (*hessians_out)[j] = hessians[0][j];
+    (*hessians_out)[j + 4] = hessians[1][j];
+  }
+}
+
+// Samples k medoids as k-means++ samples its centers: the first one
+// uniformly, the next ones with a probability proportional to the squared
+// distance to the nearest medoid sampled so far.
+void sampleMedoidsPlusPlus(const PackedDistanceMatrix& dist_mat, size_t k,
+                           std::default_random_engine* generator,
+                           std::vector<size_t>* medoids) {
+  CHECK_NOTNULL(generator);
+  CHECK_NOTNULL(medoids);
+  const size_t n = dist_mat.size();
+  CHECK_GT(k, 0u);
+  CHECK_LE(k, n);
+  medoids->clear();
+  std::vector<double> nearest(n, std::numeric_limits<double>::infinity());
+  size_t medoid = std::uniform_int_distribution<size_t>(0, n - 1)(*generator);
+  while (true) {
+    medoids->push_back(medoid);
+    if (medoids->size() == k) break;
+    double sum = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+      nearest[i] =
+          std::min(nearest[i], static_cast<double>(dist_mat(i, medoid)));
+      sum += nearest[i] * nearest[i];
+    }
+    if (sum <= 0.0) {
+      // All the nodes coincide with a medoid: take the first node that is not
+      // one yet.
+      for (medoid = 0; medoid < n; ++medoid) {
+        if (std::find(medoids->begin(), medoids->end(), medoid) ==
+            medoids->end()) {
+          break;
+        }
+      }
+      continue;
+    }
+    double threshold =
+        std::uniform_real_distribution<double>(0.0, sum)(*generator);
+    // The medoids have a weight of zero and are never sampled again. Because
+    // of rounding, the threshold may not be reached: the last node with a
+    // non-zero weight is taken then.
+    for (size_t i = 0; i < n; ++i) {
+      if (nearest[i] <= 0.0) continue;
+      medoid = i;
+      threshold -= nearest[i] * nearest[i];
+      if (threshold < 0.0) break;
+    }
+  }
+}
+
+// Returns the sum of the distances of the nodes to their nearest medoid.
+double totalDeviation(const PackedDistanceMatrix& dist_mat,
+                      const std::vector<size_t>& medoids) {
+  double total = 0.0;
+  for (size_t i = 0; i < dist_mat.size(); ++i) {
+    float nearest = std::numeric_limits<float>::infinity();
+    for (size_t medoid : medoids) {
+      nearest = std::min(nearest, dist_mat(i, medoid));
+    }
+    total += nearest;
+  }
+  return total;
+}
+
+// Improves the medoids with FasterPAM: the nodes are visited in turn and
+// every node is swapped with the medoid whose replacement decreases the most
+// the sum of the distances of the nodes to their nearest medoid, as soon as
+// this sum decreases. The algorithm stops once all the nodes were visited
+// without a swap.
+void fasterPam(const PackedDistanceMatrix& dist_mat,
+               std::vector<size_t>* medoids) {
+  CHECK_NOTNULL(medoids);
+  const size_t n = dist_mat.size();
+  const size_t k = medoids->size();
+  CHECK_GT(k, 0u);
+  if (k >= n) return;
+  if (k == 1) {
+    // Without a second medoid the removal losses are not defined, but the
+    // best medoid can simply be searched exhaustively.
+    double min_total = std::numeric_limits<double>::infinity();
+    for (size_t candidate = 0; candidate < n; ++candidate) {
+      double total = 0.0;
+      for (size_t i = 0; i < n; ++i) total += dist_mat(i, candidate);
+      if (total < min_total) {
+        min_total = total;
+        (*medoids)[0] = candidate;
+      }
+    }
+    return;
+  }
+  std::vector<unsigned char> is_medoid(n, 0);
+  for (size_t medoid : *medoids) is_medoid[medoid] = 1;
+  // Index (in medoids) of the nearest and second nearest medoid of every
+  // node, and their distances to it.
+  std::vector<size_t> nearest(n), second(n);
+  std::vector<float> dist_nearest(n), dist_second(n);
+  // Increase of the sum of the distances if a medoid is removed (and its
+  // nodes go to their second nearest medoid).
+  std::vector<double> removal_loss(k);
+  const auto updateNearestMedoids = [&]() {
+    std::fill(removal_loss.begin(), removal_loss.end(), 0.0);
+    for (size_t i = 0; i < n; ++i) {
+      dist_nearest[i] = std::numeric_limits<float>::infinity();
+      dist_second[i] = std::numeric_limits<float>::infinity();
+      for (size_t m = 0; m < k; ++m) {
+        const float distance = dist_mat(i, (*medoids)[m]);
+        if (distance < dist_nearest[i]) {
+          second[i] = nearest[i];
+          dist_second[i] = dist_nearest[i];
+          nearest[i] = m;
+          dist_nearest[i] = distance;
+        } else if (distance < dist_second[i]) {
+          second[i] = m;
+          dist_second[i] = distance;
+        }
+      }
+      removal_loss[nearest[i]] += dist_second[i] - dist_nearest[i];
+    }
+  };
+  updateNearestMedoids();
+
+  // Guards against cycles caused by rounding, which should not happen.
+  constexpr size_t kMaxNumPasses = 100;
+  std::vector<double> change(k);
+  size_t num_visited_without_swap = 0;
+  size_t num_visited = 0;
+  for (size_t candidate = 0;
+       num_visited_without_swap < n && num_visited < kMaxNumPasses * n;
+       candidate = (candidate + 1) % n) {
+    ++num_visited;
+    ++num_visited_without_swap;
+    if (is_medoid[candidate]) continue;
+    // Change of the sum of the distances if the candidate replaces each of
+    // the medoids: change[m] for the nodes that keep or lose their medoid
+    // depending on m, shared_change for the ones that move to the candidate
+    // whichever medoid is replaced.
+    std::copy(removal_loss.begin(), removal_loss.end(), change.begin());
+    double shared_change = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+      const float distance = dist_mat(i, candidate);
+      if (distance < dist_nearest[i]) {
+        shared_change += distance - dist_nearest[i];
+        change[nearest[i]] += dist_nearest[i] - dist_second[i];
+      } else if (distance < dist_second[i]) {
+        change[nearest[i]] += distance - dist_second[i];
+      }
+    }
+    const size_t best =
+        std::min_element(change.begin(), change.end()) - change.begin();
+    if (change[best] + shared_change >= 0.0) continue;
+    is_medoid[(*medoids)[best]] = 0;
+    is_medoid[candidate] = 1;
+    (*medoids)[best] = candidate;
+    updateNearestMedoids();
+    num_visited_without_swap = 0;
+  }
+}
+
+}  // namespace
 
 double computePerpendicularDistanceLines(const cv::Vec6f& line1,
                                          const cv::Vec6f& line2) {
@@ -88,18 +262,18 @@ void KMeansCluster::setLines(
     const std::vector<line_detection::LineWithPlanes>& lines3D) {
   lines_.resize(lines3D.size());
   hessians_.resize(lines3D.size());
-  int n;
   for (size_t i = 0; i < lines3D.size(); ++i) {
     lines_[i] = lines3D[i].line;
-    if (lines3D[i].hessians.size() == 2) {
-      n = 1;
-    } else {
-      n = 0;
-    }
-    hessians_[i] = {lines3D[i].hessians[0][0], lines3D[i].hessians[0][1],
-                    lines3D[i].hessians[0][2], lines3D[i].hessians[0][3],
-                    lines3D[i].hessians[n][0], lines3D[i].hessians[n][1],
-                    lines3D[i].hessians[n][2], lines3D[i].hessians[n][3]};
+    concatenateHessians(lines3D[i].hessians, &hessians_[i]);
+  }
+  lines_set_ = true;
+  hessians_set_ = true;
+}
+void KMeansCluster::setLines(const line_detection::LineBatch& lines3D) {
+  lines_.assign(lines3D.lines.begin(), lines3D.lines.end());
+  hessians_.resize(lines3D.size());
+  for (size_t i = 0; i < lines3D.size(); ++i) {
+    concatenateHessians(lines3D.hessians[i], &hessians_[i]);
   }
   lines_set_ = true;
   hessians_set_ = true;
@@ -156,17 +330,17 @@ void KMeansCluster::initClusteringWithHessians(double scale_hessians) {
   cluster_with_hessians_init_ = true;
 }
 
-cv::Mat KMeansCluster::getDistanceMatrix() {
+void KMeansCluster::computeDistanceMatrix(PackedDistanceMatrix* dist_mat,
+                                          size_t num_threads) {
+  CHECK_NOTNULL(dist_mat);
   CHECK(cluster_with_hessians_init_);
-  const size_t num_lines = lines_and_hessians_.size();
-  cv::Mat dist_mat = cv::Mat::zeros(num_lines, num_lines, CV_32FC1);
-  for (size_t i = 0; i < num_lines; ++i) {
-    for (size_t j = i + 1; j < num_lines; ++j) {
-      dist_mat.at<float>(i, j) =
-          cv::norm(lines_and_hessians_[i] - lines_and_hessians_[j]);
-    }
-  }
-  return dist_mat;
+  dist_mat->computeEuclidean(lines_and_hessians_, num_threads);
+}
+
+cv::Mat KMeansCluster::getDistanceMatrix() {
+  PackedDistanceMatrix dist_mat;
+  computeDistanceMatrix(&dist_mat);
+  return dist_mat.toMat();
 }
 
 void KMeansCluster::runOnLinesAndHessians() {
@@ -187,6 +361,231 @@ void KMeansCluster::runOnLinesAndHessians() {
 
 std::vector<cv::Vec6f> KMeansCluster::getLines() { return lines_; }
 
+StreamingKMeansCluster::StreamingKMeansCluster() { k_set_ = false; }
+StreamingKMeansCluster::StreamingKMeansCluster(unsigned int num_clusters) {
+  setNumberOfClusters(num_clusters);
+}
+
+void StreamingKMeansCluster::setNumberOfClusters(unsigned int num_clusters) {
+  K_ = num_clusters;
+  k_set_ = true;
+}
+void StreamingKMeansCluster::setMiniBatch(size_t batch_size,
+                                          size_t num_iterations) {
+  batch_size_ = batch_size;
+  num_iterations_ = num_iterations;
+}
+void StreamingKMeansCluster::setForgettingFactor(double forgetting_factor) {
+  CHECK(forgetting_factor >= 0.0 && forgetting_factor <= 1.0);
+  forgetting_factor_ = forgetting_factor;
+}
+void StreamingKMeansCluster::setNewClusterDistance(
+    double new_cluster_distance) {
+  CHECK_GE(new_cluster_distance, 0.0);
+  new_cluster_distance_ = new_cluster_distance;
+}
+void StreamingKMeansCluster::setMaxFramesWithoutLines(
+    size_t max_frames_without_lines) {
+  max_frames_without_lines_ = max_frames_without_lines;
+}
+void StreamingKMeansCluster::setSeed(unsigned int seed) {
+  generator_.seed(seed);
+}
+void StreamingKMeansCluster::reset() {
+  active_.clear();
+  centers_.clear();
+  counts_.clear();
+  frames_without_lines_.clear();
+  cluster_idx_.clear();
+}
+
+void StreamingKMeansCluster::cluster(
+    const std::vector<line_detection::LineWithPlanes>& lines3D,
+    const cv::Matx44f& transform_current_previous) {
+  std::vector<cv::Vec6f> lines(lines3D.size());
+  for (size_t i = 0; i < lines3D.size(); ++i) {
+    lines[i] = lines3D[i].line;
+  }
+  cluster(lines, transform_current_previous);
+}
+
+void StreamingKMeansCluster::cluster(
+    const std::vector<cv::Vec6f>& lines3D,
+    const cv::Matx44f& transform_current_previous) {
+  CHECK(k_set_) << "You need to set K before clustering.";
+  CHECK_GT(K_, 0u);
+  line_means_.resize(lines3D.size());
+  for (size_t i = 0; i < lines3D.size(); ++i) {
+    line_means_[i] = cv::Vec3f((lines3D[i][0] + lines3D[i][3]) / 2,
+                               (lines3D[i][1] + lines3D[i][4]) / 2,
+                               (lines3D[i][2] + lines3D[i][5]) / 2);
+  }
+  // Move the centers into the current camera frame, and fade the weight of
+  // the lines of the previous frames.
+  for (size_t c = 0; c < centers_.size(); ++c) {
+    if (!active_[c]) continue;
+    const cv::Vec4f center = transform_current_previous *
+                             cv::Vec4f(centers_[c][0], centers_[c][1],
+                                       centers_[c][2], 1.0f);
+    centers_[c] = cv::Vec3f(center[0], center[1], center[2]);
+    counts_[c] *= forgetting_factor_;
+  }
+  addClusters();
+  updateCenters();
+  // Assign every line to its nearest center.
+  std::vector<size_t> num_lines(centers_.size(), 0);
+  cluster_idx_.resize(line_means_.size());
+  float square_distance;
+  for (size_t i = 0; i < line_means_.size(); ++i) {
+    cluster_idx_[i] = findNearestCluster(line_means_[i], &square_distance);
+    ++num_lines[cluster_idx_[i]];
+  }
+  // Remove the clusters whose lines disappeared.
+  for (size_t c = 0; c < centers_.size(); ++c) {
+    if (!active_[c]) continue;
+    if (num_lines[c] > 0) {
+      frames_without_lines_[c] = 0;
+    } else if (++frames_without_lines_[c] > max_frames_without_lines_) {
+      active_[c] = 0;
+    }
+  }
+}
+
+size_t StreamingKMeansCluster::getNumberOfClusters() const {
+  return std::count(active_.begin(), active_.end(), 1);
+}
+
+cv::Vec3f StreamingKMeansCluster::getCenter(int label) const {
+  CHECK(label >= 0 && static_cast<size_t>(label) < centers_.size() &&
+        active_[label])
+      << "There is no cluster with label " << label << ".";
+  return centers_[label];
+}
+
+int StreamingKMeansCluster::findNearestCluster(const cv::Vec3f& point,
+                                               float* square_distance) const {
+  CHECK_NOTNULL(square_distance);
+  int nearest = -1;
+  *square_distance = std::numeric_limits<float>::infinity();
+  for (size_t c = 0; c < centers_.size(); ++c) {
+    if (!active_[c]) continue;
+    const cv::Vec3f difference = point - centers_[c];
+    const float distance = difference.dot(difference);
+    if (distance < *square_distance) {
+      *square_distance = distance;
+      nearest = c;
+    }
+  }
+  return nearest;
+}
+
+void StreamingKMeansCluster::addCluster(const cv::Vec3f& point) {
+  const size_t c =
+      std::find(active_.begin(), active_.end(), 0) - active_.begin();
+  if (c == active_.size()) {
+    active_.push_back(1);
+    centers_.push_back(point);
+    counts_.push_back(0.0);
+    frames_without_lines_.push_back(0);
+    return;
+  }
+  active_[c] = 1;
+  centers_[c] = point;
+  counts_[c] = 0.0;
+  frames_without_lines_[c] = 0;
+}
+
+void StreamingKMeansCluster::addClusters() {
+  const size_t n = line_means_.size();
+  if (n == 0) return;
+  std::vector<float> square_distances(n);
+  for (size_t i = 0; i < n; ++i) {
+    findNearestCluster(line_means_[i], &square_distances[i]);
+  }
+  const auto addClusterAtLine = [&](size_t line) {
+    addCluster(line_means_[line]);
+    for (size_t i = 0; i < n; ++i) {
+      const cv::Vec3f difference = line_means_[i] - line_means_[line];
+      square_distances[i] =
+          std::min(square_distances[i], difference.dot(difference));
+    }
+  };
+  // The new clusters are sampled as in k-means++: the first one at a random
+  // line, the next ones at lines sampled with a probability proportional to
+  // their squared distance to the nearest center.
+  for (size_t num_clusters = getNumberOfClusters(); num_clusters < K_;
+       ++num_clusters) {
+    if (num_clusters == 0) {
+      addClusterAtLine(
+          std::uniform_int_distribution<size_t>(0, n - 1)(generator_));
+      continue;
+    }
+    double sum = 0.0;
+    for (size_t i = 0; i < n; ++i) sum += square_distances[i];
+    // Every line is on a center.
+    if (sum <= 0.0) break;
+    double threshold =
+        std::uniform_real_distribution<double>(0.0, sum)(generator_);
+    size_t line = 0;
+    for (size_t i = 0; i < n; ++i) {
+      if (square_distances[i] <= 0.0f) continue;
+      line = i;
+      threshold -= square_distances[i];
+      if (threshold < 0.0) break;
+    }
+    addClusterAtLine(line);
+  }
+  if (new_cluster_distance_ <= 0.0) return;
+  const float max_square_distance =
+      new_cluster_distance_ * new_cluster_distance_;
+  while (true) {
+    const size_t farthest =
+        std::max_element(square_distances.begin(), square_distances.end()) -
+        square_distances.begin();
+    if (square_distances[farthest] <= max_square_distance) break;
+    addClusterAtLine(farthest);
+  }
+}
+
+void StreamingKMeansCluster::updateCenters() {
+  const size_t n = line_means_.size();
+  if (n == 0 || getNumberOfClusters() == 0) return;
+  // The updates stop when no center moves by more than epsilon (in m).
+  constexpr double epsilon = 0.01;
+  std::vector<size_t> indices(n), batch;
+  std::iota(indices.begin(), indices.end(), 0);
+  std::vector<int> nearest;
+  std::vector<cv::Vec3f> previous_centers;
+  float square_distance;
+  for (size_t iteration = 0; iteration < num_iterations_; ++iteration) {
+    if (batch_size_ == 0 || batch_size_ >= n) {
+      batch = indices;
+    } else {
+      line_detection::getNUniqueRandomElements(indices, batch_size_,
+                                               &generator_, &batch);
+    }
+    // The lines of the batch are assigned before any center moves.
+    nearest.resize(batch.size());
+    for (size_t b = 0; b < batch.size(); ++b) {
+      nearest[b] = findNearestCluster(line_means_[batch[b]], &square_distance);
+    }
+    previous_centers = centers_;
+    for (size_t b = 0; b < batch.size(); ++b) {
+      const int c = nearest[b];
+      counts_[c] += 1.0;
+      const float learning_rate = 1.0 / counts_[c];
+      centers_[c] += learning_rate * (line_means_[batch[b]] - centers_[c]);
+    }
+    double max_shift = 0.0;
+    for (size_t c = 0; c < centers_.size(); ++c) {
+      if (!active_[c]) continue;
+      max_shift =
+          std::max(max_shift, cv::norm(centers_[c] - previous_centers[c]));
+    }
+    if (max_shift < epsilon) break;
+  }
+}
+
 KMedoidsCluster::KMedoidsCluster() {
   k_set_ = false;
   dist_mat_set_ = false;
@@ -195,12 +594,22 @@ KMedoidsCluster::KMedoidsCluster(const cv::Mat& dist_mat, size_t K) {
   setDistanceMatrix(dist_mat);
   setK(K);
 }
+KMedoidsCluster::KMedoidsCluster(const PackedDistanceMatrix& dist_mat,
+                                 size_t K) {
+  setDistanceMatrix(dist_mat);
+  setK(K);
+}
 
 void KMedoidsCluster::setDistanceMatrix(const cv::Mat& dist_mat) {
   CHECK(dist_mat.cols == dist_mat.rows);
   CHECK(dist_mat.type() == CV_32FC1);
-  num_points_ = dist_mat.cols;
+  dist_mat_.fromMat(dist_mat);
+  num_points_ = dist_mat_.size();
+  dist_mat_set_ = true;
+}
+void KMedoidsCluster::setDistanceMatrix(const PackedDistanceMatrix& dist_mat) {
   dist_mat_ = dist_mat;
+  num_points_ = dist_mat_.size();
   dist_mat_set_ = true;
 }
 
@@ -209,10 +618,46 @@ void KMedoidsCluster::setK(size_t K) {
   k_set_ = true;
 }
 
+void KMedoidsCluster::setSeed(unsigned int seed) { seed_ = seed; }
+
+void KMedoidsCluster::setMethod(KMedoidsMethod method) { method_ = method; }
+
+void KMedoidsCluster::setClaraParameters(size_t num_samples,
+                                         size_t sample_size) {
+  CHECK_GT(num_samples, 0u);
+  clara_num_samples_ = num_samples;
+  clara_sample_size_ = sample_size;
+}
+
 void KMedoidsCluster::cluster() {
   CHECK(k_set_) << "K must be set before clustering.";
   CHECK(dist_mat_set_) << "The distance matrix must be set before clustering.";
-  init();
+  if (method_ == KMedoidsMethod::ALTERNATE) {
+    init();
+    clusterAlternate();
+    return;
+  }
+  CHECK_GT(K_, 0u);
+  // Do not allow more clusters than data points.
+  const size_t k = std::min(K_, num_points_);
+  clusters_.resize(k);
+  labels_.resize(num_points_);
+  if (k == num_points_) {
+    // Every node is its own cluster.
+    centers_.resize(k);
+    std::iota(centers_.begin(), centers_.end(), 0);
+  } else if (method_ == KMedoidsMethod::FASTER_PAM) {
+    std::default_random_engine generator(seed_);
+    sampleMedoidsPlusPlus(dist_mat_, k, &generator, &centers_);
+    fasterPam(dist_mat_, &centers_);
+  } else {
+    clusterClara();
+  }
+  // Labels and clusters of the final medoids.
+  assignDataPoints();
+}
+
+void KMedoidsCluster::clusterAlternate() {
   std::vector<size_t> centers_old;
   bool centers_changed;
   constexpr size_t max_iter = 1e4;
@@ -236,6 +681,53 @@ void KMedoidsCluster::cluster() {
   } while (centers_changed);
 }
 
+void KMedoidsCluster::clusterClara() {
+  const size_t k = clusters_.size();
+  const size_t sample_size =
+      clara_sample_size_ > 0 ? std::max(clara_sample_size_, k) : 40 + 2 * k;
+  std::default_random_engine generator(seed_);
+  if (sample_size >= num_points_) {
+    sampleMedoidsPlusPlus(dist_mat_, k, &generator, &centers_);
+    fasterPam(dist_mat_, &centers_);
+    return;
+  }
+  std::vector<size_t> best_medoids, medoids, sample, others, drawn;
+  double min_deviation = std::numeric_limits<double>::infinity();
+  PackedDistanceMatrix sample_dist_mat;
+  std::vector<unsigned char> is_best_medoid(num_points_);
+  for (size_t s = 0; s < clara_num_samples_; ++s) {
+    // The sample is made of the best medoids found so far and of randomly
+    // drawn nodes.
+    std::fill(is_best_medoid.begin(), is_best_medoid.end(), 0);
+    for (size_t medoid : best_medoids) is_best_medoid[medoid] = 1;
+    others.clear();
+    for (size_t i = 0; i < num_points_; ++i) {
+      if (!is_best_medoid[i]) others.push_back(i);
+    }
+    line_detection::getNUniqueRandomElements(
+        others, sample_size - best_medoids.size(), &generator, &drawn);
+    sample = best_medoids;
+    sample.insert(sample.end(), drawn.begin(), drawn.end());
+    sample_dist_mat.resize(sample_size);
+    for (size_t a = 0; a + 1 < sample_size; ++a) {
+      float* distances = sample_dist_mat.row(a);
+      for (size_t b = a + 1; b < sample_size; ++b) {
+        distances[b - a - 1] = dist_mat_(sample[a], sample[b]);
+      }
+    }
+    sampleMedoidsPlusPlus(sample_dist_mat, k, &generator, &medoids);
+    fasterPam(sample_dist_mat, &medoids);
+    for (size_t& medoid : medoids) medoid = sample[medoid];
+    // The medoids are rated on all the nodes.
+    const double deviation = totalDeviation(dist_mat_, medoids);
+    if (deviation < min_deviation) {
+      min_deviation = deviation;
+      best_medoids = medoids;
+    }
+  }
+  centers_ = best_medoids;
+}
+
 std::vector<size_t> KMedoidsCluster::getLabels() { return labels_; }
 
 void KMedoidsCluster::init() {
@@ -258,16 +750,9 @@ void KMedoidsCluster::init() {
   if (k == num_points_) {
     centers_ = labels_;
   } else {
-    line_detection::getNUniqueRandomElements(labels_, k, &centers_);
-  }
-}
-
-double KMedoidsCluster::dist(size_t i, size_t j) {
-  // Only look up the upper triangle of the matrix.
-  if (i < j) {
-    return dist_mat_.at<float>(i, j);
-  } else {
-    return dist_mat_.at<float>(j, i);
+    std::default_random_engine generator(seed_);
+    line_detection::getNUniqueRandomElements(labels_, k, &generator,
+                                             &centers_);
   }
 }
 
@@ -312,4 +797,140 @@ void KMedoidsCluster::reasssignMediods() {
   }
 }
 
+
+constexpr int DBSCANCluster::kNoise;
+
+DBSCANCluster::DBSCANCluster() {
+  lines_set_ = false;
+  hessians_set_ = false;
+}
+DBSCANCluster::DBSCANCluster(double max_distance, size_t min_num_neighbours) {
+  lines_set_ = false;
+  hessians_set_ = false;
+  setMaxDistance(max_distance);
+  setMinNumNeighbours(min_num_neighbours);
+}
+
+void DBSCANCluster::setLines(const std::vector<cv::Vec6f>& lines3D) {
+  lines_ = lines3D;
+  hessians_.clear();
+  lines_set_ = true;
+  hessians_set_ = false;
+}
+void DBSCANCluster::setLines(
+    const std::vector<line_detection::LineWithPlanes>& lines3D) {
+  lines_.resize(lines3D.size());
+  hessians_.resize(lines3D.size());
+  for (size_t i = 0; i < lines3D.size(); ++i) {
+    lines_[i] = lines3D[i].line;
+    hessians_[i] = lines3D[i].hessians;
+  }
+  lines_set_ = true;
+  hessians_set_ = true;
+}
+void DBSCANCluster::setMaxDistance(double max_distance) {
+  CHECK_GT(max_distance, 0.0);
+  max_distance_ = max_distance;
+}
+void DBSCANCluster::setMinNumNeighbours(size_t min_num_neighbours) {
+  min_num_neighbours_ = min_num_neighbours;
+}
+void DBSCANCluster::setMaxPerpendicularDistance(
+    double max_perpendicular_distance) {
+  CHECK_GE(max_perpendicular_distance, 0.0);
+  max_perpendicular_distance_ = max_perpendicular_distance;
+}
+void DBSCANCluster::setPlaneSimilarity(double min_cos_angle,
+                                       double max_offset) {
+  CHECK(min_cos_angle >= 0.0 && min_cos_angle <= 1.0);
+  CHECK_GE(max_offset, 0.0);
+  min_cos_angle_ = min_cos_angle;
+  max_offset_ = max_offset;
+}
+
+void DBSCANCluster::cluster() {
+  CHECK(lines_set_) << "You have to set the lines before clustering.";
+  // Label of the lines that were not visited yet.
+  constexpr int kUnvisited = -2;
+  const size_t n = lines_.size();
+  index_.build(lines_, max_distance_);
+  labels_.assign(n, kUnvisited);
+  num_clusters_ = 0;
+  std::vector<size_t> neighbours, to_expand;
+  for (size_t i = 0; i < n; ++i) {
+    if (labels_[i] != kUnvisited) continue;
+    findNeighbours(i, &neighbours);
+    if (neighbours.size() < min_num_neighbours_) {
+      // The line may still become the border line of a cluster.
+      labels_[i] = kNoise;
+      continue;
+    }
+    // Start a new cluster and expand it from its core lines.
+    const int label = num_clusters_++;
+    labels_[i] = label;
+    to_expand = neighbours;
+    while (!to_expand.empty()) {
+      const size_t j = to_expand.back();
+      to_expand.pop_back();
+      if (labels_[j] == kNoise) labels_[j] = label;
+      if (labels_[j] != kUnvisited) continue;
+      labels_[j] = label;
+      findNeighbours(j, &neighbours);
+      if (neighbours.size() >= min_num_neighbours_) {
+        to_expand.insert(to_expand.end(), neighbours.begin(),
+                         neighbours.end());
+      }
+    }
+  }
+}
+
+std::vector<int> DBSCANCluster::getLabels() { return labels_; }
+
+size_t DBSCANCluster::getNumberOfClusters() { return num_clusters_; }
+
+void DBSCANCluster::findNeighbours(size_t line,
+                                   std::vector<size_t>* neighbours) const {
+  CHECK_NOTNULL(neighbours);
+  index_.findNeighbours(line, max_distance_, neighbours);
+  neighbours->erase(
+      std::remove_if(neighbours->begin(), neighbours->end(),
+                     [&](size_t other) { return !areNeighbours(line, other); }),
+      neighbours->end());
+}
+
+bool DBSCANCluster::areNeighbours(size_t line1, size_t line2) const {
+  if (max_perpendicular_distance_ < std::numeric_limits<double>::infinity() &&
+      computePerpendicularDistanceLines(lines_[line1], lines_[line2]) >
+          max_perpendicular_distance_) {
+    return false;
+  }
+  if (!hessians_set_ || min_cos_angle_ <= 0.0) return true;
+  constexpr double kMinNormNormal = 1e-6;
+  bool has_planes1 = false, has_planes2 = false;
+  for (const cv::Vec4f& plane1 : hessians_[line1]) {
+    const cv::Vec3f normal1(plane1[0], plane1[1], plane1[2]);
+    const double norm1 = cv::norm(normal1);
+    if (norm1 < kMinNormNormal) continue;
+    has_planes1 = true;
+    for (const cv::Vec4f& plane2 : hessians_[line2]) {
+      const cv::Vec3f normal2(plane2[0], plane2[1], plane2[2]);
+      const double norm2 = cv::norm(normal2);
+      if (norm2 < kMinNormNormal) continue;
+      has_planes2 = true;
+      const double cos_angle = normal1.dot(normal2) / (norm1 * norm2);
+      // The planes of opposite normals are the same if their offsets are
+      // opposite.
+      const double offset1 = plane1[3] / norm1;
+      const double offset2 =
+          (cos_angle < 0.0 ? -plane2[3] : plane2[3]) / norm2;
+      if (std::fabs(cos_angle) >= min_cos_angle_ &&
+          std::fabs(offset1 - offset2) <= max_offset_) {
+        return true;
+      }
+    }
+  }
+  // Lines without planes are only compared by their distances.
+  return !has_planes1 || !has_planes2;
+}
+
 }  // namespace line_clustering
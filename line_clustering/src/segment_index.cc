@@ -0,0 +1,122 @@
+#include "line_clustering/segment_index.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace line_clustering {
+
+constexpr size_t SegmentIndex::kNumKeyPoints;
+
+namespace {
+
+// Bits per cell coordinate in a cell key: the grid spans 2^21 cells along
+// every axis, centered on the origin.
+constexpr int kNumBitsCell = 21;
+constexpr int64_t kCellOffset = int64_t(1) << (kNumBitsCell - 1);
+
+}  // namespace
+
+void SegmentIndex::build(const std::vector<cv::Vec6f>& lines,
+                         double cell_size) {
+  CHECK_GT(cell_size, 0.0);
+  cell_size_ = cell_size;
+  key_points_.clear();
+  key_points_.reserve(kNumKeyPoints * lines.size());
+  for (const cv::Vec6f& line : lines) {
+    appendKeyPoints(line, &key_points_);
+  }
+  cells_.resize(key_points_.size());
+  for (size_t i = 0; i < key_points_.size(); ++i) {
+    const cv::Vec3f& point = key_points_[i];
+    cells_[i] = {cellKey(cellCoordinate(point[0]), cellCoordinate(point[1]),
+                         cellCoordinate(point[2])),
+                 i};
+  }
+  std::sort(cells_.begin(), cells_.end());
+}
+
+void SegmentIndex::findNeighbours(size_t line, double radius,
+                                  std::vector<size_t>* neighbours) const {
+  CHECK_NOTNULL(neighbours);
+  CHECK_LT(line, size());
+  neighbours->clear();
+  findNeighbours(&key_points_[kNumKeyPoints * line], line, radius,
+                 neighbours);
+}
+
+void SegmentIndex::findNeighbours(const cv::Vec6f& segment, double radius,
+                                  std::vector<size_t>* neighbours) const {
+  CHECK_NOTNULL(neighbours);
+  neighbours->clear();
+  std::vector<cv::Vec3f> key_points;
+  appendKeyPoints(segment, &key_points);
+  findNeighbours(key_points.data(), std::numeric_limits<size_t>::max(),
+                 radius, neighbours);
+}
+
+void SegmentIndex::appendKeyPoints(const cv::Vec6f& segment,
+                                   std::vector<cv::Vec3f>* key_points) {
+  const cv::Vec3f start(segment[0], segment[1], segment[2]);
+  const cv::Vec3f end(segment[3], segment[4], segment[5]);
+  key_points->push_back(start);
+  key_points->push_back(end);
+  key_points->push_back((start + end) * 0.5f);
+}
+
+int64_t SegmentIndex::cellCoordinate(float coordinate) const {
+  const double cell = std::floor(coordinate / cell_size_);
+  // Points out of the grid are put into its border cells.
+  return static_cast<int64_t>(std::max<double>(
+      -kCellOffset, std::min<double>(kCellOffset - 1, cell)));
+}
+
+uint64_t SegmentIndex::cellKey(int64_t x, int64_t y, int64_t z) {
+  return (static_cast<uint64_t>(x + kCellOffset) << (2 * kNumBitsCell)) |
+         (static_cast<uint64_t>(y + kCellOffset) << kNumBitsCell) |
+         static_cast<uint64_t>(z + kCellOffset);
+}
+
+void SegmentIndex::findNeighbours(const cv::Vec3f* key_points, size_t exclude,
+                                  double radius,
+                                  std::vector<size_t>* neighbours) const {
+  CHECK_GE(radius, 0.0);
+  const double square_radius = radius * radius;
+  // Number of cells to visit on each side of the cell of a key point.
+  const int64_t range =
+      std::min<int64_t>(kCellOffset, std::ceil(radius / cell_size_));
+  for (size_t k = 0; k < kNumKeyPoints; ++k) {
+    const cv::Vec3f& point = key_points[k];
+    const int64_t x = cellCoordinate(point[0]);
+    const int64_t y = cellCoordinate(point[1]);
+    const int64_t z = cellCoordinate(point[2]);
+    const int64_t z_min = std::max(z - range, -kCellOffset);
+    const int64_t z_max = std::min(z + range, kCellOffset - 1);
+    for (int64_t dx = -range; dx <= range; ++dx) {
+      if (x + dx < -kCellOffset || x + dx >= kCellOffset) continue;
+      for (int64_t dy = -range; dy <= range; ++dy) {
+        if (y + dy < -kCellOffset || y + dy >= kCellOffset) continue;
+        // The cells along z are contiguous in cells_.
+        const auto begin = std::lower_bound(
+            cells_.begin(), cells_.end(),
+            std::make_pair(cellKey(x + dx, y + dy, z_min), size_t(0)));
+        const auto end = std::lower_bound(
+            begin, cells_.end(),
+            std::make_pair(cellKey(x + dx, y + dy, z_max) + 1, size_t(0)));
+        for (auto it = begin; it != end; ++it) {
+          const size_t line = it->second / kNumKeyPoints;
+          if (line == exclude) continue;
+          const cv::Vec3f difference = key_points_[it->second] - point;
+          if (difference.dot(difference) <= square_radius) {
+            neighbours->push_back(line);
+          }
+        }
+      }
+    }
+  }
+  std::sort(neighbours->begin(), neighbours->end());
+  neighbours->erase(std::unique(neighbours->begin(), neighbours->end()),
+                    neighbours->end());
+}
+
+}  // namespace line_clustering
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <random>
+
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 #include <Eigen/Core>
@@ -88,6 +91,247 @@ TEST_F(LineClusteringTest, testrunLineMeans) {
   }
 }
 
+TEST_F(LineClusteringTest, testStreamingKMeans) {
+  StreamingKMeansCluster streaming_kmeans(2);
+  streaming_kmeans.cluster(lines_);
+  const size_t num_lines_cube = lines_.size() / 2;
+  const int label_cube_1 = streaming_kmeans.cluster_idx_[0];
+  const int label_cube_2 = streaming_kmeans.cluster_idx_[num_lines_cube];
+  EXPECT_NE(label_cube_1, label_cube_2);
+  for (size_t i = 0; i < num_lines_cube; ++i) {
+    EXPECT_EQ(streaming_kmeans.cluster_idx_[i], label_cube_1);
+    EXPECT_EQ(streaming_kmeans.cluster_idx_[i + num_lines_cube], label_cube_2);
+  }
+  const cv::Vec3f center_cube_1 = streaming_kmeans.getCenter(label_cube_1);
+  // The camera moves: the clusters move with it and keep their labels.
+  cv::Matx44f transform = cv::Matx44f::eye();
+  transform(0, 3) = 0.5;
+  transform(2, 3) = -1.0;
+  const cv::Vec6f shift(0.5, 0, -1.0, 0.5, 0, -1.0);
+  std::vector<cv::Vec6f> lines = lines_;
+  for (cv::Vec6f& line : lines) line += shift;
+  streaming_kmeans.cluster(lines, transform);
+  for (size_t i = 0; i < num_lines_cube; ++i) {
+    EXPECT_EQ(streaming_kmeans.cluster_idx_[i], label_cube_1);
+    EXPECT_EQ(streaming_kmeans.cluster_idx_[i + num_lines_cube], label_cube_2);
+  }
+  EXPECT_LT(cv::norm(streaming_kmeans.getCenter(label_cube_1) -
+                     (center_cube_1 + cv::Vec3f(0.5, 0, -1.0))),
+            1e-4);
+  // The first cube disappears and a new one appears far away: it gets a new
+  // cluster, while the one of the first cube is removed.
+  std::vector<cv::Vec6f> lines_new_cube(lines.begin() + num_lines_cube,
+                                        lines.end());
+  const cv::Vec6f shift_new_cube(10, 0, 0, 10, 0, 0);
+  for (size_t i = 0; i < num_lines_cube; ++i) {
+    lines_new_cube.push_back(lines[i] + shift_new_cube);
+  }
+  streaming_kmeans.setNewClusterDistance(2.0);
+  streaming_kmeans.cluster(lines_new_cube);
+  EXPECT_EQ(streaming_kmeans.getNumberOfClusters(), 2u);
+  const int label_new_cube = streaming_kmeans.cluster_idx_[num_lines_cube];
+  EXPECT_NE(label_new_cube, label_cube_2);
+  for (size_t i = 0; i < num_lines_cube; ++i) {
+    EXPECT_EQ(streaming_kmeans.cluster_idx_[i], label_cube_2);
+    EXPECT_EQ(streaming_kmeans.cluster_idx_[i + num_lines_cube],
+              label_new_cube);
+  }
+}
+
+TEST_F(LineClusteringTest, testSegmentIndex) {
+  std::mt19937 generator(3);
+  std::uniform_real_distribution<float> coordinate(-2.0, 2.0);
+  std::vector<cv::Vec6f> lines(200);
+  for (cv::Vec6f& line : lines) {
+    for (int k = 0; k < 6; ++k) line[k] = coordinate(generator);
+  }
+  const auto keyPoints = [](const cv::Vec6f& line) {
+    const cv::Vec3f start(line[0], line[1], line[2]);
+    const cv::Vec3f end(line[3], line[4], line[5]);
+    return std::vector<cv::Vec3f>{start, end, (start + end) * 0.5f};
+  };
+  SegmentIndex index;
+  index.build(lines, 0.3);
+  ASSERT_EQ(index.size(), lines.size());
+  std::vector<size_t> neighbours;
+  // Radii smaller and larger than the cells.
+  for (double radius : {0.2, 0.3, 0.7}) {
+    for (size_t i = 0; i < lines.size(); ++i) {
+      std::vector<size_t> expected;
+      for (size_t j = 0; j < lines.size(); ++j) {
+        if (j == i) continue;
+        bool near = false;
+        for (const cv::Vec3f& point_i : keyPoints(lines[i])) {
+          for (const cv::Vec3f& point_j : keyPoints(lines[j])) {
+            near = near || cv::norm(point_i - point_j) <= radius;
+          }
+        }
+        if (near) expected.push_back(j);
+      }
+      index.findNeighbours(i, radius, &neighbours);
+      EXPECT_EQ(neighbours, expected);
+    }
+  }
+}
+
+TEST_F(LineClusteringTest, testDBSCAN) {
+  // The lines of a cube are connected by their shared corners. A line far
+  // from the cubes is noise.
+  std::vector<cv::Vec6f> lines = lines_;
+  lines.push_back(cv::Vec6f(10, 10, 10, 11, 10, 10));
+  DBSCANCluster dbscan(0.05, 2);
+  dbscan.setLines(lines);
+  dbscan.cluster();
+  std::vector<int> labels = dbscan.getLabels();
+  ASSERT_EQ(labels.size(), lines.size());
+  EXPECT_EQ(dbscan.getNumberOfClusters(), 2u);
+  const size_t num_lines_cube = lines_.size() / 2;
+  EXPECT_NE(labels[0], labels[num_lines_cube]);
+  for (size_t i = 0; i < num_lines_cube; ++i) {
+    EXPECT_EQ(labels[i], labels[0]);
+    EXPECT_EQ(labels[i + num_lines_cube], labels[num_lines_cube]);
+  }
+  EXPECT_EQ(labels.back(), DBSCANCluster::kNoise);
+  // With more neighbours needed than any line has (at most five corners
+  // shared), all lines are noise.
+  dbscan.setMinNumNeighbours(6);
+  dbscan.cluster();
+  EXPECT_EQ(dbscan.getNumberOfClusters(), 0u);
+  labels = dbscan.getLabels();
+  EXPECT_EQ(std::count(labels.begin(), labels.end(), DBSCANCluster::kNoise),
+            static_cast<int>(lines.size()));
+  // Two parallel lines touching at a corner, on planes 1 m apart, are only
+  // neighbours if the planes are not compared.
+  std::vector<line_detection::LineWithPlanes> lines_with_planes(3);
+  lines_with_planes[0].line = cv::Vec6f(0, 0, 0, 1, 0, 0);
+  lines_with_planes[1].line = cv::Vec6f(0, 0, 0, 0, 1, 0);
+  lines_with_planes[2].line = cv::Vec6f(0, 0.01, 0, 0, 1, 0);
+  lines_with_planes[0].hessians = {{{0, 0, 1, 0}, {0, 1, 0, 0}}};
+  lines_with_planes[1].hessians = {{{0, 0, 1, 0}, {1, 0, 0, 0}}};
+  lines_with_planes[2].hessians = {{{0, 0, 1, -1}, {1, 0, 0, -1}}};
+  DBSCANCluster dbscan_planes(0.05, 1);
+  dbscan_planes.setLines(lines_with_planes);
+  dbscan_planes.cluster();
+  EXPECT_EQ(dbscan_planes.getNumberOfClusters(), 1u);
+  dbscan_planes.setPlaneSimilarity(0.95, 0.1);
+  dbscan_planes.cluster();
+  labels = dbscan_planes.getLabels();
+  EXPECT_EQ(dbscan_planes.getNumberOfClusters(), 1u);
+  EXPECT_EQ(labels[0], labels[1]);
+  EXPECT_EQ(labels[2], DBSCANCluster::kNoise);
+}
+
+TEST_F(LineClusteringTest, testPackedDistanceMatrix) {
+  const size_t N = lines_.size();
+  PackedDistanceMatrix perpendicular, nearest;
+  perpendicular.compute(lines_, computePerpendicularDistanceLines);
+  // The result does not depend on the number of threads.
+  nearest.compute(lines_, computeSquareNearestDifferenceLines, 4);
+  EXPECT_EQ(perpendicular.size(), N);
+  EXPECT_EQ(perpendicular.numEntries(), N * (N - 1) / 2);
+  for (size_t i = 0; i < N; ++i) {
+    EXPECT_EQ(perpendicular(i, i), 0.0f);
+    for (size_t j = 0; j < N; ++j) {
+      if (i == j) continue;
+      EXPECT_FLOAT_EQ(perpendicular(i, j),
+                      computePerpendicularDistanceLines(lines_[i], lines_[j]));
+      EXPECT_EQ(perpendicular(i, j), perpendicular(j, i));
+      EXPECT_FLOAT_EQ(
+          nearest(i, j),
+          computeSquareNearestDifferenceLines(lines_[i], lines_[j]));
+    }
+  }
+  // Conversion to and from the upper triangle of a cv::Mat.
+  cv::Mat dist_mat = nearest.toMat();
+  PackedDistanceMatrix converted;
+  converted.fromMat(dist_mat);
+  for (size_t i = 0; i < N; ++i) {
+    for (size_t j = 0; j < N; ++j) {
+      EXPECT_EQ(converted(i, j), nearest(i, j));
+      EXPECT_EQ(dist_mat.at<float>(i, j), j > i ? nearest(i, j) : 0.0f);
+    }
+  }
+}
+
+TEST_F(LineClusteringTest, testDistanceMatrixOfLinesAndHessians) {
+  std::vector<line_detection::LineWithPlanes> lines(lines_.size());
+  for (size_t i = 0; i < lines_.size(); ++i) {
+    lines[i].line = lines_[i];
+    // Planes of the cube faces that contain the line.
+    lines[i].hessians[0] = {0, 0, 1, -lines_[i][2]};
+    lines[i].hessians[1] = {1, 0, 0, -lines_[i][0]};
+  }
+  KMeansCluster kmeans_cluster(lines, 2);
+  kmeans_cluster.initClusteringWithHessians(0.5);
+  const cv::Mat dist_mat = kmeans_cluster.getDistanceMatrix();
+  PackedDistanceMatrix packed;
+  kmeans_cluster.computeDistanceMatrix(&packed, 4);
+  ASSERT_EQ(packed.size(), lines.size());
+  // Reference: the lines are divided by the mean of all their coordinates
+  // and the hessians multiplied by the mean and by the scale 0.5.
+  double mean = 0.0;
+  for (const line_detection::LineWithPlanes& line : lines) {
+    for (int k = 0; k < 6; ++k) mean += line.line[k];
+  }
+  mean /= 6.0 * lines.size();
+  std::vector<cv::Vec<float, 14>> lines_and_hessians(lines.size());
+  for (size_t i = 0; i < lines.size(); ++i) {
+    for (int k = 0; k < 6; ++k) {
+      lines_and_hessians[i][k] = lines[i].line[k] / mean;
+    }
+    for (int k = 0; k < 4; ++k) {
+      lines_and_hessians[i][6 + k] = lines[i].hessians[0][k] * mean * 0.5;
+      lines_and_hessians[i][10 + k] = lines[i].hessians[1][k] * mean * 0.5;
+    }
+  }
+  for (size_t i = 0; i < lines.size(); ++i) {
+    for (size_t j = i + 1; j < lines.size(); ++j) {
+      const double expected =
+          cv::norm(lines_and_hessians[i] - lines_and_hessians[j]);
+      EXPECT_NEAR(packed(i, j), expected, 1e-5 * (1.0 + expected));
+      EXPECT_EQ(packed(i, j), dist_mat.at<float>(i, j));
+    }
+  }
+  // The clustering of the packed matrix is the one of the cv::Mat.
+  KMedoidsCluster kmedoids_mat(dist_mat, 2);
+  KMedoidsCluster kmedoids_packed(packed, 2);
+  kmedoids_mat.cluster();
+  kmedoids_packed.cluster();
+  EXPECT_EQ(kmedoids_mat.getLabels(), kmedoids_packed.getLabels());
+}
+
+TEST_F(LineClusteringTest, testKMedoidsMethods) {
+  // Every line of a cube is nearer to all the lines of its cube than to any
+  // line of the other one.
+  PackedDistanceMatrix dist_mat;
+  dist_mat.computeEuclidean(lines_);
+  const size_t num_lines_cube = lines_.size() / 2;
+  for (KMedoidsMethod method :
+       {KMedoidsMethod::FASTER_PAM, KMedoidsMethod::CLARA}) {
+    KMedoidsCluster kmedoids(dist_mat, 2);
+    kmedoids.setMethod(method);
+    // Samples of less than half of the lines.
+    kmedoids.setClaraParameters(4, 10);
+    kmedoids.cluster();
+    const std::vector<size_t> labels = kmedoids.getLabels();
+    ASSERT_EQ(labels.size(), lines_.size());
+    EXPECT_NE(labels[0], labels[num_lines_cube]);
+    for (size_t i = 0; i < num_lines_cube; ++i) {
+      EXPECT_EQ(labels[i], labels[0]);
+      EXPECT_EQ(labels[i + num_lines_cube], labels[num_lines_cube]);
+    }
+  }
+  // With as many clusters as lines, every line is a medoid.
+  KMedoidsCluster kmedoids(dist_mat, lines_.size());
+  kmedoids.setMethod(KMedoidsMethod::FASTER_PAM);
+  kmedoids.cluster();
+  std::vector<size_t> labels = kmedoids.getLabels();
+  std::sort(labels.begin(), labels.end());
+  for (size_t i = 0; i < labels.size(); ++i) {
+    EXPECT_EQ(labels[i], i);
+  }
+}
+
 }  // namespace line_clustering
 
 LINE_CLUSTERING_TESTING_ENTRYPOINT
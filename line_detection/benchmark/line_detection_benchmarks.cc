@@ -0,0 +1,319 @@
+// Benchmarks of the hot functions of the line detection and of the whole
+// pipeline on a frame. The inputs are test_data/kitchen.png (copied by the
+// test_data target, the benchmarks that need it are skipped if it is missing)
+// and synthetic organized clouds of several sizes, which show a room as seen
+// by a pinhole camera.
+//
+// Usage (from the build directory of the package, after "make test_data"):
+//   ./line_detection_benchmarks [--benchmark_filter=<regex>]
+//                               [--benchmark_format=json] ...
+
+#include <line_detection/line_detection.h>
+
+#include <cmath>
+#include <limits>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+namespace line_detection {
+namespace {
+
+const char kKitchenImagePath[] = "test_data/kitchen.png";
+
+// Synthetic frame: a room (floor, ceiling, three walls) with a box on the
+// floor, seen by a camera of the given size. The pixels of every surface
+// have a different color, so that the 2D detectors find lines where the
+// surfaces meet.
+struct SyntheticFrame {
+  cv::Mat image;
+  cv::Mat cloud;
+  cv::Mat camera_P;
+};
+
+SyntheticFrame makeSyntheticFrame(int cols, int rows) {
+  SyntheticFrame frame;
+  const float focal_length = 0.8f * cols;
+  const float cx = 0.5f * cols;
+  const float cy = 0.5f * rows;
+  frame.camera_P = (cv::Mat_<float>(3, 4) << focal_length, 0, cx, 0,
+                                             0, focal_length, cy, 0,
+                                             0, 0, 1, 0);
+  // Planes n * x = d of the room (the camera looks along z, y points down).
+  const cv::Vec3f normals[5] = {{0, 0, 1}, {0, 1, 0}, {0, -1, 0},
+                                {1, 0, 0}, {-1, 0, 0}};
+  const float distances[5] = {4.0f, 1.2f, 1.5f, 2.0f, 2.0f};
+  const cv::Vec3b colors[5] = {{200, 200, 200}, {90, 60, 40}, {250, 250, 250},
+                               {150, 160, 170}, {120, 140, 130}};
+  // Box: x in [-0.4, 0.4], y in [0.6, 1.2], z in [2, 2.8].
+  const cv::Vec3f box_min(-0.4f, 0.6f, 2.0f), box_max(0.4f, 1.2f, 2.8f);
+  const cv::Vec3b box_colors[3] = {{40, 40, 160}, {60, 60, 200},
+                                   {30, 30, 120}};
+  std::default_random_engine generator(1);
+  std::normal_distribution<float> noise(0.0f, 0.003f);
+  frame.image.create(rows, cols, CV_8UC3);
+  frame.cloud.create(rows, cols, CV_32FC3);
+  for (int v = 0; v < rows; ++v) {
+    for (int u = 0; u < cols; ++u) {
+      const cv::Vec3f ray((u - cx) / focal_length, (v - cy) / focal_length,
+                          1.0f);
+      float t_min = std::numeric_limits<float>::max();
+      cv::Vec3b color;
+      for (size_t k = 0; k < 5; ++k) {
+        const float denominator = normals[k].dot(ray);
+        if (denominator <= 0.0f) continue;
+        const float t = distances[k] / denominator;
+        if (t > 0.0f && t < t_min) {
+          t_min = t;
+          color = colors[k];
+        }
+      }
+      // Intersection with the faces of the box facing the camera.
+      for (int axis = 0; axis < 3; ++axis) {
+        const float plane = axis == 2 ? box_min[axis]
+                                      : (ray[axis] > 0.0f ? box_min[axis]
+                                                          : box_max[axis]);
+        if (ray[axis] == 0.0f) continue;
+        const float t = plane / ray[axis];
+        if (t <= 0.0f || t >= t_min) continue;
+        const cv::Vec3f point = t * ray;
+        bool inside = true;
+        for (int j = 0; j < 3; ++j) {
+          if (j == axis) continue;
+          inside &= point[j] >= box_min[j] && point[j] <= box_max[j];
+        }
+        if (inside) {
+          t_min = t;
+          color = box_colors[axis];
+        }
+      }
+      frame.cloud.at<cv::Vec3f>(v, u) = (t_min + noise(generator)) * ray;
+      frame.image.at<cv::Vec3b>(v, u) = color;
+    }
+  }
+  return frame;
+}
+
+// Synthetic frames are cached, since they are used by several benchmarks.
+const SyntheticFrame& getSyntheticFrame(int cols) {
+  static std::vector<std::pair<int, SyntheticFrame>> frames;
+  for (const std::pair<int, SyntheticFrame>& frame : frames) {
+    if (frame.first == cols) return frame.second;
+  }
+  frames.emplace_back(cols, makeSyntheticFrame(cols, cols * 3 / 4));
+  return frames.back().second;
+}
+
+// Random 2D lines of at least 10 pixels inside an image of the given size.
+std::vector<cv::Vec4f> makeRandomLines2D(int cols, int rows, size_t num_lines) {
+  std::default_random_engine generator(2);
+  std::uniform_real_distribution<float> x(0.0f, cols - 1.0f);
+  std::uniform_real_distribution<float> y(0.0f, rows - 1.0f);
+  std::vector<cv::Vec4f> lines;
+  while (lines.size() < num_lines) {
+    const cv::Vec4f line(x(generator), y(generator), x(generator),
+                         y(generator));
+    if (std::hypot(line[2] - line[0], line[3] - line[1]) >= 10.0f) {
+      lines.push_back(line);
+    }
+  }
+  return lines;
+}
+
+// Points on the plane z = 1 + 0.2 * x with noise, and a fraction of outliers.
+std::vector<cv::Vec3f> makePlanePoints(size_t num_points,
+                                       double outlier_fraction) {
+  std::default_random_engine generator(3);
+  std::uniform_real_distribution<float> coordinate(-0.5f, 0.5f);
+  std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  std::normal_distribution<float> noise(0.0f, 0.002f);
+  std::vector<cv::Vec3f> points(num_points);
+  for (cv::Vec3f& point : points) {
+    point[0] = coordinate(generator);
+    point[1] = coordinate(generator);
+    point[2] = 1.0f + 0.2f * point[0] + noise(generator);
+    if (uniform(generator) < outlier_fraction) {
+      point[2] += coordinate(generator);
+    }
+  }
+  return points;
+}
+
+bool loadKitchenImage(cv::Mat* image, benchmark::State* state) {
+  *image = cv::imread(kKitchenImagePath, cv::IMREAD_COLOR);
+  if (image->empty()) {
+    state->SkipWithError("Could not load test_data/kitchen.png.");
+    return false;
+  }
+  return true;
+}
+
+void BM_PlaneRANSAC(benchmark::State& state) {
+  LineDetector line_detector;
+  DetectionContext context;
+  const std::vector<cv::Vec3f> points = makePlanePoints(state.range(0), 0.3);
+  std::vector<cv::Vec3f> inliers;
+  for (auto _ : state) {
+    line_detector.planeRANSAC(points, &inliers, &context);
+    benchmark::DoNotOptimize(inliers.data());
+  }
+  state.SetItemsProcessed(state.iterations() * points.size());
+}
+BENCHMARK(BM_PlaneRANSAC)->Arg(100)->Arg(1000)->Arg(10000);
+
+void BM_HessianNormalFormOfPlane(benchmark::State& state) {
+  LineDetector line_detector;
+  const std::vector<cv::Vec3f> points = makePlanePoints(state.range(0), 0.0);
+  cv::Vec4f hessian;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        line_detector.hessianNormalFormOfPlane(points, &hessian));
+  }
+  state.SetItemsProcessed(state.iterations() * points.size());
+}
+BENCHMARK(BM_HessianNormalFormOfPlane)->Arg(3)->Arg(100)->Arg(10000);
+
+void BM_FindPointsInRectangle(benchmark::State& state) {
+  // Rectangle of the given width along a diagonal line of 200 pixels.
+  const float width = state.range(0);
+  const std::vector<cv::Point2f> corners = {
+      {100.0f, 100.0f}, {241.4f, 241.4f},
+      {241.4f - 0.7071f * width, 241.4f + 0.7071f * width},
+      {100.0f - 0.7071f * width, 100.0f + 0.7071f * width}};
+  std::vector<cv::Point2i> points;
+  for (auto _ : state) {
+    findPointsInRectangle(corners, &points);
+    benchmark::DoNotOptimize(points.data());
+  }
+  state.SetItemsProcessed(state.iterations() * points.size());
+}
+BENCHMARK(BM_FindPointsInRectangle)->Arg(5)->Arg(20)->Arg(80);
+
+void BM_FuseLines2DOnTheFly(benchmark::State& state) {
+  cv::Mat image, image_gray;
+  if (!loadKitchenImage(&image, &state)) return;
+  cv::cvtColor(image, image_gray, cv::COLOR_BGR2GRAY);
+  LineDetector line_detector;
+  std::vector<cv::Vec4f> lines2D, lines2D_fused;
+  line_detector.detectLines(image_gray, DetectorType::LSD, &lines2D);
+  for (auto _ : state) {
+    line_detector.fuseLines2DOnTheFly(lines2D, &lines2D_fused);
+    benchmark::DoNotOptimize(lines2D_fused.data());
+  }
+  state.SetItemsProcessed(state.iterations() * lines2D.size());
+}
+BENCHMARK(BM_FuseLines2DOnTheFly);
+
+void BM_Find3DlinesRated(benchmark::State& state) {
+  const SyntheticFrame& frame = getSyntheticFrame(state.range(0));
+  LineDetector line_detector;
+  DetectionContext context;
+  const std::vector<cv::Vec4f> lines2D =
+      makeRandomLines2D(frame.cloud.cols, frame.cloud.rows, 200);
+  std::vector<cv::Vec6f> lines3D;
+  std::vector<double> rating;
+  for (auto _ : state) {
+    line_detector.find3DlinesRated(frame.cloud, lines2D, &lines3D, &rating,
+                                   &context);
+    benchmark::DoNotOptimize(lines3D.data());
+  }
+  state.SetItemsProcessed(state.iterations() * lines2D.size());
+}
+BENCHMARK(BM_Find3DlinesRated)->Arg(160)->Arg(320)->Arg(640);
+
+// Checks 3D lines between random points of the cloud. With range(1) = 1 the
+// voxel grid of the cloud is used, as in runCheckOn3DLines.
+void BM_CheckIfValidLineBruteForce(benchmark::State& state) {
+  const SyntheticFrame& frame = getSyntheticFrame(state.range(0));
+  const bool use_grid = state.range(1) != 0;
+  LineDetectionParams params;
+  LineDetector line_detector(&params);
+  FrameArena arena;
+  CloudVoxelGrid cloud_grid;
+  cloud_grid.compute(frame.cloud, 2.0 * params.max_deviation_inlier_line_check);
+  std::default_random_engine generator(4);
+  std::uniform_int_distribution<int> row(0, frame.cloud.rows - 1);
+  std::uniform_int_distribution<int> col(0, frame.cloud.cols - 1);
+  std::vector<cv::Vec6f> lines(50);
+  for (cv::Vec6f& line : lines) {
+    const cv::Vec3f start =
+        frame.cloud.at<cv::Vec3f>(row(generator), col(generator));
+    const cv::Vec3f end =
+        frame.cloud.at<cv::Vec3f>(row(generator), col(generator));
+    line = {start[0], start[1], start[2], end[0], end[1], end[2]};
+  }
+  for (auto _ : state) {
+    for (const cv::Vec6f& line_in : lines) {
+      cv::Vec6f line = line_in;
+      benchmark::DoNotOptimize(line_detector.checkIfValidLineBruteForce(
+          frame.cloud, &line, use_grid ? &cloud_grid : nullptr, &arena));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * lines.size());
+}
+BENCHMARK(BM_CheckIfValidLineBruteForce)
+    ->Args({160, 0})
+    ->Args({160, 1})
+    ->Args({320, 0})
+    ->Args({320, 1})
+    ->Args({640, 1});
+
+// Whole pipeline (detection, fusion, projection to 3D, check) on a synthetic
+// frame. The counters are the ones of the last frame.
+void BM_ProcessFrameSynthetic(benchmark::State& state) {
+  const SyntheticFrame& frame = getSyntheticFrame(state.range(0));
+  LineDetector line_detector;
+  DetectionContext context;
+  FrameOptions options;
+  FrameResult result;
+  for (auto _ : state) {
+    line_detector.processFrame(frame.image, frame.cloud, frame.camera_P,
+                               options, &result, &context);
+  }
+  state.counters["lines2D"] = result.lines2D_detected.size();
+  state.counters["lines3D"] = result.lines3D.size();
+  state.counters["ransac_iterations"] =
+      result.statistics.num_ransac_iterations;
+}
+BENCHMARK(BM_ProcessFrameSynthetic)
+    ->Arg(160)
+    ->Arg(320)
+    ->Arg(640)
+    ->Unit(benchmark::kMillisecond);
+
+// Whole pipeline on the kitchen image, with a synthetic cloud of the same
+// size. The 2D lines do not match the cloud, but they are as many and as
+// long as in a real frame.
+void BM_ProcessFrameKitchen(benchmark::State& state) {
+  cv::Mat image;
+  if (!loadKitchenImage(&image, &state)) return;
+  cv::cvtColor(image, image, cv::COLOR_BGR2RGB);
+  const SyntheticFrame synthetic_frame =
+      makeSyntheticFrame(image.cols, image.rows);
+  LineDetector line_detector;
+  DetectionContext context;
+  FrameOptions options;
+  options.detector = static_cast<DetectorType>(state.range(0));
+  FrameResult result;
+  for (auto _ : state) {
+    line_detector.processFrame(image, synthetic_frame.cloud,
+                               synthetic_frame.camera_P, options, &result,
+                               &context);
+  }
+  state.counters["lines2D"] = result.lines2D_detected.size();
+  state.counters["lines3D"] = result.lines3D.size();
+}
+BENCHMARK(BM_ProcessFrameKitchen)
+    ->Arg(static_cast<int>(DetectorType::LSD))
+    ->Arg(static_cast<int>(DetectorType::FAST))
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace
+}  // namespace line_detection
+
+BENCHMARK_MAIN();
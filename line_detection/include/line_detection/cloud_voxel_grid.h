@@ -0,0 +1,82 @@
+#ifndef LINE_DETECTION_CLOUD_VOXEL_GRID_H_
+#define LINE_DETECTION_CLOUD_VOXEL_GRID_H_
+
+#include <cstdint>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+namespace line_detection {
+
+// Spatial index of the points of a cloud, computed once per frame, so that the
+// points near a 3D segment can be found without looking at the whole cloud.
+// The space is divided into cubic cells, which are hashed into buckets. The
+// points of a bucket are stored contiguously. Since several cells can fall
+// into the same bucket, the points of the buckets returned by
+// findBucketsNearSegment are a superset of the points near the segment: the
+// caller must still check the distance of each point.
+class CloudVoxelGrid {
+ public:
+  CloudVoxelGrid() {}
+
+  // Sorts the finite points of the cloud (of type CV_32FC3) into the buckets.
+  // The buffers are reused from one call to the next.
+  // Input: cloud:     Point cloud in the format CV_32FC3.
+  //
+  //        cell_size: Edge length of the cells (in meters).
+  void compute(const cv::Mat& cloud, double cell_size);
+  // Marks the grid as not computed, without freeing the buffers.
+  void reset();
+  // Returns true if compute was called with (the data of) this cloud and
+  // reset was not called afterwards.
+  bool isComputedFor(const cv::Mat& cloud) const;
+
+  // Finds the buckets that contain all the points whose distance to the
+  // segment from start to end is smaller than radius. Only the part of the
+  // segment near the bounding box of the points is visited, and all the
+  // buckets are returned if that would visit more cells than there are
+  // buckets, so that the cost is bounded even for far away endpoints.
+  // Input: start/end: Endpoints of the segment.
+  //
+  //        radius:    Maximum distance of the points to the segment.
+  //
+  // Output: buckets:  Indices of the buckets, sorted and without duplicates.
+  void findBucketsNearSegment(const cv::Vec3f& start, const cv::Vec3f& end,
+                              double radius, std::vector<int>* buckets) const;
+
+  // Returns the range [begin, end) of the points in a bucket.
+  const cv::Vec3f* bucketBegin(int bucket) const {
+    return points_.data() + bucket_start_[bucket];
+  }
+  const cv::Vec3f* bucketEnd(int bucket) const {
+    return points_.data() + bucket_start_[bucket + 1];
+  }
+
+  double cell_size() const { return cell_size_; }
+  size_t num_points() const { return points_.size(); }
+
+ private:
+  // Returns the index of the cell that contains the coordinate.
+  int64_t cellCoordinate(double coordinate) const;
+  int bucketOfCell(int64_t x, int64_t y, int64_t z) const;
+
+  // Cloud from which the grid was computed (empty if not computed).
+  cv::Mat cloud_;
+  double cell_size_ = 1.0;
+  // Bounding box of the finite points of the cloud.
+  cv::Vec3d bounding_box_min_;
+  cv::Vec3d bounding_box_max_;
+  // Number of buckets minus one (the number of buckets is a power of 2).
+  uint64_t bucket_mask_ = 0;
+  // Points of bucket b are points_[bucket_start_[b]] to
+  // points_[bucket_start_[b + 1] - 1].
+  std::vector<int> bucket_start_;
+  std::vector<cv::Vec3f> points_;
+  // Bucket of each point of the cloud (-1 for the points that are not
+  // finite), used while computing the grid.
+  std::vector<int> point_buckets_;
+};
+
+}  // namespace line_detection
+
+#endif  // LINE_DETECTION_CLOUD_VOXEL_GRID_H_
@@ -0,0 +1,97 @@
+#ifndef LINE_DETECTION_COUNTER_RNG_H_
+#define LINE_DETECTION_COUNTER_RNG_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include <glog/logging.h>
+
+namespace line_detection {
+
+// Counter-based random number generator Philox4x32-10 (Salmon et al.,
+// "Parallel Random Numbers: As Easy as 1, 2, 3", SC 2011). The random numbers
+// are a function of a counter and of a key, without any state carried from
+// one number to the next. The numbers drawn for a given counter are therefore
+// the same whatever the order in which the counters are visited, which makes
+// parallel computations reproduce the serial ones exactly.
+class Philox4x32 {
+ public:
+  typedef std::array<uint32_t, 4> Counter;
+  typedef std::array<uint32_t, 2> Key;
+
+  // Returns four independent, uniformly distributed 32-bit random numbers for
+  // the given counter and key.
+  static Counter generate(Counter counter, Key key) {
+    constexpr size_t kNumRounds = 10;
+    for (size_t round = 0; round < kNumRounds; ++round) {
+      if (round > 0) {
+        key[0] += kWeyl0;
+        key[1] += kWeyl1;
+      }
+      const uint64_t product0 =
+          static_cast<uint64_t>(kMultiplier0) * counter[0];
+      const uint64_t product1 =
+          static_cast<uint64_t>(kMultiplier1) * counter[2];
+      counter = {static_cast<uint32_t>(product1 >> 32) ^ counter[1] ^ key[0],
+                 static_cast<uint32_t>(product1),
+                 static_cast<uint32_t>(product0 >> 32) ^ counter[3] ^ key[1],
+                 static_cast<uint32_t>(product0)};
+    }
+    return counter;
+  }
+
+ private:
+  static constexpr uint32_t kMultiplier0 = 0xD2511F53;
+  static constexpr uint32_t kMultiplier1 = 0xCD9E8D57;
+  static constexpr uint32_t kWeyl0 = 0x9E3779B9;
+  static constexpr uint32_t kWeyl1 = 0xBB67AE85;
+};
+
+// Identifies the random numbers of a RANSAC run: the numbers drawn in
+// iteration i of the run are Philox4x32::generate({line, side, i, 0},
+// {seed, frame}). Runs with the same key draw the same numbers, whichever
+// thread runs them and in whichever order.
+struct RansacKey {
+  uint32_t seed = 1;
+  // Index of the frame (see FrameOptions::frame_index).
+  uint32_t frame = 0;
+  // Index of the 2D line whose planes are fitted, and side of the line
+  // (0: left, 1: right).
+  uint32_t line = 0;
+  uint32_t side = 0;
+
+  Philox4x32::Counter generate(uint32_t iteration) const {
+    return Philox4x32::generate({line, side, iteration, 0}, {seed, frame});
+  }
+};
+
+// Maps a 32-bit random number to [0, n). The bias, at most n / 2^32, is
+// negligible for the number of points of a patch.
+inline size_t randomIndexBelow(uint32_t random, size_t n) {
+  return static_cast<size_t>((static_cast<uint64_t>(random) * n) >> 32);
+}
+
+// Samples three distinct indices in [0, n) uniformly from three random
+// numbers, without building an array of all the indices: the k-th index is
+// drawn among the n - k indices not drawn yet and shifted past the ones
+// drawn before it.
+inline void sampleThreeUniqueIndices(const Philox4x32::Counter& random,
+                                     size_t n, size_t indices[3]) {
+  CHECK_GE(n, 3u);
+  size_t first = randomIndexBelow(random[0], n);
+  size_t second = randomIndexBelow(random[1], n - 1);
+  if (second >= first) ++second;
+  size_t third = randomIndexBelow(random[2], n - 2);
+  const size_t smaller = first < second ? first : second;
+  const size_t larger = first < second ? second : first;
+  if (third >= smaller) ++third;
+  if (third >= larger) ++third;
+  indices[0] = first;
+  indices[1] = second;
+  indices[2] = third;
+}
+
+}  // namespace line_detection
+
+#endif  // LINE_DETECTION_COUNTER_RNG_H_
@@ -0,0 +1,137 @@
+#ifndef LINE_DETECTION_FRAME_ARENA_H_
+#define LINE_DETECTION_FRAME_ARENA_H_
+
+#include <memory>
+#include <vector>
+
+#include <glog/logging.h>
+#include <opencv2/core.hpp>
+
+namespace line_detection {
+
+// Pool of reusable buffers for the computations made on every line of a
+// frame. A buffer is borrowed with a ScratchVector and given back, with its
+// memory, when the ScratchVector goes out of scope. After the first frames
+// the buffers are large enough for all the lines, so that the per-line code
+// does not allocate memory anymore.
+// The buffers must be given back in the reverse order in which they were
+// borrowed (which ScratchVector does automatically, as long as it is only
+// used as a local variable). An arena must not be shared between threads.
+class FrameArena {
+ public:
+  FrameArena() {}
+
+  // Borrows an empty buffer of the given type.
+  template <typename T>
+  std::vector<T>* acquire();
+  // Gives back the buffer last borrowed for the given type.
+  template <typename T>
+  void release(std::vector<T>* buffer);
+
+  // Number of times that a buffer had to be created or to grow since the last
+  // call to resetAllocationCounter. It stays zero while the buffers are large
+  // enough for the data they are used for.
+  size_t num_allocations() const { return num_allocations_; }
+  void resetAllocationCounter() { num_allocations_ = 0; }
+
+ private:
+  // Buffers of one type, in the order in which they are borrowed.
+  template <typename T>
+  struct Pool {
+    std::vector<std::unique_ptr<std::vector<T>>> buffers;
+    // Capacity of the buffers in use when they were borrowed.
+    std::vector<size_t> capacities;
+    size_t num_in_use = 0;
+  };
+
+  template <typename T>
+  Pool<T>* getPool();
+
+  Pool<int> int_pool_;
+  Pool<float> float_pool_;
+  Pool<double> double_pool_;
+  Pool<unsigned char> uchar_pool_;
+  Pool<cv::Point2f> point2f_pool_;
+  Pool<cv::Vec3f> vec3f_pool_;
+  size_t num_allocations_ = 0;
+};
+
+template <>
+inline FrameArena::Pool<int>* FrameArena::getPool<int>() {
+  return &int_pool_;
+}
+template <>
+inline FrameArena::Pool<float>* FrameArena::getPool<float>() {
+  return &float_pool_;
+}
+template <>
+inline FrameArena::Pool<double>* FrameArena::getPool<double>() {
+  return &double_pool_;
+}
+template <>
+inline FrameArena::Pool<unsigned char>* FrameArena::getPool<unsigned char>() {
+  return &uchar_pool_;
+}
+template <>
+inline FrameArena::Pool<cv::Point2f>* FrameArena::getPool<cv::Point2f>() {
+  return &point2f_pool_;
+}
+template <>
+inline FrameArena::Pool<cv::Vec3f>* FrameArena::getPool<cv::Vec3f>() {
+  return &vec3f_pool_;
+}
+
+template <typename T>
+std::vector<T>* FrameArena::acquire() {
+  Pool<T>* pool = getPool<T>();
+  if (pool->num_in_use == pool->buffers.size()) {
+    pool->buffers.emplace_back(new std::vector<T>());
+    pool->capacities.push_back(0);
+    ++num_allocations_;
+  }
+  std::vector<T>* buffer = pool->buffers[pool->num_in_use].get();
+  buffer->clear();
+  pool->capacities[pool->num_in_use] = buffer->capacity();
+  ++pool->num_in_use;
+  return buffer;
+}
+
+template <typename T>
+void FrameArena::release(std::vector<T>* buffer) {
+  Pool<T>* pool = getPool<T>();
+  CHECK_GT(pool->num_in_use, 0u);
+  --pool->num_in_use;
+  CHECK_EQ(buffer, pool->buffers[pool->num_in_use].get())
+      << "The buffers must be released in the reverse order of acquisition.";
+  if (buffer->capacity() > pool->capacities[pool->num_in_use]) {
+    ++num_allocations_;
+  }
+}
+
+// Buffer borrowed from a FrameArena for the lifetime of the object. If no
+// arena is given, the buffer is owned by the object itself.
+template <typename T>
+class ScratchVector {
+ public:
+  explicit ScratchVector(FrameArena* arena)
+      : arena_(arena),
+        buffer_(arena != nullptr ? arena->acquire<T>() : &own_buffer_) {}
+  ~ScratchVector() {
+    if (arena_ != nullptr) arena_->release(buffer_);
+  }
+  ScratchVector(const ScratchVector&) = delete;
+  ScratchVector& operator=(const ScratchVector&) = delete;
+
+  std::vector<T>& operator*() { return *buffer_; }
+  std::vector<T>* operator->() { return buffer_; }
+  std::vector<T>* get() { return buffer_; }
+
+ private:
+  FrameArena* arena_;
+  std::vector<T> own_buffer_;
+  std::vector<T>* buffer_;
+};
+
+}  // namespace line_detection
+
+#endif  // LINE_DETECTION_FRAME_ARENA_H_
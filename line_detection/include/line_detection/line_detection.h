@@ -1,13 +1,23 @@
 #ifndef LINE_DETECTION_LINE_DETECTION_H_
 #define LINE_DETECTION_LINE_DETECTION_H_
 
+#include "line_detection/cloud_voxel_grid.h"
 #include "line_detection/common.h"
-
+#include "line_detection/counter_rng.h"
+#include "line_detection/frame_arena.h"
+#include "line_detection/patch_sampler.h"
+#include "line_detection/plane_error_kernels.h"
+#include "line_detection/preprocessed_cloud.h"
+
+#include <algorithm>
+#include <array>
 #include <chrono>
 #include <cmath>
 #include <fstream>
 #include <limits>
+#include <memory>
 #include <random>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -37,6 +47,17 @@ enum class DetectorType : unsigned int {
   HOUGH = 3
 };
 
+// Methods to check whether the inliers found by planeRANSAC form a single
+// connected component:
+// - DISTANCE_FROM_MEAN: the sorted distances of the inliers from their mean
+//   have no gap larger than a threshold (see ClusterDistanceFromMean).
+// - PIXEL_GRID: the inliers are connected through neighbouring pixels of the
+//   organized cloud (see ClusterPixelGrid).
+enum class ConnectivityCheck : unsigned int {
+  DISTANCE_FROM_MEAN = 0,
+  PIXEL_GRID = 1
+};
+
 // Meaning of line types:
 // - DISCONT: discontinuity line. Line on a discontinuity edge of an object,
 //            i.e., for which the two planes fitted to the inliers around the
@@ -71,20 +92,71 @@ enum class LineType : unsigned int {
   INTERSECT = 3
 };
 
+// The planes and colors around a line are stored inline, so that the line
+// records can be copied and stored in vectors without allocating memory.
+// By convention hessians[0] is the plane on the right side of the line and
+// hessians[1] the plane on the left side (a plane that was not found is set to
+// zero), whereas colors[0] is the mean color on the left side and colors[1]
+// the one on the right side.
 struct Line2D3DWithPlanes {
   cv::Vec4f line2D;
   cv::Vec6f line3D;
-  std::vector<cv::Vec4f> hessians;
+  std::array<cv::Vec4f, 2> hessians;
   LineType type;
 };
 
 struct LineWithPlanes {
   cv::Vec6f line;
-  std::vector<cv::Vec4f> hessians;
-  std::vector<cv::Vec3b> colors;
+  std::array<cv::Vec4f, 2> hessians;
+  std::array<cv::Vec3b, 2> colors;
   LineType type;
 };
 
+// Lines of a whole frame stored as a structure of arrays, e.g. to pass them
+// on to the clustering or to fill in messages field by field.
+struct LineBatch {
+  std::vector<cv::Vec6f> lines;
+  std::vector<std::array<cv::Vec4f, 2>> hessians;
+  std::vector<std::array<cv::Vec3b, 2>> colors;
+  std::vector<LineType> types;
+
+  size_t size() const { return lines.size(); }
+  bool empty() const { return lines.empty(); }
+  void clear() {
+    lines.clear();
+    hessians.clear();
+    colors.clear();
+    types.clear();
+  }
+  void reserve(size_t n) {
+    lines.reserve(n);
+    hessians.reserve(n);
+    colors.reserve(n);
+    types.reserve(n);
+  }
+  void push_back(const LineWithPlanes& line) {
+    lines.push_back(line.line);
+    hessians.push_back(line.hessians);
+    colors.push_back(line.colors);
+    types.push_back(line.type);
+  }
+  // Replaces the content of the batch with the given lines. The memory of the
+  // batch is reused if it is large enough.
+  void assign(const std::vector<LineWithPlanes>& lines_in) {
+    clear();
+    reserve(lines_in.size());
+    for (const LineWithPlanes& line : lines_in) push_back(line);
+  }
+  LineWithPlanes get(size_t i) const {
+    LineWithPlanes line;
+    line.line = lines[i];
+    line.hessians = hessians[i];
+    line.colors = colors[i];
+    line.type = types[i];
+    return line;
+  }
+};
+
 struct LineDetectionParams {
   // default = 0.3: find3DLineOnPlanes
   double max_dist_between_planes = 0.3;
@@ -96,6 +168,21 @@ struct LineDetectionParams {
   double max_absolute_rect_size = 5.0;
   // default = 20: LineDetector::project2Dto3DwithPlanes
   unsigned int min_points_in_rect = 20;
+  // default = 1: LineDetector::findInliersGiven2DLine
+  // Only every patch_sampling_stride-th pixel (along both image axes) of the
+  // rectangles around a line is used to fit its planes (see
+  // PatchSampler::setSubsampling). With ConnectivityCheck::PIXEL_GRID, the
+  // thresholds of the connectivity check are scaled by the spacing of the
+  // samples (PatchSamples::pixel_step).
+  int patch_sampling_stride = 1;
+  // default = 0: LineDetector::findInliersGiven2DLine
+  // If not 0, at most this many points of a rectangle around a line are used
+  // to fit its plane, on evenly spaced columns (or rows) along the line. This
+  // bounds the cost of RANSAC for long lines. min_points_in_rect is checked
+  // on the points before the subsampling. As for patch_sampling_stride, the
+  // thresholds of the PIXEL_GRID check are scaled by the resulting spacing
+  // of the samples.
+  size_t max_points_per_patch = 0;
   // default = 20: LineDetector::checkIfValidPointsOnPlanesGivenProlongedLine
   unsigned int min_points_in_prolonged_rect = 20;
   // default = 100: LineDetector::planeRANSAC
@@ -104,12 +191,44 @@ struct LineDetectionParams {
   double max_error_inlier_ransac = 0.005;
   // default = 0.8: LineDetector::planeRANSAC
   double inlier_max_ransac = 0.8;
+  // default = false: LineDetector::planeRANSAC
+  // If true, RANSAC stops as soon as the number of iterations performed
+  // guarantees, with probability confidence_ransac, that a sample with only
+  // inliers was drawn, given the best inlier ratio found so far.
+  bool adaptive_iterations_ransac = false;
+  // default = 0.99: LineDetector::planeRANSAC
+  double confidence_ransac = 0.99;
   // default = 10: LineDetector::planeRANSAC
   unsigned int min_num_inliers = 10;
+  // default = 1: LineDetector::planeRANSAC
+  // Seed of the random numbers of RANSAC (see RansacKey).
+  unsigned int seed_ransac = 1;
   // default = 0.05: LineDetector::planeRANSAC
   double max_pairwise_point_distance_connected_components = 0.05;
   // default = 0.05: LineDetector::planeRANSAC
   double max_discont_in_point_to_mean_distance_connected_components = 0.05;
+  // default = DISTANCE_FROM_MEAN: LineDetector::planeRANSAC
+  // Check that the inliers of a plane form a single connected component.
+  // PIXEL_GRID is only used if the pixels of the points are given to
+  // planeRANSAC (otherwise DISTANCE_FROM_MEAN is used).
+  ConnectivityCheck connectivity_check_ransac =
+      ConnectivityCheck::DISTANCE_FROM_MEAN;
+  // default = 2: LineDetector::planeRANSAC
+  // With PIXEL_GRID, two inliers are connected if their pixels are at most
+  // this far apart (along both axes) and their points are closer than
+  // max_pairwise_point_distance_connected_components. Both thresholds are
+  // multiplied by the spacing of the pixels given to planeRANSAC (e.g. by
+  // the patch_sampling_stride), as they hold for neighbouring pixels.
+  int connectivity_pixel_radius = 2;
+  // default = 5.0: LineDetector::processFrame (FrameOptions::track_lines)
+  // A line of the previous frame, moved into the current frame, is matched
+  // to a 2D line of the current frame if the endpoints of the shorter of the
+  // two are at most this many pixels away from the longer one.
+  double max_endpoint_distance_tracking = 5.0;
+  // default = 0.5: LineDetector::findInliersGiven2DLine
+  // A plane predicted by the tracking is kept (and RANSAC is not run) if at
+  // least this fraction of the points of the patch are inliers to it.
+  double min_inlier_fraction_tracking = 0.5;
   // default = 0.1: LineDetector::project2Dto3DwithPlanes
   double min_inlier_ransac = 0.1;
   // default = 10: LineDetector::checkIfValidLineBruteForce
@@ -146,6 +265,300 @@ struct LineDetectionParams {
   double hough_detector_minLineLength = 10.0;
   // default = 5: hough line detector
   double hough_detector_maxLineGap = 5.0;
+  // default = 1: LineDetector::project2Dto3DwithPlanes
+  // Number of worker threads among which the 2D lines are distributed. If set
+  // to 0, std::thread::hardware_concurrency() threads are used.
+  unsigned int num_threads_projection = 1;
+  // default = 0: LineDetector::detectLines
+  // Number of times the image is halved (with cv::pyrDown) before the lines
+  // are detected. The lines are scaled back to the original resolution. Note
+  // that the parameters of the detectors given in pixels (e.g. the ones of
+  // the hough detector) then refer to the reduced image.
+  unsigned int detection_pyramid_level = 0;
+  // default = 1: LineDetector::detectLines
+  // Number of tiles along the x/y axis in which the image is split to detect
+  // the lines. With a single tile, the detector is run on the whole image.
+  unsigned int detection_num_tiles_x = 1;
+  unsigned int detection_num_tiles_y = 1;
+  // default = 16: LineDetector::detectLines
+  // Number of pixels by which every tile is extended on each side into the
+  // neighbouring tiles, so that the lines close to the seams are detected
+  // by both tiles.
+  unsigned int detection_tile_overlap = 16;
+  // default = 1: LineDetector::detectLines
+  // Number of worker threads among which the tiles are distributed. If set to
+  // 0, std::thread::hardware_concurrency() threads are used.
+  unsigned int num_threads_detection = 1;
+};
+
+// Statistics about the lines projected to 3D in a frame. They are filled by
+// project2Dto3DwithPlanes and the functions it calls.
+struct LineDetectionStatistics {
+  int num_discontinuity_lines = 0;
+  int num_planar_lines = 0;
+  int num_intersection_lines = 0;
+  int num_edge_lines = 0;
+
+  int num_lines_discarded_for_convexity_concavity = 0;
+
+  // The following matrix stores the number of occurrences for each
+  // configuration of points in the 'prolonged planes', i.e., the planes around
+  // the prolonged lines.
+  // The correspondence between indices and configurations is as follows
+  // (0 in the configuration means "no points" (or not enough), 1 means
+  //  "(enough) points"):
+  //  _________________________________________________________________________
+  // |   |   |   |   | Configurations associated to indices i, j, m, n:        |
+  // |   |   |   |   |                   before start | after end              |
+  // | i | j | m | n |             Left            [ ]|[ ]                     |
+  // |   |   |   |   |             Right           [ ]|[ ]                     |
+  // |___|___|___|___|_________________________________________________________|
+  // |   |   |   |   |    [0]|[0]                                              |
+  // | 0 | 0 | 0 | 0 |    [0]|[0]                                              |
+  // |___|___|___|___|_________________________________________________________|
+  // |   |   |   |   |    [1]|[0]  [0]|[0]  [0]|[1]  [0]|[0]                   |
+  // | 1 | 0 | 0 | 0 |    [0]|[0], [1]|[0], [0]|[0], [0]|[1]                   |
+  // |___|___|___|___|_________________________________________________________|
+  // |   |   |   |   |    [1]|[0]  [0]|[1]                                     |
+  // | 1 | 1 | 0 | 0 |    [1]|[0], [0]|[1]                                     |
+  // |___|___|___|___|_________________________________________________________|
+  // |   |   |   |   |    [1]|[1]  [0]|[0]                                     |
+  // | 1 | 0 | 1 | 0 |    [0]|[0], [1]|[1]                                     |
+  // |___|___|___|___|_________________________________________________________|
+  // |   |   |   |   |    [1]|[0]  [0]|[1]                                     |
+  // | 1 | 0 | 0 | 1 |    [0]|[1], [1]|[0]                                     |
+  // |___|___|___|___|_________________________________________________________|
+  // |   |   |   |   |    [1]|[1]  [1]|[1]  [0]|[1]  [1]|[0]                   |
+  // | 1 | 1 | 1 | 0 |    [1]|[0], [0]|[1], [1]|[1], [1]|[1]                   |
+  // |___|___|___|___|_________________________________________________________|
+  // |   |   |   |   |    [1]|[1]                                              |
+  // | 1 | 1 | 1 | 1 |    [1]|[1]                                              |
+  // |___|___|___|___|_________________________________________________________|
+  // | All other     |                                                         |
+  // | indices       |    None.                                                |
+  // |_______________|_________________________________________________________|
+  int occurrences_config_prolonged_plane[2][2][2][2] = {};
+
+  // Index for the lines successfully projected from 2D to 3D (makes mapping
+  // with the line labelled by line_ros_utility easier).
+  int num_lines_successfully_projected_to_3D = 0;
+
+  // Number of times that a buffer of the FrameArena of a context had to be
+  // created or to grow. Zero once the buffers are large enough for the
+  // frames processed.
+  int num_scratch_allocations = 0;
+
+  // Number of candidate lines rejected at each stage of the projection to 3D:
+  // * Rating of the 3D line guess too high (see find3DlinesRated).
+  int num_lines_rejected_by_rating = 0;
+  // * No plane found on either side of the line.
+  int num_lines_rejected_without_planes = 0;
+  // * No valid 3D line found on the planes (find3DlineOnPlanes). This
+  //   includes the lines counted in
+  //   num_lines_discarded_for_convexity_concavity.
+  int num_lines_rejected_on_planes = 0;
+
+  // Number of calls to planeRANSAC, and total and maximum number of
+  // iterations made by a call.
+  int num_ransac_runs = 0;
+  int num_ransac_iterations = 0;
+  int max_ransac_iterations = 0;
+  // Number of planes taken from the previous frame (FrameOptions::
+  // track_lines) instead of being fitted by planeRANSAC.
+  int num_planes_tracked = 0;
+
+  // Time (in seconds) spent in the stages of the projection to 3D. Except
+  // for time_rating, these are summed over the lines, and therefore over the
+  // threads in the multi-threaded mode.
+  // * Rating of the 3D line guesses (find3DlinesRated).
+  double time_rating = 0.0;
+  // * Sampling of the patches and plane fitting (findInliersGiven2DLine),
+  //   including time_ransac.
+  double time_inlier_search = 0.0;
+  double time_ransac = 0.0;
+  // * Fitting of the 3D line to the planes (find3DlineOnPlanes), including
+  //   time_type_assignment.
+  double time_line_fit = 0.0;
+  double time_type_assignment = 0.0;
+
+  // Sets all the counters to zero.
+  void reset() { *this = LineDetectionStatistics(); }
+
+  // Adds the counters of other to the ones of this object. Used to merge the
+  // statistics collected by different threads.
+  void merge(const LineDetectionStatistics& other) {
+    num_discontinuity_lines += other.num_discontinuity_lines;
+    num_planar_lines += other.num_planar_lines;
+    num_intersection_lines += other.num_intersection_lines;
+    num_edge_lines += other.num_edge_lines;
+    num_lines_discarded_for_convexity_concavity +=
+        other.num_lines_discarded_for_convexity_concavity;
+    for (size_t i = 0; i < 2; ++i)
+      for (size_t j = 0; j < 2; ++j)
+        for (size_t m = 0; m < 2; ++m)
+          for (size_t n = 0; n < 2; ++n)
+            occurrences_config_prolonged_plane[i][j][m][n] +=
+                other.occurrences_config_prolonged_plane[i][j][m][n];
+    num_lines_successfully_projected_to_3D +=
+        other.num_lines_successfully_projected_to_3D;
+    num_scratch_allocations += other.num_scratch_allocations;
+    num_lines_rejected_by_rating += other.num_lines_rejected_by_rating;
+    num_lines_rejected_without_planes +=
+        other.num_lines_rejected_without_planes;
+    num_lines_rejected_on_planes += other.num_lines_rejected_on_planes;
+    num_ransac_runs += other.num_ransac_runs;
+    num_ransac_iterations += other.num_ransac_iterations;
+    max_ransac_iterations =
+        std::max(max_ransac_iterations, other.max_ransac_iterations);
+    num_planes_tracked += other.num_planes_tracked;
+    time_rating += other.time_rating;
+    time_inlier_search += other.time_inlier_search;
+    time_ransac += other.time_ransac;
+    time_line_fit += other.time_line_fit;
+    time_type_assignment += other.time_type_assignment;
+  }
+};
+
+// Buffers used to project a single 2D line to 3D (see
+// LineDetector::project2DLineTo3DwithPlanes). They are kept in the context,
+// so that they are reused from one line (and one frame) to the next without
+// reallocating.
+struct ProjectionScratch {
+  std::vector<cv::Point2f> rect_left, rect_right;
+  std::vector<cv::Vec3f> inliers_left, inliers_right;
+};
+
+// Lines kept from one frame to the next when the frames are processed with
+// FrameOptions::track_lines (see LineDetector::processFrame).
+struct LineTrackingState {
+  // True once a frame has been processed with tracking.
+  bool has_previous_frame = false;
+  // 3D lines found in the previous frame, in its camera frame.
+  std::vector<LineWithPlanes> previous_lines3D;
+  // For the frame being processed: for each 2D line given to
+  // project2Dto3DwithPlanes, whether a line of the previous frame was matched
+  // to it and, if so, its planes moved into the current camera frame. Empty
+  // outside of processFrame.
+  std::vector<unsigned char> has_prediction;
+  std::vector<std::array<cv::Vec4f, 2>> predicted_hessians;
+  // Buffers used to match the lines: the lines of the previous frame
+  // projected to the current image, and whether they are in front of the
+  // camera.
+  std::vector<cv::Vec4f> predicted_lines2D;
+  std::vector<unsigned char> predicted_in_front;
+
+  // Forgets the previous frame.
+  void reset() {
+    has_previous_frame = false;
+    previous_lines3D.clear();
+    has_prediction.clear();
+    predicted_hessians.clear();
+  }
+};
+
+// Mutable state of the LineDetector, that changes from one call (frame) to
+// the next. The LineDetector itself only stores its configuration, therefore
+// the same detector can serve several threads at the same time, as long as
+// every thread passes its own context.
+struct DetectionContext {
+  // Statistics about the lines projected to 3D.
+  LineDetectionStatistics statistics;
+  // Used for visualization purposes when displaying the line/prolonged line
+  // with rectangles overlapped on the original image.
+  cv::Mat background_image;
+  // The OpenCV detectors keep internal buffers and cannot be shared between
+  // threads. They are created the first time they are needed.
+  cv::Ptr<cv::LineSegmentDetector> lsd_detector;
+  cv::Ptr<cv::line_descriptor::BinaryDescriptor> edl_detector;
+  cv::Ptr<cv::ximgproc::FastLineDetector> fast_detector;
+  // Samples the points in the rectangles around the lines, with its buffer.
+  PatchSampler patch_sampler;
+  PatchSamples patch_samples;
+  // Validity mask and integral images of the cloud, computed once per frame.
+  PreprocessedCloud preprocessed_cloud;
+  // Preprocessed cloud of the frame being processed by
+  // project2Dto3DwithPlanes: either &preprocessed_cloud or, for the contexts
+  // of the worker threads, the one of the calling context. Null otherwise.
+  const PreprocessedCloud* frame_cloud = nullptr;
+  // Spatial index of the points of the cloud, computed once per frame by
+  // runCheckOn3DLines.
+  CloudVoxelGrid cloud_grid;
+  // Buffers of processFrame for the grayscale image and the 2D lines before
+  // fusion.
+  cv::Mat frame_gray_image;
+  std::vector<cv::Vec4f> frame_lines2D;
+  // Identifies the random numbers drawn by planeRANSAC. The frame is set by
+  // processFrame (FrameOptions::frame_index), so that successive frames draw
+  // different numbers. The line and the side are set by
+  // project2Dto3DwithPlanes and findInliersGiven2DLine, so that the planes of
+  // a line are fitted with the same numbers whichever thread fits them.
+  RansacKey ransac_key;
+  // Lines of the previous frame, used by processFrame with
+  // FrameOptions::track_lines.
+  LineTrackingState tracking;
+  // Reusable buffers for the computations made on every line.
+  FrameArena arena;
+  ProjectionScratch projection_scratch;
+  // Contexts of the worker threads started from this context (by
+  // detectLines and project2Dto3DwithPlanes). They are kept from one call to
+  // the next, so that their detectors and buffers are reused.
+  std::vector<std::unique_ptr<DetectionContext>> worker_contexts;
+};
+
+// Stages of LineDetector::processFrame that are run, and how.
+struct FrameOptions {
+  DetectorType detector = DetectorType::LSD;
+  // Fuse the 2D lines (fuseLines2D) before projecting them to 3D.
+  bool fuse_lines2D = true;
+  // Assign to the 3D lines the colors of the image around them. Only
+  // possible if the image has 3 channels.
+  bool set_colors = true;
+  // Check the 3D lines with the information of their 2D lines
+  // (checkIfValidLineWith2DInfo).
+  bool check_lines3D = true;
+  // Reuse the planes of the lines found in the previous frame processed with
+  // the same context: every line of the previous frame is moved into the
+  // current frame with transform_current_previous and matched to the 2D
+  // lines detected. For a matched line, the moved planes are first checked
+  // against the points of the current patches, and RANSAC is only run for
+  // the sides where none of them fits (see findInliersGiven2DLine). The lines
+  // found are then kept for the next frame. A frame processed without
+  // tracking clears the lines kept.
+  bool track_lines = false;
+  // Rigid transform from the camera frame of the previous frame to the one
+  // of this frame (x_current = T * x_previous). Only used with track_lines.
+  cv::Matx44f transform_current_previous = cv::Matx44f::eye();
+  // Index of the frame, part of the key of the random numbers of RANSAC
+  // (RansacKey::frame): successive frames with different indices draw
+  // different numbers, and a frame is processed the same way whenever it is
+  // processed with the same index.
+  uint32_t frame_index = 0;
+};
+
+// Time spent (in seconds) in each stage of LineDetector::processFrame.
+struct FrameTimings {
+  double detection = 0.0;
+  double fusion = 0.0;
+  double projection = 0.0;
+  double check = 0.0;
+  double total = 0.0;
+};
+
+// Result of LineDetector::processFrame. If the same result is passed to
+// successive frames, its vectors are reused.
+struct FrameResult {
+  // 2D lines given to the projection to 3D (after fusion, if enabled).
+  std::vector<cv::Vec4f> lines2D_detected;
+  // 3D lines kept after the checks, and the 2D lines they were found from.
+  std::vector<cv::Vec4f> lines2D;
+  std::vector<LineWithPlanes> lines3D;
+  // Number of 2D lines detected before fusion, and of 3D lines found before
+  // the checks.
+  size_t num_lines2D_before_fusion = 0;
+  size_t num_lines3D_before_check = 0;
+  FrameTimings timings;
+  // Statistics of the projection to 3D.
+  LineDetectionStatistics statistics;
 };
 
 // Returns true if lines are nearby and could be equal (low difference in angle
@@ -387,6 +800,48 @@ inline bool linesHaveSimilarLength(const cv::Vec6f& line_1,
   return true;
 }
 
+// Running sums of a set of points, from which their mean and covariance
+// matrix are computed in a single pass without storing the points. The sums
+// are taken relative to the first point added, which limits the cancellation
+// in the covariance.
+struct PointMoments {
+  size_t num_points = 0;
+  cv::Vec3d origin = cv::Vec3d(0.0, 0.0, 0.0);
+  cv::Vec3d sum = cv::Vec3d(0.0, 0.0, 0.0);
+  // Upper triangle of the sum of the outer products, in the order xx, xy,
+  // xz, yy, yz, zz.
+  cv::Vec6d sum_outer = cv::Vec6d::all(0.0);
+
+  void add(const cv::Vec3f& point) {
+    if (num_points == 0) origin = cv::Vec3d(point[0], point[1], point[2]);
+    const double x = point[0] - origin[0];
+    const double y = point[1] - origin[1];
+    const double z = point[2] - origin[2];
+    ++num_points;
+    sum += cv::Vec3d(x, y, z);
+    sum_outer += cv::Vec6d(x * x, x * y, x * z, y * y, y * z, z * z);
+  }
+  cv::Vec3d mean() const { return origin + sum / double(num_points); }
+  // Covariance matrix (normalized by the number of points).
+  cv::Matx33d covariance() const;
+};
+
+// Returns the (unit) eigenvector of a symmetric 3x3 matrix with the smallest
+// eigenvalue. The eigenvalues are computed in closed form (trigonometric
+// solution of the characteristic polynomial) and the eigenvector as the
+// largest cross product of two rows of (matrix - eigenvalue * I). The sign is
+// chosen so that the largest component is positive.
+cv::Vec3d smallestEigenvectorOfSymmetric3x3(const cv::Matx33d& matrix);
+
+// Fits a plane to points given through their moments, by minimizing the sum
+// of the squared orthogonal distances (the normal is the eigenvector of the
+// covariance matrix with the smallest eigenvalue).
+// Input: moments: Moments of at least 3 points.
+//
+// Output: hessian_normal_form: Plane in hessian normal form.
+void fitPlaneToMoments(const PointMoments& moments,
+                       cv::Vec4f* hessian_normal_form);
+
 // Returns the projection of a point on the plane given defined by the hessian.
 cv::Vec3f projectPointOnPlane(const cv::Vec4f& hessian, const cv::Vec3f& point);
 
@@ -451,6 +906,22 @@ void findPointsInRectangle(std::vector<cv::Point2f>* corners,
                            std::vector<cv::Point2i>* points,
                            bool verbose = false);
 
+// Same as findPointsInRectangle, but returns the pixels as horizontal spans,
+// one per row: the pixels in row first_row + i are the ones with x coordinate
+// from x_start[i] to x_end[i] (both included). Used by PatchSampler.
+// Input: corners:   See findPointsInRectangle.
+//
+//        verbose:   See findPointsInRectangle.
+//
+// Output: first_row: y coordinate of the first row of the rectangle.
+//
+//         x_start:   x coordinate of the first pixel of each row.
+//
+//         x_end:     x coordinate of the last pixel of each row.
+void findRowSpansInRectangle(std::vector<cv::Point2f>* corners, int* first_row,
+                             std::vector<int>* x_start,
+                             std::vector<int>* x_end, bool verbose = false);
+
 // Takes two planes and computes the intersection line. This function takes
 // already the direction of the line (which could be computed from the two
 // planes as well), because you can save computation time with it, if you
@@ -520,37 +991,130 @@ void displayLineWithPointsAndPlanes(const cv::Vec3f& start,
                                     const cv::Vec4f& hessian1,
                                     const cv::Vec4f& hessian2);
 
-
+// Marks the points that are inliers to a plane, i.e., the points for which
+// errorPointToPlane(hessian, point) < max_error. The points are given as
+// separate arrays of coordinates and are processed with maskInliersToPlane
+// (see plane_error_kernels.h).
+// Input: x/y/z:     Coordinates of the points (num_points elements each).
+//
+//        hessian:   Hessian normal form of the plane.
+//
+//        max_error: Maximum distance of an inlier from the plane.
+//
+// Output: mask:     mask[i] is set to 1 if the i-th point is an inlier, to 0
+//                   otherwise. Must have room for num_points elements.
+//
+//         return:   Number of inliers.
+size_t findInliersToPlane(const float* x, const float* y, const float* z,
+                          size_t num_points, const cv::Vec4f& hessian,
+                          double max_error, unsigned char* mask);
+
+// Counts the points for which errorPointToPlane(hessian, point) < max_error.
+// The points are first split into separate arrays of coordinates and then
+// processed with countInliersToPlane (see plane_error_kernels.h).
+// Input: points:    Points to check.
+//
+//        hessian:   Hessian normal form of the plane.
+//
+//        max_error: Maximum distance of an inlier from the plane.
+//
+//        (arena):   Arena from which the arrays of coordinates are borrowed.
+//
+// Output: return:   Number of inliers.
+size_t countInliersToPlane(const std::vector<cv::Vec3f>& points,
+                           const cv::Vec4f& hessian, double max_error,
+                           FrameArena* arena = nullptr);
+
+
+// The detector does not change during the calls that take a DetectionContext
+// (all the per-frame state lives in the context). These calls can therefore be
+// made concurrently on the same detector, each with its own context, which
+// must not be null. The overloads without a context are kept for
+// compatibility: they run with a temporary context, so they are reentrant too,
+// but nothing (buffers, detectors, statistics, tracked lines) is kept from one
+// call to the next. setVisualizationMode, setVerboseMode and the parameters
+// must not be changed while any call is running.
 class LineDetector {
  public:
   LineDetector();
+  // The parameters are not copied, so that changes made to them (e.g. by
+  // dynamic reconfigure) are seen by the detector. They must outlive the
+  // detector and must not be changed while a call is running.
   LineDetector(LineDetectionParams* params);
 
-  ~LineDetector();
-
   // Returns the parameter of the line detector.
   // Return: parameters params of the line detector.
   inline LineDetectionParams get_line_detection_params() {
     return *params_;
   }
 
-  // detectLines:
+  // Returns the statistics of the last frame processed by
+  // project2Dto3DwithPlanes with the given context.
+  inline LineDetectionStatistics get_line_detection_statistics(
+      const DetectionContext& context) const {
+    return context.statistics;
+  }
+
+  // Runs the whole pipeline on a frame: detection of the 2D lines, fusion,
+  // projection to 3D and check of the 3D lines (as configured in options).
+  // The stages write directly into the vectors of the result, or into
+  // buffers of the context, and the check removes the discarded lines in
+  // place, so that there are no copies between the stages. With
+  // options.track_lines, the lines found are kept in the context for the next
+  // frame (see FrameOptions::track_lines).
+  // Input: image:     RGB image (CV_8UC3) or grayscale image (CV_8UC1). The
+  //                   colors of the lines can only be set from an RGB image.
+  //
+  //        cloud:     Point cloud of type CV_32FC3, registered with image.
+  //
+  //        camera_P:  Camera projection matrix.
+  //
+  //        options:   Stages to run.
+  //
+  //        (context): Context of the frame. Without a context, a temporary
+  //                   one is used, therefore options.track_lines must not be
+  //                   set.
+  //
+  // Output: result:   Lines found, timings of the stages and statistics.
+  void processFrame(const cv::Mat& image, const cv::Mat& cloud,
+                    const cv::Mat& camera_P, const FrameOptions& options,
+                    FrameResult* result);
+  void processFrame(const cv::Mat& image, const cv::Mat& cloud,
+                    const cv::Mat& camera_P, const FrameOptions& options,
+                    FrameResult* result, DetectionContext* context);
+
+  // detectLines: If the parameters ask for it, the image is first reduced
+  // (detection_pyramid_level) and split into overlapping tiles
+  // (detection_num_tiles_x/y), on which the detector is run in parallel
+  // (num_threads_detection). Every tile keeps the part of its lines that lies
+  // in its own (not extended) area, and the pieces cut at the seams between
+  // the tiles are merged back together with fuseLines2D.
   // Input: image:    The image on which the lines should be detected.
   //
   //        detector: 0-> LSD, 1->EDL, 2->FAST, 3-> HOUGH
   //                  Default is LSD. It is chosen even if an invalid number is
   //                  given.
   //
+  //        (context): Context holding the OpenCV detectors to use. In the
+  //                   tiled mode, the worker threads other than the first one
+  //                   use their own detectors.
+  //
   // Output: lines:   The lines are stored in the following format:
   //                  {start.x, start.y, end.x, end.y}.
   void detectLines(const cv::Mat& image, DetectorType detector,
                    std::vector<cv::Vec4f>* lines);
+  void detectLines(const cv::Mat& image, DetectorType detector,
+                   DetectionContext* context, std::vector<cv::Vec4f>* lines);
   void detectLines(const cv::Mat& image, int detector,
                    std::vector<cv::Vec4f>* lines);
+  void detectLines(const cv::Mat& image, int detector,
+                   DetectionContext* context, std::vector<cv::Vec4f>* lines);
   void detectLines(const cv::Mat& image, std::vector<cv::Vec4f>* lines);
 // Overload for the EDL detector (returns EDL KeyLines).
   void detectLines(const cv::Mat& image,
                    std::vector<cv::line_descriptor::KeyLine>* keylines);
+  void detectLines(const cv::Mat& image, DetectionContext* context,
+                   std::vector<cv::line_descriptor::KeyLine>* keylines);
 
   // This function computes the Hessian Normal Form of a plane given points on
   // that plane.
@@ -558,8 +1122,9 @@ class LineDetector {
   //                  lie on a line. If 3 points are given, the plane normal is
   //                  computed as the cross product. The solution is then exact.
   //                  If more than 3 points are given the function solves a
-  //                  minimization problem (min sum (orthogonal dist)^2) through
-  //                  SVD.
+  //                  minimization problem (min sum (orthogonal dist)^2) with
+  //                  the covariance matrix of the points (see
+  //                  fitPlaneToMoments).
   //
   // Output: hessian_normal_form: The first 3 entries are the normal vector n,
   //                              the last one is the parameter p
@@ -586,7 +1151,9 @@ class LineDetector {
   void fuseLines2DAtTheEnd(const std::vector<cv::Vec4f>& lines_in,
                            std::vector<cv::Vec4f>* lines_out);
   // * Merge each input line into the matching previously-formed clusters, as
-  //   soon as the match is found.
+  //   soon as the match is found. The clusters are looked up in a grid of
+  //   their endpoints (see LineEndpointGrid), so that each line is only
+  //   compared with the clusters that are near it.
   void fuseLines2DOnTheFly(const std::vector<cv::Vec4f>& lines_in,
                            std::vector<cv::Vec4f>* lines_out);
 
@@ -653,10 +1220,10 @@ class LineDetector {
                              std::vector<cv::Point2f>* rect_right);
 
   // This function takes a set of points within an image and computes the
-  // average color of all pixels at these points. It appends the color in the
-  // colors vectors of the line3D.
+  // average color of all pixels at these points. It stores the color in
+  // line3D->colors[side] (0 for the left side, 1 for the right side).
   void assignColorToLines(const cv::Mat& image,
-                          const std::vector<cv::Point2i>& points,
+                          const std::vector<cv::Point2i>& points, size_t side,
                           LineWithPlanes* line3D);
 
   // (The two following functions are deprecated.They remain here just for
@@ -695,12 +1262,16 @@ class LineDetector {
   //                             line are found.
   //
   // Output:  line:              The 3D line found.
+  //
+  //          context:           Context whose statistics are updated with the
+  //                             type of the line found.
   bool find3DlineOnPlanes(const std::vector<cv::Vec3f>& points1,
                           const std::vector<cv::Vec3f>& points2,
                           const cv::Vec6f& line_guess,
                           const cv::Vec4f& reference_line_2D,
                           const cv::Mat& cloud, const cv::Mat& camera_P,
-                          const bool planes_found, LineWithPlanes* line);
+                          const bool planes_found, LineWithPlanes* line,
+                          DetectionContext* context);
 
   // Assign the type of line to be either edge or intersection.
   // Input: cloud:               Point cloud as CV_32FC3.
@@ -713,10 +1284,14 @@ class LineDetector {
   // Output: line:               Input line with a type assigned to it.
   //         return:             True if line type assignment could be
   //                             performed, False otherwise.
+  //
+  //         context:            Context whose statistics are updated with the
+  //                             type assigned.
   bool assignEdgeOrIntersectionLineType(const cv::Mat& cloud,
       const cv::Mat& camera_P,
       const std::vector<cv::Vec3f>& inliers_right,
-      const std::vector<cv::Vec3f>& inliers_left, LineWithPlanes* line);
+      const std::vector<cv::Vec3f>& inliers_left, LineWithPlanes* line,
+      DetectionContext* context);
 
   // Determines whether the two inlier planes of a line form a convex or
   // concave angle when seen from a given viewpoint. This is done by using
@@ -734,10 +1309,13 @@ class LineDetector {
   //
   //         return:                    True if no errors occurs, false
   //                                    otherwise.
+  //
+  //         context:                   Context whose statistics are
+  //                                    updated if the line is discarded.
   bool determineConvexityFromViewpointGivenLineAndInlierPoints(
     const LineWithPlanes& line, const std::vector<cv::Vec3f>& inliers_1,
     const std::vector<cv::Vec3f>& inliers_2, const cv::Vec3f& viewpoint,
-    bool* convex_true_concave_false);
+    bool* convex_true_concave_false, DetectionContext* context);
 
   // Determines whether the two inlier planes of a line form a convex or
   // concave angle when seen from a given viewpoint. This is done by using
@@ -774,7 +1352,7 @@ class LineDetector {
   //        end:                End endpoint of the prolonged line
   //                            segment.
   //
-  //        hessians:           Vector containing the Hessian normal form
+  //        hessians:           Array containing the Hessian normal form
   //                            of the two planes around the original
   //                            line.
   //
@@ -783,19 +1361,45 @@ class LineDetector {
   //                                               to the left/right plane,
   //                                               False otherwise.
   //
+  //         context:   Context holding the background image used for
+  //                    visualization.
+  //
   // Overload.
   void checkIfValidPointsOnPlanesGivenProlongedLine(
       const cv::Mat& cloud, const cv::Mat& camera_P,
       const cv::Vec3f& start, const cv::Vec3f& end,
-      const std::vector<cv::Vec4f>& hessians,
+      const std::array<cv::Vec4f, 2>& hessians,
       bool* right_plane_enough_valid_points,
-      bool* left_plane_enough_valid_points);
-
-  // Fits a plane to the points using RANSAC.
+      bool* left_plane_enough_valid_points,
+      DetectionContext* context);
+
+  // Fits a plane to the points using RANSAC. At most num_iter_ransac
+  // iterations are run. RANSAC stops earlier if more than inlier_max_ransac of
+  // the points are inliers or, if adaptive_iterations_ransac is set, once the
+  // confidence_ransac bound is reached. The buffers are borrowed from the
+  // arena of the context (of a temporary context, if not given). The random
+  // numbers are drawn with the ransac_key of the context and seed_ransac,
+  // therefore the result only depends on the points and on the key.
   bool planeRANSAC(const std::vector<cv::Vec3f>& points,
                    cv::Vec4f* hessian_normal_form);
+  bool planeRANSAC(const std::vector<cv::Vec3f>& points,
+                   cv::Vec4f* hessian_normal_form, DetectionContext* context);
+  void planeRANSAC(const std::vector<cv::Vec3f>& points,
+                   std::vector<cv::Vec3f>* inliers);
+  void planeRANSAC(const std::vector<cv::Vec3f>& points,
+                   std::vector<cv::Vec3f>* inliers, DetectionContext* context);
+  // Overload for points sampled from an organized cloud (e.g. by
+  // PatchSampler), with the pixel of each point and the spacing of the
+  // pixels (PatchSamples::pixel_step, 1 if every pixel is sampled). The
+  // pixels are used by the PIXEL_GRID connectivity check, whose thresholds
+  // are multiplied by the spacing. An empty vector means that the pixels are
+  // not known.
   void planeRANSAC(const std::vector<cv::Vec3f>& points,
+                   const std::vector<cv::Point2i>& pixels, int pixel_step,
                    std::vector<cv::Vec3f>* inliers);
+  void planeRANSAC(const std::vector<cv::Vec3f>& points,
+                   const std::vector<cv::Point2i>& pixels, int pixel_step,
+                   std::vector<cv::Vec3f>* inliers, DetectionContext* context);
 
   // Projects 2D lines to 3D using a plane intersection method.
   // Input: cloud:    Point cloud of type CV_32FC3.
@@ -816,12 +1420,18 @@ class LineDetector {
                                const std::vector<cv::Vec4f>& lines2D_in,
                                const bool set_colors,
                                std::vector<LineWithPlanes>* lines3D);
-  // Current version of project2Dto3DwithPlanes.
+  // Current version of project2Dto3DwithPlanes. The lines are distributed
+  // among params_->num_threads_projection worker threads (visualization mode
+  // forces a single thread). The output and the statistics do not depend on
+  // the number of threads used.
   // Input: cloud:    Point cloud of type CV_32FC3.
   //
   //        lines2D_in:  Lines in 2D in pixel coordinates of the cloud.
   //        set_colors: True if assigning color to lines.
   //
+  //        (context): Context of the frame. Its statistics are reset and
+  //                   filled with the lines found.
+  //
   // Output:  lines_2D_out: 2D lines that correspond to lines3D
   //
   //          lines3D:  3D lines found.
@@ -834,6 +1444,13 @@ class LineDetector {
                                const bool set_colors,
                                std::vector<cv::Vec4f>* lines2D_out,
                                std::vector<LineWithPlanes>* lines3D);
+  void project2Dto3DwithPlanes(const cv::Mat& cloud, const cv::Mat& image,
+                               const cv::Mat& camera_P,
+                               const std::vector<cv::Vec4f>& lines2D_in,
+                               const bool set_colors,
+                               DetectionContext* context,
+                               std::vector<cv::Vec4f>* lines2D_out,
+                               std::vector<LineWithPlanes>* lines3D);
 
   // Given a point in 3D and a projection matrix returns a point in 2D.
   // Input: point_3D:  3D point.
@@ -867,6 +1484,12 @@ class LineDetector {
   //
   //        (set_colors):         True if assign color to lines3D.
   //
+  //        (predicted_hessians): Planes predicted for the line by the
+  //                              tracking (see FrameOptions::track_lines).
+  //                              For each side, if one of them fits the
+  //                              patch (see fitPredictedPlane), it is used
+  //                              instead of running planeRANSAC.
+  //
   // Output: (line_3D): 3D line to which to assign the colors.
   //
   //          inliers_right/left: inlier points to the line.
@@ -875,6 +1498,9 @@ class LineDetector {
   //
   //          (right/left_found): true if enough inliers points are found for
   //                              the right/left plane.
+  //
+  //          (context):          Context whose patch sampler is used (a
+  //                              temporary one in the first overload).
   void findInliersGiven2DLine(const cv::Vec4f& line_2D, const cv::Mat& cloud,
                               std::vector<cv::Vec3f>* inliers_right,
                               std::vector<cv::Vec3f>* inliers_left);
@@ -885,7 +1511,10 @@ class LineDetector {
                               std::vector<cv::Vec3f>* inliers_left,
                               std::vector<cv::Point2f>* rect_right,
                               std::vector<cv::Point2f>* rect_left,
-                              bool* right_found, bool* left_found);
+                              bool* right_found, bool* left_found,
+                              DetectionContext* context,
+                              const std::array<cv::Vec4f, 2>*
+                                  predicted_hessians = nullptr);
 
   // Projects 2D to 3D lines with a shortest is the best approach. Works in
   // general better than naive approach, but lines that lie on surfaces tend to
@@ -916,33 +1545,57 @@ class LineDetector {
   // points by computing the distance to all points on the line. Use the mean
   // distance of all inliers as the rating. Then the line with the lowest rating
   // is chosen as the best.
-  // Input: cloud:    Point cloud in the format CV_32FC3.
+  // The pixels of the 2D line are traversed only once: at every step the
+  // points of the line and of the two lines offset by one pixel are sampled
+  // together (the offset pixels outside of the image count as NaN points).
+  // Input: cloud:     Point cloud in the format CV_32FC3.
+  //
+  //        lines2D:   2D lines defined in pixel coordinates.
   //
-  //        lines2D:  2D lines defined in pixel coordinates.
+  //        (context): Context from whose arena the buffers are borrowed (a
+  //                   temporary one if not given).
   //
   // Output: lines3D: 3D lines defined in same coordinates as the cloud.
   //
-  //         rating:  The rating for every 3D lines in the same order.
+  //         rating:  The rating for every 3D lines in the same order (1e9 if
+  //                  no 3D line was found).
   void find3DlinesRated(const cv::Mat& cloud,
                         const std::vector<cv::Vec4f>& lines2D,
                         std::vector<cv::Vec6f>* lines3D,
                         std::vector<double>* rating);
+  void find3DlinesRated(const cv::Mat& cloud,
+                        const std::vector<cv::Vec4f>& lines2D,
+                        std::vector<cv::Vec6f>* lines3D,
+                        std::vector<double>* rating, DetectionContext* context);
   // Overload: Does not give a rating as an output and gets rid off 3D lines for
   // which no reasonable rating is given.
   void find3DlinesRated(const cv::Mat& cloud,
                         const std::vector<cv::Vec4f>& lines2D,
                         std::vector<cv::Vec6f>* lines3D);
+  void find3DlinesRated(const cv::Mat& cloud,
+                        const std::vector<cv::Vec4f>& lines2D,
+                        std::vector<cv::Vec6f>* lines3D,
+                        DetectionContext* context);
 
   // Does a check by applying checkIfValidLineBruteForce to every line (using
-  // checkIfValidLineBruteForce function to check).
+  // checkIfValidLineBruteForce function to check). The points of the cloud
+  // are sorted once into a voxel grid (the one of the context, or of a
+  // temporary context if none is given), so that only the points near each
+  // line are visited.
   // Input: cloud:      Point cloud in the format CV_32FC3.
   //
   //        lines3D_in: 3D lines to be checked.
   //
+  //        (context):  Context holding the voxel grid and the buffers.
+  //
   // Output: lines3D_out: All 3D lines that are considered as valid
   void runCheckOn3DLines(const cv::Mat& cloud,
                          const std::vector<LineWithPlanes>& lines3D_in,
                          std::vector<LineWithPlanes>* lines3D_out);
+  void runCheckOn3DLines(const cv::Mat& cloud,
+                         const std::vector<LineWithPlanes>& lines3D_in,
+                         std::vector<LineWithPlanes>* lines3D_out,
+                         DetectionContext* context);
   // Overload: Check the validity of 3D lines with the help of the corresponded
   // 2D lines (using checkIfValidLineWith2DInfo function to check)
   // Input: cloud:       Point cloud in the format CV_32FC3.
@@ -961,13 +1614,21 @@ class LineDetector {
                          const std::vector<LineWithPlanes>& lines3D_in,
                          std::vector<cv::Vec4f>* lines2D_out,
                          std::vector<LineWithPlanes>* lines3D_out);
+  // Overload: Removes the invalid lines in place. The lines kept are the
+  // (adjusted) lines that the overload above outputs.
+  void runCheckOn3DLines(const cv::Mat& cloud, const cv::Mat& camera_P,
+                         std::vector<cv::Vec4f>* lines2D,
+                         std::vector<LineWithPlanes>* lines3D);
 
   // Does a check by applying checkIfValidLineDiscont on every line. This
   // check was mostly to try it out, it has shown that this way to check if
-  // a line is valid is prone to errors.
+  // a line is valid is prone to errors. The cloud is preprocessed once in
+  // the context, so that the check of each line only needs lookups in the
+  // integral images.
   void runCheckOn2DLines(const cv::Mat& cloud,
                          const std::vector<cv::Vec4f>& lines2D_in,
-                         std::vector<cv::Vec4f>* lines2D_out);
+                         std::vector<cv::Vec4f>* lines2D_out,
+                         DetectionContext* context);
 
   // Checks if a line is valid with 2D information:
   // Input: cloud:    Point cloud as CV_32FC3
@@ -984,13 +1645,22 @@ class LineDetector {
 
   // Checks if a line is valid by brute force approach: It computes the distance
   // between every point in the point cloud and the line and returns true if a
-  // sufficiently large number of this distances are below a threshold.
-  // Input: cloud: Point cloud as CV_32FC3.
+  // sufficiently large number of this distances are below a threshold. The
+  // line is truncated at the ends where there are no points near it.
+  // Input: cloud:        Point cloud as CV_32FC3.
+  //
+  //        line:         Line in 3D defined by (start, end).
+  //
+  //        (cloud_grid): Voxel grid computed from cloud. If given, only the
+  //                      points in the buckets near the line are visited,
+  //                      with the same result.
   //
-  //        line:  Line in 3D defined by (start, end).
+  //        (arena):      Arena from which the buffers are borrowed.
   //
   // Output: return: True if it is a possible line, false otherwise.
-  bool checkIfValidLineBruteForce(const cv::Mat& cloud, cv::Vec6f* line);
+  bool checkIfValidLineBruteForce(const cv::Mat& cloud, cv::Vec6f* line,
+                                  const CloudVoxelGrid* cloud_grid = nullptr,
+                                  FrameArena* arena = nullptr);
 
   // Checks if a line is valid by looking for discontinuities. It computes the
   // mean of a patch around a pixel and looks for jumps when this mean is given
@@ -999,8 +1669,14 @@ class LineDetector {
   //
   //        line:  Line in 2D defined by (start, end).
   //
+  //        (preprocessed_cloud): Preprocessed version of cloud. If given, the
+  //                              means of the patches are computed from its
+  //                              integral images.
+  //
   // Output: return: True if it is a possible line, false otherwise.
-  bool checkIfValidLineDiscont(const cv::Mat& cloud, const cv::Vec4f& line);
+  bool checkIfValidLineDiscont(
+      const cv::Mat& cloud, const cv::Vec4f& line,
+      const PreprocessedCloud* preprocessed_cloud = nullptr);
 
   // This function does a search for a line with non-NaN start and end points in
   // 3D given a line in 2D. It then computes number of points on this line
@@ -1143,16 +1819,19 @@ class LineDetector {
 
   // Displays the statistics about the number of lines of each type detected and
   // the number of occurrences of each case of the prolonged lines.
-  void displayStatistics();
+  // Input: context: Context of which to display the statistics, the one given
+  //                 to the calls that filled them.
+  void displayStatistics(const DetectionContext& context);
 
-  // Set visualization mode.
+  // Set visualization mode. Not thread-safe: it must not be called while
+  // another call to the detector is running.
   // Input: on_true_off_false: True if visualization mode should be set to On,
   //                           false if it should be set to Off.
   inline void setVisualizationMode(bool on_true_off_false) {
     visualization_mode_on_ = on_true_off_false;
   }
 
-  // Set verbose mode.
+  // Set verbose mode. Not thread-safe, as setVisualizationMode.
   // Input: on_true_off_false: True if verbose mode should be set to On,
   //                           false if it should be set to Off.
   inline void setVerboseMode(bool on_true_off_false) {
@@ -1160,72 +1839,120 @@ class LineDetector {
   }
 
 private:
-  cv::Ptr<cv::LineSegmentDetector> lsd_detector_;
-  cv::Ptr<cv::line_descriptor::BinaryDescriptor> edl_detector_;
-  cv::Ptr<cv::ximgproc::FastLineDetector> fast_detector_;
-  LineDetectionParams* params_;
-  bool params_is_mine_;
+  // Shared, so that copies of the detector (and the detector itself) do not
+  // need to care about who owns the parameters.
+  std::shared_ptr<const LineDetectionParams> params_;
 
   // True if lines/prolonged lines with rectangles should be displayed.
   bool visualization_mode_on_ = false;
   // True if detailed prints about the lines detected should be displayed.
   bool verbose_mode_on_ = false;
 
-  // Used for visualization purposes when displaying the line/prolonged line
-  // with rectangles overlapped on the original image.
-  cv::Mat background_image_;
-
-  int num_discontinuity_lines, num_planar_lines, num_intersection_lines,
-      num_edge_lines;
-
-  int num_lines_discarded_for_convexity_concavity;
-
-  // The following matrix stores the number of occurrences for each
-  // configuration of points in the 'prolonged planes', i.e., the planes around
-  // the prolonged lines.
-  // The correspondence between indices and configurations is as follows
-  // (0 in the configuration means "no points" (or not enough), 1 means
-  //  "(enough) points"):
-  //  _________________________________________________________________________
-  // |   |   |   |   | Configurations associated to indices i, j, m, n:        |
-  // |   |   |   |   |                   before start | after end              |
-  // | i | j | m | n |             Left            [ ]|[ ]                     |
-  // |   |   |   |   |             Right           [ ]|[ ]                     |
-  // |___|___|___|___|_________________________________________________________|
-  // |   |   |   |   |    [0]|[0]                                              |
-  // | 0 | 0 | 0 | 0 |    [0]|[0]                                              |
-  // |___|___|___|___|_________________________________________________________|
-  // |   |   |   |   |    [1]|[0]  [0]|[0]  [0]|[1]  [0]|[0]                   |
-  // | 1 | 0 | 0 | 0 |    [0]|[0], [1]|[0], [0]|[0], [0]|[1]                   |
-  // |___|___|___|___|_________________________________________________________|
-  // |   |   |   |   |    [1]|[0]  [0]|[1]                                     |
-  // | 1 | 1 | 0 | 0 |    [1]|[0], [0]|[1]                                     |
-  // |___|___|___|___|_________________________________________________________|
-  // |   |   |   |   |    [1]|[1]  [0]|[0]                                     |
-  // | 1 | 0 | 1 | 0 |    [0]|[0], [1]|[1]                                     |
-  // |___|___|___|___|_________________________________________________________|
-  // |   |   |   |   |    [1]|[0]  [0]|[1]                                     |
-  // | 1 | 0 | 0 | 1 |    [0]|[1], [1]|[0]                                     |
-  // |___|___|___|___|_________________________________________________________|
-  // |   |   |   |   |    [1]|[1]  [1]|[1]  [0]|[1]  [1]|[0]                   |
-  // | 1 | 1 | 1 | 0 |    [1]|[0], [0]|[1], [1]|[1], [1]|[1]                   |
-  // |___|___|___|___|_________________________________________________________|
-  // |   |   |   |   |    [1]|[1]                                              |
-  // | 1 | 1 | 1 | 1 |    [1]|[1]                                              |
-  // |___|___|___|___|_________________________________________________________|
-  // | All other     |                                                         |
-  // | indices       |    None.                                                |
-  // |_______________|_________________________________________________________|
-  int occurrences_config_prolonged_plane[2][2][2][2];
-
-  // Index for the lines successfully projected from 2D to 3D (makes mapping
-  // with the line labelled by line_ros_utility easier).
-  int num_lines_successfully_projected_to_3D;
-
-  // Resets the statistics about the number of lines of each type detected and
-  // the number of occurrences of each case of the prolonged lines. (Done at
-  // every new frame).
-  void resetStatistics();
+  // Runs the detector on the whole image, see detectLines.
+  void detectLinesInImage(const cv::Mat& image, DetectorType detector,
+                          DetectionContext* context,
+                          std::vector<cv::Vec4f>* lines);
+
+  // Splits the image into detection_num_tiles_x x detection_num_tiles_y
+  // overlapping tiles, runs the detector on each of them and stitches the
+  // lines across the seams, see detectLines.
+  void detectLinesInTiles(const cv::Mat& image, DetectorType detector,
+                          DetectionContext* context,
+                          std::vector<cv::Vec4f>* lines);
+
+  // Projects a single 2D line to 3D. This is the body of the main loop of
+  // project2Dto3DwithPlanes and can be run concurrently on different lines,
+  // as long as each call gets its own scratch and context.
+  // Input: cloud:        Point cloud of type CV_32FC3.
+  //
+  //        image:        RGB image, used if set_colors = True.
+  //
+  //        camera_P:     Camera projection matrix.
+  //
+  //        line2D:       2D line (fitted to the bounds of the image).
+  //
+  //        line3D_guess: First guess of the 3D line, from find3DlinesRated.
+  //
+  //        set_colors:   True if assigning color to lines.
+  //
+  //        predicted_hessians: Planes predicted for the line by the tracking,
+  //                      or nullptr (see findInliersGiven2DLine).
+  //
+  // Output: scratch:     Buffers holding the rectangles and inliers of the
+  //                      line after the call.
+  //
+  //         context:     Context whose statistics are updated with the type
+  //                      of the line.
+  //
+  //         line3D:      3D line found.
+  //
+  //         return:      True if the line was successfully projected to 3D.
+  bool project2DLineTo3DwithPlanes(const cv::Mat& cloud, const cv::Mat& image,
+                                   const cv::Mat& camera_P,
+                                   const cv::Vec4f& line2D,
+                                   const cv::Vec6f& line3D_guess,
+                                   const bool set_colors,
+                                   const std::array<cv::Vec4f, 2>*
+                                       predicted_hessians,
+                                   ProjectionScratch* scratch,
+                                   DetectionContext* context,
+                                   LineWithPlanes* line3D);
+
+  // Moves the lines of the previous frame kept in context->tracking into the
+  // current camera frame, projects them to the image and matches them to the
+  // given 2D lines: a line is matched to the moved line that lies closest
+  // along it, if the endpoints of the shorter of the two are at most
+  // max_endpoint_distance_tracking pixels away from the longer one. Fills
+  // context->tracking.has_prediction and predicted_hessians for the lines.
+  // Input: camera_P:                   Camera projection matrix.
+  //
+  //        transform_current_previous: Rigid transform from the previous to
+  //                                    the current camera frame.
+  //
+  //        lines2D:                    2D lines of the current frame.
+  //
+  // Output: context:                   Context whose tracking state is used.
+  void predictTrackedLines(const cv::Mat& camera_P,
+                           const cv::Matx44f& transform_current_previous,
+                           const std::vector<cv::Vec4f>& lines2D,
+                           DetectionContext* context);
+
+  // Checks whether one of the planes predicted for a line fits the points of
+  // one of its patches: the plane with the most inliers (points closer than
+  // max_error_inlier_ransac) is kept if they are at least
+  // min_inlier_fraction_tracking of the points and min_num_inliers, and if
+  // they form a single connected component (as in planeRANSAC).
+  // Input: points:             Points of the patch.
+  //
+  //        pixels:             Pixels of the points (used by the PIXEL_GRID
+  //                            connectivity check), or empty.
+  //
+  //        pixel_step:         Spacing of the pixels, as in planeRANSAC.
+  //
+  //        predicted_hessians: Planes predicted for the line.
+  //
+  // Output: inliers:           Inliers to the plane kept.
+  //
+  //         context:           Context whose arena is used.
+  //
+  //         return:            True if one of the planes was kept.
+  bool fitPredictedPlane(const std::vector<cv::Vec3f>& points,
+                         const std::vector<cv::Point2i>& pixels,
+                         int pixel_step,
+                         const std::array<cv::Vec4f, 2>& predicted_hessians,
+                         std::vector<cv::Vec3f>* inliers,
+                         DetectionContext* context);
+
+  // Stores a line found by project2Dto3DwithPlanes in the output vectors. It
+  // is always called in the order of the input lines, so that the output does
+  // not depend on the number of threads used.
+  void storeProjectedLine(const cv::Mat& camera_P, const cv::Vec4f& line2D,
+                          const cv::Vec6f& line3D_guess,
+                          const LineWithPlanes& line3D,
+                          const ProjectionScratch& scratch,
+                          DetectionContext* context,
+                          std::vector<cv::Vec4f>* lines2D_out,
+                          std::vector<LineWithPlanes>* lines3D);
 
   // Working principle of the function: It starts at the starting point of the
   // 2D line and looks if the values in the point_cloud are not NaN there. If
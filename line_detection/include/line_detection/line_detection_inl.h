@@ -6,9 +6,11 @@
 #include <pcl/point_cloud.h>
 #include <pcl/octree/octree_search.h>
 
+#include <algorithm>
 #include <functional>
 #include <queue>
 #include <set>
+#include <unordered_map>
 
 namespace line_detection {
 
@@ -32,34 +34,43 @@ void getNUniqueRandomElements(const std::vector<T>& in, size_t num_samples,
   out->clear();
   out->reserve(num_samples);
   // The algorithm uses the Fisher-Yates Shuffle to guarantee that no element is
-  // sampled twice.
-  size_t max = in.size();
-  int idx;
-  // From this array the indices of an element is sampled.
-  int indices[max];
-  for (size_t i = 0; i < max; ++i) {
-    indices[i] = i;
+  // sampled twice: the indices are sampled from an array holding the indices
+  // of all the elements, and every sampled index is replaced in the array by
+  // the last one of the range still to be sampled. Since the array is equal to
+  // its positions except where an index was replaced, only the replaced
+  // entries are stored, as pairs {position, index}. For few samples, they are
+  // stored on the stack, so that no memory is allocated.
+  constexpr size_t kMaxNumSamplesOnStack = 16;
+  std::pair<size_t, size_t> replaced_on_stack[kMaxNumSamplesOnStack];
+  std::vector<std::pair<size_t, size_t>> replaced_on_heap;
+  std::pair<size_t, size_t>* replaced = replaced_on_stack;
+  if (num_samples > kMaxNumSamplesOnStack) {
+    replaced_on_heap.resize(num_samples);
+    replaced = replaced_on_heap.data();
   }
-  std::uniform_int_distribution<int>* distribution;
+  size_t num_replaced = 0;
+  auto index_at = [&](size_t position) -> size_t {
+    for (size_t k = 0; k < num_replaced; ++k) {
+      if (replaced[k].first == position) return replaced[k].second;
+    }
+    return position;
+  };
+  auto replace_index_at = [&](size_t position, size_t index) {
+    for (size_t k = 0; k < num_replaced; ++k) {
+      if (replaced[k].first == position) {
+        replaced[k].second = index;
+        return;
+      }
+    }
+    replaced[num_replaced++] = std::make_pair(position, index);
+  };
+  const size_t max = in.size();
   for (size_t i = max; i > max - num_samples; --i) {
-    distribution = new std::uniform_int_distribution<int>(0, i - 1);
-    idx = (*distribution)(*generator);
-    out->push_back(in[indices[idx]]);
-    indices[idx] = indices[i - 1];
+    std::uniform_int_distribution<int> distribution(0, i - 1);
+    const size_t idx = distribution(*generator);
+    out->push_back(in[index_at(idx)]);
+    replace_index_at(idx, index_at(i - 1));
   }
-  delete distribution;
-}
-
-// An overload, that allows the use without specifyng an random engine. Be
-// careful if this is used in a loop (because the seed might be the same for
-// very small time differences between calls).
-template <typename T>
-void getNUniqueRandomElements(const std::vector<T>& in, size_t num_samples,
-                              std::vector<T>* out) {
-  unsigned seed =
-      std::chrono::high_resolution_clock::now().time_since_epoch().count();
-  std::default_random_engine generator(seed);
-  getNUniqueRandomElements(in, num_samples, &generator, out);
 }
 
 // Union-find data structure for efficient clustering of the points used in
@@ -290,18 +301,24 @@ class ClusterOctree {
    double distance_threshold_;
 };
 
-// Priority-queue-like structure to cluster the points based on their
-// distances from their mean point.
+// Structure to cluster the points based on their (sorted) distances from
+// their mean point.
 class ClusterDistanceFromMean {
  public:
-   ClusterDistanceFromMean(double distance_threshold) {
+   // The distances are stored in buffer, if given, so that its memory can be
+   // reused (e.g. from a FrameArena). Otherwise, the structure stores them.
+   ClusterDistanceFromMean(double distance_threshold,
+                           std::vector<double>* buffer = nullptr)
+       : distances_(buffer != nullptr ? buffer : &own_distances_) {
      distance_threshold_ = distance_threshold;
+     distances_->clear();
    }
+   ClusterDistanceFromMean(const ClusterDistanceFromMean&) = delete;
+   ClusterDistanceFromMean& operator=(const ClusterDistanceFromMean&) = delete;
+
    // Clears the entire structure.
    void clear() {
-     while(!distances_.empty()) {
-       distances_.pop();
-     }
+     distances_->clear();
    }
 
    // Adds the points to the data structure.
@@ -311,31 +328,30 @@ class ClusterDistanceFromMean {
      for (auto& point : points) {
        mean += (point / float(points.size()));
      }
-     // Compute the distance of all points from the mean point and insert them
-     // in the priority queue.
+     // Compute the distance of all points from the mean point. They are sorted
+     // when needed.
      for (auto& point : points) {
-       distances_.push(cv::norm(mean - point));
+       distances_->push_back(cv::norm(mean - point));
      }
    }
 
    // True if the points form a single connected component, false otherwise.
    bool singleConnectedComponent() {
-     if (distances_.size() == 0) {
+     if (distances_->size() == 0) {
        return false;
      }
+     std::sort(distances_->begin(), distances_->end());
      double current_distance;
      // Obtain first element.
-     double previous_distance = distances_.top();
-     distances_.pop();
+     double previous_distance = distances_->front();
      // If the smallest distance from the mean point is more than 10 cm, then
      // the points do not form a single connected component.
      if (previous_distance > 0.1) {
        return false;
      }
-     while(!distances_.empty()) {
+     for (size_t i = 1; i < distances_->size(); ++i) {
        // Obtains current distance.
-       current_distance = distances_.top();
-       distances_.pop();
+       current_distance = (*distances_)[i];
        if (current_distance - previous_distance > distance_threshold_) {
          // The difference in distance is such that they identify two separated
          // components.
@@ -347,13 +363,208 @@ class ClusterDistanceFromMean {
    }
 
  private:
-   // Stores the pairwise distances in ascending order.
-   std::priority_queue<double, std::vector<double>, std::greater<double>>
-       distances_;
+   // Stores the distances of the points from their mean.
+   std::vector<double>* distances_;
+   std::vector<double> own_distances_;
    // Threshold for two distances to still identify the same cluster.
    double distance_threshold_;
 };
 
+// Structure to find whether the inliers of a patch of an organized point
+// cloud form a single connected component. Two inliers are connected if
+// their pixels are at most pixel_radius apart along both image axes and if
+// their points are closer than distance_threshold. The components are found
+// by a union-find over the pixel grid, in time linear in the number of points
+// (times (2 * pixel_radius + 1)^2). The buffers are borrowed from the arena,
+// if given, so that no memory is allocated once they are large enough.
+class ClusterPixelGrid {
+ public:
+   ClusterPixelGrid(double distance_threshold, int pixel_radius,
+                    FrameArena* arena = nullptr)
+       : squared_distance_threshold_(distance_threshold * distance_threshold),
+         pixel_radius_(pixel_radius),
+         arena_(arena) {
+     CHECK_GE(pixel_radius, 1);
+   }
+
+   // True if the inliers form a single connected component, false otherwise
+   // (also if there is no inlier).
+   // Input: points: Points of the patch.
+   //
+   //        pixels: Pixel of each point. The points must be ordered row by
+   //                row and, within a row, by increasing x coordinate, as the
+   //                ones sampled by PatchSampler.
+   //
+   //        mask:   Nonzero for the inliers, one entry per point.
+   bool singleConnectedComponent(const std::vector<cv::Vec3f>& points,
+                                 const std::vector<cv::Point2i>& pixels,
+                                 const unsigned char* mask) {
+     CHECK_EQ(points.size(), pixels.size());
+     CHECK_NOTNULL(mask);
+     const int num_points = points.size();
+     if (num_points == 0) return false;
+     ScratchVector<int> parents(arena_), row_starts(arena_), cursors(arena_);
+     // row_starts[r] is the index of the first point of row first_row + r,
+     // row_starts[r + 1] the index after its last point.
+     const int first_row = pixels.front().y;
+     const int num_rows = pixels.back().y - first_row + 1;
+     row_starts->assign(num_rows + 1, num_points);
+     for (int i = num_points - 1; i >= 0; --i) {
+       (*row_starts)[pixels[i].y - first_row] = i;
+     }
+     for (int r = num_rows - 1; r >= 0; --r) {
+       (*row_starts)[r] = std::min((*row_starts)[r], (*row_starts)[r + 1]);
+     }
+     parents->resize(num_points);
+     // cursors[dy] is the first point of row y - dy that can be a neighbour
+     // of the current point. It only moves forward along a row.
+     cursors->resize(pixel_radius_ + 1);
+     int num_components = 0;
+     int current_row = first_row - 1;
+     for (int i = 0; i < num_points; ++i) {
+       const cv::Point2i& pixel = pixels[i];
+       if (pixel.y != current_row) {
+         current_row = pixel.y;
+         for (int dy = 0; dy <= pixel_radius_; ++dy) {
+           const int r = std::max(current_row - dy - first_row, 0);
+           (*cursors)[dy] = (*row_starts)[r];
+         }
+       }
+       if (!mask[i]) continue;
+       (*parents)[i] = i;
+       ++num_components;
+       for (int dy = 0; dy <= pixel_radius_; ++dy) {
+         const int r = current_row - dy - first_row;
+         if (r < 0) break;
+         // In the row of the point, only the points before it are visited.
+         const int end = dy == 0 ? i : (*row_starts)[r + 1];
+         int& cursor = (*cursors)[dy];
+         while (cursor < end && pixels[cursor].x < pixel.x - pixel_radius_) {
+           ++cursor;
+         }
+         for (int j = cursor; j < end && pixels[j].x <= pixel.x + pixel_radius_;
+              ++j) {
+           if (!mask[j]) continue;
+           const cv::Vec3f difference = points[i] - points[j];
+           if (difference.dot(difference) >= squared_distance_threshold_) {
+             continue;
+           }
+           if (unionSets(i, j, parents.get())) --num_components;
+         }
+       }
+     }
+     return num_components == 1;
+   }
+
+ private:
+   // Finds the root of the set of idx, halving the path on the way.
+   static int findSet(int idx, std::vector<int>* parents) {
+     while ((*parents)[idx] != idx) {
+       (*parents)[idx] = (*parents)[(*parents)[idx]];
+       idx = (*parents)[idx];
+     }
+     return idx;
+   }
+   // Merges the sets of the two points. Returns false if they were already in
+   // the same set.
+   static bool unionSets(int idx_1, int idx_2, std::vector<int>* parents) {
+     const int root_1 = findSet(idx_1, parents);
+     const int root_2 = findSet(idx_2, parents);
+     if (root_1 == root_2) return false;
+     // The root with the smaller index becomes the root of the merged set.
+     if (root_1 < root_2) {
+       (*parents)[root_2] = root_1;
+     } else {
+       (*parents)[root_1] = root_2;
+     }
+     return true;
+   }
+
+   float squared_distance_threshold_;
+   int pixel_radius_;
+   FrameArena* arena_;
+};
+
+// Spatial hash of the endpoints of 2D lines, used in fuseLines2DOnTheFly to
+// only compare a line with the clusters that have an endpoint close to one of
+// its endpoints. Lines are identified by an index. When a line changes, it is
+// simply added again with the same index: the old entries stay in the grid,
+// so the lines returned must still be checked with areLinesEqual2D.
+class LineEndpointGrid {
+ public:
+   // Two endpoints closer than cell_size are always in the same or in
+   // neighbouring cells.
+   LineEndpointGrid(float cell_size) : cell_size_(cell_size) {
+     CHECK(cell_size > 0);
+   }
+   // Clears the entire structure.
+   void clear() { cells_.clear(); }
+
+   // Adds the endpoints of the line with the given index. Lines with a
+   // non-finite coordinate are not added.
+   void addLine(const cv::Vec4f& line, size_t index) {
+     long long cell_x, cell_y;
+     for (size_t i = 0; i < 4; i += 2) {
+       if (!getCell(line[i], line[i + 1], &cell_x, &cell_y)) continue;
+       std::vector<size_t>& cell = cells_[getKey(cell_x, cell_y)];
+       // The two endpoints of a short line are often in the same cell.
+       if (cell.empty() || cell.back() != index) {
+         cell.push_back(index);
+       }
+     }
+   }
+
+   // Finds the lines with an endpoint in the cells around one of the
+   // endpoints of the given line.
+   // Input: line:     Line to look for.
+   //
+   // Output: indices: Indices of the lines found, in ascending order and
+   //                  without duplicates.
+   void findLinesNearEndpoints(const cv::Vec4f& line,
+                               std::vector<size_t>* indices) const {
+     CHECK_NOTNULL(indices);
+     indices->clear();
+     long long cell_x, cell_y;
+     for (size_t i = 0; i < 4; i += 2) {
+       if (!getCell(line[i], line[i + 1], &cell_x, &cell_y)) continue;
+       for (long long dx = -1; dx <= 1; ++dx) {
+         for (long long dy = -1; dy <= 1; ++dy) {
+           auto cell = cells_.find(getKey(cell_x + dx, cell_y + dy));
+           if (cell == cells_.end()) continue;
+           indices->insert(indices->end(), cell->second.begin(),
+                           cell->second.end());
+         }
+       }
+     }
+     std::sort(indices->begin(), indices->end());
+     indices->erase(std::unique(indices->begin(), indices->end()),
+                    indices->end());
+   }
+
+ private:
+   // Side of the (square) cells.
+   float cell_size_;
+   // Indices of the lines with an endpoint in each cell.
+   std::unordered_map<long long, std::vector<size_t>> cells_;
+
+   bool getCell(float x, float y, long long* cell_x, long long* cell_y) const {
+     // Pixel coordinates are far from the limits of long long; this also
+     // excludes NaN and infinite coordinates.
+     constexpr float kMaxCoordinate = 1e9;
+     if (!(std::fabs(x) < kMaxCoordinate && std::fabs(y) < kMaxCoordinate)) {
+       return false;
+     }
+     *cell_x = static_cast<long long>(std::floor(x / cell_size_));
+     *cell_y = static_cast<long long>(std::floor(y / cell_size_));
+     return true;
+   }
+
+   static long long getKey(long long cell_x, long long cell_y) {
+     // The cell coordinates fit in 32 bits.
+     return (cell_x << 32) ^ (cell_y & 0xffffffffLL);
+   }
+};
+
 }  // namespace line_detection
 
 #endif  // LINE_DETECTION_LINE_DETECTION_INL_H_
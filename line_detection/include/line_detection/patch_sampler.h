@@ -0,0 +1,131 @@
+#ifndef LINE_DETECTION_PATCH_SAMPLER_H_
+#define LINE_DETECTION_PATCH_SAMPLER_H_
+
+#include <cstddef>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "line_detection/preprocessed_cloud.h"
+
+namespace line_detection {
+
+// Points sampled from an organized point cloud within a rectangle.
+struct PatchSamples {
+  // Points of the cloud within the rectangle, skipping the NaN points. They
+  // are ordered row by row, as the pixels returned by findPointsInRectangle.
+  std::vector<cv::Vec3f> points;
+  // Pixel of each point.
+  std::vector<cv::Point2i> pixels;
+  // Label of each point. Only filled if labels were set in the sampler.
+  std::vector<unsigned short> labels;
+  // Color of each point. Only filled if an image was set in the sampler.
+  std::vector<cv::Vec3b> colors;
+  // Number of points of the cloud within the rectangle (skipping the NaN
+  // points), before the subsampling (see PatchSampler::setSubsampling).
+  size_t num_points_in_rect = 0;
+  // Spacing in pixels of the sampled pixels: on a rectangle without NaN
+  // points, every sample has another one at most this far away along both
+  // image axes. It is the stride, or larger if max_points was reached.
+  int pixel_step = 1;
+  // Mean color of the rectangle, computed as in
+  // LineDetector::assignColorToLines (i.e., over all the pixels of the image
+  // within the rectangle, including the ones with a NaN point). Only valid if
+  // an image was set in the sampler.
+  cv::Vec3b mean_color;
+};
+
+// Samples the points of an organized point cloud within rectangles in the
+// image (e.g. the ones returned by LineDetector::getRectanglesFromLine).
+// The rectangle is rasterized row by row and the points are read directly
+// from the rows of the cloud, without going through a vector of pixels. The
+// buffers used for the rasterization are kept between calls, therefore a
+// sampler should not be shared between threads.
+class PatchSampler {
+ public:
+  PatchSampler() {}
+
+  // Sets the point cloud (of type CV_32FC3) to sample from. The image and the
+  // labels are reset. The data of the cloud is not copied and must not be
+  // changed while the sampler is used.
+  void setCloud(const cv::Mat& cloud);
+  // Sets an RGB image (of type CV_8UC3 and of the same size as the cloud)
+  // from which the colors are taken. An empty image disables the colors.
+  void setImage(const cv::Mat& image);
+  // Sets an image of labels (of type CV_16UC1 and of the same size as the
+  // cloud), e.g. instance labels. An empty image disables the labels.
+  void setLabels(const cv::Mat& labels);
+  // Sets the preprocessed version of the cloud (computed from the cloud set
+  // with setCloud), or null if it is not available. If available, it is used
+  // to reject the rectangles with points with no depth information without
+  // sampling them and to count the points in a rectangle.
+  void setPreprocessedCloud(const PreprocessedCloud* preprocessed_cloud);
+  // Sets how the points of a rectangle are subsampled, so that the cost of
+  // the computations on the samples (e.g. RANSAC) is bounded for long lines.
+  // The subsampling is kept when the cloud changes.
+  // Input: stride:     Only the pixels whose coordinates are both multiples
+  //                    of stride are sampled (1: all the pixels). The grid is
+  //                    aligned with the image, therefore the patches on the
+  //                    two sides of a line are sampled on the same grid.
+  //
+  //        max_points: If more points than this are left after the stride,
+  //                    only the ones on every n-th column (or row, if the
+  //                    rectangle is taller than wide) of the grid of the
+  //                    stride are kept, with n as small as possible so that
+  //                    at most max_points are left (0: no limit). The
+  //                    resulting spacing is PatchSamples::pixel_step.
+  void setSubsampling(int stride, size_t max_points);
+
+  // Counts the points within a rectangle, in time linear in its number of
+  // rows. Requires the preprocessed cloud.
+  // Input: corners: Corners of the rectangle, see findPointsInRectangle.
+  //
+  // Output: counts: Counts in the rectangle.
+  //
+  //         return: False if no preprocessed cloud is set (counts is not
+  //                 changed in this case), true otherwise.
+  bool countPoints(const std::vector<cv::Point2f>& corners,
+                   PointCounts* counts);
+
+  // Samples the points within a rectangle.
+  // Input: corners:             Corners of the rectangle, see
+  //                             findPointsInRectangle.
+  //
+  //        discard_if_no_depth: If true, the sampling is stopped as soon as a
+  //                             point with no depth information (i.e. with
+  //                             coordinates {0, 0, 0}) is found. Otherwise
+  //                             these points are sampled as the others.
+  //
+  // Output: samples:            Sampled points (and labels/colors), after
+  //                             the subsampling. The mean color and the
+  //                             checks for no depth information are computed
+  //                             on all the pixels of the rectangle.
+  //
+  //         return:             False if discard_if_no_depth is true and a
+  //                             point with no depth information was found (in
+  //                             this case samples is incomplete and should
+  //                             not be used), true otherwise.
+  bool sample(const std::vector<cv::Point2f>& corners,
+              bool discard_if_no_depth, PatchSamples* samples);
+
+ private:
+  // Rasterizes the rectangle into first_row_, x_start_ and x_end_.
+  void rasterize(const std::vector<cv::Point2f>& corners);
+
+  cv::Mat cloud_;
+  cv::Mat image_;
+  cv::Mat labels_;
+  const PreprocessedCloud* preprocessed_cloud_ = nullptr;
+  // Subsampling, see setSubsampling.
+  int stride_ = 1;
+  size_t max_points_ = 0;
+  // Buffers for the rasterization.
+  std::vector<cv::Point2f> corners_;
+  int first_row_ = 0;
+  std::vector<int> x_start_;
+  std::vector<int> x_end_;
+};
+
+}  // namespace line_detection
+
+#endif  // LINE_DETECTION_PATCH_SAMPLER_H_
@@ -0,0 +1,71 @@
+#ifndef LINE_DETECTION_PLANE_ERROR_KERNELS_H_
+#define LINE_DETECTION_PLANE_ERROR_KERNELS_H_
+
+// Batched point-to-plane error kernels. The points are given as separate
+// arrays of x, y and z coordinates (structure of arrays), so that several
+// points can be processed with a single SIMD instruction. The instruction set
+// is chosen at runtime (AVX2, SSE2 or plain C++), so the same binary runs on
+// machines that do not support AVX2.
+//
+// All the kernels compute the error of a point (x, y, z) from the plane given
+// in Hessian normal form (a, b, c, d) as |a * x + b * y + c * z + d|, in float
+// and in this order of operations, exactly as errorPointToPlane does. Hence
+// the results do not depend on the instruction set used.
+
+#include <cstddef>
+
+namespace line_detection {
+
+enum class SimdLevel : unsigned int {
+  SCALAR = 0,
+  SSE2 = 1,
+  AVX2 = 2
+};
+
+// Returns the best instruction set supported by the CPU (and by the
+// compiler). The kernels without a SimdLevel argument use this one.
+SimdLevel getSupportedSimdLevel();
+
+// Counts the points whose error from the plane is <= max_error.
+// Input: x/y/z:     Coordinates of the points (num_points elements each).
+//
+//        plane:     Hessian normal form of the plane {a, b, c, d}.
+//
+//        max_error: Maximum error of an inlier (inclusive).
+//
+//        (level):   Instruction set to use. Must be supported by the CPU.
+//
+// Output: return:   Number of inliers.
+size_t countInliersToPlane(const float* x, const float* y, const float* z,
+                           size_t num_points, const float plane[4],
+                           float max_error);
+size_t countInliersToPlane(const float* x, const float* y, const float* z,
+                           size_t num_points, const float plane[4],
+                           float max_error, SimdLevel level);
+
+// Same as countInliersToPlane, but also marks the inliers.
+// Output: mask:     mask[i] is set to 1 if the i-th point is an inlier, to 0
+//                   otherwise. Must have room for num_points elements.
+//
+//         return:   Number of inliers.
+size_t maskInliersToPlane(const float* x, const float* y, const float* z,
+                          size_t num_points, const float plane[4],
+                          float max_error, unsigned char* mask);
+size_t maskInliersToPlane(const float* x, const float* y, const float* z,
+                          size_t num_points, const float plane[4],
+                          float max_error, unsigned char* mask,
+                          SimdLevel level);
+
+// Computes the error from the plane of every point.
+// Output: residuals: residuals[i] is the error of the i-th point. Must have
+//                    room for num_points elements.
+void residualsToPlane(const float* x, const float* y, const float* z,
+                      size_t num_points, const float plane[4],
+                      float* residuals);
+void residualsToPlane(const float* x, const float* y, const float* z,
+                      size_t num_points, const float plane[4],
+                      float* residuals, SimdLevel level);
+
+}  // namespace line_detection
+
+#endif  // LINE_DETECTION_PLANE_ERROR_KERNELS_H_
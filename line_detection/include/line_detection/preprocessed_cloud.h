@@ -0,0 +1,97 @@
+#ifndef LINE_DETECTION_PREPROCESSED_CLOUD_H_
+#define LINE_DETECTION_PREPROCESSED_CLOUD_H_
+
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+namespace line_detection {
+
+// Number of points of each kind (and sum of the valid points) in a region of
+// an organized point cloud.
+struct PointCounts {
+  // Points with valid coordinates.
+  size_t num_valid = 0;
+  // Points with no depth information, i.e. with coordinates {0, 0, 0}.
+  size_t num_no_depth = 0;
+  // Points with NaN coordinates.
+  size_t num_nan = 0;
+  // Sum of the coordinates of the valid points.
+  cv::Vec3d sum_valid = cv::Vec3d(0.0, 0.0, 0.0);
+};
+
+// Data computed once per frame from an organized point cloud, so that the
+// checks made on many (often overlapping) regions of the cloud do not need to
+// look at every point of the regions:
+// - A mask with the state of each point (valid, NaN or no depth
+//   information).
+// - Integral images of the number of valid points, of the number of points
+//   with no depth information and of the sum of the valid points.
+// With these, the counts (and the mean of the valid points) of an
+// axis-aligned box are found in constant time and the ones of a rasterized
+// rectangle in time linear in its number of rows.
+class PreprocessedCloud {
+ public:
+  enum PointState : unsigned char {
+    NAN_POINT = 0,
+    NO_DEPTH_POINT = 1,
+    VALID_POINT = 2
+  };
+
+  PreprocessedCloud() {}
+
+  // Computes the mask and the integral images of the cloud (of type
+  // CV_32FC3). The buffers are reused if the size of the cloud does not
+  // change. The data of the cloud is not copied: the cloud must not be
+  // changed while the preprocessed cloud is used.
+  void compute(const cv::Mat& cloud);
+  // Marks the preprocessed cloud as not computed, without freeing the
+  // buffers.
+  void reset();
+  // Returns true if compute was called with (the data of) this cloud and
+  // reset was not called afterwards.
+  bool isComputedFor(const cv::Mat& cloud) const;
+
+  int rows() const { return state_.rows; }
+  int cols() const { return state_.cols; }
+  // Returns a pointer to the states of the points in row y.
+  const unsigned char* stateRow(int y) const { return state_.ptr(y); }
+
+  // Returns the counts for the box from (x_min, y_min) to (x_max, y_max)
+  // (both included). The part of the box outside of the cloud is ignored.
+  // Input: x_min/y_min/x_max/y_max: Corners of the box.
+  //
+  // Output: counts:                 Counts in the box.
+  void countInBox(int x_min, int y_min, int x_max, int y_max,
+                  PointCounts* counts) const;
+
+  // Returns the counts for a region given as one span per row (see
+  // findRowSpansInRectangle). The part of the region outside of the cloud is
+  // ignored.
+  // Input: first_row:     y coordinate of the first row of the region.
+  //
+  //        x_start/x_end: x coordinates of the first/last pixel of each row.
+  //
+  // Output: counts:       Counts in the region.
+  void countInRows(int first_row, const std::vector<int>& x_start,
+                   const std::vector<int>& x_end, PointCounts* counts) const;
+
+ private:
+  // Adds the counts of the box, which must be within the cloud.
+  void addBox(int x_min, int y_min, int x_max, int y_max,
+              PointCounts* counts) const;
+
+  // Cloud from which the data was computed (empty if not computed).
+  cv::Mat cloud_;
+  // State (PointState) of each point, CV_8UC1.
+  cv::Mat state_;
+  // Integral images, with one row and one column more than the cloud: the
+  // element (y, x) refers to the points in [0, x) x [0, y).
+  cv::Mat valid_count_;     // CV_32SC1
+  cv::Mat no_depth_count_;  // CV_32SC1
+  cv::Mat valid_sum_;       // CV_64FC3
+};
+
+}  // namespace line_detection
+
+#endif  // LINE_DETECTION_PREPROCESSED_CLOUD_H_
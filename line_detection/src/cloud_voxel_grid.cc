@@ -0,0 +1,174 @@
+#include "line_detection/cloud_voxel_grid.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <glog/logging.h>
+
+namespace line_detection {
+
+void CloudVoxelGrid::compute(const cv::Mat& cloud, double cell_size) {
+  CHECK_EQ(cloud.type(), CV_32FC3);
+  CHECK_GT(cell_size, 0.0);
+  cloud_ = cloud;
+  cell_size_ = cell_size;
+  // There are usually many points per cell, therefore a fraction of the
+  // number of points is enough to have few cells per bucket.
+  const size_t num_cloud_points = cloud.rows * cloud.cols;
+  size_t num_buckets = 1;
+  while (num_buckets < num_cloud_points / 4) num_buckets *= 2;
+  bucket_mask_ = num_buckets - 1;
+
+  // Count the points of every bucket.
+  bucket_start_.assign(num_buckets + 1, 0);
+  point_buckets_.resize(num_cloud_points);
+  size_t num_points = 0;
+  size_t i = 0;
+  bounding_box_min_ = cv::Vec3d(std::numeric_limits<double>::infinity(),
+                                std::numeric_limits<double>::infinity(),
+                                std::numeric_limits<double>::infinity());
+  bounding_box_max_ = -bounding_box_min_;
+  for (int y = 0; y < cloud.rows; ++y) {
+    const cv::Vec3f* cloud_row = cloud.ptr<cv::Vec3f>(y);
+    for (int x = 0; x < cloud.cols; ++x, ++i) {
+      const cv::Vec3f& point = cloud_row[x];
+      if (!std::isfinite(point[0]) || !std::isfinite(point[1]) ||
+          !std::isfinite(point[2])) {
+        point_buckets_[i] = -1;
+        continue;
+      }
+      for (size_t j = 0; j < 3; ++j) {
+        bounding_box_min_[j] = std::min<double>(bounding_box_min_[j], point[j]);
+        bounding_box_max_[j] = std::max<double>(bounding_box_max_[j], point[j]);
+      }
+      const int bucket =
+          bucketOfCell(cellCoordinate(point[0]), cellCoordinate(point[1]),
+                       cellCoordinate(point[2]));
+      point_buckets_[i] = bucket;
+      ++bucket_start_[bucket];
+      ++num_points;
+    }
+  }
+  // After the prefix sum bucket_start_[b] is the end of bucket b. It is
+  // decremented for every point stored in the bucket, so that it ends up at
+  // the start of the bucket.
+  for (size_t b = 1; b < num_buckets; ++b) {
+    bucket_start_[b] += bucket_start_[b - 1];
+  }
+  bucket_start_[num_buckets] = num_points;
+  points_.resize(num_points);
+  i = 0;
+  for (int y = 0; y < cloud.rows; ++y) {
+    const cv::Vec3f* cloud_row = cloud.ptr<cv::Vec3f>(y);
+    for (int x = 0; x < cloud.cols; ++x, ++i) {
+      if (point_buckets_[i] < 0) continue;
+      points_[--bucket_start_[point_buckets_[i]]] = cloud_row[x];
+    }
+  }
+}
+
+void CloudVoxelGrid::reset() { cloud_ = cv::Mat(); }
+
+bool CloudVoxelGrid::isComputedFor(const cv::Mat& cloud) const {
+  return !cloud_.empty() && cloud_.data == cloud.data &&
+         cloud_.size() == cloud.size() && cloud_.step == cloud.step;
+}
+
+void CloudVoxelGrid::findBucketsNearSegment(const cv::Vec3f& start,
+                                            const cv::Vec3f& end,
+                                            double radius,
+                                            std::vector<int>* buckets) const {
+  CHECK_NOTNULL(buckets);
+  buckets->clear();
+  for (size_t j = 0; j < 3; ++j) {
+    if (!std::isfinite(start[j]) || !std::isfinite(end[j])) return;
+  }
+  if (points_.empty()) return;
+  // Only the part of the segment within radius of the bounding box of the
+  // points can be near a point, therefore the segment is clipped to the box
+  // (enlarged by radius and by a small margin for the rounding errors).
+  const double margin = radius + 1e-3 * cell_size_;
+  cv::Vec3d start_d(start[0], start[1], start[2]);
+  cv::Vec3d direction = cv::Vec3d(end[0], end[1], end[2]) - start_d;
+  double t_min = 0.0, t_max = 1.0;
+  for (size_t j = 0; j < 3; ++j) {
+    const double low = bounding_box_min_[j] - margin;
+    const double high = bounding_box_max_[j] + margin;
+    if (direction[j] == 0.0) {
+      if (start_d[j] < low || start_d[j] > high) return;
+      continue;
+    }
+    double t_low = (low - start_d[j]) / direction[j];
+    double t_high = (high - start_d[j]) / direction[j];
+    if (t_low > t_high) std::swap(t_low, t_high);
+    t_min = std::max(t_min, t_low);
+    t_max = std::min(t_max, t_high);
+    if (t_min > t_max) return;
+  }
+  start_d += t_min * direction;
+  direction *= t_max - t_min;
+  // The segment is sampled with a step of at most one cell. Every point of the
+  // segment is then within half a step of a sample, so the points within
+  // radius of the segment are within reach of a sample. The small margin
+  // covers the rounding errors of the distances computed by the caller.
+  const double length = cv::norm(direction);
+  const double num_steps_needed = std::max(1.0, std::ceil(length / cell_size_));
+  // If visiting the cells around the samples costs more than visiting all the
+  // buckets (e.g. for a large radius, or a segment that stays long within the
+  // box of a sparse cloud), all the buckets are returned.
+  const double reach_max = radius + 0.5 * cell_size_ + 1e-3 * cell_size_;
+  const double cells_per_axis = 2.0 * reach_max / cell_size_ + 2.0;
+  const size_t num_buckets = bucket_mask_ + 1;
+  if ((num_steps_needed + 1.0) * cells_per_axis * cells_per_axis *
+          cells_per_axis >
+      static_cast<double>(num_buckets)) {
+    buckets->resize(num_buckets);
+    for (size_t b = 0; b < num_buckets; ++b) {
+      (*buckets)[b] = static_cast<int>(b);
+    }
+    return;
+  }
+  const int num_steps = static_cast<int>(num_steps_needed);
+  const double reach =
+      radius + 0.5 * length / num_steps + 1e-3 * cell_size_;
+  for (int k = 0; k <= num_steps; ++k) {
+    const cv::Vec3d sample =
+        start_d + direction * (static_cast<double>(k) / num_steps);
+    const int64_t x_min = cellCoordinate(sample[0] - reach);
+    const int64_t x_max = cellCoordinate(sample[0] + reach);
+    const int64_t y_min = cellCoordinate(sample[1] - reach);
+    const int64_t y_max = cellCoordinate(sample[1] + reach);
+    const int64_t z_min = cellCoordinate(sample[2] - reach);
+    const int64_t z_max = cellCoordinate(sample[2] + reach);
+    for (int64_t x = x_min; x <= x_max; ++x) {
+      for (int64_t y = y_min; y <= y_max; ++y) {
+        for (int64_t z = z_min; z <= z_max; ++z) {
+          buckets->push_back(bucketOfCell(x, y, z));
+        }
+      }
+    }
+  }
+  std::sort(buckets->begin(), buckets->end());
+  buckets->erase(std::unique(buckets->begin(), buckets->end()),
+                 buckets->end());
+}
+
+int64_t CloudVoxelGrid::cellCoordinate(double coordinate) const {
+  // Clamped, so that the coordinates of points very far away do not overflow.
+  constexpr double kMaxCellCoordinate = 1e12;
+  return static_cast<int64_t>(
+      std::max(-kMaxCellCoordinate,
+               std::min(kMaxCellCoordinate,
+                        std::floor(coordinate / cell_size_))));
+}
+
+int CloudVoxelGrid::bucketOfCell(int64_t x, int64_t y, int64_t z) const {
+  uint64_t hash = static_cast<uint64_t>(x) * 73856093u ^
+                  static_cast<uint64_t>(y) * 19349663u ^
+                  static_cast<uint64_t>(z) * 83492791u;
+  hash ^= hash >> 29;
+  return static_cast<int>(hash & bucket_mask_);
+}
+
+}  // namespace line_detection
@@ -1,9 +1,99 @@
 #include "line_detection/line_detection.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cstdlib>
 
 namespace line_detection {
+cv::Matx33d PointMoments::covariance() const {
+  CHECK_GT(num_points, 0u);
+  const double n = num_points;
+  const cv::Vec3d m = sum / n;
+  const double xx = sum_outer[0] / n - m[0] * m[0];
+  const double xy = sum_outer[1] / n - m[0] * m[1];
+  const double xz = sum_outer[2] / n - m[0] * m[2];
+  const double yy = sum_outer[3] / n - m[1] * m[1];
+  const double yz = sum_outer[4] / n - m[1] * m[2];
+  const double zz = sum_outer[5] / n - m[2] * m[2];
+  return cv::Matx33d(xx, xy, xz, xy, yy, yz, xz, yz, zz);
+}
+
+cv::Vec3d smallestEigenvectorOfSymmetric3x3(const cv::Matx33d& matrix) {
+  // Scale the matrix, so that the computations do not depend on the units.
+  double max_entry = 0.0;
+  for (int i = 0; i < 9; ++i) {
+    max_entry = std::max(max_entry, fabs(matrix.val[i]));
+  }
+  if (max_entry == 0.0) return cv::Vec3d(0.0, 0.0, 1.0);
+  const cv::Matx33d a = matrix * (1.0 / max_entry);
+  // Smallest eigenvalue: with a = q * I + p * b, the eigenvalues of b are
+  // 2 * cos(phi + 2 * k * pi / 3), where cos(3 * phi) = det(b) / 2.
+  const double q = (a(0, 0) + a(1, 1) + a(2, 2)) / 3.0;
+  const double p1 = a(0, 1) * a(0, 1) + a(0, 2) * a(0, 2) + a(1, 2) * a(1, 2);
+  const double p2 = (a(0, 0) - q) * (a(0, 0) - q) +
+                    (a(1, 1) - q) * (a(1, 1) - q) +
+                    (a(2, 2) - q) * (a(2, 2) - q) + 2.0 * p1;
+  double eigenvalue = q;
+  if (p2 > 0.0) {
+    const double p = sqrt(p2 / 6.0);
+    const cv::Matx33d b = (a - q * cv::Matx33d::eye()) * (1.0 / p);
+    const double r = std::max(-1.0, std::min(1.0, cv::determinant(b) / 2.0));
+    const double phi = acos(r) / 3.0;
+    eigenvalue = q + 2.0 * p * cos(phi + 2.0 * kPi / 3.0);
+  }
+  // The eigenvector is orthogonal to the rows of (a - eigenvalue * I). Take
+  // the largest cross product of two rows, which is the most accurate one.
+  const cv::Matx33d m = a - eigenvalue * cv::Matx33d::eye();
+  const cv::Vec3d row0(m(0, 0), m(0, 1), m(0, 2));
+  const cv::Vec3d row1(m(1, 0), m(1, 1), m(1, 2));
+  const cv::Vec3d row2(m(2, 0), m(2, 1), m(2, 2));
+  const cv::Vec3d crosses[3] = {row0.cross(row1), row0.cross(row2),
+                                row1.cross(row2)};
+  cv::Vec3d eigenvector = crosses[0];
+  for (size_t i = 1; i < 3; ++i) {
+    if (crosses[i].dot(crosses[i]) > eigenvector.dot(eigenvector)) {
+      eigenvector = crosses[i];
+    }
+  }
+  constexpr double kMinSquaredNorm = 1e-24;
+  if (eigenvector.dot(eigenvector) < kMinSquaredNorm) {
+    // The smallest eigenvalue is (at least) double, e.g. if the points lie
+    // on a line: any vector orthogonal to the largest row is an eigenvector.
+    const cv::Vec3d rows[3] = {row0, row1, row2};
+    cv::Vec3d row = rows[0];
+    for (size_t i = 1; i < 3; ++i) {
+      if (rows[i].dot(rows[i]) > row.dot(row)) row = rows[i];
+    }
+    if (row.dot(row) < kMinSquaredNorm) return cv::Vec3d(0.0, 0.0, 1.0);
+    // Cross product with the axis least aligned with the row.
+    size_t axis = 0;
+    for (size_t i = 1; i < 3; ++i) {
+      if (fabs(row[i]) < fabs(row[axis])) axis = i;
+    }
+    cv::Vec3d unit_axis(0.0, 0.0, 0.0);
+    unit_axis[axis] = 1.0;
+    eigenvector = row.cross(unit_axis);
+  }
+  eigenvector = eigenvector / cv::norm(eigenvector);
+  size_t largest = 0;
+  for (size_t i = 1; i < 3; ++i) {
+    if (fabs(eigenvector[i]) > fabs(eigenvector[largest])) largest = i;
+  }
+  if (eigenvector[largest] < 0.0) eigenvector = -eigenvector;
+  return eigenvector;
+}
+
+void fitPlaneToMoments(const PointMoments& moments,
+                       cv::Vec4f* hessian_normal_form) {
+  CHECK_NOTNULL(hessian_normal_form);
+  CHECK_GE(moments.num_points, 3u);
+  const cv::Vec3d normal =
+      smallestEigenvectorOfSymmetric3x3(moments.covariance());
+  const cv::Vec3d mean = moments.mean();
+  *hessian_normal_form = cv::Vec4f(normal[0], normal[1], normal[2],
+                                   -normal.dot(mean));
+}
+
 cv::Vec3f projectPointOnPlane(const cv::Vec4f& hessian,
                               const cv::Vec3f& point) {
   cv::Vec3f x_0, normal;
@@ -139,12 +229,27 @@ void findPointsInRectangle(std::vector<cv::Point2f> corners,
 void findPointsInRectangle(std::vector<cv::Point2f>* corners,
                            std::vector<cv::Point2i>* points, bool verbose) {
   CHECK_NOTNULL(points);
+  int first_row;
+  std::vector<int> x_start, x_end;
+  findRowSpansInRectangle(corners, &first_row, &x_start, &x_end, verbose);
+  // Iterate over all pixels in the rectangle.
+  points->clear();
+  for (size_t i = 0; i < x_start.size(); ++i) {
+    for (int x = x_start[i]; x <= x_end[i]; ++x) {
+      points->push_back(cv::Point2i(x, first_row + static_cast<int>(i)));
+    }
+  }
+}
+
+void findRowSpansInRectangle(std::vector<cv::Point2f>* corners, int* first_row,
+                             std::vector<int>* x_start,
+                             std::vector<int>* x_end, bool verbose) {
   CHECK_NOTNULL(corners);
+  CHECK_NOTNULL(first_row);
+  CHECK_NOTNULL(x_start);
+  CHECK_NOTNULL(x_end);
   CHECK_EQ(corners->size(), 4)
       << "The rectangle must be defined by exactly 4 corner points.";
-  // Find the relative positions of the points.
-  // int upper, lower, left, right, store_i;
-  std::vector<int> idx{0, 1, 2, 3};
   // This part finds out if two of the points have equal y values. This may
   // not be very likely for some data, but if it happens it can produce
   // unpredictable outcome. If this is the case, the rectangle is rotated by
@@ -227,8 +332,11 @@ void findPointsInRectangle(std::vector<cv::Point2f>* corners,
   }
   // With the ordering given, the border pixels can be found as pixels, that
   // lie on the border vectors.
-  std::vector<int> left_border;
-  std::vector<int> right_border;
+  // The x coordinates of the borders are directly written to the output.
+  std::vector<int>& left_border = *x_start;
+  std::vector<int>& right_border = *x_end;
+  left_border.clear();
+  right_border.clear();
   findXCoordOfPixelsOnVector(upper, left, true, &left_border);
   findXCoordOfPixelsOnVector(upper, right, false, &right_border);
   // Pop_back is used because otherwise the corners [left/right] pixels would
@@ -243,16 +351,10 @@ void findPointsInRectangle(std::vector<cv::Point2f>* corners,
     right_border.pop_back();
   }
   CHECK_EQ(left_border.size(), right_border.size());
-  // Iterate over all pixels in the rectangle.
-  points->clear();
-  int x, y;
-  for (size_t i = 0; i < left_border.size(); ++i) {
-    y = floor(upper.y) + i;
-    x = left_border[i];
-    do {
-      points->push_back(cv::Point2i(x, y));
-      ++x;
-    } while (x <= right_border[i]);
+  // Each row contains at least its leftmost pixel.
+  *first_row = floor(upper.y);
+  for (size_t i = 0; i < right_border.size(); ++i) {
+    right_border[i] = std::max(right_border[i], left_border[i]);
   }
 }
 
@@ -409,59 +511,299 @@ void displayLineWithPointsAndPlanes(const cv::Vec3f& start,
   system(command.c_str());
 }
 
+namespace {
+float inlierThresholdToPlane(double max_error) {
+  // The error is computed in float, as in errorPointToPlane. To keep the
+  // comparison in float, take the largest float that is smaller than
+  // max_error: for a float error, error <= threshold <=> error < max_error.
+  float threshold = static_cast<float>(max_error);
+  if (static_cast<double>(threshold) >= max_error) {
+    threshold = std::nextafter(threshold, 0.0f);
+  }
+  return threshold;
+}
+
+// Makes sure that the context holds at least num_workers worker contexts.
+void reserveWorkerContexts(size_t num_workers, DetectionContext* context) {
+  CHECK_NOTNULL(context);
+  while (context->worker_contexts.size() < num_workers) {
+    context->worker_contexts.emplace_back(new DetectionContext());
+  }
+}
+}  // namespace
+
+size_t findInliersToPlane(const float* x, const float* y, const float* z,
+                          size_t num_points, const cv::Vec4f& hessian,
+                          double max_error, unsigned char* mask) {
+  CHECK_NOTNULL(x);
+  CHECK_NOTNULL(y);
+  CHECK_NOTNULL(z);
+  CHECK_NOTNULL(mask);
+  const float plane[4] = {hessian[0], hessian[1], hessian[2], hessian[3]};
+  return maskInliersToPlane(x, y, z, num_points, plane,
+                            inlierThresholdToPlane(max_error), mask);
+}
+
+size_t countInliersToPlane(const std::vector<cv::Vec3f>& points,
+                           const cv::Vec4f& hessian, double max_error,
+                           FrameArena* arena) {
+  const size_t num_points = points.size();
+  ScratchVector<float> x(arena), y(arena), z(arena);
+  x->resize(num_points);
+  y->resize(num_points);
+  z->resize(num_points);
+  for (size_t i = 0; i < num_points; ++i) {
+    (*x)[i] = points[i][0];
+    (*y)[i] = points[i][1];
+    (*z)[i] = points[i][2];
+  }
+  const float plane[4] = {hessian[0], hessian[1], hessian[2], hessian[3]};
+  return countInliersToPlane(x->data(), y->data(), z->data(), num_points,
+                             plane, inlierThresholdToPlane(max_error));
+}
+
 LineDetector::LineDetector() {
-  lsd_detector_ = cv::createLineSegmentDetector(cv::LSD_REFINE_STD);
-  edl_detector_ =
-      cv::line_descriptor::BinaryDescriptor::createBinaryDescriptor();
-  fast_detector_ = cv::ximgproc::createFastLineDetector();
-  params_ = new LineDetectionParams();
-  params_is_mine_ = true;
+  params_ = std::make_shared<LineDetectionParams>();
 }
 LineDetector::LineDetector(LineDetectionParams* params) {
-  lsd_detector_ = cv::createLineSegmentDetector(cv::LSD_REFINE_STD);
-  edl_detector_ =
-      cv::line_descriptor::BinaryDescriptor::createBinaryDescriptor();
-  fast_detector_ = cv::ximgproc::createFastLineDetector();
-  params_ = params;
-  params_is_mine_ = false;
+  CHECK_NOTNULL(params);
+  // The parameters are owned by the caller: do not delete them.
+  params_ = std::shared_ptr<const LineDetectionParams>(
+      params, [](const LineDetectionParams*) {});
 }
-LineDetector::~LineDetector() {
-  if (params_is_mine_) {
-    delete params_;
-  }
+
+void LineDetector::detectLines(const cv::Mat& image, int detector,
+                               std::vector<cv::Vec4f>* lines) {
+  DetectionContext context;
+  detectLines(image, detector, &context, lines);
 }
 
 void LineDetector::detectLines(const cv::Mat& image, int detector,
+                               DetectionContext* context,
                                std::vector<cv::Vec4f>* lines) {
   if (detector == 0)
-    detectLines(image, DetectorType::LSD, lines);
+    detectLines(image, DetectorType::LSD, context, lines);
   else if (detector == 1)
-    detectLines(image, DetectorType::EDL, lines);
+    detectLines(image, DetectorType::EDL, context, lines);
   else if (detector == 2)
-    detectLines(image, DetectorType::FAST, lines);
+    detectLines(image, DetectorType::FAST, context, lines);
   else if (detector == 3)
-    detectLines(image, DetectorType::HOUGH, lines);
+    detectLines(image, DetectorType::HOUGH, context, lines);
   else {
     LOG(WARNING)
         << "LineDetector::detectLines: DetectorType choice not valid, LSD was "
            "chosen as default.";
-    detectLines(image, DetectorType::LSD, lines);
+    detectLines(image, DetectorType::LSD, context, lines);
   }
 }
 
 void LineDetector::detectLines(const cv::Mat& image, DetectorType detector,
                                std::vector<cv::Vec4f>* lines) {
+  DetectionContext context;
+  detectLines(image, detector, &context, lines);
+}
+
+void LineDetector::detectLines(const cv::Mat& image, DetectorType detector,
+                               DetectionContext* context,
+                               std::vector<cv::Vec4f>* lines) {
+  CHECK_NOTNULL(context);
+  CHECK_NOTNULL(lines);
+  // Reduce the image, as long as it is large enough to be halved.
+  cv::Mat detection_image = image;
+  unsigned int pyramid_level = 0;
+  for (; pyramid_level < params_->detection_pyramid_level; ++pyramid_level) {
+    if (detection_image.cols < 2 || detection_image.rows < 2) break;
+    cv::Mat reduced_image;
+    cv::pyrDown(detection_image, reduced_image);
+    detection_image = reduced_image;
+  }
+  if (params_->detection_num_tiles_x > 1 ||
+      params_->detection_num_tiles_y > 1) {
+    detectLinesInTiles(detection_image, detector, context, lines);
+  } else {
+    detectLinesInImage(detection_image, detector, context, lines);
+  }
+  if (pyramid_level == 0) return;
+  // Pixel (x, y) of the reduced image covers the pixels of the original image
+  // centered around ((x + 0.5) * scale - 0.5, (y + 0.5) * scale - 0.5).
+  const float scale = static_cast<float>(1u << pyramid_level);
+  for (cv::Vec4f& line : *lines) {
+    for (size_t i = 0; i < 4; i += 2) {
+      line[i] = fitToBoundary((line[i] + 0.5f) * scale - 0.5f, 0.0,
+                              image.cols - 1);
+      line[i + 1] = fitToBoundary((line[i + 1] + 0.5f) * scale - 0.5f, 0.0,
+                                  image.rows - 1);
+    }
+  }
+}
+
+namespace {
+// Clips a 2D line to the box [x_min, x_max] x [y_min, y_max] (Liang-Barsky).
+// Input: line:        Line to clip.
+//
+//        box:         Box in the format {x_min, y_min, x_max, y_max}. Its
+//                     coordinates can be infinite.
+//
+// Output: clipped:    Part of the line within the box.
+//
+//         was_clipped: True if the line was not entirely within the box.
+//
+//         return:      False if the line does not intersect the box.
+bool clipLineToBox(const cv::Vec4f& line, const cv::Vec4f& box,
+                   cv::Vec4f* clipped, bool* was_clipped) {
+  const float dx = line[2] - line[0];
+  const float dy = line[3] - line[1];
+  const float p[4] = {-dx, dx, -dy, dy};
+  const float q[4] = {line[0] - box[0], box[2] - line[0], line[1] - box[1],
+                      box[3] - line[1]};
+  float t_start = 0.0f;
+  float t_end = 1.0f;
+  for (size_t i = 0; i < 4; ++i) {
+    if (p[i] == 0.0f) {
+      // Parallel to this side of the box.
+      if (q[i] < 0.0f) return false;
+      continue;
+    }
+    const float t = q[i] / p[i];
+    if (p[i] < 0.0f) {
+      if (t > t_end) return false;
+      t_start = std::max(t_start, t);
+    } else {
+      if (t < t_start) return false;
+      t_end = std::min(t_end, t);
+    }
+  }
+  *was_clipped = t_start > 0.0f || t_end < 1.0f;
+  if (*was_clipped) {
+    *clipped = cv::Vec4f(line[0] + t_start * dx, line[1] + t_start * dy,
+                         line[0] + t_end * dx, line[1] + t_end * dy);
+  } else {
+    *clipped = line;
+  }
+  return true;
+}
+}  // namespace
+
+void LineDetector::detectLinesInTiles(const cv::Mat& image,
+                                      DetectorType detector,
+                                      DetectionContext* context,
+                                      std::vector<cv::Vec4f>* lines) {
+  CHECK_NOTNULL(context);
+  CHECK_NOTNULL(lines);
+  lines->clear();
+  const int num_tiles_x = fitToBoundaryInt(params_->detection_num_tiles_x, 1,
+                                           std::max(image.cols, 1));
+  const int num_tiles_y = fitToBoundaryInt(params_->detection_num_tiles_y, 1,
+                                           std::max(image.rows, 1));
+  const int overlap = params_->detection_tile_overlap;
+  const size_t num_tiles = num_tiles_x * num_tiles_y;
+  // Area of each tile (its part of the image, with and without the overlap).
+  // The boxes of the tiles at the border of the image are unbounded on the
+  // side of the border, so that the lines are never clipped there.
+  constexpr float kInf = std::numeric_limits<float>::infinity();
+  std::vector<cv::Rect> tile_rects(num_tiles);
+  std::vector<cv::Vec4f> tile_boxes(num_tiles);
+  for (int j = 0; j < num_tiles_y; ++j) {
+    const int y_begin = j * image.rows / num_tiles_y;
+    const int y_end = (j + 1) * image.rows / num_tiles_y;
+    for (int i = 0; i < num_tiles_x; ++i) {
+      const int x_begin = i * image.cols / num_tiles_x;
+      const int x_end = (i + 1) * image.cols / num_tiles_x;
+      const size_t tile = j * num_tiles_x + i;
+      const int x_min = std::max(x_begin - overlap, 0);
+      const int y_min = std::max(y_begin - overlap, 0);
+      const int x_max = std::min(x_end + overlap, image.cols);
+      const int y_max = std::min(y_end + overlap, image.rows);
+      tile_rects[tile] = cv::Rect(x_min, y_min, x_max - x_min, y_max - y_min);
+      // Pixel x covers [x - 0.5, x + 0.5], the seams are between the pixels.
+      tile_boxes[tile] = cv::Vec4f(i == 0 ? -kInf : x_begin - 0.5f,
+                                   j == 0 ? -kInf : y_begin - 0.5f,
+                                   i == num_tiles_x - 1 ? kInf : x_end - 0.5f,
+                                   j == num_tiles_y - 1 ? kInf : y_end - 0.5f);
+    }
+  }
+
+  size_t num_threads = params_->num_threads_detection;
+  if (num_threads == 0) {
+    num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  num_threads = std::min(num_threads, num_tiles);
+  // The first thread uses the given context, the others the worker contexts.
+  reserveWorkerContexts(num_threads - 1, context);
+  std::vector<std::vector<cv::Vec4f>> tile_lines(num_tiles);
+  std::atomic<size_t> next_tile(0);
+  auto detect_in_tiles = [&](size_t t) {
+    DetectionContext* thread_context =
+        (t == 0) ? context : context->worker_contexts[t - 1].get();
+    cv::Mat tile_image;
+    for (size_t tile = next_tile++; tile < num_tiles; tile = next_tile++) {
+      // The tile is copied, so that the detectors do not look at the pixels
+      // outside of it and the result does not depend on the other tiles.
+      image(tile_rects[tile]).copyTo(tile_image);
+      detectLinesInImage(tile_image, detector, thread_context,
+                         &tile_lines[tile]);
+      for (cv::Vec4f& line : tile_lines[tile]) {
+        line += cv::Vec4f(tile_rects[tile].x, tile_rects[tile].y,
+                          tile_rects[tile].x, tile_rects[tile].y);
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  workers.reserve(num_threads - 1);
+  for (size_t t = 1; t < num_threads; ++t) {
+    workers.emplace_back(detect_in_tiles, t);
+  }
+  detect_in_tiles(0);
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+
+  // Every tile only keeps the part of its lines within its own area, so that
+  // the lines in the overlaps are not found twice. The lines cut at a seam
+  // are found in pieces by the tiles on both sides and are merged back.
+  constexpr float kMinSqLengthOfPiece = 1.0f;
+  std::vector<cv::Vec4f> pieces;
+  cv::Vec4f clipped;
+  bool was_clipped;
+  for (size_t tile = 0; tile < num_tiles; ++tile) {
+    for (const cv::Vec4f& line : tile_lines[tile]) {
+      if (!clipLineToBox(line, tile_boxes[tile], &clipped, &was_clipped)) {
+        continue;
+      }
+      if (!was_clipped) {
+        lines->push_back(line);
+        continue;
+      }
+      const float dx = clipped[2] - clipped[0];
+      const float dy = clipped[3] - clipped[1];
+      if (dx * dx + dy * dy >= kMinSqLengthOfPiece) pieces.push_back(clipped);
+    }
+  }
+  std::vector<cv::Vec4f> stitched_lines;
+  fuseLines2D(pieces, &stitched_lines);
+  lines->insert(lines->end(), stitched_lines.begin(), stitched_lines.end());
+}
+
+void LineDetector::detectLinesInImage(const cv::Mat& image,
+                                      DetectorType detector,
+                                      DetectionContext* context,
+                                      std::vector<cv::Vec4f>* lines) {
+  CHECK_NOTNULL(context);
   CHECK_NOTNULL(lines);
   lines->clear();
   // Check which detector is chosen by user. If an invalid number is given the
   // default (LSD) is chosen without a warning.
   if (detector == DetectorType::LSD) {
-    lsd_detector_->detect(image, *lines);
+    if (context->lsd_detector.empty()) {
+      context->lsd_detector =
+          cv::createLineSegmentDetector(cv::LSD_REFINE_STD);
+    }
+    context->lsd_detector->detect(image, *lines);
   } else if (detector == DetectorType::EDL) {  // EDL_DETECTOR
     // The edl detector uses a different kind of vector to store the lines in.
     // The conversion is done later.
     std::vector<cv::line_descriptor::KeyLine> edl_lines;
-    edl_detector_->detect(image, edl_lines);
+    detectLines(image, context, &edl_lines);
 
     // Write lines to standard format
     for (size_t i = 0u; i < edl_lines.size(); ++i) {
@@ -471,7 +813,10 @@ void LineDetector::detectLines(const cv::Mat& image, DetectorType detector,
     }
 
   } else if (detector == DetectorType::FAST) {  // FAST_DETECTOR
-    fast_detector_->detect(image, *lines);
+    if (context->fast_detector.empty()) {
+      context->fast_detector = cv::ximgproc::createFastLineDetector();
+    }
+    context->fast_detector->detect(image, *lines);
   } else if (detector == DetectorType::HOUGH) {  // HOUGH_DETECTOR
     cv::Mat output;
     // Parameters of the Canny should not be changed (or better: the result is
@@ -494,14 +839,316 @@ void LineDetector::detectLines(const cv::Mat& image,
 void LineDetector::detectLines(
     const cv::Mat& image,
     std::vector<cv::line_descriptor::KeyLine>* keylines) {
+  DetectionContext context;
+  detectLines(image, &context, keylines);
+}
+
+void LineDetector::detectLines(
+    const cv::Mat& image, DetectionContext* context,
+    std::vector<cv::line_descriptor::KeyLine>* keylines) {
+  CHECK_NOTNULL(context);
   CHECK_NOTNULL(keylines);
   keylines->clear();
   // Use EDL detector to extract keylines.
+  if (context->edl_detector.empty()) {
+    context->edl_detector =
+        cv::line_descriptor::BinaryDescriptor::createBinaryDescriptor();
+  }
   std::vector<cv::line_descriptor::KeyLine> edl_lines;
-  edl_detector_->detect(image, edl_lines);
+  context->edl_detector->detect(image, edl_lines);
   *keylines = edl_lines;
 }
 
+namespace {
+// Returns the time in seconds elapsed since start.
+double secondsSince(const std::chrono::steady_clock::time_point& start) {
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// Returns the time in seconds elapsed since start and sets start to now.
+double restartTimer(std::chrono::steady_clock::time_point* start) {
+  const std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now();
+  const std::chrono::duration<double> elapsed = now - *start;
+  *start = now;
+  return elapsed.count();
+}
+
+// Returns the squared distance from the point (x, y) to the 2D segment line.
+float squaredDistancePointToSegment(float x, float y, const cv::Vec4f& line) {
+  const float dx = line[2] - line[0];
+  const float dy = line[3] - line[1];
+  const float length_squared = dx * dx + dy * dy;
+  float t = 0.0f;
+  if (length_squared > 0.0f) {
+    t = ((x - line[0]) * dx + (y - line[1]) * dy) / length_squared;
+    t = std::min(std::max(t, 0.0f), 1.0f);
+  }
+  const float ex = line[0] + t * dx - x;
+  const float ey = line[1] + t * dy - y;
+  return ex * ex + ey * ey;
+}
+
+// Returns the larger of the squared distances from the endpoints of the
+// shorter of two 2D segments to the longer one. It is small if the shorter
+// segment lies along the longer one, whatever their lengths and directions:
+// the endpoints of a 3D line depend on its inliers, therefore its projection
+// is often shorter than the 2D line it was found from.
+float squaredSegmentDeviation(const cv::Vec4f& line1, const cv::Vec4f& line2) {
+  const auto squaredLength = [](const cv::Vec4f& line) {
+    return (line[2] - line[0]) * (line[2] - line[0]) +
+           (line[3] - line[1]) * (line[3] - line[1]);
+  };
+  const bool first_shorter = squaredLength(line1) < squaredLength(line2);
+  const cv::Vec4f& shorter = first_shorter ? line1 : line2;
+  const cv::Vec4f& longer = first_shorter ? line2 : line1;
+  return std::max(
+      squaredDistancePointToSegment(shorter[0], shorter[1], longer),
+      squaredDistancePointToSegment(shorter[2], shorter[3], longer));
+}
+
+// Moves a plane in hessian normal form with the rigid transform
+// x' = rotation * x + translation.
+cv::Vec4f transformHessian(const cv::Vec4f& hessian,
+                           const cv::Matx33f& rotation,
+                           const cv::Vec3f& translation) {
+  const cv::Vec3f normal =
+      rotation * cv::Vec3f(hessian[0], hessian[1], hessian[2]);
+  return cv::Vec4f(normal[0], normal[1], normal[2],
+                   hessian[3] - normal.dot(translation));
+}
+}  // namespace
+
+void LineDetector::processFrame(const cv::Mat& image, const cv::Mat& cloud,
+                                const cv::Mat& camera_P,
+                                const FrameOptions& options,
+                                FrameResult* result) {
+  // The lines of a temporary context could not be tracked in the next frame.
+  CHECK(!options.track_lines)
+      << "Tracking the lines needs a context kept from frame to frame.";
+  DetectionContext context;
+  processFrame(image, cloud, camera_P, options, result, &context);
+}
+
+void LineDetector::processFrame(const cv::Mat& image, const cv::Mat& cloud,
+                                const cv::Mat& camera_P,
+                                const FrameOptions& options,
+                                FrameResult* result,
+                                DetectionContext* context) {
+  CHECK_NOTNULL(context);
+  CHECK_NOTNULL(result);
+  CHECK_EQ(cloud.type(), CV_32FC3);
+  CHECK(image.type() == CV_8UC3 || image.type() == CV_8UC1);
+  CHECK_EQ(image.rows, cloud.rows);
+  CHECK_EQ(image.cols, cloud.cols);
+  context->ransac_key.frame = options.frame_index;
+  result->timings = FrameTimings();
+  const std::chrono::steady_clock::time_point frame_start =
+      std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point stage_start = frame_start;
+
+  // Detection, on the grayscale image.
+  const cv::Mat* gray_image = &image;
+  if (image.channels() == 3) {
+    cv::cvtColor(image, context->frame_gray_image, cv::COLOR_RGB2GRAY);
+    gray_image = &context->frame_gray_image;
+  }
+  std::vector<cv::Vec4f>* lines2D_detected =
+      options.fuse_lines2D ? &context->frame_lines2D
+                           : &result->lines2D_detected;
+  detectLines(*gray_image, options.detector, context, lines2D_detected);
+  result->num_lines2D_before_fusion = lines2D_detected->size();
+  result->timings.detection = restartTimer(&stage_start);
+
+  if (options.fuse_lines2D) {
+    result->lines2D_detected.clear();
+    fuseLines2D(context->frame_lines2D, &result->lines2D_detected);
+    result->timings.fusion = restartTimer(&stage_start);
+  }
+
+  const bool set_colors = options.set_colors && image.channels() == 3;
+  if (options.track_lines) {
+    predictTrackedLines(camera_P, options.transform_current_previous,
+                        result->lines2D_detected, context);
+  } else {
+    context->tracking.reset();
+  }
+  project2Dto3DwithPlanes(cloud, image, camera_P, result->lines2D_detected,
+                          set_colors, context, &result->lines2D,
+                          &result->lines3D);
+  // The predictions only hold for the lines of this frame.
+  context->tracking.has_prediction.clear();
+  context->tracking.predicted_hessians.clear();
+  result->num_lines3D_before_check = result->lines3D.size();
+  result->statistics = context->statistics;
+  result->timings.projection = restartTimer(&stage_start);
+
+  if (options.check_lines3D) {
+    runCheckOn3DLines(cloud, camera_P, &result->lines2D, &result->lines3D);
+    result->timings.check = restartTimer(&stage_start);
+  }
+  if (options.track_lines) {
+    context->tracking.previous_lines3D = result->lines3D;
+    context->tracking.has_previous_frame = true;
+  }
+  const std::chrono::duration<double> total =
+      std::chrono::steady_clock::now() - frame_start;
+  result->timings.total = total.count();
+}
+
+void LineDetector::predictTrackedLines(
+    const cv::Mat& camera_P, const cv::Matx44f& transform_current_previous,
+    const std::vector<cv::Vec4f>& lines2D, DetectionContext* context) {
+  CHECK_NOTNULL(context);
+  LineTrackingState& tracking = context->tracking;
+  const size_t num_lines = lines2D.size();
+  tracking.has_prediction.assign(num_lines, 0);
+  tracking.predicted_hessians.resize(num_lines);
+  if (!tracking.has_previous_frame) return;
+  const std::vector<LineWithPlanes>& previous = tracking.previous_lines3D;
+  const cv::Matx44f& T = transform_current_previous;
+  const cv::Matx33f rotation(T(0, 0), T(0, 1), T(0, 2),
+                             T(1, 0), T(1, 1), T(1, 2),
+                             T(2, 0), T(2, 1), T(2, 2));
+  const cv::Vec3f translation(T(0, 3), T(1, 3), T(2, 3));
+  const float max_distance = params_->max_endpoint_distance_tracking;
+  CHECK(max_distance > 0.0f);
+
+  // Move the lines of the previous frame into the current frame and project
+  // them to the image.
+  tracking.predicted_lines2D.resize(previous.size());
+  tracking.predicted_in_front.assign(previous.size(), 0);
+  for (size_t i = 0; i < previous.size(); ++i) {
+    const cv::Vec6f& line = previous[i].line;
+    const cv::Vec3f start =
+        rotation * cv::Vec3f(line[0], line[1], line[2]) + translation;
+    const cv::Vec3f end =
+        rotation * cv::Vec3f(line[3], line[4], line[5]) + translation;
+    // Lines (partly) behind the camera cannot be projected.
+    if (start[2] <= 0.0f || end[2] <= 0.0f) continue;
+    project3DLineTo2D(start, end, camera_P, &tracking.predicted_lines2D[i]);
+    tracking.predicted_in_front[i] = 1;
+  }
+
+  // Match every line of the current frame to the moved line that lies
+  // closest along it. The lines of a frame are a few hundred at most,
+  // therefore all the pairs are compared, after a check of their bounding
+  // boxes.
+  const float max_distance_squared = max_distance * max_distance;
+  for (size_t j = 0; j < num_lines; ++j) {
+    const cv::Vec4f& line2D = lines2D[j];
+    const float x_min = std::min(line2D[0], line2D[2]) - max_distance;
+    const float x_max = std::max(line2D[0], line2D[2]) + max_distance;
+    const float y_min = std::min(line2D[1], line2D[3]) - max_distance;
+    const float y_max = std::max(line2D[1], line2D[3]) + max_distance;
+    size_t best = previous.size();
+    float best_distance_squared = max_distance_squared;
+    for (size_t i = 0; i < previous.size(); ++i) {
+      if (!tracking.predicted_in_front[i]) continue;
+      const cv::Vec4f& predicted = tracking.predicted_lines2D[i];
+      if (std::max(predicted[0], predicted[2]) < x_min ||
+          std::min(predicted[0], predicted[2]) > x_max ||
+          std::max(predicted[1], predicted[3]) < y_min ||
+          std::min(predicted[1], predicted[3]) > y_max) {
+        continue;
+      }
+      const float distance_squared =
+          squaredSegmentDeviation(line2D, predicted);
+      if (distance_squared <= best_distance_squared) {
+        best = i;
+        best_distance_squared = distance_squared;
+      }
+    }
+    if (best == previous.size()) continue;
+    tracking.has_prediction[j] = 1;
+    for (size_t side = 0; side < 2; ++side) {
+      tracking.predicted_hessians[j][side] = transformHessian(
+          previous[best].hessians[side], rotation, translation);
+    }
+  }
+}
+
+bool LineDetector::fitPredictedPlane(
+    const std::vector<cv::Vec3f>& points,
+    const std::vector<cv::Point2i>& pixels, int pixel_step,
+    const std::array<cv::Vec4f, 2>& predicted_hessians,
+    std::vector<cv::Vec3f>* inliers, DetectionContext* context) {
+  CHECK_NOTNULL(inliers);
+  CHECK_NOTNULL(context);
+  CHECK(pixels.empty() || pixels.size() == points.size());
+  CHECK_GE(pixel_step, 1);
+  FrameArena* arena = &context->arena;
+  const size_t N = points.size();
+  inliers->clear();
+  ScratchVector<float> x(arena), y(arena), z(arena);
+  x->resize(N);
+  y->resize(N);
+  z->resize(N);
+  for (size_t j = 0; j < N; ++j) {
+    (*x)[j] = points[j][0];
+    (*y)[j] = points[j][1];
+    (*z)[j] = points[j][2];
+  }
+  // Count the inliers to both planes, and keep the mask of the better one.
+  ScratchVector<unsigned char> inlier_mask(arena), best_inlier_mask(arena);
+  inlier_mask->resize(N);
+  size_t max_num_inliers = 0;
+  for (const cv::Vec4f& hessian : predicted_hessians) {
+    // The lines at discontinuities have a hessian of zero on the side without
+    // a plane: every point would be an inlier to it.
+    constexpr double kMinNormNormal = 1e-6;
+    if (cv::norm(cv::Vec3f(hessian[0], hessian[1], hessian[2])) <
+        kMinNormNormal) {
+      continue;
+    }
+    const size_t num_inliers =
+        findInliersToPlane(x->data(), y->data(), z->data(), N, hessian,
+                           params_->max_error_inlier_ransac,
+                           inlier_mask->data());
+    if (num_inliers > max_num_inliers) {
+      max_num_inliers = num_inliers;
+      best_inlier_mask->assign(inlier_mask->begin(), inlier_mask->end());
+    }
+  }
+  if (max_num_inliers == 0 || max_num_inliers < params_->min_num_inliers ||
+      max_num_inliers < params_->min_inlier_fraction_tracking * N) {
+    return false;
+  }
+  // The inliers must form a single connected component, as those of
+  // planeRANSAC.
+  const bool use_pixel_grid =
+      !pixels.empty() &&
+      params_->connectivity_check_ransac == ConnectivityCheck::PIXEL_GRID;
+  if (use_pixel_grid) {
+    ClusterPixelGrid cluster_pixel_grid(
+        pixel_step * params_->max_pairwise_point_distance_connected_components,
+        pixel_step * params_->connectivity_pixel_radius, arena);
+    if (!cluster_pixel_grid.singleConnectedComponent(
+            points, pixels, best_inlier_mask->data())) {
+      return false;
+    }
+  }
+  for (size_t j = 0; j < N; ++j) {
+    if ((*best_inlier_mask)[j]) {
+      inliers->push_back(points[j]);
+    }
+  }
+  if (!use_pixel_grid) {
+    ScratchVector<double> distances_from_mean(arena);
+    ClusterDistanceFromMean cluster_distance_from_mean(
+        params_->max_discont_in_point_to_mean_distance_connected_components,
+        distances_from_mean.get());
+    cluster_distance_from_mean.addPoints(*inliers);
+    if (!cluster_distance_from_mean.singleConnectedComponent()) {
+      inliers->clear();
+      return false;
+    }
+  }
+  return true;
+}
+
 bool LineDetector::hessianNormalFormOfPlane(
     const std::vector<cv::Vec3f>& points, cv::Vec4f* hessian_normal_form) {
   CHECK_NOTNULL(hessian_normal_form);
@@ -527,28 +1174,11 @@ bool LineDetector::hessianNormalFormOfPlane(
     *hessian_normal_form = (*hessian_normal_form) / cv::norm(normal);
     return true;
   } else {  // If there are more than 3 points, the solution is approximate.
-    cv::Vec3f mean(0.0f, 0.0f, 0.0f);
+    PointMoments moments;
     for (int i = 0; i < num_points; ++i) {
-      mean += points[i] / num_points;
-    }
-    cv::Mat A(3, num_points, CV_64FC1);
-    for (size_t i = 0u; i < static_cast<size_t>(num_points); ++i) {
-      A.at<double>(0, i) = points[i][0] - mean[0];
-      A.at<double>(1, i) = points[i][1] - mean[1];
-      A.at<double>(2, i) = points[i][2] - mean[2];
-    }
-    cv::Mat U, W, Vt;
-    cv::SVD::compute(A, W, U, Vt);
-    cv::Vec3f normal;
-    if (U.type() == CV_64FC1) {
-      normal =
-          cv::Vec3f(U.at<double>(0, 2), U.at<double>(1, 2), U.at<double>(2, 2));
-    } else if (U.type() == CV_32FC1) {
-      normal =
-          cv::Vec3f(U.at<float>(0, 2), U.at<float>(1, 2), U.at<float>(2, 2));
-    }
-    *hessian_normal_form = cv::Vec4f(normal[0], normal[1], normal[2],
-                                     computeDfromPlaneNormal(normal, mean));
+      moments.add(points[i]);
+    }
+    fitPlaneToMoments(moments, hessian_normal_form);
     return true;
   }
 }
@@ -657,58 +1287,89 @@ void LineDetector::fuseLines2DOnTheFly(const std::vector<cv::Vec4f>& lines_in,
   CHECK_NOTNULL(lines_out);
   lines_out->clear();
 
-  std::list<cv::Vec4f> line_cluster;
-  // Iterate over all lines.
-  std::list<cv::Vec4f>::iterator old_line_it, current_line_it;
-  cv::Vec4f old_line, current_line;
-  bool current_line_is_in_cluster;
   // The principle is the following: at each iteration we keep so-called
   // "clusters", that represent either a single input line or the line obtained
   // by merging several lines that have close endpoints and similar directions.
   // At the start of each iteration the clusters are such that none of them can
   // be merged with any other cluster. At each iteration, a line "current_line"
-  // is compared with all the previously-formed clusters and either immediately
-  // merged into the matching clusters (therefore updating the 'receiving'
-  // cluster) or set to be a new cluster (if no matches with the previous
-  // clusters are found).
+  // is compared with all the previously-formed clusters (in the order in which
+  // they were formed) and either immediately merged into the matching clusters
+  // (therefore updating the 'receiving' cluster) or set to be a new cluster (if
+  // no matches with the previous clusters are found).
+  // The clusters are stored in the order in which they were formed; the ones
+  // that were merged into a later cluster are marked as removed.
+  std::vector<cv::Vec4f> line_cluster;
+  std::vector<unsigned char> cluster_is_removed;
+  line_cluster.reserve(lines_in.size());
+  cluster_is_removed.reserve(lines_in.size());
+  // areLinesEqual2D requires the squared distance between two endpoints to be
+  // less than 2, therefore only the clusters with an endpoint in the cells
+  // around the endpoints of current_line need to be compared with it.
+  constexpr float kCellSize = 2.0f;
+  LineEndpointGrid grid(kCellSize);
+  std::vector<size_t> candidate_clusters;
+  cv::Vec4f current_line;
+  bool current_line_is_in_cluster;
+  size_t current_cluster = 0;
   for (size_t line_idx = 0; line_idx < lines_in.size(); ++line_idx) {
     // At first, current_line is initialized to the input line considered at
     // this iteration.
     current_line = lines_in[line_idx];
     current_line_is_in_cluster = false;
-    for (old_line_it = line_cluster.begin(); old_line_it != line_cluster.end();
-         ++old_line_it) {
-      old_line = *old_line_it;
-      // Compare current_line with each previously-formed cluster.
-      if (areLinesEqual2D(current_line, old_line)) {
+    // Clusters before this one were already compared with current_line.
+    size_t first_cluster_to_compare = 0;
+    bool merged = true;
+    while (merged) {
+      merged = false;
+      grid.findLinesNearEndpoints(current_line, &candidate_clusters);
+      for (size_t cluster_idx : candidate_clusters) {
+        if (cluster_idx < first_cluster_to_compare ||
+            cluster_is_removed[cluster_idx]) {
+          continue;
+        }
+        // Compare current_line with each previously-formed cluster.
+        if (!areLinesEqual2D(current_line, line_cluster[cluster_idx])) {
+          continue;
+        }
         // Merge current line into the previously-formed cluster.
-        *old_line_it = mergeLines2D(current_line, old_line);
-        current_line = *old_line_it;
+        line_cluster[cluster_idx] =
+            mergeLines2D(current_line, line_cluster[cluster_idx]);
+        current_line = line_cluster[cluster_idx];
+        grid.addLine(current_line, cluster_idx);
         // If current_line is a cluster, i.e., the input line was already merged
-        // to another cluster old_line in the same iteration, remove the cluster
-        // to which the line was previously merged (old_line), since it has now
-        // itself been merged into the newly found cluster.
+        // to another cluster in the same iteration, remove the cluster to which
+        // the line was previously merged, since it has now itself been merged
+        // into the newly found cluster.
         if (current_line_is_in_cluster) {
-          line_cluster.erase(current_line_it);
+          cluster_is_removed[current_cluster] = 1;
         }
         // Update current_line to be the cluster into which the input line/the
         // older cluster was merged.
         current_line_is_in_cluster = true;
-        current_line_it = old_line_it;
+        current_cluster = cluster_idx;
+        // current_line changed: look again for the clusters near it, among the
+        // ones that follow the cluster it was merged into.
+        first_cluster_to_compare = cluster_idx + 1;
+        merged = true;
+        break;
       }
     }
-    // The input line cannot be merged into any of the previoùsly-found
+    // The input line cannot be merged into any of the previously-found
     // clusters.
     if (!current_line_is_in_cluster) {
       // Add the input line as a new cluster.
+      grid.addLine(current_line, line_cluster.size());
       line_cluster.push_back(current_line);
+      cluster_is_removed.push_back(0);
     }
   }
   // Return the clusters left, that by construction are all disconnected
   // components, in the sense that they cannot be merged into one another.
-  *lines_out = std::vector<cv::Vec4f> (
-      std::make_move_iterator(std::begin(line_cluster)),
-      std::make_move_iterator(std::end(line_cluster)));
+  for (size_t i = 0; i < line_cluster.size(); ++i) {
+    if (!cluster_is_removed[i]) {
+      lines_out->push_back(line_cluster[i]);
+    }
+  }
 }
 
 cv::Vec4f LineDetector::mergeLines2D(const cv::Vec4f& line_1,
@@ -821,17 +1482,17 @@ double LineDetector::findAndRate3DLine(const cv::Mat& point_cloud,
 
   cv::LineIterator it_start_end_found(point_cloud, start, end, 8);
   while (!(rate_it.x == end.x && rate_it.y == end.y)) {
-    if (std::isnan(point_cloud.at<cv::Vec3f>(rate_it)[0])){
+    if (std::isnan(point_cloud.at<cv::Vec3f>(rate_it)[0])) {
       ++num_nan_points;
-      continue;
+    } else {
+      rating_temp = distPointToLine(point_cloud.at<cv::Vec3f>(start),
+                                    point_cloud.at<cv::Vec3f>(end),
+                                    point_cloud.at<cv::Vec3f>(rate_it));
+      rating += rating_temp;
+      ++(*num_points);
     }
-    rating_temp = distPointToLine(point_cloud.at<cv::Vec3f>(start),
-                                  point_cloud.at<cv::Vec3f>(end),
-                                  point_cloud.at<cv::Vec3f>(rate_it));
     ++it_start_end_found;
     rate_it = it_start_end_found.pos();
-    rating += rating_temp;
-    ++(*num_points);
   }
 
   return rating / (*num_points);
@@ -1229,8 +1890,9 @@ bool LineDetector::getRectanglesFromLine(const cv::Vec4f& line,
 
 void LineDetector::assignColorToLines(const cv::Mat& image,
                                       const std::vector<cv::Point2i>& points,
-                                      LineWithPlanes* line3D) {
+                                      size_t side, LineWithPlanes* line3D) {
   CHECK_NOTNULL(line3D);
+  CHECK_LT(side, line3D->colors.size());
   CHECK_EQ(image.type(), CV_8UC3);
   long long x1 = 0, x2 = 0, x3 = 0;
   int num_points = points.size();
@@ -1243,9 +1905,9 @@ void LineDetector::assignColorToLines(const cv::Mat& image,
     x2 += image.at<cv::Vec3b>(points[i])[1];
     x3 += image.at<cv::Vec3b>(points[i])[2];
   }
-  line3D->colors.push_back({static_cast<unsigned char>(x1 / num_points),
-                            static_cast<unsigned char>(x2 / num_points),
-                            static_cast<unsigned char>(x3 / num_points)});
+  line3D->colors[side] = {static_cast<unsigned char>(x1 / num_points),
+                          static_cast<unsigned char>(x2 / num_points),
+                          static_cast<unsigned char>(x3 / num_points)};
 }
 
 // DEPRECATED
@@ -1272,7 +1934,6 @@ bool LineDetector::find3DlineOnPlanes(const std::vector<cv::Vec3f>& points1,
   size_t N2 = points2.size();
   if (N1 < 3 || N2 < 3) return false;
   cv::Vec3f mean1, mean2, normal1, normal2;
-  line->hessians.resize(2);
   // cv::Vec4f hessian1, hessian2;
   // Fit a plane model to the two sets of points individually.
   if (!hessianNormalFormOfPlane(points1, &(line->hessians[0])))
@@ -1393,8 +2054,10 @@ bool LineDetector::find3DlineOnPlanes(const std::vector<cv::Vec3f>& points1,
                                       const cv::Mat& cloud,
                                       const cv::Mat& camera_P,
                                       const bool planes_found,
-                                      LineWithPlanes* line) {
+                                      LineWithPlanes* line,
+                                      DetectionContext* context) {
   CHECK_NOTNULL(line);
+  CHECK_NOTNULL(context);
   // To consider a line found as valid. It should have enough number of inliers
   // and enough inliers around the center of the line.
   bool enough_num_inliers, enough_inliers_around_center;
@@ -1412,7 +2075,6 @@ bool LineDetector::find3DlineOnPlanes(const std::vector<cv::Vec3f>& points1,
   size_t N2 = points2.size();
   if (N1 < 3 || N2 < 3) return false;
   cv::Vec3f mean1, mean2, normal1, normal2;
-  line->hessians.resize(2);
   // Fit a plane model to the two sets of points individually.
   if (!hessianNormalFormOfPlane(points1, &(line->hessians[0])))
     LOG(WARNING) << "find3DlineOnPlanes: search for hessian failed.";
@@ -1436,7 +2098,8 @@ bool LineDetector::find3DlineOnPlanes(const std::vector<cv::Vec3f>& points1,
     // Concatenate the two sets of points. For surface and intersection line,
     // points1 and points2 are different and thus no repetition of points. The
     // latter is also ensured by the fact that planes_found is True.
-    std::vector<cv::Vec3f> points;
+    ScratchVector<cv::Vec3f> scratch_points(&context->arena);
+    std::vector<cv::Vec3f>& points = *scratch_points;
     points.reserve(points1.size() + points2.size());
     points.insert(points.end(), points1.begin(), points1.end());
     points.insert(points.end(), points2.begin(), points2.end());
@@ -1470,8 +2133,8 @@ bool LineDetector::find3DlineOnPlanes(const std::vector<cv::Vec3f>& points1,
             readjusted_line_reprojected, cloud.cols, cloud.rows);
         fitLineToBounds(readjusted_line_reprojected, cloud.cols, cloud.rows);
         // Update background image.
-        background_image_ = getImageOfLine(readjusted_line_reprojected,
-                                           background_image_, 1);
+        context->background_image = getImageOfLine(
+            readjusted_line_reprojected, context->background_image, 1);
         LOG(INFO) << "* Displaying candidate planar line in 3D with inliers.";
         displayLineWithPointsAndPlanes(start_readjusted_line,
                                        end_readjusted_line, start_init_guess,
@@ -1487,7 +2150,7 @@ bool LineDetector::find3DlineOnPlanes(const std::vector<cv::Vec3f>& points1,
         if (verbose_mode_on_) {
           LOG(INFO) << "* Line is assigned PLANE type.";
         }
-        num_planar_lines++;
+        context->statistics.num_planar_lines++;
         return true;
       } else {
         if (verbose_mode_on_) {
@@ -1546,8 +2209,8 @@ bool LineDetector::find3DlineOnPlanes(const std::vector<cv::Vec3f>& points1,
         readjusted_line_reprojected = fitLineToBounds(
             readjusted_line_reprojected, cloud.cols, cloud.rows);
        // Update background image.
-        background_image_ = getImageOfLine(readjusted_line_reprojected,
-                                           background_image_, 1);
+        context->background_image = getImageOfLine(
+            readjusted_line_reprojected, context->background_image, 1);
         LOG(INFO) << "* Displaying candidate edge/intersection line in 3D with "
                   << "inliers.";
         displayLineWithPointsAndPlanes(start_readjusted_line,
@@ -1557,8 +2220,12 @@ bool LineDetector::find3DlineOnPlanes(const std::vector<cv::Vec3f>& points1,
       }
 
       // Line can now be either an edge or on an intersection line.
-      if (!assignEdgeOrIntersectionLineType(cloud, camera_P, points1, points2,
-                                            line)) {
+      const std::chrono::steady_clock::time_point type_start =
+          std::chrono::steady_clock::now();
+      const bool type_assigned = assignEdgeOrIntersectionLineType(
+          cloud, camera_P, points1, points2, line, context);
+      context->statistics.time_type_assignment += secondsSince(type_start);
+      if (!type_assigned) {
         if (verbose_mode_on_) {
           LOG(ERROR) << "Could not assign neither edge- nor intersection- line "
                      << "type to line (" << line->line[0] << ", "
@@ -1631,8 +2298,8 @@ bool LineDetector::find3DlineOnPlanes(const std::vector<cv::Vec3f>& points1,
       readjusted_line_reprojected = fitLineToBounds(
           readjusted_line_reprojected, cloud.cols, cloud.rows);
       // Update background image.
-      background_image_ = getImageOfLine(readjusted_line_reprojected,
-                                         background_image_, 1);
+      context->background_image = getImageOfLine(
+          readjusted_line_reprojected, context->background_image, 1);
       LOG(INFO) << "* Displaying candidate discontinuity line in 3D with "
                 << "inliers.";
       displayLineWithPointsAndPlanes(start_readjusted_line, end_readjusted_line,
@@ -1648,7 +2315,7 @@ bool LineDetector::find3DlineOnPlanes(const std::vector<cv::Vec3f>& points1,
       if (verbose_mode_on_) {
         LOG(INFO) << "* Line is assigned DISCONT type.";
       }
-      num_discontinuity_lines++;
+      context->statistics.num_discontinuity_lines++;
       return true;
     } else {
       if (verbose_mode_on_) {
@@ -1662,8 +2329,10 @@ bool LineDetector::find3DlineOnPlanes(const std::vector<cv::Vec3f>& points1,
 
 bool LineDetector::assignEdgeOrIntersectionLineType(const cv::Mat& cloud,
     const cv::Mat& camera_P, const std::vector<cv::Vec3f>& inliers_right,
-    const std::vector<cv::Vec3f>& inliers_left, LineWithPlanes* line) {
+    const std::vector<cv::Vec3f>& inliers_left, LineWithPlanes* line,
+    DetectionContext* context) {
   CHECK_NOTNULL(line);
+  CHECK_NOTNULL(context);
   // First step: if the two planes around the original line form a
   // convex angle, set the line type to be EDGE, otherwise both EDGE and
   // INTERSECTION line type are possible and a further test is required.
@@ -1679,11 +2348,12 @@ bool LineDetector::assignEdgeOrIntersectionLineType(const cv::Mat& cloud,
   bool convex_true_concave_false;
   cv::Vec3f origin({0.0f, 0.0f, 0.0f});
   if (determineConvexityFromViewpointGivenLineAndInlierPoints(*line,
-    inliers_right, inliers_left, origin, &convex_true_concave_false)) {
+    inliers_right, inliers_left, origin, &convex_true_concave_false,
+    context)) {
       if (convex_true_concave_false) {
         // Convex => Edge.
         line->type = LineType::EDGE;
-        num_edge_lines++;
+        context->statistics.num_edge_lines++;
         return true;
       }
   } else {
@@ -1731,11 +2401,11 @@ bool LineDetector::assignEdgeOrIntersectionLineType(const cv::Mat& cloud,
   checkIfValidPointsOnPlanesGivenProlongedLine(
       cloud, camera_P, start_line_before_start, end_line_before_start,
       line->hessians, &right_plane_enough_valid_points_before_start,
-      &left_plane_enough_valid_points_before_start);
+      &left_plane_enough_valid_points_before_start, context);
   checkIfValidPointsOnPlanesGivenProlongedLine(
       cloud, camera_P, start_line_after_end, end_line_after_end, line->hessians,
       &right_plane_enough_valid_points_after_end,
-      &left_plane_enough_valid_points_after_end);
+      &left_plane_enough_valid_points_after_end, context);
 
   bool can_prolonge_before_start, can_prolonge_after_end, can_prolonge;
   constexpr size_t max_iterations = 4;
@@ -1759,11 +2429,11 @@ bool LineDetector::assignEdgeOrIntersectionLineType(const cv::Mat& cloud,
     checkIfValidPointsOnPlanesGivenProlongedLine(
         cloud, camera_P, start_line_before_start, end_line_before_start,
         line->hessians, &right_plane_enough_valid_points_before_start,
-        &left_plane_enough_valid_points_before_start);
+        &left_plane_enough_valid_points_before_start, context);
     checkIfValidPointsOnPlanesGivenProlongedLine(
         cloud, camera_P, start_line_after_end, end_line_after_end,
         line->hessians, &right_plane_enough_valid_points_after_end,
-        &left_plane_enough_valid_points_after_end);
+        &left_plane_enough_valid_points_after_end, context);
     can_prolonge_before_start = right_plane_enough_valid_points_before_start &&
                                 left_plane_enough_valid_points_before_start;
     can_prolonge_after_end = right_plane_enough_valid_points_after_end &&
@@ -1788,12 +2458,12 @@ bool LineDetector::assignEdgeOrIntersectionLineType(const cv::Mat& cloud,
   // - All other cases -> Intersection line.
   if (point_planes_config == "0000") {
     line->type = LineType::EDGE;
-    num_edge_lines++;
-    occurrences_config_prolonged_plane[0][0][0][0]++;
+    context->statistics.num_edge_lines++;
+    context->statistics.occurrences_config_prolonged_plane[0][0][0][0]++;
   } else if (point_planes_config == "1111") {
     line->type = LineType::EDGE;
-    num_edge_lines++;
-    occurrences_config_prolonged_plane[1][1][1][1]++;
+    context->statistics.num_edge_lines++;
+    context->statistics.occurrences_config_prolonged_plane[1][1][1][1]++;
   } else {
     if (verbose_mode_on_) {
       LOG(INFO) << "The current line (of intersection type) has the following "
@@ -1802,26 +2472,26 @@ bool LineDetector::assignEdgeOrIntersectionLineType(const cv::Mat& cloud,
     }
     if (point_planes_config == "0001" || point_planes_config == "0010" ||
         point_planes_config == "0100" || point_planes_config == "1000") {
-      occurrences_config_prolonged_plane[1][0][0][0]++;
+      context->statistics.occurrences_config_prolonged_plane[1][0][0][0]++;
     } else if (point_planes_config == "1100" || point_planes_config == "0011") {
-      occurrences_config_prolonged_plane[1][1][0][0]++;
+      context->statistics.occurrences_config_prolonged_plane[1][1][0][0]++;
     } else if (point_planes_config == "1010" || point_planes_config == "0101") {
-      occurrences_config_prolonged_plane[1][0][1][0]++;
+      context->statistics.occurrences_config_prolonged_plane[1][0][1][0]++;
     } else if (point_planes_config == "1001" || point_planes_config == "0110") {
-      occurrences_config_prolonged_plane[1][0][0][1]++;
+      context->statistics.occurrences_config_prolonged_plane[1][0][0][1]++;
       if (verbose_mode_on_) {
         LOG(WARNING) << "Note: The configuration is one of the strange ones.";
       }
     } else if (point_planes_config == "1110" || point_planes_config == "1101" ||
                point_planes_config == "1011" || point_planes_config == "0111") {
-      occurrences_config_prolonged_plane[1][1][1][0]++;
+      context->statistics.occurrences_config_prolonged_plane[1][1][1][0]++;
     } else {
       LOG(ERROR) << "Found a case for the configuration valid points/prolonged "
                  << "planes that should be impossible.";
       return false;
     }
     line->type = LineType::INTERSECT;
-    num_intersection_lines++;
+    context->statistics.num_intersection_lines++;
   }
   return true;
 }
@@ -1829,8 +2499,9 @@ bool LineDetector::assignEdgeOrIntersectionLineType(const cv::Mat& cloud,
 bool LineDetector::determineConvexityFromViewpointGivenLineAndInlierPoints(
   const LineWithPlanes& line, const std::vector<cv::Vec3f>& inliers_1,
   const std::vector<cv::Vec3f>& inliers_2, const cv::Vec3f& viewpoint,
-  bool* convex_true_concave_false) {
+  bool* convex_true_concave_false, DetectionContext* context) {
   CHECK_NOTNULL(convex_true_concave_false);
+  CHECK_NOTNULL(context);
   // Orient normal vectors towards the viewpoint (if not done before).
   cv::Vec4f hessians[2];
   hessians[0] = line.hessians[0];
@@ -1897,7 +2568,7 @@ bool LineDetector::determineConvexityFromViewpointGivenLineAndInlierPoints(
                  << hessians[1][0] << ", " << hessians[1][1] << ", "
                  << hessians[1][2] << ", " << hessians[1][3] << "].";
     }
-    num_lines_discarded_for_convexity_concavity++;
+    context->statistics.num_lines_discarded_for_convexity_concavity++;
     return false;
   }
 }
@@ -1959,11 +2630,12 @@ bool LineDetector::determineConvexityFromViewpointGivenLineAndMeanPoints(
 
 void LineDetector::checkIfValidPointsOnPlanesGivenProlongedLine(
     const cv::Mat& cloud, const cv::Mat& camera_P, const cv::Vec3f& start,
-    const cv::Vec3f& end, const std::vector<cv::Vec4f>& hessians,
+    const cv::Vec3f& end, const std::array<cv::Vec4f, 2>& hessians,
     bool* right_plane_enough_valid_points,
-    bool* left_plane_enough_valid_points) {
+    bool* left_plane_enough_valid_points, DetectionContext* context) {
   CHECK_NOTNULL(left_plane_enough_valid_points);
   CHECK_NOTNULL(right_plane_enough_valid_points);
+  CHECK_NOTNULL(context);
   double max_deviation = params_->max_error_inlier_ransac;
   // Get 2D coordinates of the endpoints of the line segment.
   cv::Vec4f prolonged_line;
@@ -1974,102 +2646,91 @@ void LineDetector::checkIfValidPointsOnPlanesGivenProlongedLine(
   // fit a plane to these points, in such a way that the plane is parallel to
   // the inlier plane of the original line that is on the same side of the line
   // as it is.
-  std::vector<cv::Point2f> rect_left, rect_right;
-  std::vector<cv::Point2i> points_in_rect;
-  std::vector<cv::Vec3f> points_left_plane, points_right_plane;
-  getRectanglesFromLine(prolonged_line, &rect_left, &rect_right);
+  ScratchVector<cv::Point2f> rect_left(&context->arena);
+  ScratchVector<cv::Point2f> rect_right(&context->arena);
+  // The two sides are sampled and checked one after the other, with the
+  // buffer of the context.
+  PatchSamples& samples = context->patch_samples;
+  const std::vector<cv::Vec3f>& points_in_rect = samples.points;
+  getRectanglesFromLine(prolonged_line, rect_left.get(), rect_right.get());
 
 
   if (visualization_mode_on_) {
     // Display image of prolonged line.
-    background_image_ = getImageOfLineWithRectangles(prolonged_line, rect_left,
-                                                     rect_right,
-                                                     background_image_, 1);
+    context->background_image = getImageOfLineWithRectangles(
+        prolonged_line, *rect_left, *rect_right, context->background_image,
+        1);
   }
 
-  // Find points for the left side.
-  findPointsInRectangle(rect_left, &points_in_rect);
-  points_left_plane.clear();
-  for (size_t j = 0; j < points_in_rect.size(); ++j) {
-    if (points_in_rect[j].x < 0 || points_in_rect[j].x >= cloud.cols ||
-        points_in_rect[j].y < 0 || points_in_rect[j].y >= cloud.rows) {
-      continue;
-    }
-    if (std::isnan(cloud.at<cv::Vec3f>(points_in_rect[j])[0])) continue;
-    points_left_plane.push_back(cloud.at<cv::Vec3f>(points_in_rect[j]));
-  }
-  if (verbose_mode_on_) {
-    LOG(INFO) << "Left rectangle contains " << points_left_plane.size()
-              << " points.";
-  }
-
-  // Find points for the right side.
-  findPointsInRectangle(rect_right, &points_in_rect);
-  points_right_plane.clear();
-  for (size_t j = 0; j < points_in_rect.size(); ++j) {
-    if (points_in_rect[j].x < 0 || points_in_rect[j].x >= cloud.cols ||
-        points_in_rect[j].y < 0 || points_in_rect[j].y >= cloud.rows) {
-      continue;
-    }
-    if (std::isnan(cloud.at<cv::Vec3f>(points_in_rect[j])[0])) continue;
-    points_right_plane.push_back(cloud.at<cv::Vec3f>(points_in_rect[j]));
-  }
-  if (verbose_mode_on_) {
-    LOG(INFO) << "Right rectangle contains " << points_right_plane.size()
-              << " points.";
-  }
+  // Points with no depth information are not discarded here.
+  constexpr bool kDiscardIfNoDepth = false;
+  PatchSampler& sampler = context->patch_sampler;
+  sampler.setCloud(cloud);
+  sampler.setPreprocessedCloud(context->frame_cloud);
+  // If the preprocessed cloud is available, the points of a rectangle are
+  // only sampled if there are enough of them to count (see below).
+  PointCounts counts;
 
+  // Now check if the points around the two planes could be part of the two
+  // planes around the original line, i.e., if they could belong to the same
+  // object as the points on the corresponding plane around the original line.
+  // To do so, count how many points in the two planes around the prolonged line
+  // are consistent with the hessians of the original line.
   // If the number of points around the plane is too small, either the line
   // segment is too short (but this should not be the case if
   // extension_length_for_edge_or_intersection is properly set) or the line
   // segment is near the edge of the image. Therefore, not enough points can be
   // counted to determine whether there are enough valid points on the two
   // sides.
-  bool enough_left_points_to_count = true;
-  bool enough_right_points_to_count = true;
-  if (points_left_plane.size() < params_->min_points_in_prolonged_rect) {
-    *left_plane_enough_valid_points = false;
-    enough_left_points_to_count = false;
-  }
-
-  if (points_right_plane.size() < params_->min_points_in_prolonged_rect) {
-    *right_plane_enough_valid_points = false;
-    enough_right_points_to_count = false;
-  }
-
-  // Now check if the points around the two planes could be part of the two
-  // planes around the original line, i.e., if they could belong to the same
-  // object as the points on the corresponding plane around the original line.
-  // To do so, count how many points in the two planes around the prolonged line
-  // are consistent with the hessians of the original line.
   int valid_points_left_plane = 0, valid_points_right_plane = 0;
   cv::Vec4f hessian_left_plane, hessian_right_plane;
-  std::vector<cv::Vec3f>::iterator it;
   // According to the way hessians were assigned to the lines in
   // project2Dto3DwithPlanes, the map between hessians and side is
   // hessians[0] -> right, hessians[1] -> left.
-  valid_points_left_plane = 0;
-  valid_points_right_plane = 0;
   hessian_left_plane = hessians[1];
   hessian_right_plane = hessians[0];
 
-  if (enough_left_points_to_count) {
-    for (it = points_left_plane.begin(); it != points_left_plane.end(); ++it) {
-      if (errorPointToPlane(hessian_left_plane, *it) < max_deviation)
-        ++valid_points_left_plane;
-    }
+  // Find points for the left side.
+  samples.points.clear();
+  if (!sampler.countPoints(*rect_left, &counts) ||
+      counts.num_valid + counts.num_no_depth >=
+          params_->min_points_in_prolonged_rect) {
+    sampler.sample(*rect_left, kDiscardIfNoDepth, &samples);
+  }
+  if (verbose_mode_on_) {
+    LOG(INFO) << "Left rectangle contains " << points_in_rect.size()
+              << " points.";
+  }
+  if (points_in_rect.size() < params_->min_points_in_prolonged_rect) {
+    *left_plane_enough_valid_points = false;
+  } else {
+    valid_points_left_plane =
+        countInliersToPlane(points_in_rect, hessian_left_plane, max_deviation,
+                            &context->arena);
     // Determine if enough valid points are found for the left plane.
     if (valid_points_left_plane < params_-> max_points_for_empty_rectangle)
       *left_plane_enough_valid_points = false;
     else
       *left_plane_enough_valid_points = true;
   }
-  if (enough_right_points_to_count) {
-    for (it = points_right_plane.begin(); it != points_right_plane.end();
-         ++it) {
-      if (errorPointToPlane(hessian_right_plane, *it) < max_deviation)
-        ++valid_points_right_plane;
-    }
+
+  // Find points for the right side.
+  samples.points.clear();
+  if (!sampler.countPoints(*rect_right, &counts) ||
+      counts.num_valid + counts.num_no_depth >=
+          params_->min_points_in_prolonged_rect) {
+    sampler.sample(*rect_right, kDiscardIfNoDepth, &samples);
+  }
+  if (verbose_mode_on_) {
+    LOG(INFO) << "Right rectangle contains " << points_in_rect.size()
+              << " points.";
+  }
+  if (points_in_rect.size() < params_->min_points_in_prolonged_rect) {
+    *right_plane_enough_valid_points = false;
+  } else {
+    valid_points_right_plane =
+        countInliersToPlane(points_in_rect, hessian_right_plane, max_deviation,
+                            &context->arena);
     // Determine if enough valid points are found for the right plane.
     if (valid_points_right_plane < params_-> max_points_for_empty_rectangle)
       *right_plane_enough_valid_points = false;
@@ -2085,10 +2746,18 @@ void LineDetector::checkIfValidPointsOnPlanesGivenProlongedLine(
 
 bool LineDetector::planeRANSAC(const std::vector<cv::Vec3f>& points,
                                cv::Vec4f* hessian_normal_form) {
+  DetectionContext context;
+  return planeRANSAC(points, hessian_normal_form, &context);
+}
+bool LineDetector::planeRANSAC(const std::vector<cv::Vec3f>& points,
+                               cv::Vec4f* hessian_normal_form,
+                               DetectionContext* context) {
+  CHECK_NOTNULL(context);
   const size_t N = points.size();
   double inlier_fraction_min = params_->min_inlier_ransac;
-  std::vector<cv::Vec3f> inliers;
-  planeRANSAC(points, &inliers);
+  ScratchVector<cv::Vec3f> scratch_inliers(&context->arena);
+  std::vector<cv::Vec3f>& inliers = *scratch_inliers;
+  planeRANSAC(points, &inliers, context);
   // If we found not enough inlier, return false. This is important because
   // there might not be a solution (and we dont want to propose one if there
   // is none).
@@ -2098,7 +2767,32 @@ bool LineDetector::planeRANSAC(const std::vector<cv::Vec3f>& points,
 }
 void LineDetector::planeRANSAC(const std::vector<cv::Vec3f>& points,
                                std::vector<cv::Vec3f>* inliers) {
+  DetectionContext context;
+  planeRANSAC(points, inliers, &context);
+}
+void LineDetector::planeRANSAC(const std::vector<cv::Vec3f>& points,
+                               std::vector<cv::Vec3f>* inliers,
+                               DetectionContext* context) {
+  planeRANSAC(points, std::vector<cv::Point2i>(), 1, inliers, context);
+}
+
+void LineDetector::planeRANSAC(const std::vector<cv::Vec3f>& points,
+                               const std::vector<cv::Point2i>& pixels,
+                               int pixel_step,
+                               std::vector<cv::Vec3f>* inliers) {
+  DetectionContext context;
+  planeRANSAC(points, pixels, pixel_step, inliers, &context);
+}
+
+void LineDetector::planeRANSAC(const std::vector<cv::Vec3f>& points,
+                               const std::vector<cv::Point2i>& pixels,
+                               int pixel_step,
+                               std::vector<cv::Vec3f>* inliers,
+                               DetectionContext* context) {
   CHECK_NOTNULL(inliers);
+  CHECK_NOTNULL(context);
+  CHECK_GE(pixel_step, 1);
+  FrameArena* arena = &context->arena;
   // Set parameters and do a sanity check.
   const int N = points.size();
   inliers->clear();
@@ -2109,49 +2803,111 @@ void LineDetector::planeRANSAC(const std::vector<cv::Vec3f>& points,
   double max_discont_in_point_to_mean_distance_connected_components =
       params_->max_discont_in_point_to_mean_distance_connected_components;
   unsigned int min_num_inliers = params_->min_num_inliers;
+  const bool adaptive_iterations = params_->adaptive_iterations_ransac;
+  const double log_one_minus_confidence =
+      std::log(1.0 - params_->confidence_ransac);
   CHECK(N > number_of_model_params) << "Not enough points to use RANSAC.";
-  // Declare variables that are used for the RANSAC.
-  std::vector<cv::Vec3f> random_points, inlier_candidates;
-  cv::Vec3f normal;
+  CHECK(params_->confidence_ransac > 0.0 && params_->confidence_ransac < 1.0);
+  CHECK(pixels.empty() || static_cast<int>(pixels.size()) == N);
+  const bool use_pixel_grid =
+      !pixels.empty() &&
+      params_->connectivity_check_ransac == ConnectivityCheck::PIXEL_GRID;
+  // Declare variables that are used for the RANSAC. The buffers are borrowed
+  // from the arena, so that they are not allocated for every call.
+  ScratchVector<cv::Vec3f> random_points(arena), inlier_candidates(arena);
+  static_assert(number_of_model_params == 3,
+                "The samples are drawn by sampleThreeUniqueIndices.");
+  random_points->resize(number_of_model_params);
+  size_t random_indices[number_of_model_params];
   cv::Vec4f hessian_normal_form;
+  size_t num_inlier_candidates;
+  // The coordinates of the points are stored in separate arrays, so that the
+  // inliers of a model can be counted by a single vectorizable pass. The
+  // inliers are only copied when a model beats the best one found so far.
+  ScratchVector<float> x(arena), y(arena), z(arena);
+  x->resize(N);
+  y->resize(N);
+  z->resize(N);
+  for (int j = 0; j < N; ++j) {
+    (*x)[j] = points[j][0];
+    (*y)[j] = points[j][1];
+    (*z)[j] = points[j][2];
+  }
+  ScratchVector<unsigned char> inlier_mask(arena);
+  inlier_mask->resize(N);
+  inlier_candidates->reserve(N);
   // Data structure to find whether the points form a single connected
   // component.
+  ScratchVector<double> distances_from_mean(arena);
   ClusterDistanceFromMean cluster_distance_from_mean(
-      max_discont_in_point_to_mean_distance_connected_components);
-  // Set a random seed.
-  unsigned seed = 1;
-  std::default_random_engine generator(seed);
+      max_discont_in_point_to_mean_distance_connected_components,
+      distances_from_mean.get());
+  const std::chrono::steady_clock::time_point start_time =
+      std::chrono::steady_clock::now();
+  int num_iterations = 0;
+  // The random numbers of an iteration only depend on the key and on the
+  // iteration, not on the calls made before.
+  RansacKey key = context->ransac_key;
+  key.seed = params_->seed_ransac;
   // Start RANSAC.
   for (int iter = 0; iter < max_it; ++iter) {
+    num_iterations = iter + 1;
     // Get number_of_model_params unique elements from points.
-    getNUniqueRandomElements(points, number_of_model_params, &generator,
-                             &random_points);
+    sampleThreeUniqueIndices(key.generate(iter), N, random_indices);
+    for (int k = 0; k < number_of_model_params; ++k) {
+      (*random_points)[k] = points[random_indices[k]];
+    }
     // It might happen that the randomly chosen points lie on a line. In this
     // case, hessianNormalFormOfPlane would return false.
-    if (!hessianNormalFormOfPlane(random_points, &hessian_normal_form))
+    if (!hessianNormalFormOfPlane(*random_points, &hessian_normal_form))
       continue;
-    normal = cv::Vec3f(hessian_normal_form[0], hessian_normal_form[1],
-                       hessian_normal_form[2]);
     // Check which of the points are inlier with the current plane model.
-    inlier_candidates.clear();
-    for (int j = 0; j < N; ++j) {
-      if (errorPointToPlane(hessian_normal_form, points[j]) < max_deviation) {
-        inlier_candidates.push_back(points[j]);
-      }
-    }
+    num_inlier_candidates =
+        findInliersToPlane(x->data(), y->data(), z->data(), N,
+                           hessian_normal_form, max_deviation,
+                           inlier_mask->data());
 
     // If we found more inliers than in any previous run, if the inliers form a
     // single connected component a if they are at least as many as the defined
     // threshold, then we store them as global inliers.
-    if (inlier_candidates.size() > inliers->size() &&
-        inlier_candidates.size() >= min_num_inliers) {
-      // Clear data structure that retrieves the connected components among the
-      // inliers.
-      cluster_distance_from_mean.clear();
-      cluster_distance_from_mean.addPoints(inlier_candidates);
-
-      if (cluster_distance_from_mean.singleConnectedComponent()) {
-        *inliers = inlier_candidates;
+    if (num_inlier_candidates > inliers->size() &&
+        num_inlier_candidates >= min_num_inliers) {
+      if (use_pixel_grid) {
+        // The connectivity is checked on the mask, the inliers are only
+        // copied if they are kept. The grid is only built here, as its
+        // parameters are only valid with ConnectivityCheck::PIXEL_GRID (it
+        // holds no state, its buffers are borrowed from the arena).
+        ClusterPixelGrid cluster_pixel_grid(
+            pixel_step *
+                params_->max_pairwise_point_distance_connected_components,
+            pixel_step * params_->connectivity_pixel_radius, arena);
+        if (cluster_pixel_grid.singleConnectedComponent(
+                points, pixels, inlier_mask->data())) {
+          inliers->clear();
+          for (int j = 0; j < N; ++j) {
+            if ((*inlier_mask)[j]) {
+              inliers->push_back(points[j]);
+            }
+          }
+        }
+      } else {
+        inlier_candidates->clear();
+        for (int j = 0; j < N; ++j) {
+          if ((*inlier_mask)[j]) {
+            inlier_candidates->push_back(points[j]);
+          }
+        }
+        // Clear data structure that retrieves the connected components among
+        // the inliers.
+        cluster_distance_from_mean.clear();
+        cluster_distance_from_mean.addPoints(*inlier_candidates);
+
+        if (cluster_distance_from_mean.singleConnectedComponent()) {
+          // The inliers are copied rather than swapped, so that the buffers
+          // stay with their owners.
+          inliers->assign(inlier_candidates->begin(),
+                          inlier_candidates->end());
+        }
       }
     }
 
@@ -2161,7 +2917,28 @@ void LineDetector::planeRANSAC(const std::vector<cv::Vec3f>& points,
     // model within the first few iterations and all later iterations
     // are just wasted run time.
     if (inliers->size() > inlier_fraction_max * N) break;
+
+    // Adaptive number of iterations: with an inlier ratio w, the probability
+    // that none of k samples of 3 points contains only inliers is
+    // (1 - w^3)^k. Stop once it is below 1 - confidence, i.e., after
+    // log(1 - confidence) / log(1 - w^3) iterations.
+    if (adaptive_iterations && !inliers->empty()) {
+      const double inlier_ratio = static_cast<double>(inliers->size()) / N;
+      const double prob_all_inliers =
+          std::pow(inlier_ratio, number_of_model_params);
+      if (prob_all_inliers >= 1.0 ||
+          iter + 1 >= log_one_minus_confidence /
+                          std::log(1.0 - prob_all_inliers)) {
+        break;
+      }
+    }
   }
+  LineDetectionStatistics& statistics = context->statistics;
+  ++statistics.num_ransac_runs;
+  statistics.num_ransac_iterations += num_iterations;
+  statistics.max_ransac_iterations =
+      std::max(statistics.max_ransac_iterations, num_iterations);
+  statistics.time_ransac += secondsSince(start_time);
 }
 
 void LineDetector::project2Dto3DwithPlanes(
@@ -2189,9 +2966,12 @@ void LineDetector::project2Dto3DwithPlanes(
   CHECK_NOTNULL(lines3D);
   CHECK_EQ(cloud.type(), CV_32FC3);
   // Declare all variables before the main loop.
+  DetectionContext context;
   std::vector<cv::Point2f> rect_left, rect_right;
-  std::vector<cv::Point2i> points_in_rect;
-  std::vector<cv::Vec3f> plane_point_cand, inliers_left, inliers_right;
+  PatchSampler sampler;
+  PatchSamples samples;
+  const std::vector<cv::Vec3f>& plane_point_cand = samples.points;
+  std::vector<cv::Vec3f> inliers_left, inliers_right;
   std::vector<cv::Vec6f> lines3D_cand;
   std::vector<double> rating;
   cv::Point2i start, end;
@@ -2202,17 +2982,20 @@ void LineDetector::project2Dto3DwithPlanes(
   double max_rating = params_->max_rating_valid_line;
   bool right_found, left_found;
   // For a description please cf. findInliersGiven2DLine.
-  bool found_point_with_no_depth_info;
+  constexpr bool kDiscardIfNoDepth = true;
   constexpr size_t min_points_for_ransac = 3;
   // This is a first guess of the 3D lines. They are used in some cases, where
   // the lines cannot be found by intersecting planes.
   std::vector<cv::Vec4f> lines2D =
       fitLinesToBounds(lines2D_in, cloud.cols, cloud.rows);
 
-  find3DlinesRated(cloud, lines2D, &lines3D_cand, &rating);
+  find3DlinesRated(cloud, lines2D, &lines3D_cand, &rating, &context);
+  sampler.setCloud(cloud);
+  if (set_colors) {
+    sampler.setImage(image);
+  }
   // Loop over all 2D lines.
   for (size_t i = 0; i < lines2D.size(); ++i) {
-    found_point_with_no_depth_info = false;
     // If the rating is so high, no valid 3d line was found by the
     // find3DlinesRated function.
     if (rating[i] > max_rating) continue;
@@ -2221,61 +3004,35 @@ void LineDetector::project2Dto3DwithPlanes(
     // plane to these points.
     getRectanglesFromLine(lines2D[i], &rect_left, &rect_right);
     // Find points for the left side.
-    findPointsInRectangle(rect_left, &points_in_rect);
+    const bool found_point_with_no_depth_info_left =
+        !sampler.sample(rect_left, kDiscardIfNoDepth, &samples);
     if (set_colors) {
-      assignColorToLines(image, points_in_rect, &line3D_true);
-    }
-    plane_point_cand.clear();
-    for (size_t j = 0; j < points_in_rect.size(); ++j) {
-      if (points_in_rect[j].x < 0 || points_in_rect[j].x >= cloud.cols ||
-          points_in_rect[j].y < 0 || points_in_rect[j].y >= cloud.rows) {
-        continue;
-      }
-      if (std::isnan(cloud.at<cv::Vec3f>(points_in_rect[j])[0])) continue;
-      if (checkEqualPoints(cloud.at<cv::Vec3f>(points_in_rect[j]),
-          {0.0f, 0.0f, 0.0f})) {
-          found_point_with_no_depth_info = true;
-          break;
-      }
-      plane_point_cand.push_back(cloud.at<cv::Vec3f>(points_in_rect[j]));
+      line3D_true.colors[0] = samples.mean_color;
     }
     // Point with no depth info => Discard line.
-    if (found_point_with_no_depth_info) {
+    if (found_point_with_no_depth_info_left) {
       continue;
     }
     left_found = false;
     if (plane_point_cand.size() > min_points_for_ransac) {
-      planeRANSAC(plane_point_cand, &inliers_left);
+      planeRANSAC(plane_point_cand, &inliers_left, &context);
       if (inliers_left.size() >= min_inliers * plane_point_cand.size()) {
         left_found = true;
       }
     }
     // Find points for the right side.
-    findPointsInRectangle(rect_right, &points_in_rect);
+    const bool found_point_with_no_depth_info_right =
+        !sampler.sample(rect_right, kDiscardIfNoDepth, &samples);
     if (set_colors) {
-      assignColorToLines(image, points_in_rect, &line3D_true);
-    }
-    plane_point_cand.clear();
-    for (size_t j = 0; j < points_in_rect.size(); ++j) {
-      if (points_in_rect[j].x < 0 || points_in_rect[j].x >= cloud.cols ||
-          points_in_rect[j].y < 0 || points_in_rect[j].y >= cloud.rows) {
-        continue;
-      }
-      if (std::isnan(cloud.at<cv::Vec3f>(points_in_rect[j])[0])) continue;
-      if (checkEqualPoints(cloud.at<cv::Vec3f>(points_in_rect[j]),
-          {0.0f, 0.0f, 0.0f})) {
-          found_point_with_no_depth_info = true;
-          break;
-      }
-      plane_point_cand.push_back(cloud.at<cv::Vec3f>(points_in_rect[j]));
+      line3D_true.colors[1] = samples.mean_color;
     }
     // Point with no depth info => Discard line.
-    if (found_point_with_no_depth_info) {
+    if (found_point_with_no_depth_info_right) {
       continue;
     }
     right_found = false;
     if (plane_point_cand.size() > min_points_for_ransac) {
-      planeRANSAC(plane_point_cand, &inliers_right);
+      planeRANSAC(plane_point_cand, &inliers_right, &context);
       if (inliers_right.size() >= min_inliers * plane_point_cand.size()) {
         right_found = true;
       }
@@ -2316,22 +3073,30 @@ void LineDetector::project2Dto3DwithPlanes(
     const cv::Mat& cloud, const cv::Mat& image, const cv::Mat& camera_P,
     const std::vector<cv::Vec4f>& lines2D_in, const bool set_colors,
     std::vector<cv::Vec4f>* lines2D_out, std::vector<LineWithPlanes>* lines3D) {
+  DetectionContext context;
+  project2Dto3DwithPlanes(cloud, image, camera_P, lines2D_in, set_colors,
+                          &context, lines2D_out, lines3D);
+}
+
+void LineDetector::project2Dto3DwithPlanes(
+    const cv::Mat& cloud, const cv::Mat& image, const cv::Mat& camera_P,
+    const std::vector<cv::Vec4f>& lines2D_in, const bool set_colors,
+    DetectionContext* context, std::vector<cv::Vec4f>* lines2D_out,
+    std::vector<LineWithPlanes>* lines3D) {
+  CHECK_NOTNULL(context);
   CHECK_NOTNULL(lines2D_out);
   CHECK_NOTNULL(lines3D);
   CHECK_EQ(cloud.type(), CV_32FC3);
   lines3D->clear();
   lines2D_out->clear();
-  resetStatistics();
-  // Declare all variables before the main loop.
-  std::vector<cv::Point2f> rect_left, rect_right;
-  std::vector<cv::Vec3f> inliers_left, inliers_right;
+  // Reset the statistics about the number of lines of each type detected and
+  // the number of occurrences of each case of the prolonged lines.
+  context->statistics.reset();
+  context->arena.resetAllocationCounter();
   std::vector<cv::Vec6f> lines3D_cand;
   std::vector<double> rating;
-  cv::Point2i start, end;
-  LineWithPlanes line3D_true;
 
   double max_rating = params_->max_rating_valid_line;
-  bool right_found, left_found;
 
   // This is a first guess of the 3D lines. They are used in some cases, where
   // the lines cannot be found by intersecting planes.
@@ -2345,115 +3110,268 @@ void LineDetector::project2Dto3DwithPlanes(
   shrink2Dlines(lines2D, kShrinkCoff, kMinLengthAfterShrinking,
                 &lines2D_shrunk);
 
-  find3DlinesRated(cloud, lines2D_shrunk, &lines3D_cand, &rating);
+  const std::chrono::steady_clock::time_point rating_start =
+      std::chrono::steady_clock::now();
+  find3DlinesRated(cloud, lines2D_shrunk, &lines3D_cand, &rating, context);
+  context->statistics.time_rating = secondsSince(rating_start);
+  for (size_t i = 0; i < rating.size(); ++i) {
+    if (rating[i] > max_rating) {
+      ++context->statistics.num_lines_rejected_by_rating;
+    }
+  }
 
-  // Initialize the number of lines successfully projected to 3D to 0.
-  num_lines_successfully_projected_to_3D = 0;
+  // The rectangles around the lines are checked with the preprocessed cloud.
+  context->preprocessed_cloud.compute(cloud);
+  context->frame_cloud = &context->preprocessed_cloud;
 
+  const size_t num_lines = lines2D.size();
+  size_t num_threads = params_->num_threads_projection;
+  if (num_threads == 0) {
+    num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  // Lines are displayed one after the other, therefore visualization is only
+  // possible in the serial mode.
+  if (visualization_mode_on_) {
+    num_threads = 1;
+  }
+  num_threads = std::min(num_threads, num_lines);
+  // Planes predicted for the lines by the tracking, if any (see
+  // processFrame). They are only read by the workers.
+  const LineTrackingState& tracking = context->tracking;
+  const bool has_predictions = tracking.has_prediction.size() == num_lines;
+  const auto predictedHessians =
+      [&](size_t i) -> const std::array<cv::Vec4f, 2>* {
+    return has_predictions && tracking.has_prediction[i]
+               ? &tracking.predicted_hessians[i]
+               : nullptr;
+  };
+
+  if (num_threads <= 1) {
+    ProjectionScratch* scratch = &context->projection_scratch;
+    LineWithPlanes line3D_true;
+    // Loop over all 2D lines.
+    for (size_t i = 0; i < num_lines; ++i) {
+      // If cannot find valid 3D start and end points for the 2D line.
+      if (rating[i] > max_rating) continue;
+      context->ransac_key.line = i;
+      if (project2DLineTo3DwithPlanes(cloud, image, camera_P, lines2D[i],
+                                      lines3D_cand[i], set_colors,
+                                      predictedHessians(i), scratch, context,
+                                      &line3D_true)) {
+        storeProjectedLine(camera_P, lines2D[i], lines3D_cand[i], line3D_true,
+                           *scratch, context, lines2D_out, lines3D);
+      }
+    }
+    context->frame_cloud = nullptr;
+    context->preprocessed_cloud.reset();
+    context->statistics.num_scratch_allocations +=
+        context->arena.num_allocations();
+    return;
+  }
+
+  // Multi-threaded mode: every worker takes the next unprocessed line and
+  // stores the result in the slot of that line. The results are collected in
+  // the order of the input lines once all workers are done, so that the
+  // output is the same as in the serial mode.
+  std::vector<LineWithPlanes> lines3D_found(num_lines);
+  // NOTE: std::vector<bool> cannot be written concurrently.
+  std::vector<unsigned char> line_found(num_lines, 0);
+  reserveWorkerContexts(num_threads, context);
+  for (size_t t = 0; t < num_threads; ++t) {
+    DetectionContext* worker_context = context->worker_contexts[t].get();
+    worker_context->statistics.reset();
+    worker_context->arena.resetAllocationCounter();
+    worker_context->frame_cloud = context->frame_cloud;
+    worker_context->ransac_key = context->ransac_key;
+  }
+  std::atomic<size_t> next_line(0);
+  std::vector<std::thread> workers;
+  workers.reserve(num_threads);
+  for (size_t t = 0; t < num_threads; ++t) {
+    workers.emplace_back([&, t]() {
+      DetectionContext* worker_context = context->worker_contexts[t].get();
+      for (size_t i = next_line++; i < num_lines; i = next_line++) {
+        if (rating[i] > max_rating) continue;
+        worker_context->ransac_key.line = i;
+        line_found[i] = project2DLineTo3DwithPlanes(
+            cloud, image, camera_P, lines2D[i], lines3D_cand[i], set_colors,
+            predictedHessians(i), &worker_context->projection_scratch,
+            worker_context, &lines3D_found[i]);
+      }
+    });
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  for (size_t t = 0; t < num_threads; ++t) {
+    DetectionContext* worker_context = context->worker_contexts[t].get();
+    worker_context->statistics.num_scratch_allocations +=
+        worker_context->arena.num_allocations();
+    context->statistics.merge(worker_context->statistics);
+    worker_context->frame_cloud = nullptr;
+  }
+  context->frame_cloud = nullptr;
+  context->preprocessed_cloud.reset();
+  context->statistics.num_scratch_allocations +=
+      context->arena.num_allocations();
+  for (size_t i = 0; i < num_lines; ++i) {
+    if (line_found[i]) {
+      storeProjectedLine(camera_P, lines2D[i], lines3D_cand[i],
+                         lines3D_found[i], context->projection_scratch,
+                         context, lines2D_out, lines3D);
+    }
+  }
+}
+
+bool LineDetector::project2DLineTo3DwithPlanes(
+    const cv::Mat& cloud, const cv::Mat& image, const cv::Mat& camera_P,
+    const cv::Vec4f& line2D, const cv::Vec6f& line3D_guess,
+    const bool set_colors,
+    const std::array<cv::Vec4f, 2>* predicted_hessians,
+    ProjectionScratch* scratch, DetectionContext* context,
+    LineWithPlanes* line3D) {
+  CHECK_NOTNULL(scratch);
+  CHECK_NOTNULL(context);
+  CHECK_NOTNULL(line3D);
+  bool right_found, left_found;
   bool planes_found;
   cv::Mat image_of_line_with_rectangles;
-  cv::Vec4f reprojected_line;
-  cv::Vec3f start_3D, end_3D;
-  // Loop over all 2D lines.
-  for (size_t i = 0; i < lines2D.size(); ++i) {
-    // If cannot find valid 3D start and end points for the 2D line.
-    if (rating[i] > max_rating) continue;
+  // The colors of a side whose patch is not sampled must not carry over from
+  // the line previously stored in line3D.
+  line3D->colors.fill(cv::Vec3b(0, 0, 0));
+
+  std::chrono::steady_clock::time_point start_time =
+      std::chrono::steady_clock::now();
+  findInliersGiven2DLine(line2D, cloud, image, set_colors, line3D,
+                         &scratch->inliers_right, &scratch->inliers_left,
+                         &scratch->rect_right, &scratch->rect_left,
+                         &right_found, &left_found, context,
+                         predicted_hessians);
+  context->statistics.time_inlier_search += restartTimer(&start_time);
+  planes_found = false;
+  if ((!right_found) && (!left_found)) {
+    ++context->statistics.num_lines_rejected_without_planes;
+    return false;
+  } else if (!right_found) {
+    scratch->inliers_right = scratch->inliers_left;
+  } else if (!left_found) {
+    scratch->inliers_left = scratch->inliers_right;
+  } else {
+    // Both left and right planes are found.
+    planes_found = true;
+  }
 
-    findInliersGiven2DLine(lines2D[i], cloud, image, set_colors, &line3D_true,
-                          &inliers_right, &inliers_left, &rect_right,
-                          &rect_left, &right_found, &left_found);
-    planes_found = false;
-    if ((!right_found) && (!left_found)) {
-      continue;
-    } else if (!right_found) {
-      inliers_right = inliers_left;
-    } else if (!left_found) {
-      inliers_left = inliers_right;
-    } else {
-      // Both left and right planes are found.
-      planes_found = true;
-    }
+  if (visualization_mode_on_) {
+    context->background_image = image;
+    // Display 2D image with rectangles.
+    LOG(INFO) << "* Displaying new candidate line in 2D.";
+    image_of_line_with_rectangles = getImageOfLineWithRectangles(line2D,
+                                        scratch->rect_left,
+                                        scratch->rect_right,
+                                        context->background_image);
+    cv::imshow("Line with rectangles", image_of_line_with_rectangles);
+    cv::waitKey();
+  }
 
-    if (visualization_mode_on_) {
-      background_image_ = image;
-      // Display 2D image with rectangles.
-      LOG(INFO) << "* Displaying new candidate line in 2D.";
-      image_of_line_with_rectangles = getImageOfLineWithRectangles(lines2D[i],
-                                          rect_left, rect_right,
-                                          background_image_);
-      cv::imshow("Line with rectangles", image_of_line_with_rectangles);
-      cv::waitKey();
-    }
+  // Find 3D line on planes.
+  start_time = std::chrono::steady_clock::now();
+  const bool line_found =
+      find3DlineOnPlanes(scratch->inliers_right, scratch->inliers_left,
+                         line3D_guess, line2D, cloud, camera_P, planes_found,
+                         line3D, context);
+  context->statistics.time_line_fit += secondsSince(start_time);
+  if (!line_found) {
+    ++context->statistics.num_lines_rejected_on_planes;
+  }
+  return line_found;
+}
 
-    // Find 3D line on planes.
-    if (find3DlineOnPlanes(inliers_right, inliers_left, lines3D_cand[i],
-                           lines2D[i], cloud, camera_P, planes_found,
-                           &line3D_true)) {
+void LineDetector::storeProjectedLine(const cv::Mat& camera_P,
+                                      const cv::Vec4f& line2D,
+                                      const cv::Vec6f& line3D_guess,
+                                      const LineWithPlanes& line3D,
+                                      const ProjectionScratch& scratch,
+                                      DetectionContext* context,
+                                      std::vector<cv::Vec4f>* lines2D_out,
+                                      std::vector<LineWithPlanes>* lines3D) {
+  CHECK_NOTNULL(context);
+  CHECK_NOTNULL(lines2D_out);
+  CHECK_NOTNULL(lines3D);
+  cv::Mat image_of_line_with_rectangles;
+  cv::Vec4f reprojected_line;
+  cv::Vec3f start_3D, end_3D;
 
-      // Only push back the reliably found lines.
-      lines3D->push_back(line3D_true);
-      lines2D_out->push_back(lines2D[i]);
-      start_3D = {line3D_true.line[0], line3D_true.line[1],
-                  line3D_true.line[2]};
-      end_3D = {line3D_true.line[3], line3D_true.line[4], line3D_true.line[5]};
+  // Only push back the reliably found lines.
+  lines3D->push_back(line3D);
+  lines2D_out->push_back(line2D);
+  start_3D = {line3D.line[0], line3D.line[1], line3D.line[2]};
+  end_3D = {line3D.line[3], line3D.line[4], line3D.line[5]};
 
-      if (!linesHaveSimilarLength(lines3D_cand[i], line3D_true.line)) {
-        continue;
-      }
-      if (verbose_mode_on_) {
-        project3DLineTo2D(start_3D, end_3D, camera_P, &reprojected_line);
-        LOG(INFO) << "** Candidate line was successfully projected to 3D with "
-                  << "index " << num_lines_successfully_projected_to_3D
-                  << ":\n   - 2D: (" << lines2D[i][0]  << ", " << lines2D[i][1]
-                  << ") -- (" << lines2D[i][2] << ", " << lines2D[i][3]
-                  << ").\n   - 3D before adjustment: (" << lines3D_cand[i][0]
-                  << ", " << lines3D_cand[i][1] << ", " << lines3D_cand[i][2]
-                  << ") -- (" << lines3D_cand[i][3] << ", "
-                  << lines3D_cand[i][4] << ", " << lines3D_cand[i][5]
-                  << ").\n   - 3D after adjustment: (" << line3D_true.line[0]
-                  << ", " << line3D_true.line[1] << ", " << line3D_true.line[2]
-                  << ") -- (" << line3D_true.line[3] << ", "
-                  << line3D_true.line[4] << ", " << line3D_true.line[5]
-                  << ").\n   - 2D after reprojection: (" << reprojected_line[0]
-                  << ", " << reprojected_line[1] << ") -- ("
-                  << reprojected_line[2] << ", " << reprojected_line[3] << ").";
-      }
+  if (!linesHaveSimilarLength(line3D_guess, line3D.line)) {
+    return;
+  }
+  if (verbose_mode_on_) {
+    project3DLineTo2D(start_3D, end_3D, camera_P, &reprojected_line);
+    LOG(INFO) << "** Candidate line was successfully projected to 3D with "
+              << "index "
+              << context->statistics.num_lines_successfully_projected_to_3D
+              << ":\n   - 2D: (" << line2D[0]  << ", " << line2D[1]
+              << ") -- (" << line2D[2] << ", " << line2D[3]
+              << ").\n   - 3D before adjustment: (" << line3D_guess[0]
+              << ", " << line3D_guess[1] << ", " << line3D_guess[2]
+              << ") -- (" << line3D_guess[3] << ", "
+              << line3D_guess[4] << ", " << line3D_guess[5]
+              << ").\n   - 3D after adjustment: (" << line3D.line[0]
+              << ", " << line3D.line[1] << ", " << line3D.line[2]
+              << ") -- (" << line3D.line[3] << ", "
+              << line3D.line[4] << ", " << line3D.line[5]
+              << ").\n   - 2D after reprojection: (" << reprojected_line[0]
+              << ", " << reprojected_line[1] << ") -- ("
+              << reprojected_line[2] << ", " << reprojected_line[3] << ").";
+  }
 
-      if (visualization_mode_on_) {
-        // Display original line/rectangles overlapped with the reprojection
-        // of the line adjusted with inliers and the prolonged line/
-        // rectangles (if any).
-        image_of_line_with_rectangles = getImageOfLineWithRectangles(lines2D[i],
-                                            rect_left, rect_right,
-                                            background_image_);
-        cv::imshow("Line with rectangles + reprojected line + prolonged line ("
-                   "if any)", image_of_line_with_rectangles);
-        cv::waitKey();
-        try {
-          cv::destroyWindow("Line with rectangles + reprojected line + "
-                            "prolonged line (if any)");
-        }
-        catch (cv::Exception& e) {
-          if (verbose_mode_on_) {
-            LOG(INFO) << "Did not close window"
-                      << """Line with rectangles + reprojected line etc."" "
-                      << "because it was not open.";
-          }
-        }
+  if (visualization_mode_on_) {
+    // Display original line/rectangles overlapped with the reprojection
+    // of the line adjusted with inliers and the prolonged line/
+    // rectangles (if any).
+    image_of_line_with_rectangles = getImageOfLineWithRectangles(line2D,
+                                        scratch.rect_left, scratch.rect_right,
+                                        context->background_image);
+    cv::imshow("Line with rectangles + reprojected line + prolonged line ("
+               "if any)", image_of_line_with_rectangles);
+    cv::waitKey();
+    try {
+      cv::destroyWindow("Line with rectangles + reprojected line + "
+                        "prolonged line (if any)");
+    }
+    catch (cv::Exception& e) {
+      if (verbose_mode_on_) {
+        LOG(INFO) << "Did not close window"
+                  << """Line with rectangles + reprojected line etc."" "
+                  << "because it was not open.";
       }
-      num_lines_successfully_projected_to_3D++;
     }
   }
+  context->statistics.num_lines_successfully_projected_to_3D++;
 }
 
 void LineDetector::project3DPointTo2D(const cv::Vec3f& point_3D,
                                       const cv::Mat& camera_P,
                                       cv::Vec2f* point_2D) {
   CHECK_NOTNULL(point_2D);
-  cv::Vec4f point_3D_homo = {point_3D[0], point_3D[1], point_3D[2], 1.0};
-  cv::Mat point_2D_homo = camera_P * cv::Mat(point_3D_homo);
-  *point_2D = {point_2D_homo.at<float>(0, 0) / point_2D_homo.at<float>(2, 0),
-              point_2D_homo.at<float>(1, 0) / point_2D_homo.at<float>(2, 0)};
+  CHECK_EQ(camera_P.type(), CV_32FC1);
+  // The product is computed directly, without allocating the result as a
+  // cv::Mat. As the matrix product of OpenCV, it is accumulated in double.
+  float point_2D_homo[3];
+  for (int i = 0; i < 3; ++i) {
+    const float* row = camera_P.ptr<float>(i);
+    point_2D_homo[i] = static_cast<float>(
+        static_cast<double>(row[0]) * point_3D[0] +
+        static_cast<double>(row[1]) * point_3D[1] +
+        static_cast<double>(row[2]) * point_3D[2] + row[3]);
+  }
+  *point_2D = {point_2D_homo[0] / point_2D_homo[2],
+               point_2D_homo[1] / point_2D_homo[2]};
 }
 
 void LineDetector::project3DLineTo2D(const cv::Vec3f& start_3D,
@@ -2490,10 +3408,11 @@ void LineDetector::findInliersGiven2DLine(const cv::Vec4f& line_2D,
   LineWithPlanes line_3D;
   std::vector<cv::Point2f> rect_right, rect_left;
   bool right_found, left_found;
+  DetectionContext context;
 
   findInliersGiven2DLine(line_2D, cloud, image, false, &line_3D, inliers_right,
                          inliers_left, &rect_right, &rect_left, &right_found,
-                         &left_found);
+                         &left_found, &context);
 }
 
 void LineDetector::findInliersGiven2DLine(const cv::Vec4f& line_2D,
@@ -2505,7 +3424,10 @@ void LineDetector::findInliersGiven2DLine(const cv::Vec4f& line_2D,
                                         std::vector<cv::Vec3f>* inliers_left,
                                         std::vector<cv::Point2f>* rect_right,
                                         std::vector<cv::Point2f>* rect_left,
-                                        bool* right_found, bool* left_found) {
+                                        bool* right_found, bool* left_found,
+                                        DetectionContext* context,
+                                        const std::array<cv::Vec4f, 2>*
+                                            predicted_hessians) {
   CHECK_NOTNULL(line_3D);
   CHECK_NOTNULL(inliers_right);
   CHECK_NOTNULL(inliers_left);
@@ -2513,9 +3435,8 @@ void LineDetector::findInliersGiven2DLine(const cv::Vec4f& line_2D,
   CHECK_NOTNULL(rect_left);
   CHECK_NOTNULL(right_found);
   CHECK_NOTNULL(left_found);
+  CHECK_NOTNULL(context);
 
-  std::vector<cv::Point2i> points_in_rect;
-  std::vector<cv::Vec3f> plane_point_cand;
   // Some points in the point cloud might have no depth information. In
   // SceneNetRGBD these are encoded with corresponding {0, 0, 0} coordinates in
   // the point cloud. If a line is on the edge of a region containing such
@@ -2528,96 +3449,104 @@ void LineDetector::findInliersGiven2DLine(const cv::Vec4f& line_2D,
   // discarding the entire line, but this way the line could be assigned to a
   // wrong line type or have remaining inliers that are not descriptive of the
   // actual plane.
-  bool found_point_with_no_depth_info;
+  constexpr bool kDiscardIfNoDepth = true;
   constexpr size_t min_points_for_ransac = 3;
   // Parameter: Fraction of inlier that must be found for the plane model to
   // be valid.
   double min_inliers = params_->min_inlier_ransac;
+  PatchSampler& sampler = context->patch_sampler;
+  const std::vector<cv::Vec3f>& plane_point_cand =
+      context->patch_samples.points;
 
-  found_point_with_no_depth_info = false;
+  *right_found = false;
+  *left_found = false;
   // Clear inliers.
   inliers_right->clear();
   inliers_left->clear();
 
+  sampler.setCloud(cloud);
+  if (set_colors) {
+    sampler.setImage(image);
+  }
+  sampler.setPreprocessedCloud(context->frame_cloud);
+  sampler.setSubsampling(params_->patch_sampling_stride,
+                         params_->max_points_per_patch);
   // For both the left and the right side of the line: Find a rectangle
   // defining a patch, find all points within the patch and try to fit a plane
   // to these points.
   getRectanglesFromLine(line_2D, rect_left, rect_right);
+  // If the preprocessed cloud is available, first check (without sampling
+  // the points) that none of the two rectangles makes the line be discarded
+  // by the checks below.
+  PointCounts counts_left, counts_right;
+  if (sampler.countPoints(*rect_left, &counts_left) &&
+      sampler.countPoints(*rect_right, &counts_right)) {
+    if (counts_left.num_no_depth > 0 || counts_right.num_no_depth > 0 ||
+        counts_left.num_valid < params_->min_points_in_rect ||
+        counts_right.num_valid < params_->min_points_in_rect) {
+      return;
+    }
+  }
   // Find points for the left side.
-  findPointsInRectangle(*rect_left, &points_in_rect);
+  bool found_point_with_no_depth_info =
+      !sampler.sample(*rect_left, kDiscardIfNoDepth, &context->patch_samples);
   if (set_colors) {
-    assignColorToLines(image, points_in_rect, line_3D);
-  }
-  plane_point_cand.clear();
-  for (size_t j = 0; j < points_in_rect.size(); ++j) {
-    if (points_in_rect[j].x < 0 || points_in_rect[j].x >= cloud.cols ||
-        points_in_rect[j].y < 0 || points_in_rect[j].y >= cloud.rows) {
-      continue;
-    }
-    if (std::isnan(cloud.at<cv::Vec3f>(points_in_rect[j])[0])) continue;
-    if (checkEqualPoints(cloud.at<cv::Vec3f>(points_in_rect[j]),
-        {0.0f, 0.0f, 0.0f})) {
-        found_point_with_no_depth_info = true;
-        break;
-    }
-    plane_point_cand.push_back(cloud.at<cv::Vec3f>(points_in_rect[j]));
+    line_3D->colors[0] = context->patch_samples.mean_color;
   }
   // Point with no depth info => Discard line.
   if (found_point_with_no_depth_info) {
-    *right_found = false;
-    *left_found = false;
     return;
   }
-  // If the size of plane_point_cand is too small, either the line is too short
+  // If there are too few points in the rectangle, either the line is too short
   // or the line is near the edge of the image, reject it.
-  if (plane_point_cand.size() < params_->min_points_in_rect) {
-    *right_found = false;
-    *left_found = false;
+  if (context->patch_samples.num_points_in_rect <
+      params_->min_points_in_rect) {
     return;
   }
-  // See if left plane is found by RANSAC.
-  *left_found = false;
+  // See if left plane is predicted by the tracking or found by RANSAC.
   if (plane_point_cand.size() > min_points_for_ransac) {
-    planeRANSAC(plane_point_cand, inliers_left);
+    if (predicted_hessians != nullptr &&
+        fitPredictedPlane(plane_point_cand, context->patch_samples.pixels,
+                          context->patch_samples.pixel_step,
+                          *predicted_hessians, inliers_left, context)) {
+      ++context->statistics.num_planes_tracked;
+    } else {
+      context->ransac_key.side = 0;
+      planeRANSAC(plane_point_cand, context->patch_samples.pixels,
+                  context->patch_samples.pixel_step, inliers_left, context);
+    }
     if (inliers_left->size() >= min_inliers * plane_point_cand.size()) {
       *left_found = true;
     }
   }
   // Find points for the right side.
-  findPointsInRectangle(*rect_right, &points_in_rect);
+  found_point_with_no_depth_info =
+      !sampler.sample(*rect_right, kDiscardIfNoDepth, &context->patch_samples);
   if (set_colors) {
-    assignColorToLines(image, points_in_rect, line_3D);
-  }
-  plane_point_cand.clear();
-  for (size_t j = 0; j < points_in_rect.size(); ++j) {
-    if (points_in_rect[j].x < 0 || points_in_rect[j].x >= cloud.cols ||
-        points_in_rect[j].y < 0 || points_in_rect[j].y >= cloud.rows) {
-      continue;
-    }
-    if (std::isnan(cloud.at<cv::Vec3f>(points_in_rect[j])[0])) continue;
-    if (checkEqualPoints(cloud.at<cv::Vec3f>(points_in_rect[j]),
-        {0.0f, 0.0f, 0.0f})) {
-        found_point_with_no_depth_info = true;
-        break;
-    }
-    plane_point_cand.push_back(cloud.at<cv::Vec3f>(points_in_rect[j]));
+    line_3D->colors[1] = context->patch_samples.mean_color;
   }
   // Point with no depth info => Discard line.
   if (found_point_with_no_depth_info) {
-    *right_found = false;
     *left_found = false;
     return;
   }
-
-  if (plane_point_cand.size() < params_->min_points_in_rect) {
-    *right_found = false;
+  if (context->patch_samples.num_points_in_rect <
+      params_->min_points_in_rect) {
     *left_found = false;
     return;
   }
-  // See if right plane is found by RANSAC.
-  *right_found = false;
+  // See if right plane is predicted by the tracking or found by RANSAC.
   if (plane_point_cand.size() > min_points_for_ransac) {
-    planeRANSAC(plane_point_cand, inliers_right);
+    if (predicted_hessians != nullptr &&
+        fitPredictedPlane(plane_point_cand, context->patch_samples.pixels,
+                          context->patch_samples.pixel_step,
+                          *predicted_hessians, inliers_right, context)) {
+      ++context->statistics.num_planes_tracked;
+    } else {
+      context->ransac_key.side = 1;
+      planeRANSAC(plane_point_cand, context->patch_samples.pixels,
+                  context->patch_samples.pixel_step, inliers_right, context);
+    }
     if (inliers_right->size() >= min_inliers * plane_point_cand.size()) {
       *right_found = true;
     }
@@ -2707,73 +3636,154 @@ void LineDetector::find3DlinesByShortest(const cv::Mat& cloud,
   }
 }
 
+namespace {
+// Rating of the lines for which no 3D line is found.
+constexpr double kNoLineRating = 1e9;
+
+// Finds the 3D line and its rating from the points sampled along a 2D line,
+// as findAndRate3DLine does from the cloud: the line goes from the first to
+// the last non-NaN point and the rating is the mean distance of the non-NaN
+// points in between (the end point excluded) to the line.
+// Input: points: Points of the cloud along the 2D line, NaN where the cloud
+//                is NaN or where the pixel is outside of the image.
+//
+// Output: line3D: 3D line found.
+//
+//         return: Rating of the line (kNoLineRating if no line was found).
+double rateSampledLine(const std::vector<cv::Vec3f>& points,
+                       cv::Vec6f* line3D) {
+  CHECK_NOTNULL(line3D);
+  *line3D = cv::Vec6f::all(0.0f);
+  const int num_samples = points.size();
+  // The start must be before the last sample and the end after the start.
+  int start = 0;
+  while (start < num_samples - 1 && std::isnan(points[start][0])) ++start;
+  if (start >= num_samples - 1) return kNoLineRating;
+  int end = num_samples - 1;
+  while (end > start && std::isnan(points[end][0])) --end;
+  if (end == start) return kNoLineRating;
+  const cv::Vec3f& start_3D = points[start];
+  const cv::Vec3f& end_3D = points[end];
+  *line3D = cv::Vec6f(start_3D[0], start_3D[1], start_3D[2], end_3D[0],
+                      end_3D[1], end_3D[2]);
+  // In some cases the line found had an endpoint that coincided with the
+  // origin, causing the reprojection to 2D to fail. This line should be
+  // discarded. A line whose endpoints coincide cannot be rated.
+  if (checkEqualPoints(start_3D, {0.0f, 0.0f, 0.0f}) ||
+      checkEqualPoints(end_3D, {0.0f, 0.0f, 0.0f}) ||
+      checkEqualPoints(start_3D, end_3D)) {
+    return kNoLineRating;
+  }
+  double rating = 0.0;
+  int num_points = 0;
+  for (int i = start; i < end; ++i) {
+    if (std::isnan(points[i][0])) continue;
+    rating += distPointToLine(start_3D, end_3D, points[i]);
+    ++num_points;
+  }
+  return rating / num_points;
+}
+
+// Returns the offset (rounded to the pixel) along the given normal of a 2D
+// line, as used for the additional lines in find3DlinesRated.
+cv::Point2i roundedOffset(double normal_x, double normal_y) {
+  return cv::Point2i(static_cast<int>(floor(normal_x + 0.5)),
+                     static_cast<int>(floor(normal_y + 0.5)));
+}
+}  // namespace
+
 void LineDetector::find3DlinesRated(const cv::Mat& cloud,
                                     const std::vector<cv::Vec4f>& lines2D,
                                     std::vector<cv::Vec6f>* lines3D,
                                     std::vector<double>* rating) {
+  DetectionContext context;
+  find3DlinesRated(cloud, lines2D, lines3D, rating, &context);
+}
+
+void LineDetector::find3DlinesRated(const cv::Mat& cloud,
+                                    const std::vector<cv::Vec4f>& lines2D,
+                                    std::vector<cv::Vec6f>* lines3D,
+                                    std::vector<double>* rating,
+                                    DetectionContext* context) {
   CHECK_NOTNULL(lines3D);
   CHECK_NOTNULL(rating);
   CHECK_EQ(cloud.type(), CV_32FC3);
-  int cols = cloud.cols;
-  int rows = cloud.rows;
-  cv::Vec4f upper_line2D, lower_line2D;
-  cv::Point2f line;
+  CHECK_NOTNULL(context);
+  const cv::Rect image_rect(0, 0, cloud.cols, cloud.rows);
+  const cv::Vec3f nan_point(std::numeric_limits<float>::quiet_NaN(),
+                            std::numeric_limits<float>::quiet_NaN(),
+                            std::numeric_limits<float>::quiet_NaN());
+  // Points sampled along the lower line, the line itself and the upper line.
+  ScratchVector<cv::Vec3f> lower_points(&context->arena);
+  ScratchVector<cv::Vec3f> points(&context->arena);
+  ScratchVector<cv::Vec3f> upper_points(&context->arena);
   cv::Vec6f lower_line3D, line3D, upper_line3D;
-  double rate_low, rate_mid, rate_up;
-  lines3D->clear();
-  lines3D->reserve(lines2D.size());
-  rating->clear();
-  rating->reserve(lines2D.size());
+  lines3D->resize(lines2D.size());
+  rating->resize(lines2D.size());
   for (size_t i = 0; i < lines2D.size(); ++i) {
-    line.x = lines2D[i][2] - lines2D[i][0];
-    line.y = lines2D[i][3] - lines2D[i][1];
-    double line_normalizer = sqrt(line.x * line.x + line.y * line.y);
-    upper_line2D[0] = fitToBoundary(
-        floor(lines2D[i][0]) + floor(line.y / line_normalizer + 0.5), 0.0,
-        cols - 1);
-    upper_line2D[1] = fitToBoundary(
-        floor(lines2D[i][1]) + floor(-line.x / line_normalizer + 0.5), 0.0,
-        rows - 1);
-    upper_line2D[2] = fitToBoundary(
-        floor(lines2D[i][2]) + floor(line.y / line_normalizer + 0.5), 0.0,
-        cols - 1);
-    upper_line2D[3] = fitToBoundary(
-        floor(lines2D[i][3]) + floor(-line.x / line_normalizer + 0.5), 0.0,
-        rows - 1);
-    lower_line2D[0] = fitToBoundary(
-        floor(lines2D[i][0]) + floor(-line.y / line_normalizer + 0.5), 0.0,
-        cols - 1);
-    lower_line2D[1] = fitToBoundary(
-        floor(lines2D[i][1]) + floor(line.x / line_normalizer + 0.5), 0.0,
-        rows - 1);
-    lower_line2D[2] = fitToBoundary(
-        floor(lines2D[i][2]) + floor(-line.y / line_normalizer + 0.5), 0.0,
-        cols - 1);
-    lower_line2D[3] = fitToBoundary(
-        floor(lines2D[i][3]) + floor(line.x / line_normalizer + 0.5), 0.0,
-        rows - 1);
-    rate_low = findAndRate3DLine(cloud, lower_line2D, &lower_line3D);
-    rate_mid = findAndRate3DLine(cloud, lines2D[i], &line3D);
-    rate_up = findAndRate3DLine(cloud, upper_line2D, &upper_line3D);
+    // A floating point value that decribes a position in an image is always
+    // within the pixel described through the floor operation.
+    const cv::Point2i start(static_cast<int>(floor(lines2D[i][0])),
+                            static_cast<int>(floor(lines2D[i][1])));
+    const cv::Point2i end(static_cast<int>(floor(lines2D[i][2])),
+                          static_cast<int>(floor(lines2D[i][3])));
+    const double dx = lines2D[i][2] - lines2D[i][0];
+    const double dy = lines2D[i][3] - lines2D[i][1];
+    const double line_normalizer = sqrt(dx * dx + dy * dy);
+    cv::Point2i upper_offset(0, 0), lower_offset(0, 0);
+    if (line_normalizer > 0.0) {
+      upper_offset =
+          roundedOffset(dy / line_normalizer, -dx / line_normalizer);
+      lower_offset =
+          roundedOffset(-dy / line_normalizer, dx / line_normalizer);
+    }
+    // Single traversal of the pixels of the line.
+    cv::LineIterator it(cloud, start, end, 8);
+    lower_points->resize(it.count);
+    points->resize(it.count);
+    upper_points->resize(it.count);
+    for (int j = 0; j < it.count; ++j, ++it) {
+      const cv::Point2i pixel = it.pos();
+      const cv::Point2i lower_pixel = pixel + lower_offset;
+      const cv::Point2i upper_pixel = pixel + upper_offset;
+      (*points)[j] = cloud.at<cv::Vec3f>(pixel);
+      (*lower_points)[j] = image_rect.contains(lower_pixel)
+                               ? cloud.at<cv::Vec3f>(lower_pixel)
+                               : nan_point;
+      (*upper_points)[j] = image_rect.contains(upper_pixel)
+                               ? cloud.at<cv::Vec3f>(upper_pixel)
+                               : nan_point;
+    }
+    const double rate_low = rateSampledLine(*lower_points, &lower_line3D);
+    const double rate_mid = rateSampledLine(*points, &line3D);
+    const double rate_up = rateSampledLine(*upper_points, &upper_line3D);
 
     if (rate_up < rate_mid && rate_up < rate_low) {
-      lines3D->push_back(upper_line3D);
-      rating->push_back(rate_up);
+      (*lines3D)[i] = upper_line3D;
+      (*rating)[i] = rate_up;
     } else if (rate_low < rate_mid) {
-      lines3D->push_back(lower_line3D);
-      rating->push_back(rate_low);
+      (*lines3D)[i] = lower_line3D;
+      (*rating)[i] = rate_low;
     } else {
-      lines3D->push_back(line3D);
-      rating->push_back(rate_mid);
+      (*lines3D)[i] = line3D;
+      (*rating)[i] = rate_mid;
     }
   }
 }
 void LineDetector::find3DlinesRated(const cv::Mat& cloud,
                                     const std::vector<cv::Vec4f>& lines2D,
                                     std::vector<cv::Vec6f>* lines3D) {
+  DetectionContext context;
+  find3DlinesRated(cloud, lines2D, lines3D, &context);
+}
+void LineDetector::find3DlinesRated(const cv::Mat& cloud,
+                                    const std::vector<cv::Vec4f>& lines2D,
+                                    std::vector<cv::Vec6f>* lines3D,
+                                    DetectionContext* context) {
+  CHECK_NOTNULL(lines3D);
   std::vector<double> rating;
   std::vector<cv::Vec6f> lines3D_cand;
-  find3DlinesRated(cloud, lines2D, &lines3D_cand, &rating);
+  find3DlinesRated(cloud, lines2D, &lines3D_cand, &rating, context);
   for (size_t i = 0; i < lines3D_cand.size(); ++i) {
     if (rating[i] > params_->max_rating_valid_line) {
       continue;
@@ -2785,15 +3795,29 @@ void LineDetector::find3DlinesRated(const cv::Mat& cloud,
 void LineDetector::runCheckOn3DLines(
     const cv::Mat& cloud, const std::vector<LineWithPlanes>& lines3D_in,
     std::vector<LineWithPlanes>* lines3D_out) {
+  DetectionContext context;
+  runCheckOn3DLines(cloud, lines3D_in, lines3D_out, &context);
+}
+
+void LineDetector::runCheckOn3DLines(
+    const cv::Mat& cloud, const std::vector<LineWithPlanes>& lines3D_in,
+    std::vector<LineWithPlanes>* lines3D_out, DetectionContext* context) {
   CHECK_NOTNULL(lines3D_out);
+  CHECK_NOTNULL(context);
   lines3D_out->clear();
+  // With cells twice as large as the maximum deviation, the points near a
+  // line are found in a few cells around each sample of the line.
+  context->cloud_grid.compute(cloud,
+                              2.0 * params_->max_deviation_inlier_line_check);
   LineWithPlanes line_cand;
   for (size_t i = 0; i < lines3D_in.size(); ++i) {
     line_cand = lines3D_in[i];
-    if (checkIfValidLineBruteForce(cloud, &(line_cand.line))) {
+    if (checkIfValidLineBruteForce(cloud, &(line_cand.line),
+                                   &context->cloud_grid, &context->arena)) {
       lines3D_out->push_back(line_cand);
     }
   }
+  context->cloud_grid.reset();
 }
 
 void LineDetector::runCheckOn3DLines(
@@ -2823,17 +3847,48 @@ void LineDetector::runCheckOn3DLines(
   }
 }
 
+void LineDetector::runCheckOn3DLines(const cv::Mat& cloud,
+                                     const cv::Mat& camera_P,
+                                     std::vector<cv::Vec4f>* lines2D,
+                                     std::vector<LineWithPlanes>* lines3D) {
+  CHECK_NOTNULL(lines2D);
+  CHECK_NOTNULL(lines3D);
+  CHECK_EQ(lines2D->size(), lines3D->size());
+  size_t num_kept = 0;
+  for (size_t i = 0; i < lines3D->size(); ++i) {
+    if (checkIfValidLineWith2DInfo(cloud, camera_P, (*lines2D)[i],
+                                   &(*lines3D)[i].line)) {
+      if (num_kept != i) {
+        (*lines2D)[num_kept] = (*lines2D)[i];
+        (*lines3D)[num_kept] = (*lines3D)[i];
+      }
+      ++num_kept;
+    } else {
+      if (verbose_mode_on_) {
+        LOG(INFO) << "Line " << i << " is discarded after check with 2D info.";
+      }
+    }
+  }
+  lines2D->resize(num_kept);
+  lines3D->resize(num_kept);
+}
+
 void LineDetector::runCheckOn2DLines(const cv::Mat& cloud,
                                      const std::vector<cv::Vec4f>& lines2D_in,
-                                     std::vector<cv::Vec4f>* lines2D_out) {
+                                     std::vector<cv::Vec4f>* lines2D_out,
+                                     DetectionContext* context) {
   CHECK_NOTNULL(lines2D_out);
+  CHECK_NOTNULL(context);
   size_t N = lines2D_in.size();
   lines2D_out->clear();
+  context->preprocessed_cloud.compute(cloud);
   for (size_t i = 0; i < N; ++i) {
-    if (checkIfValidLineDiscont(cloud, lines2D_in[i])) {
+    if (checkIfValidLineDiscont(cloud, lines2D_in[i],
+                                &context->preprocessed_cloud)) {
       lines2D_out->push_back(lines2D_in[i]);
     }
   }
+  context->preprocessed_cloud.reset();
 }
 
 bool LineDetector::checkIfValidLineWith2DInfo(const cv::Mat& cloud,
@@ -2907,9 +3962,14 @@ bool LineDetector::checkIfValidLineWith2DInfo(const cv::Mat& cloud,
 }
 
 bool LineDetector::checkIfValidLineBruteForce(const cv::Mat& cloud,
-                                              cv::Vec6f* line) {
+                                              cv::Vec6f* line,
+                                              const CloudVoxelGrid* cloud_grid,
+                                              FrameArena* arena) {
   CHECK_NOTNULL(line);
   CHECK_EQ(cloud.type(), CV_32FC3);
+  if (cloud_grid != nullptr) {
+    CHECK(cloud_grid->isComputedFor(cloud));
+  }
   // First check: if one of the points near exactly on the origin, get rid of
   // it.
   if ((fabs((*line)[0]) < 1e-3 && fabs((*line)[1]) < 1e-3 &&
@@ -2924,37 +3984,51 @@ bool LineDetector::checkIfValidLineBruteForce(const cv::Mat& cloud,
   double max_deviation = params_->max_deviation_inlier_line_check;
   // This point density measures the where the points lie on the line. It is
   // used to truncate the line on the ends, if one end lies in empty space.
-  int point_density[num_of_points_required];
-  for (int i = 0; i < num_of_points_required; ++i) {
-    point_density[i] = 0;
-  }
+  ScratchVector<int> point_density_buffer(arena);
+  std::vector<int>& point_density = *point_density_buffer;
+  point_density.assign(num_of_points_required, 0);
 
   double dist;
-  cv::Vec3f start, end, point;
+  cv::Vec3f start, end;
   start = {(*line)[0], (*line)[1], (*line)[2]};
   end = {(*line)[3], (*line)[4], (*line)[5]};
   double length = cv::norm(start - end);
   int count_inliers = 0;
-  // For every point in the cloud: This is why it is called brute force
-  // approach.
-  for (int i = 0; i < cloud.rows; ++i) {
-    for (int j = 0; j < cloud.cols; ++j) {
-      point = cloud.at<cv::Vec3f>(i, j);
-      // Check if the distance to the line is below the threshold. This
-      // computes the distance to the infinite line.
-      if (distPointToLine(start, end, point) < max_deviation) {
-        // This is the distance from the start point projected on to the line.
-        // If its negative or larger the line length, the point may lie on the
-        // line, but not between the start and the end point.
-        dist = (end - start).dot(point - start) / length;
-        if (dist < 0 || length <= dist) {
-          continue;
-        }
-        // Now the histogramm like point_density is raised at the entry where
-        // the point lies.
-        point_density[(int)(dist / length * (double)num_of_points_required)] +=
-            1;
-        ++count_inliers;
+  auto add_point_if_inlier = [&](const cv::Vec3f& point) {
+    // Check if the distance to the line is below the threshold. This
+    // computes the distance to the infinite line.
+    if (distPointToLine(start, end, point) < max_deviation) {
+      // This is the distance from the start point projected on to the line.
+      // If its negative or larger the line length, the point may lie on the
+      // line, but not between the start and the end point.
+      dist = (end - start).dot(point - start) / length;
+      if (dist < 0 || length <= dist) {
+        return;
+      }
+      // Now the histogramm like point_density is raised at the entry where
+      // the point lies.
+      point_density[(int)(dist / length * (double)num_of_points_required)] +=
+          1;
+      ++count_inliers;
+    }
+  };
+  if (cloud_grid != nullptr) {
+    // Only the points in the buckets near the line can be inliers.
+    ScratchVector<int> buckets(arena);
+    cloud_grid->findBucketsNearSegment(start, end, max_deviation,
+                                       buckets.get());
+    for (int bucket : *buckets) {
+      for (const cv::Vec3f* point = cloud_grid->bucketBegin(bucket);
+           point != cloud_grid->bucketEnd(bucket); ++point) {
+        add_point_if_inlier(*point);
+      }
+    }
+  } else {
+    // For every point in the cloud: This is why it is called brute force
+    // approach.
+    for (int i = 0; i < cloud.rows; ++i) {
+      for (int j = 0; j < cloud.cols; ++j) {
+        add_point_if_inlier(cloud.at<cv::Vec3f>(i, j));
       }
     }
   }
@@ -2978,9 +4052,13 @@ bool LineDetector::checkIfValidLineBruteForce(const cv::Mat& cloud,
   return true;
 }
 
-bool LineDetector::checkIfValidLineDiscont(const cv::Mat& cloud,
-                                           const cv::Vec4f& line) {
+bool LineDetector::checkIfValidLineDiscont(
+    const cv::Mat& cloud, const cv::Vec4f& line,
+    const PreprocessedCloud* preprocessed_cloud) {
   CHECK_EQ(cloud.type(), CV_32FC3);
+  if (preprocessed_cloud != nullptr) {
+    CHECK(preprocessed_cloud->isComputedFor(cloud));
+  }
   cv::Point2i start, end, dir;
   start = {static_cast<int>(floor(line[0])), static_cast<int>(floor(line[1]))};
   end = {static_cast<int>(floor(line[2])), static_cast<int>(floor(line[3]))};
@@ -3008,6 +4086,8 @@ bool LineDetector::checkIfValidLineDiscont(const cv::Mat& cloud,
   cv::Vec3f last_mean(0, 0, 0);
   double max_mean_diff = 0.1;
   int count;
+  PointCounts counts;
+  const float kNaN = std::numeric_limits<float>::quiet_NaN();
   bool first_time = true;
   while (start != end) {
     current_mean = {0, 0, 0};
@@ -3025,13 +4105,25 @@ bool LineDetector::checkIfValidLineDiscont(const cv::Mat& cloud,
     // Count is used to count the number of pixels that were added to the mean
     // so that we can effectively build the mean from the sum.
     count = 0;
-    for (int i = x_from; i <= x_to; ++i) {
-      for (int j = y_from; j <= y_to; ++j) {
-        current_mean += cloud.at<cv::Vec3f>(j, i);
-        ++count;
+    if (preprocessed_cloud != nullptr) {
+      // As in the sum below, the points with no depth information add zero
+      // and any NaN point makes the mean NaN.
+      preprocessed_cloud->countInBox(x_from, y_from, x_to, y_to, &counts);
+      count = (x_to - x_from + 1) * (y_to - y_from + 1);
+      if (counts.num_nan > 0) {
+        current_mean = cv::Vec3f(kNaN, kNaN, kNaN);
+      } else {
+        current_mean = cv::Vec3f(counts.sum_valid / count);
       }
+    } else {
+      for (int i = x_from; i <= x_to; ++i) {
+        for (int j = y_from; j <= y_to; ++j) {
+          current_mean += cloud.at<cv::Vec3f>(j, i);
+          ++count;
+        }
+      }
+      current_mean = current_mean / count;
     }
-    current_mean = current_mean / count;
     if (first_time) {
       last_mean = current_mean;
       first_time = false;
@@ -3185,14 +4277,12 @@ void LineDetector::fitDiscontLineToInliers(const std::vector<cv::Vec3f>& points,
   c = static_cast<float>(hessian[2]);
   d = static_cast<float>(hessian[3]);
 
-  cv::Mat A(3, 3, CV_32F);
-  for (size_t i = 0; i < 3; ++i) {
-    A.at<float>(i, 0) = camera_P.at<float>(i, 0) -
-                        a * camera_P.at<float>(i, 2) / c;
-    A.at<float>(i, 1) = camera_P.at<float>(i, 1) -
-                        b * camera_P.at<float>(i, 2) / c;
-    A.at<float>(i, 2) = camera_P.at<float>(i, 3) -
-                        d * camera_P.at<float>(i, 2) / c;
+  // Fixed-size matrices, so that no memory is allocated.
+  cv::Matx33f A;
+  for (int i = 0; i < 3; ++i) {
+    A(i, 0) = camera_P.at<float>(i, 0) - a * camera_P.at<float>(i, 2) / c;
+    A(i, 1) = camera_P.at<float>(i, 1) - b * camera_P.at<float>(i, 2) / c;
+    A(i, 2) = camera_P.at<float>(i, 3) - d * camera_P.at<float>(i, 2) / c;
   }
   // Find projection in 2D of the reference line.
   project3DPointTo2D(start_ref, camera_P, &start_ref_2D);
@@ -3200,15 +4290,13 @@ void LineDetector::fitDiscontLineToInliers(const std::vector<cv::Vec3f>& points,
 
   // Find (X, Y, 1) on the inlier plane for both endpoints of the reference
   // line, as described above.
-  cv::Mat start_out_temp_mat, end_out_temp_mat;
   cv::Vec3f start_out_temp, end_out_temp;
   cv::Vec3f start_ref_2D_homo, end_ref_2D_homo;
   start_ref_2D_homo = {start_ref_2D[0], start_ref_2D[1], 1.0f};
   end_ref_2D_homo = {end_ref_2D[0], end_ref_2D[1], 1.0f};
-  start_out_temp_mat = A.inv() * cv::Mat(start_ref_2D_homo);
-  end_out_temp_mat = A.inv() * cv::Mat(end_ref_2D_homo);
-  start_out_temp = cv::Vec3f(start_out_temp_mat.reshape(3).at<cv::Vec3f>());
-  end_out_temp = cv::Vec3f(end_out_temp_mat.reshape(3).at<cv::Vec3f>());
+  const cv::Matx33f A_inv = A.inv();
+  start_out_temp = A_inv * start_ref_2D_homo;
+  end_out_temp = A_inv * end_ref_2D_homo;
   // Normalization by the last element, so as to ensure that one has (X, Y, 1).
   start_out_temp /= start_out_temp[2];
   end_out_temp /= end_out_temp[2];
@@ -3312,19 +4400,26 @@ void LineDetector::adjustLineOrientationGivenReferenceLine(
 bool LineDetector::checkIfValidLineUsingInliers(
     const std::vector<cv::Vec3f>& points, const cv::Vec3f& start,
     const cv::Vec3f& end) {
-  std::vector<double> positions_on_line;
   double length = cv::norm(start - end);
   cv::Vec3f direction = end - start;
   normalizeVector3D(&direction);
+  // The positions of the inliers on the line are not stored: the ratio is
+  // computed as in getRatioOfPointsAroundCenter, while iterating.
+  size_t num_inliers = 0;
+  size_t num_inliers_around_center = 0;
   for (size_t i = 0u; i < points.size(); ++i) {
     if (distPointToLine(start, end, points[i]) >
         params_->max_deviation_inlier_line_check) {
       continue;
     }
     double position_on_line = direction.dot(points[i] - start) / length;
-    positions_on_line.push_back(position_on_line);
+    ++num_inliers;
+    if (position_on_line < 0.75f && position_on_line > 0.25f) {
+      ++num_inliers_around_center;
+    }
   }
-  const double ratio_mid = getRatioOfPointsAroundCenter(positions_on_line);
+  const double ratio_mid =
+      num_inliers_around_center / static_cast<double>(num_inliers);
   // Most points are near the start and end points, reject this line.
   constexpr double kRatioThreshold = 0.25;
   if (ratio_mid < kRatioThreshold) {
@@ -3334,15 +4429,19 @@ bool LineDetector::checkIfValidLineUsingInliers(
   }
 }
 
-void LineDetector::displayStatistics() {
-  int total_num_lines = num_discontinuity_lines + num_planar_lines +
-                        num_intersection_lines + num_edge_lines;
+void LineDetector::displayStatistics(const DetectionContext& context) {
+  const LineDetectionStatistics& statistics = context.statistics;
+  int total_num_lines = statistics.num_discontinuity_lines +
+                        statistics.num_planar_lines +
+                        statistics.num_intersection_lines +
+                        statistics.num_edge_lines;
   LOG(INFO) << "Found " << total_num_lines << " total lines, of which:\n* "
-            << num_discontinuity_lines << " discontinuity lines\n* "
-            << num_planar_lines << " planar lines\n* "
-            << num_edge_lines << " edge lines\n* "
-            << num_intersection_lines << " intersection lines.";
-  LOG(INFO) << num_lines_discarded_for_convexity_concavity << " lines were "
+            << statistics.num_discontinuity_lines << " discontinuity lines\n* "
+            << statistics.num_planar_lines << " planar lines\n* "
+            << statistics.num_edge_lines << " edge lines\n* "
+            << statistics.num_intersection_lines << " intersection lines.";
+  LOG(INFO) << statistics.num_lines_discarded_for_convexity_concavity
+            << " lines were "
             << "discarded because it was not possible to determine convexity/"
             << "concavity";
   LOG(INFO) << "Among the edge/intersection lines that were assigned to their "
@@ -3350,36 +4449,38 @@ void LineDetector::displayStatistics() {
             << "occurrences for each configuration were found (format: "
             << "before_start [L][R]/[L][R] after end):"
             << "\n* [0][0]/[0][0]: "
-            << occurrences_config_prolonged_plane[0][0][0][0]
+            << statistics.occurrences_config_prolonged_plane[0][0][0][0]
             << "\n* [0][0]/[0][1], [0][0]/[1][0], [0][1]/[0][0], "
             << "[1][0]/[0][0]: "
-            << occurrences_config_prolonged_plane[1][0][0][0]
+            << statistics.occurrences_config_prolonged_plane[1][0][0][0]
             << "\n* [1][1]/[0][0], [0][0]/[1][1]: "
-            << occurrences_config_prolonged_plane[1][1][0][0]
+            << statistics.occurrences_config_prolonged_plane[1][1][0][0]
             << "\n* [1][0]/[1][0], [0][1]/[0][1]: "
-            << occurrences_config_prolonged_plane[1][0][1][0]
+            << statistics.occurrences_config_prolonged_plane[1][0][1][0]
             << "\n* [1][0]/[0][1], [0][1]/[1][0]: "
-            << occurrences_config_prolonged_plane[1][0][0][1]
+            << statistics.occurrences_config_prolonged_plane[1][0][0][1]
             << "\n* [1][1]/[1][0], [1][1]/[0][1], [1][0]/[1][1], "
             << "[0][1]/[1][1]: "
-            << occurrences_config_prolonged_plane[1][1][1][0]
+            << statistics.occurrences_config_prolonged_plane[1][1][1][0]
             << "\n* [1][1]/[1][1]: "
-            << occurrences_config_prolonged_plane[1][1][1][1];
-}
-
-void LineDetector::resetStatistics() {
-  num_discontinuity_lines = 0;
-  num_planar_lines = 0;
-  num_intersection_lines = 0;
-  num_edge_lines = 0;
-  num_lines_discarded_for_convexity_concavity = 0;
-  occurrences_config_prolonged_plane[0][0][0][0] = 0;
-  occurrences_config_prolonged_plane[1][0][0][0] = 0;
-  occurrences_config_prolonged_plane[1][1][0][0] = 0;
-  occurrences_config_prolonged_plane[1][0][1][0] = 0;
-  occurrences_config_prolonged_plane[1][0][0][1] = 0;
-  occurrences_config_prolonged_plane[1][1][1][0] = 0;
-  occurrences_config_prolonged_plane[1][1][1][1] = 0;
+            << statistics.occurrences_config_prolonged_plane[1][1][1][1];
+  LOG(INFO) << "Candidate lines rejected:\n* "
+            << statistics.num_lines_rejected_by_rating << " by the rating\n* "
+            << statistics.num_lines_rejected_without_planes
+            << " without planes\n* "
+            << statistics.num_lines_rejected_on_planes << " on the planes.";
+  LOG(INFO) << statistics.num_ransac_runs << " RANSAC runs, with "
+            << statistics.num_ransac_iterations << " iterations in total ("
+            << statistics.max_ransac_iterations << " at most in a run), "
+            << statistics.num_planes_tracked
+            << " planes taken from the previous frame.";
+  LOG(INFO) << "Time spent (s): rating " << statistics.time_rating
+            << ", inlier search " << statistics.time_inlier_search
+            << " (RANSAC " << statistics.time_ransac << "), line fit "
+            << statistics.time_line_fit << " (type assignment "
+            << statistics.time_type_assignment << ").";
+  LOG(INFO) << statistics.num_scratch_allocations
+            << " allocations of scratch buffers.";
 }
 
 }  // namespace line_detection
@@ -18,11 +18,31 @@
 //    ---
 //    line_detection/KeyLine[] keylines
 //    uint8 frame_index
+//
+// The requests are served by a ros::MultiThreadedSpinner with
+// ~num_spinner_threads threads (default: 1, 0 means one per core). All the
+// threads share the same line detector, each request uses its own
+// line_detection::DetectionContext.
+//
+// If ~publish_statistics is set (default: false), the timings and counters of
+// every frame served by "extract_lines" are published on ~statistics as
+// line_detection/DetectionStatistics.
+//
+// If ~track_lines is set (default: false), "extract_lines" reuses the planes
+// of the lines found in the previous request (see
+// line_detection::FrameOptions::track_lines). The requests do not carry the
+// pose of the camera, therefore it is assumed not to move much from one
+// request to the next: the planes that do not fit the new frame are fitted
+// again by RANSAC. The requests are then served one at a time.
 
 #include <line_detection/line_detection.h>
 
+#include <atomic>
+#include <mutex>
+
 #include <ros/ros.h>
 
+#include <line_detection/DetectionStatistics.h>
 #include <line_detection/ExtractLines.h>
 #include <line_detection/ExtractKeyLines.h>
 
@@ -33,33 +53,81 @@
 #include <image_geometry/pinhole_camera_model.h>
 #include <opencv2/highgui/highgui.hpp>
 
-// Construct the line detector.
-line_detection::LineDetector line_detector;
-// To store the lines.
-std::vector<cv::Vec4f> lines_2D;
-std::vector<cv::Vec4f> lines_2D_fused;
-std::vector<cv::Vec4f> lines_2D_tmp;
-std::vector<line_detection::LineWithPlanes> lines_3D_tmp;
-std::vector<line_detection::LineWithPlanes> lines_3D;
-std::vector<cv::line_descriptor::KeyLine> keylines;
-// To store the image.
-cv_bridge::CvImageConstPtr image_cv_ptr;
-cv::Mat cv_image_rgb;
-cv::Mat cv_image_gray;
-// To store the point cloud.
-cv_bridge::CvImageConstPtr cv_cloud_ptr;
-cv::Mat cv_cloud;
-// Projection matrix.
-cv::Mat camera_P;
+// Parameters of the line detector. The ones that set the parallelism of the
+// detection and projection are read from the private namespace at startup.
+line_detection::LineDetectionParams detector_params;
+// Construct the line detector. It is shared by all the service callbacks,
+// which can run concurrently.
+line_detection::LineDetector line_detector(&detector_params);
 // Stores the index of the current frame.
-int frame_index;
+std::atomic<int> frame_index(0);
+// Publisher of the statistics of the frames (only advertised if
+// ~publish_statistics is set).
+ros::Publisher statistics_publisher;
+// Context kept from one request to the next if ~track_lines is set.
+bool track_lines = false;
+std::mutex tracking_mutex;
+line_detection::DetectionContext tracking_context;
+
+void publishStatistics(const line_detection::FrameResult& frame,
+                       uint8_t index) {
+  const line_detection::FrameTimings& timings = frame.timings;
+  const line_detection::LineDetectionStatistics& statistics =
+      frame.statistics;
+  line_detection::DetectionStatistics msg;
+  msg.frame_index = index;
+  msg.time_detection = timings.detection;
+  msg.time_fusion = timings.fusion;
+  msg.time_projection = timings.projection;
+  msg.time_check = timings.check;
+  msg.time_total = timings.total;
+  msg.time_rating = statistics.time_rating;
+  msg.time_inlier_search = statistics.time_inlier_search;
+  msg.time_ransac = statistics.time_ransac;
+  msg.time_line_fit = statistics.time_line_fit;
+  msg.time_type_assignment = statistics.time_type_assignment;
+  msg.num_lines2D_detected = frame.num_lines2D_before_fusion;
+  msg.num_lines2D_fused = frame.lines2D_detected.size();
+  msg.num_lines3D_projected = frame.num_lines3D_before_check;
+  msg.num_lines3D_kept = frame.lines3D.size();
+  msg.num_discontinuity_lines = statistics.num_discontinuity_lines;
+  msg.num_planar_lines = statistics.num_planar_lines;
+  msg.num_edge_lines = statistics.num_edge_lines;
+  msg.num_intersection_lines = statistics.num_intersection_lines;
+  msg.num_lines_rejected_by_rating = statistics.num_lines_rejected_by_rating;
+  msg.num_lines_rejected_without_planes =
+      statistics.num_lines_rejected_without_planes;
+  msg.num_lines_rejected_on_planes = statistics.num_lines_rejected_on_planes;
+  msg.num_lines_discarded_for_convexity_concavity =
+      statistics.num_lines_discarded_for_convexity_concavity;
+  msg.num_lines_rejected_by_check =
+      frame.num_lines3D_before_check - frame.lines3D.size();
+  msg.num_ransac_runs = statistics.num_ransac_runs;
+  msg.num_ransac_iterations = statistics.num_ransac_iterations;
+  msg.max_ransac_iterations = statistics.max_ransac_iterations;
+  msg.num_planes_tracked = statistics.num_planes_tracked;
+  msg.num_scratch_allocations = statistics.num_scratch_allocations;
+  statistics_publisher.publish(msg);
+}
 
 bool detectLinesCallback(line_detection::ExtractLines::Request& req,
                          line_detection::ExtractLines::Response& res) {
+  // Per-request state of the line detector.
+  line_detection::DetectionContext context;
+  // To store the lines.
+  line_detection::FrameResult frame;
+  // To store the image.
+  cv_bridge::CvImageConstPtr image_cv_ptr;
+  cv::Mat cv_image_rgb;
+  // To store the point cloud.
+  cv_bridge::CvImageConstPtr cv_cloud_ptr;
+  cv::Mat cv_cloud;
+  // Projection matrix.
+  cv::Mat camera_P;
+
   // Convert to cv_ptr (which has a member ->image (cv::Mat)).
   image_cv_ptr = cv_bridge::toCvCopy(req.image, "rgb8");
   cv_image_rgb = image_cv_ptr->image;
-  cv::cvtColor(cv_image_rgb, cv_image_gray, CV_RGB2GRAY);
 
   // Obtain projection matrix.
   image_geometry::PinholeCameraModel camera_model;
@@ -72,24 +140,34 @@ bool detectLinesCallback(line_detection::ExtractLines::Request& req,
   cv_cloud = cv_cloud_ptr->image;
   CHECK(cv_cloud.type() == CV_32FC3);
 
-  // Detect 2D lines.
-  lines_2D.clear();
-  line_detector.detectLines(cv_image_gray, req.detector, &lines_2D);
-  line_detector.fuseLines2D(lines_2D, &lines_2D_fused);
-
-  // Project to 3D.
-  line_detector.project2Dto3DwithPlanes(cv_cloud, cv_image_rgb, camera_P,
-                                         lines_2D_fused, true, &lines_2D_tmp,
-                                         &lines_3D_tmp);
-  // Perform checks.
-  line_detector.runCheckOn3DLines(cv_cloud, camera_P, lines_2D_tmp,
-                                  lines_3D_tmp, &lines_2D, &lines_3D);
+  // Detect 2D lines, project them to 3D and perform checks. An invalid
+  // detector falls back to LSD.
+  line_detection::FrameOptions options;
+  const int index = frame_index++;
+  options.frame_index = index;
+  if (req.detector <= 3) {
+    options.detector = static_cast<line_detection::DetectorType>(req.detector);
+  }
+  if (track_lines) {
+    options.track_lines = true;
+    std::lock_guard<std::mutex> lock(tracking_mutex);
+    line_detector.processFrame(cv_image_rgb, cv_cloud, camera_P, options,
+                               &frame, &tracking_context);
+  } else {
+    line_detector.processFrame(cv_image_rgb, cv_cloud, camera_P, options,
+                               &frame, &context);
+  }
+  const std::vector<cv::Vec4f>& lines_2D = frame.lines2D;
+  const std::vector<line_detection::LineWithPlanes>& lines_3D = frame.lines3D;
 
   // Store lines to the response.
   res.lines.resize(lines_2D.size());
   res.start2D.resize(lines_2D.size());
   res.end2D.resize(lines_2D.size());
-  res.frame_index = frame_index++;
+  res.frame_index = index;
+  if (statistics_publisher) {
+    publishStatistics(frame, res.frame_index);
+  }
 
   for (size_t i = 0u; i < lines_2D.size(); ++i) {
     res.start2D[i].x = lines_2D[i][0];
@@ -134,14 +212,20 @@ bool detectLinesCallback(line_detection::ExtractLines::Request& req,
 
 bool detectKeyLinesCallback(line_detection::ExtractKeyLines::Request& req,
                             line_detection::ExtractKeyLines::Response& res) {
+  // Per-request state of the line detector.
+  line_detection::DetectionContext context;
+  std::vector<cv::line_descriptor::KeyLine> keylines;
+  cv_bridge::CvImageConstPtr image_cv_ptr;
+  cv::Mat cv_image_rgb;
+  cv::Mat cv_image_gray;
+
   // Convert to cv_ptr (which has a member ->image (cv::Mat)).
   image_cv_ptr = cv_bridge::toCvCopy(req.image, "rgb8");
   cv_image_rgb = image_cv_ptr->image;
   cv::cvtColor(cv_image_rgb, cv_image_gray, CV_RGB2GRAY);
 
   // Detect 2D lines.
-  keylines.clear();
-  line_detector.detectLines(cv_image_gray, &keylines);
+  line_detector.detectLines(cv_image_gray, &context, &keylines);
 
   // Store lines to the response.
   res.keylines.resize(keylines.size());
@@ -172,11 +256,40 @@ bool detectKeyLinesCallback(line_detection::ExtractKeyLines::Request& req,
 int main(int argc, char** argv) {
   ros::init(argc, argv, "line_detector");
   ros::NodeHandle node_handle;
+  ros::NodeHandle node_handle_private("~");
+  int num_spinner_threads;
+  node_handle_private.param("num_spinner_threads", num_spinner_threads, 1);
+  CHECK_GE(num_spinner_threads, 0);
+  bool publish_statistics;
+  node_handle_private.param("publish_statistics", publish_statistics, false);
+  node_handle_private.param("track_lines", track_lines, false);
+  // Parallelism within a frame. The defaults (one thread, one tile) keep the
+  // serial behaviour; 0 threads means one per hardware thread.
+  int num_threads_detection, num_threads_projection;
+  int detection_num_tiles_x, detection_num_tiles_y;
+  node_handle_private.param("num_threads_detection", num_threads_detection, 1);
+  node_handle_private.param("num_threads_projection", num_threads_projection,
+                            1);
+  node_handle_private.param("detection_num_tiles_x", detection_num_tiles_x, 1);
+  node_handle_private.param("detection_num_tiles_y", detection_num_tiles_y, 1);
+  CHECK_GE(num_threads_detection, 0);
+  CHECK_GE(num_threads_projection, 0);
+  CHECK_GE(detection_num_tiles_x, 1);
+  CHECK_GE(detection_num_tiles_y, 1);
+  detector_params.num_threads_detection = num_threads_detection;
+  detector_params.num_threads_projection = num_threads_projection;
+  detector_params.detection_num_tiles_x = detection_num_tiles_x;
+  detector_params.detection_num_tiles_y = detection_num_tiles_y;
+  if (publish_statistics) {
+    statistics_publisher =
+        node_handle_private.advertise<line_detection::DetectionStatistics>(
+            "statistics", 10);
+  }
 
   ros::ServiceServer server_lines =
       node_handle.advertiseService("extract_lines", &detectLinesCallback);
   ros::ServiceServer server_keylines =
       node_handle.advertiseService("extract_keylines", &detectKeyLinesCallback);
-  frame_index = 0;
-  ros::spin();
+  ros::MultiThreadedSpinner spinner(num_spinner_threads);
+  spinner.spin();
 }
@@ -0,0 +1,209 @@
+#include "line_detection/patch_sampler.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "line_detection/line_detection.h"
+
+namespace line_detection {
+
+void PatchSampler::setCloud(const cv::Mat& cloud) {
+  CHECK_EQ(cloud.type(), CV_32FC3);
+  cloud_ = cloud;
+  image_ = cv::Mat();
+  labels_ = cv::Mat();
+  preprocessed_cloud_ = nullptr;
+}
+
+void PatchSampler::setImage(const cv::Mat& image) {
+  if (!image.empty()) {
+    CHECK_EQ(image.type(), CV_8UC3);
+    CHECK(image.size() == cloud_.size());
+  }
+  image_ = image;
+}
+
+void PatchSampler::setLabels(const cv::Mat& labels) {
+  if (!labels.empty()) {
+    CHECK_EQ(labels.type(), CV_16UC1);
+    CHECK(labels.size() == cloud_.size());
+  }
+  labels_ = labels;
+}
+
+void PatchSampler::setPreprocessedCloud(
+    const PreprocessedCloud* preprocessed_cloud) {
+  if (preprocessed_cloud != nullptr) {
+    CHECK(preprocessed_cloud->isComputedFor(cloud_))
+        << "The preprocessed cloud does not match the cloud of the sampler.";
+  }
+  preprocessed_cloud_ = preprocessed_cloud;
+}
+
+void PatchSampler::setSubsampling(int stride, size_t max_points) {
+  CHECK_GE(stride, 1);
+  stride_ = stride;
+  max_points_ = max_points;
+}
+
+void PatchSampler::rasterize(const std::vector<cv::Point2f>& corners) {
+  corners_ = corners;
+  findRowSpansInRectangle(&corners_, &first_row_, &x_start_, &x_end_);
+}
+
+bool PatchSampler::countPoints(const std::vector<cv::Point2f>& corners,
+                               PointCounts* counts) {
+  CHECK_NOTNULL(counts);
+  if (preprocessed_cloud_ == nullptr) return false;
+  rasterize(corners);
+  preprocessed_cloud_->countInRows(first_row_, x_start_, x_end_, counts);
+  return true;
+}
+
+bool PatchSampler::sample(const std::vector<cv::Point2f>& corners,
+                          bool discard_if_no_depth, PatchSamples* samples) {
+  CHECK_NOTNULL(samples);
+  CHECK(!cloud_.empty()) << "setCloud must be called before sample.";
+  samples->points.clear();
+  samples->pixels.clear();
+  samples->labels.clear();
+  samples->colors.clear();
+  samples->num_points_in_rect = 0;
+
+  rasterize(corners);
+  if (discard_if_no_depth && preprocessed_cloud_ != nullptr) {
+    PointCounts counts;
+    preprocessed_cloud_->countInRows(first_row_, x_start_, x_end_, &counts);
+    if (counts.num_no_depth > 0) return false;
+  }
+
+  const bool use_image = !image_.empty();
+  const bool use_labels = !labels_.empty();
+  long long color_sum[3] = {0, 0, 0};
+  long long num_pixels = 0;
+  for (size_t i = 0; i < x_start_.size(); ++i) {
+    // As in assignColorToLines, the mean color is normalized by all the pixels
+    // in the rectangle, also by the ones outside of the image.
+    num_pixels += x_end_[i] - x_start_[i] + 1;
+    const int y = first_row_ + static_cast<int>(i);
+    if (y < 0 || y >= cloud_.rows) continue;
+    const bool row_sampled = y % stride_ == 0;
+    const int x_begin = std::max(x_start_[i], 0);
+    const int x_last = std::min(x_end_[i], cloud_.cols - 1);
+    const cv::Vec3f* cloud_row = cloud_.ptr<cv::Vec3f>(y);
+    const cv::Vec3b* image_row = use_image ? image_.ptr<cv::Vec3b>(y) : nullptr;
+    const unsigned short* labels_row =
+        use_labels ? labels_.ptr<unsigned short>(y) : nullptr;
+    const unsigned char* state_row = (preprocessed_cloud_ != nullptr)
+                                         ? preprocessed_cloud_->stateRow(y)
+                                         : nullptr;
+    for (int x = x_begin; x <= x_last; ++x) {
+      if (use_image) {
+        color_sum[0] += image_row[x][0];
+        color_sum[1] += image_row[x][1];
+        color_sum[2] += image_row[x][2];
+      }
+      const cv::Vec3f& point = cloud_row[x];
+      if (state_row != nullptr) {
+        // The points with no depth information were already checked.
+        if (state_row[x] == PreprocessedCloud::NAN_POINT) continue;
+      } else {
+        if (std::isnan(point[0])) continue;
+        if (discard_if_no_depth &&
+            checkEqualPoints(point, cv::Vec3f(0.0f, 0.0f, 0.0f))) {
+          return false;
+        }
+      }
+      ++samples->num_points_in_rect;
+      if (!row_sampled || x % stride_ != 0) continue;
+      samples->points.push_back(point);
+      samples->pixels.push_back(cv::Point2i(x, y));
+      if (use_labels) samples->labels.push_back(labels_row[x]);
+      if (use_image) samples->colors.push_back(image_row[x]);
+    }
+  }
+  samples->pixel_step = stride_;
+  const size_t num_samples = samples->points.size();
+  if (max_points_ > 0 && num_samples > max_points_) {
+    // Only the samples on every factor-th column (row) of the grid of the
+    // stride are kept, starting from the first one, if the rectangle is wider
+    // (taller) than high (wide), i.e. along the line of the rectangles of
+    // getRectanglesFromLine. The kept samples are then at most
+    // stride * factor pixels away from the ones on the next kept column
+    // (row), also on a tilted rectangle, whereas keeping every k-th sample
+    // would leave holes of any size along a thin rectangle.
+    float x_min = corners_[0].x, x_max = x_min;
+    float y_min = corners_[0].y, y_max = y_min;
+    for (const cv::Point2f& corner : corners_) {
+      x_min = std::min(x_min, corner.x);
+      x_max = std::max(x_max, corner.x);
+      y_min = std::min(y_min, corner.y);
+      y_max = std::max(y_max, corner.y);
+    }
+    const bool along_x = x_max - x_min >= y_max - y_min;
+    const auto key = [this, along_x](const cv::Point2i& pixel) {
+      return static_cast<size_t>(along_x ? pixel.x : pixel.y) / stride_;
+    };
+    size_t min_key = key(samples->pixels[0]), max_key = min_key;
+    for (const cv::Point2i& pixel : samples->pixels) {
+      min_key = std::min(min_key, key(pixel));
+      max_key = std::max(max_key, key(pixel));
+    }
+    const auto is_kept = [&key, min_key](const cv::Point2i& pixel,
+                                         size_t factor) {
+      return (key(pixel) - min_key) % factor == 0;
+    };
+    const auto count_kept = [samples, &is_kept](size_t factor) {
+      size_t num_kept = 0;
+      for (const cv::Point2i& pixel : samples->pixels) {
+        if (is_kept(pixel, factor)) ++num_kept;
+      }
+      return num_kept;
+    };
+    size_t factor = (num_samples + max_points_ - 1) / max_points_;
+    size_t num_kept = count_kept(factor);
+    while (num_kept > max_points_ && factor <= max_key - min_key) {
+      ++factor;
+      num_kept = count_kept(factor);
+    }
+    // The kept samples are moved to the front of the vectors, in order.
+    num_kept = 0;
+    for (size_t k = 0; k < num_samples; ++k) {
+      if (!is_kept(samples->pixels[k], factor)) continue;
+      samples->points[num_kept] = samples->points[k];
+      samples->pixels[num_kept] = samples->pixels[k];
+      if (use_labels) samples->labels[num_kept] = samples->labels[k];
+      if (use_image) samples->colors[num_kept] = samples->colors[k];
+      ++num_kept;
+    }
+    size_t step = factor;
+    if (num_kept > max_points_) {
+      // Only the samples of a single column (row) are left, more than
+      // max_points of them: the ones at evenly spaced indices are kept.
+      const size_t num_on_line = num_kept;
+      for (size_t k = 0; k < max_points_; ++k) {
+        const size_t index = k * num_on_line / max_points_;
+        samples->points[k] = samples->points[index];
+        samples->pixels[k] = samples->pixels[index];
+        if (use_labels) samples->labels[k] = samples->labels[index];
+        if (use_image) samples->colors[k] = samples->colors[index];
+      }
+      num_kept = max_points_;
+      step = (num_on_line + max_points_ - 1) / max_points_;
+    }
+    samples->points.resize(num_kept);
+    samples->pixels.resize(num_kept);
+    if (use_labels) samples->labels.resize(num_kept);
+    if (use_image) samples->colors.resize(num_kept);
+    samples->pixel_step = stride_ * static_cast<int>(step);
+  }
+  if (use_image) {
+    for (int k = 0; k < 3; ++k) {
+      samples->mean_color[k] =
+          static_cast<unsigned char>(color_sum[k] / num_pixels);
+    }
+  }
+  return true;
+}
+
+}  // namespace line_detection
@@ -0,0 +1,228 @@
+#include "line_detection/plane_error_kernels.h"
+
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LINE_DETECTION_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace line_detection {
+
+namespace {
+
+// Plain C++ versions. They also process the remainder of the SIMD versions.
+size_t maskInliersScalar(const float* x, const float* y, const float* z,
+                         size_t begin, size_t end, const float plane[4],
+                         float max_error, unsigned char* mask) {
+  size_t num_inliers = 0;
+  for (size_t i = begin; i < end; ++i) {
+    const float error = std::fabs(plane[0] * x[i] + plane[1] * y[i] +
+                                  plane[2] * z[i] + plane[3]);
+    const unsigned char is_inlier = (error <= max_error);
+    if (mask != nullptr) mask[i] = is_inlier;
+    num_inliers += is_inlier;
+  }
+  return num_inliers;
+}
+
+void residualsScalar(const float* x, const float* y, const float* z,
+                     size_t begin, size_t end, const float plane[4],
+                     float* residuals) {
+  for (size_t i = begin; i < end; ++i) {
+    residuals[i] = std::fabs(plane[0] * x[i] + plane[1] * y[i] +
+                             plane[2] * z[i] + plane[3]);
+  }
+}
+
+#ifdef LINE_DETECTION_X86_KERNELS
+// The SIMD versions multiply and add separately (no FMA), so that they round
+// exactly as the scalar version.
+__attribute__((target("sse2")))
+size_t maskInliersSSE2(const float* x, const float* y, const float* z,
+                       size_t num_points, const float plane[4],
+                       float max_error, unsigned char* mask) {
+  const __m128 a = _mm_set1_ps(plane[0]);
+  const __m128 b = _mm_set1_ps(plane[1]);
+  const __m128 c = _mm_set1_ps(plane[2]);
+  const __m128 d = _mm_set1_ps(plane[3]);
+  const __m128 threshold = _mm_set1_ps(max_error);
+  const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  size_t num_inliers = 0;
+  size_t i = 0;
+  for (; i + 4 <= num_points; i += 4) {
+    __m128 error = _mm_add_ps(
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(a, _mm_loadu_ps(x + i)),
+                              _mm_mul_ps(b, _mm_loadu_ps(y + i))),
+                   _mm_mul_ps(c, _mm_loadu_ps(z + i))),
+        d);
+    error = _mm_and_ps(error, abs_mask);
+    const int bits = _mm_movemask_ps(_mm_cmple_ps(error, threshold));
+    if (mask != nullptr) {
+      for (int k = 0; k < 4; ++k) mask[i + k] = (bits >> k) & 1;
+    }
+    num_inliers += __builtin_popcount(bits);
+  }
+  return num_inliers + maskInliersScalar(x, y, z, i, num_points, plane,
+                                         max_error, mask);
+}
+
+__attribute__((target("avx2")))
+size_t maskInliersAVX2(const float* x, const float* y, const float* z,
+                       size_t num_points, const float plane[4],
+                       float max_error, unsigned char* mask) {
+  const __m256 a = _mm256_set1_ps(plane[0]);
+  const __m256 b = _mm256_set1_ps(plane[1]);
+  const __m256 c = _mm256_set1_ps(plane[2]);
+  const __m256 d = _mm256_set1_ps(plane[3]);
+  const __m256 threshold = _mm256_set1_ps(max_error);
+  const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  size_t num_inliers = 0;
+  size_t i = 0;
+  for (; i + 8 <= num_points; i += 8) {
+    __m256 error = _mm256_add_ps(
+        _mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(a, _mm256_loadu_ps(x + i)),
+                          _mm256_mul_ps(b, _mm256_loadu_ps(y + i))),
+            _mm256_mul_ps(c, _mm256_loadu_ps(z + i))),
+        d);
+    error = _mm256_and_ps(error, abs_mask);
+    const int bits =
+        _mm256_movemask_ps(_mm256_cmp_ps(error, threshold, _CMP_LE_OQ));
+    if (mask != nullptr) {
+      for (int k = 0; k < 8; ++k) mask[i + k] = (bits >> k) & 1;
+    }
+    num_inliers += __builtin_popcount(bits);
+  }
+  return num_inliers + maskInliersScalar(x, y, z, i, num_points, plane,
+                                         max_error, mask);
+}
+
+__attribute__((target("sse2")))
+void residualsSSE2(const float* x, const float* y, const float* z,
+                   size_t num_points, const float plane[4], float* residuals) {
+  const __m128 a = _mm_set1_ps(plane[0]);
+  const __m128 b = _mm_set1_ps(plane[1]);
+  const __m128 c = _mm_set1_ps(plane[2]);
+  const __m128 d = _mm_set1_ps(plane[3]);
+  const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  size_t i = 0;
+  for (; i + 4 <= num_points; i += 4) {
+    const __m128 error = _mm_add_ps(
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(a, _mm_loadu_ps(x + i)),
+                              _mm_mul_ps(b, _mm_loadu_ps(y + i))),
+                   _mm_mul_ps(c, _mm_loadu_ps(z + i))),
+        d);
+    _mm_storeu_ps(residuals + i, _mm_and_ps(error, abs_mask));
+  }
+  residualsScalar(x, y, z, i, num_points, plane, residuals);
+}
+
+__attribute__((target("avx2")))
+void residualsAVX2(const float* x, const float* y, const float* z,
+                   size_t num_points, const float plane[4], float* residuals) {
+  const __m256 a = _mm256_set1_ps(plane[0]);
+  const __m256 b = _mm256_set1_ps(plane[1]);
+  const __m256 c = _mm256_set1_ps(plane[2]);
+  const __m256 d = _mm256_set1_ps(plane[3]);
+  const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  size_t i = 0;
+  for (; i + 8 <= num_points; i += 8) {
+    const __m256 error = _mm256_add_ps(
+        _mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(a, _mm256_loadu_ps(x + i)),
+                          _mm256_mul_ps(b, _mm256_loadu_ps(y + i))),
+            _mm256_mul_ps(c, _mm256_loadu_ps(z + i))),
+        d);
+    _mm256_storeu_ps(residuals + i, _mm256_and_ps(error, abs_mask));
+  }
+  residualsScalar(x, y, z, i, num_points, plane, residuals);
+}
+#endif  // LINE_DETECTION_X86_KERNELS
+
+SimdLevel detectSimdLevel() {
+#ifdef LINE_DETECTION_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+  if (__builtin_cpu_supports("sse2")) return SimdLevel::SSE2;
+#endif
+  return SimdLevel::SCALAR;
+}
+
+size_t maskInliers(const float* x, const float* y, const float* z,
+                   size_t num_points, const float plane[4], float max_error,
+                   unsigned char* mask, SimdLevel level) {
+#ifdef LINE_DETECTION_X86_KERNELS
+  switch (level) {
+    case SimdLevel::AVX2:
+      return maskInliersAVX2(x, y, z, num_points, plane, max_error, mask);
+    case SimdLevel::SSE2:
+      return maskInliersSSE2(x, y, z, num_points, plane, max_error, mask);
+    default:
+      break;
+  }
+#endif
+  return maskInliersScalar(x, y, z, 0, num_points, plane, max_error, mask);
+}
+
+}  // namespace
+
+SimdLevel getSupportedSimdLevel() {
+  // Detected only once, the first time a kernel is called.
+  static const SimdLevel level = detectSimdLevel();
+  return level;
+}
+
+size_t countInliersToPlane(const float* x, const float* y, const float* z,
+                           size_t num_points, const float plane[4],
+                           float max_error) {
+  return maskInliers(x, y, z, num_points, plane, max_error, nullptr,
+                     getSupportedSimdLevel());
+}
+
+size_t countInliersToPlane(const float* x, const float* y, const float* z,
+                           size_t num_points, const float plane[4],
+                           float max_error, SimdLevel level) {
+  return maskInliers(x, y, z, num_points, plane, max_error, nullptr, level);
+}
+
+size_t maskInliersToPlane(const float* x, const float* y, const float* z,
+                          size_t num_points, const float plane[4],
+                          float max_error, unsigned char* mask) {
+  return maskInliers(x, y, z, num_points, plane, max_error, mask,
+                     getSupportedSimdLevel());
+}
+
+size_t maskInliersToPlane(const float* x, const float* y, const float* z,
+                          size_t num_points, const float plane[4],
+                          float max_error, unsigned char* mask,
+                          SimdLevel level) {
+  return maskInliers(x, y, z, num_points, plane, max_error, mask, level);
+}
+
+void residualsToPlane(const float* x, const float* y, const float* z,
+                      size_t num_points, const float plane[4],
+                      float* residuals) {
+  residualsToPlane(x, y, z, num_points, plane, residuals,
+                   getSupportedSimdLevel());
+}
+
+void residualsToPlane(const float* x, const float* y, const float* z,
+                      size_t num_points, const float plane[4],
+                      float* residuals, SimdLevel level) {
+#ifdef LINE_DETECTION_X86_KERNELS
+  switch (level) {
+    case SimdLevel::AVX2:
+      residualsAVX2(x, y, z, num_points, plane, residuals);
+      return;
+    case SimdLevel::SSE2:
+      residualsSSE2(x, y, z, num_points, plane, residuals);
+      return;
+    default:
+      break;
+  }
+#endif
+  residualsScalar(x, y, z, 0, num_points, plane, residuals);
+}
+
+}  // namespace line_detection
@@ -0,0 +1,123 @@
+#include "line_detection/preprocessed_cloud.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "line_detection/line_detection.h"
+
+namespace line_detection {
+
+void PreprocessedCloud::compute(const cv::Mat& cloud) {
+  CHECK_EQ(cloud.type(), CV_32FC3);
+  cloud_ = cloud;
+  const int rows = cloud.rows;
+  const int cols = cloud.cols;
+  state_.create(rows, cols, CV_8UC1);
+  valid_count_.create(rows + 1, cols + 1, CV_32SC1);
+  no_depth_count_.create(rows + 1, cols + 1, CV_32SC1);
+  valid_sum_.create(rows + 1, cols + 1, CV_64FC3);
+  valid_count_.row(0).setTo(0);
+  no_depth_count_.row(0).setTo(0);
+  valid_sum_.row(0).setTo(cv::Scalar::all(0.0));
+  // checkEqualPoints is only called for the points near the origin, since it
+  // is false for all the others.
+  constexpr float kMaxNoDepthCoordinate = 1e-4;
+
+  for (int y = 0; y < rows; ++y) {
+    const cv::Vec3f* cloud_row = cloud.ptr<cv::Vec3f>(y);
+    unsigned char* state_row = state_.ptr(y);
+    const int* valid_count_above = valid_count_.ptr<int>(y);
+    const int* no_depth_count_above = no_depth_count_.ptr<int>(y);
+    const cv::Vec3d* valid_sum_above = valid_sum_.ptr<cv::Vec3d>(y);
+    int* valid_count_row = valid_count_.ptr<int>(y + 1);
+    int* no_depth_count_row = no_depth_count_.ptr<int>(y + 1);
+    cv::Vec3d* valid_sum_row = valid_sum_.ptr<cv::Vec3d>(y + 1);
+    valid_count_row[0] = 0;
+    no_depth_count_row[0] = 0;
+    valid_sum_row[0] = cv::Vec3d(0.0, 0.0, 0.0);
+    // Sums over the current row, up to the current point.
+    int valid_count = 0;
+    int no_depth_count = 0;
+    cv::Vec3d valid_sum(0.0, 0.0, 0.0);
+    for (int x = 0; x < cols; ++x) {
+      const cv::Vec3f& point = cloud_row[x];
+      if (std::isnan(point[0])) {
+        state_row[x] = NAN_POINT;
+      } else if (std::fabs(point[0]) < kMaxNoDepthCoordinate &&
+                 std::fabs(point[1]) < kMaxNoDepthCoordinate &&
+                 std::fabs(point[2]) < kMaxNoDepthCoordinate &&
+                 checkEqualPoints(point, cv::Vec3f(0.0f, 0.0f, 0.0f))) {
+        state_row[x] = NO_DEPTH_POINT;
+        ++no_depth_count;
+      } else {
+        state_row[x] = VALID_POINT;
+        ++valid_count;
+        valid_sum += cv::Vec3d(point[0], point[1], point[2]);
+      }
+      valid_count_row[x + 1] = valid_count_above[x + 1] + valid_count;
+      no_depth_count_row[x + 1] = no_depth_count_above[x + 1] + no_depth_count;
+      valid_sum_row[x + 1] = valid_sum_above[x + 1] + valid_sum;
+    }
+  }
+}
+
+void PreprocessedCloud::reset() { cloud_ = cv::Mat(); }
+
+bool PreprocessedCloud::isComputedFor(const cv::Mat& cloud) const {
+  return !cloud_.empty() && cloud_.data == cloud.data &&
+         cloud_.size() == cloud.size() && cloud_.step == cloud.step;
+}
+
+void PreprocessedCloud::addBox(int x_min, int y_min, int x_max, int y_max,
+                               PointCounts* counts) const {
+  const size_t num_valid = valid_count_.at<int>(y_max + 1, x_max + 1) -
+                           valid_count_.at<int>(y_min, x_max + 1) -
+                           valid_count_.at<int>(y_max + 1, x_min) +
+                           valid_count_.at<int>(y_min, x_min);
+  const size_t num_no_depth = no_depth_count_.at<int>(y_max + 1, x_max + 1) -
+                              no_depth_count_.at<int>(y_min, x_max + 1) -
+                              no_depth_count_.at<int>(y_max + 1, x_min) +
+                              no_depth_count_.at<int>(y_min, x_min);
+  const size_t num_points = static_cast<size_t>(x_max - x_min + 1) *
+                            static_cast<size_t>(y_max - y_min + 1);
+  counts->num_valid += num_valid;
+  counts->num_no_depth += num_no_depth;
+  counts->num_nan += num_points - num_valid - num_no_depth;
+  counts->sum_valid += valid_sum_.at<cv::Vec3d>(y_max + 1, x_max + 1) -
+                       valid_sum_.at<cv::Vec3d>(y_min, x_max + 1) -
+                       valid_sum_.at<cv::Vec3d>(y_max + 1, x_min) +
+                       valid_sum_.at<cv::Vec3d>(y_min, x_min);
+}
+
+void PreprocessedCloud::countInBox(int x_min, int y_min, int x_max, int y_max,
+                                   PointCounts* counts) const {
+  CHECK_NOTNULL(counts);
+  CHECK(!cloud_.empty()) << "compute must be called first.";
+  *counts = PointCounts();
+  x_min = std::max(x_min, 0);
+  y_min = std::max(y_min, 0);
+  x_max = std::min(x_max, cols() - 1);
+  y_max = std::min(y_max, rows() - 1);
+  if (x_min > x_max || y_min > y_max) return;
+  addBox(x_min, y_min, x_max, y_max, counts);
+}
+
+void PreprocessedCloud::countInRows(int first_row,
+                                    const std::vector<int>& x_start,
+                                    const std::vector<int>& x_end,
+                                    PointCounts* counts) const {
+  CHECK_NOTNULL(counts);
+  CHECK(!cloud_.empty()) << "compute must be called first.";
+  CHECK_EQ(x_start.size(), x_end.size());
+  *counts = PointCounts();
+  for (size_t i = 0; i < x_start.size(); ++i) {
+    const int y = first_row + static_cast<int>(i);
+    if (y < 0 || y >= rows()) continue;
+    const int x_min = std::max(x_start[i], 0);
+    const int x_max = std::min(x_end[i], cols() - 1);
+    if (x_min > x_max) continue;
+    addBox(x_min, y, x_max, y, counts);
+  }
+}
+
+}  // namespace line_detection
@@ -1,3 +1,7 @@
+#include <algorithm>
+#include <list>
+#include <random>
+
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 #include <Eigen/Core>
@@ -82,6 +86,74 @@ TEST_F(LineDetectionTest, testFASTLineDetection) {
       << "HOUGH detection: Expected 165 lines to be found. Found " << n_lines;
 }*/
 
+TEST_F(LineDetectionTest, testTiledLineDetection) {
+  // Rectangles crossing the seams between the tiles.
+  cv::Mat image(240, 320, CV_8UC1, cv::Scalar(0));
+  cv::rectangle(image, cv::Point(40, 30), cv::Point(280, 200), cv::Scalar(255),
+                CV_FILLED);
+  cv::rectangle(image, cv::Point(100, 80), cv::Point(220, 150), cv::Scalar(0),
+                CV_FILLED);
+  LineDetectionParams params_tiled;
+  params_tiled.detection_num_tiles_x = 2;
+  params_tiled.detection_num_tiles_y = 2;
+  params_tiled.num_threads_detection = 1;
+  LineDetectionParams params_tiled_parallel = params_tiled;
+  params_tiled_parallel.num_threads_detection = 4;
+  LineDetectionParams params_reduced;
+  params_reduced.detection_pyramid_level = 1;
+  LineDetector line_detector_tiled(&params_tiled);
+  LineDetector line_detector_tiled_parallel(&params_tiled_parallel);
+  LineDetector line_detector_reduced(&params_reduced);
+  std::vector<cv::Vec4f> lines, lines_tiled, lines_tiled_parallel,
+      lines_reduced;
+  line_detector_.detectLines(image, DetectorType::LSD, &lines);
+  line_detector_tiled.detectLines(image, DetectorType::LSD, &lines_tiled);
+  line_detector_tiled_parallel.detectLines(image, DetectorType::LSD,
+                                           &lines_tiled_parallel);
+  line_detector_reduced.detectLines(image, DetectorType::LSD, &lines_reduced);
+
+  // The output must not depend on the number of threads.
+  ASSERT_EQ(lines_tiled.size(), lines_tiled_parallel.size());
+  for (size_t i = 0; i < lines_tiled.size(); ++i) {
+    for (size_t j = 0; j < 4; ++j) {
+      EXPECT_EQ(lines_tiled[i][j], lines_tiled_parallel[i][j]);
+    }
+  }
+  // Every edge of the rectangles must be found as a single line, also when
+  // it crosses a seam or when the image is reduced.
+  auto is_found = [](const cv::Vec4f& line, const std::vector<cv::Vec4f>& in,
+                     double max_distance) {
+    for (const cv::Vec4f& other : in) {
+      const double dist_direct =
+          std::max(cv::norm(cv::Vec2f(line[0] - other[0], line[1] - other[1])),
+                   cv::norm(cv::Vec2f(line[2] - other[2], line[3] - other[3])));
+      const double dist_inverse =
+          std::max(cv::norm(cv::Vec2f(line[0] - other[2], line[1] - other[3])),
+                   cv::norm(cv::Vec2f(line[2] - other[0], line[3] - other[1])));
+      if (std::min(dist_direct, dist_inverse) < max_distance) return true;
+    }
+    return false;
+  };
+  size_t num_long_lines = 0;
+  for (const cv::Vec4f& line : lines) {
+    if (cv::norm(cv::Vec2f(line[2] - line[0], line[3] - line[1])) < 50) {
+      continue;
+    }
+    ++num_long_lines;
+    EXPECT_TRUE(is_found(line, lines_tiled, 3.0));
+    EXPECT_TRUE(is_found(line, lines_reduced, 4.0));
+  }
+  EXPECT_GE(num_long_lines, 4);
+  for (const cv::Vec4f& line : lines_reduced) {
+    for (size_t i = 0; i < 4; i += 2) {
+      EXPECT_GE(line[i], 0);
+      EXPECT_LE(line[i], image.cols - 1);
+      EXPECT_GE(line[i + 1], 0);
+      EXPECT_LE(line[i + 1], image.rows - 1);
+    }
+  }
+}
+
 TEST_F(LineDetectionTest, testAreLinesEqual2D) {
   EXPECT_TRUE(line_detection::areLinesEqual2D(cv::Vec4f(0, 0, 10, 10),
                                               cv::Vec4f(0, 0, 10, 10)));
@@ -154,6 +226,54 @@ TEST_F(LineDetectionTest, testHessianNormalFormOfPlane) {
   EXPECT_FLOAT_EQ(hessian_normal_form[3], -1);
 }
 
+TEST_F(LineDetectionTest, testFitPlaneToMoments) {
+  // Noisy points on a tilted plane, far from the origin.
+  std::default_random_engine generator(1);
+  std::normal_distribution<float> noise(0.0, 0.002);
+  std::uniform_real_distribution<float> coordinate(-1.0, 1.0);
+  const cv::Vec3f normal_expected = cv::normalize(cv::Vec3f(1.0, -2.0, 0.5));
+  const cv::Vec3f u = cv::normalize(normal_expected.cross(cv::Vec3f(0, 0, 1)));
+  const cv::Vec3f v = normal_expected.cross(u);
+  std::vector<cv::Vec3f> points;
+  PointMoments moments;
+  cv::Mat A(3, 200, CV_64FC1);
+  for (int i = 0; i < 200; ++i) {
+    const cv::Vec3f point = cv::Vec3f(10.0, 5.0, 3.0) +
+                            coordinate(generator) * u +
+                            coordinate(generator) * v +
+                            noise(generator) * normal_expected;
+    points.push_back(point);
+    moments.add(point);
+  }
+  // The normal must be the one found by SVD (up to the sign).
+  const cv::Vec3f mean = computeMean(points);
+  for (int i = 0; i < 200; ++i) {
+    for (int j = 0; j < 3; ++j) A.at<double>(j, i) = points[i][j] - mean[j];
+  }
+  cv::Mat U, W, Vt;
+  cv::SVD::compute(A, W, U, Vt);
+  cv::Vec4f hessian_svd(U.at<double>(0, 2), U.at<double>(1, 2),
+                        U.at<double>(2, 2), 0.0);
+  hessian_svd[3] = computeDfromPlaneNormal(
+      cv::Vec3f(hessian_svd[0], hessian_svd[1], hessian_svd[2]), mean);
+  cv::Vec4f hessian;
+  fitPlaneToMoments(moments, &hessian);
+  if (hessian.dot(hessian_svd) < 0) hessian = -hessian;
+  for (int j = 0; j < 4; ++j) {
+    EXPECT_NEAR(hessian[j], hessian_svd[j], 1e-4);
+  }
+  EXPECT_NEAR(fabs(normal_expected.dot(
+                  cv::Vec3f(hessian[0], hessian[1], hessian[2]))),
+              1.0, 1e-3);
+  // Points on a line: any plane containing the line is a solution.
+  PointMoments line_moments;
+  for (int i = 0; i < 10; ++i) line_moments.add(cv::Vec3f(i, 2 * i, 3 * i));
+  fitPlaneToMoments(line_moments, &hessian);
+  EXPECT_NEAR(cv::norm(cv::Vec3f(hessian[0], hessian[1], hessian[2])), 1.0,
+              1e-6);
+  EXPECT_NEAR(hessian[0] + 2 * hessian[1] + 3 * hessian[2], 0.0, 1e-6);
+}
+
 TEST_F(LineDetectionTest, testPlaneRANSAC) {
   std::vector<cv::Vec3f> points;
   cv::Vec4f hessian_normal_form;
@@ -186,6 +306,238 @@ TEST_F(LineDetectionTest, testPlaneRANSAC) {
   EXPECT_FLOAT_EQ(hessian_normal_form[1], 0);
   EXPECT_FLOAT_EQ(fabs(hessian_normal_form[2]), 1);
   EXPECT_FLOAT_EQ(hessian_normal_form[3], 0);
+  // The parameters of the pixel grid are only used (and checked) with
+  // ConnectivityCheck::PIXEL_GRID.
+  LineDetectionParams params;
+  params.connectivity_check_ransac = ConnectivityCheck::DISTANCE_FROM_MEAN;
+  params.connectivity_pixel_radius = 0;
+  LineDetector line_detector(&params);
+  EXPECT_TRUE(line_detector.planeRANSAC(points, &hessian_normal_form));
+  EXPECT_FLOAT_EQ(fabs(hessian_normal_form[2]), 1);
+}
+
+TEST_F(LineDetectionTest, testFindInliersToPlane) {
+  std::vector<cv::Vec3f> points;
+  for (int i = 0; i < 50; ++i) {
+    points.push_back(cv::Vec3f(0.01 * i, 0.02 * i, 0.001 * (i % 10)));
+  }
+  cv::Vec4f hessian(0, 0, 1, -0.004);
+  const double max_error = 0.0025;
+  std::vector<float> x, y, z;
+  for (auto& point : points) {
+    x.push_back(point[0]);
+    y.push_back(point[1]);
+    z.push_back(point[2]);
+  }
+  std::vector<unsigned char> mask(points.size());
+  size_t num_inliers = findInliersToPlane(x.data(), y.data(), z.data(),
+                                          points.size(), hessian, max_error,
+                                          mask.data());
+  // The result must be the same as the one of errorPointToPlane.
+  size_t num_inliers_expected = 0;
+  for (size_t i = 0; i < points.size(); ++i) {
+    bool is_inlier = errorPointToPlane(hessian, points[i]) < max_error;
+    EXPECT_EQ(mask[i], is_inlier);
+    num_inliers_expected += is_inlier;
+  }
+  EXPECT_EQ(num_inliers, num_inliers_expected);
+  EXPECT_EQ(num_inliers, 25);
+}
+
+TEST_F(LineDetectionTest, testPlaneErrorKernels) {
+  // Use a number of points that is not a multiple of the SIMD width, so that
+  // the remainder is also tested.
+  const size_t num_points = 103;
+  std::vector<float> x, y, z;
+  std::vector<cv::Vec3f> points;
+  for (size_t i = 0; i < num_points; ++i) {
+    points.push_back(cv::Vec3f(0.1 * (i % 7), -0.05 * (i % 11), 0.02 * i));
+    x.push_back(points.back()[0]);
+    y.push_back(points.back()[1]);
+    z.push_back(points.back()[2]);
+  }
+  cv::Vec4f hessian(0.267f, -0.534f, 0.801f, -0.5f);
+  const float plane[4] = {hessian[0], hessian[1], hessian[2], hessian[3]};
+  const float max_error = 0.3;
+  std::vector<float> residuals_scalar(num_points);
+  std::vector<unsigned char> mask_scalar(num_points);
+  residualsToPlane(x.data(), y.data(), z.data(), num_points, plane,
+                   residuals_scalar.data(), SimdLevel::SCALAR);
+  size_t num_inliers_scalar =
+      maskInliersToPlane(x.data(), y.data(), z.data(), num_points, plane,
+                         max_error, mask_scalar.data(), SimdLevel::SCALAR);
+  size_t num_inliers_expected = 0;
+  for (size_t i = 0; i < num_points; ++i) {
+    EXPECT_EQ(residuals_scalar[i], errorPointToPlane(hessian, points[i]));
+    num_inliers_expected += (residuals_scalar[i] <= max_error);
+  }
+  EXPECT_EQ(num_inliers_scalar, num_inliers_expected);
+  // All the instruction sets supported by the CPU must give the same results
+  // as the scalar version.
+  for (unsigned int level = 0;
+       level <= static_cast<unsigned int>(getSupportedSimdLevel()); ++level) {
+    const SimdLevel simd_level = static_cast<SimdLevel>(level);
+    std::vector<float> residuals(num_points);
+    std::vector<unsigned char> mask(num_points);
+    residualsToPlane(x.data(), y.data(), z.data(), num_points, plane,
+                     residuals.data(), simd_level);
+    EXPECT_EQ(residuals, residuals_scalar);
+    EXPECT_EQ(maskInliersToPlane(x.data(), y.data(), z.data(), num_points,
+                                 plane, max_error, mask.data(), simd_level),
+              num_inliers_scalar);
+    EXPECT_EQ(mask, mask_scalar);
+    EXPECT_EQ(countInliersToPlane(x.data(), y.data(), z.data(), num_points,
+                                  plane, max_error, simd_level),
+              num_inliers_scalar);
+  }
+}
+
+TEST_F(LineDetectionTest, testPlaneRANSACAdaptiveIterations) {
+  std::vector<cv::Vec3f> points;
+  // Points on the plane z = 1.
+  for (int i = 0; i < 10; ++i) {
+    for (int j = 0; j < 10; ++j) {
+      points.push_back(cv::Vec3f(0.01 * i, 0.01 * j, 1));
+    }
+  }
+  // And outliers:
+  for (int i = 0; i < 10; ++i) {
+    points.push_back(cv::Vec3f(0.01 * i, 0.05, 1.1 + 0.01 * i));
+  }
+  LineDetectionParams params;
+  params.adaptive_iterations_ransac = true;
+  params.inlier_max_ransac = 1.0;
+  LineDetector line_detector(&params);
+  DetectionContext context;
+  std::vector<cv::Vec3f> inliers;
+  line_detector.planeRANSAC(points, &inliers, &context);
+  EXPECT_EQ(inliers.size(), 100);
+  // With about 90% of inliers, a few iterations reach the confidence, while
+  // without the adaptive number of iterations all of them are run (the
+  // early stop at inlier_max_ransac is never reached).
+  EXPECT_EQ(context.statistics.num_ransac_runs, 1);
+  EXPECT_LT(context.statistics.max_ransac_iterations,
+            static_cast<int>(params.num_iter_ransac));
+  params.adaptive_iterations_ransac = false;
+  DetectionContext context_fixed;
+  line_detector.planeRANSAC(points, &inliers, &context_fixed);
+  EXPECT_EQ(inliers.size(), 100);
+  EXPECT_EQ(context_fixed.statistics.max_ransac_iterations,
+            static_cast<int>(params.num_iter_ransac));
+  EXPECT_LT(context.statistics.num_ransac_iterations,
+            context_fixed.statistics.num_ransac_iterations);
+  params.adaptive_iterations_ransac = true;
+  cv::Vec4f hessian_normal_form;
+  EXPECT_TRUE(line_detector.planeRANSAC(points, &hessian_normal_form));
+  EXPECT_NEAR(hessian_normal_form[0], 0, 1e-5);
+  EXPECT_NEAR(hessian_normal_form[1], 0, 1e-5);
+  EXPECT_NEAR(fabs(hessian_normal_form[2]), 1, 1e-5);
+  EXPECT_NEAR(fabs(hessian_normal_form[3]), 1, 1e-5);
+}
+
+TEST_F(LineDetectionTest, testPhilox4x32) {
+  // Known answers of the reference implementation (Random123).
+  const Philox4x32::Counter zeros =
+      Philox4x32::generate({0, 0, 0, 0}, {0, 0});
+  EXPECT_EQ(zeros, Philox4x32::Counter({0x6627e8d5, 0xe169c58d, 0xbc57ac4c,
+                                        0x9b00dbd8}));
+  const Philox4x32::Counter pi = Philox4x32::generate(
+      {0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344},
+      {0xa4093822, 0x299f31d0});
+  EXPECT_EQ(pi, Philox4x32::Counter({0xd16cfe09, 0x94fdcceb, 0x5001e420,
+                                     0x24126ea1}));
+  // The three indices are distinct and every ordered triple is drawn.
+  RansacKey key;
+  std::vector<int> occurrences(5 * 5 * 5, 0);
+  for (uint32_t iteration = 0; iteration < 6000; ++iteration) {
+    size_t indices[3];
+    sampleThreeUniqueIndices(key.generate(iteration), 5, indices);
+    ASSERT_LT(indices[0], 5u);
+    ASSERT_LT(indices[1], 5u);
+    ASSERT_LT(indices[2], 5u);
+    ASSERT_NE(indices[0], indices[1]);
+    ASSERT_NE(indices[0], indices[2]);
+    ASSERT_NE(indices[1], indices[2]);
+    ++occurrences[(indices[0] * 5 + indices[1]) * 5 + indices[2]];
+  }
+  EXPECT_EQ(std::count(occurrences.begin(), occurrences.end(), 0),
+            5 * 5 * 5 - 5 * 4 * 3);
+}
+
+TEST_F(LineDetectionTest, testPlaneRANSACWithRansacKey) {
+  std::vector<cv::Vec3f> points;
+  std::default_random_engine generator(3);
+  std::uniform_real_distribution<float> coordinate(0.0f, 1.0f);
+  for (size_t i = 0; i < 200; ++i) {
+    const float x = 0.3f * coordinate(generator);
+    const float y = 0.3f * coordinate(generator);
+    // Half of the points are on the plane z = 1, the others are outliers.
+    const float z = i % 2 == 0 ? 1.0f : 1.0f + coordinate(generator);
+    points.push_back(cv::Vec3f(x, y, z));
+  }
+  DetectionContext context_1, context_2;
+  context_1.ransac_key.line = 7;
+  context_1.ransac_key.side = 1;
+  context_2.ransac_key = context_1.ransac_key;
+  std::vector<cv::Vec3f> inliers_1, inliers_2, inliers_other;
+  line_detector_.planeRANSAC(points, &inliers_1, &context_1);
+  // The result does not depend on the calls made before with the context.
+  line_detector_.planeRANSAC(points, &inliers_other, &context_2);
+  context_2.ransac_key.line = 8;
+  line_detector_.planeRANSAC(points, &inliers_other, &context_2);
+  context_2.ransac_key.line = 7;
+  line_detector_.planeRANSAC(points, &inliers_2, &context_2);
+  EXPECT_EQ(inliers_1, inliers_2);
+  EXPECT_GE(inliers_1.size(), 100u);
+}
+
+TEST_F(LineDetectionTest, testClusterPixelGrid) {
+  // Two patches of 10x10 pixels on the plane z = 1, 10 pixels apart.
+  std::vector<cv::Vec3f> points;
+  std::vector<cv::Point2i> pixels;
+  for (int y = 0; y < 10; ++y) {
+    for (int x = 0; x < 30; ++x) {
+      if (x >= 10 && x < 20) continue;
+      pixels.push_back(cv::Point2i(x, y));
+      points.push_back(cv::Vec3f(0.01 * x, 0.01 * y, 1));
+    }
+  }
+  FrameArena arena;
+  ClusterPixelGrid cluster_pixel_grid(0.05, 2, &arena);
+  std::vector<unsigned char> mask(points.size(), 1);
+  EXPECT_FALSE(
+      cluster_pixel_grid.singleConnectedComponent(points, pixels, mask.data()));
+  // Only the inliers of the left patch.
+  for (size_t i = 0; i < points.size(); ++i) mask[i] = pixels[i].x < 10;
+  EXPECT_TRUE(
+      cluster_pixel_grid.singleConnectedComponent(points, pixels, mask.data()));
+  // The points of a patch are connected in the image but not in 3D.
+  for (size_t i = 0; i < points.size(); ++i) {
+    if (pixels[i].x >= 5 && pixels[i].x < 10) points[i][2] = 2;
+  }
+  EXPECT_FALSE(
+      cluster_pixel_grid.singleConnectedComponent(points, pixels, mask.data()));
+  EXPECT_FALSE(cluster_pixel_grid.singleConnectedComponent(
+      std::vector<cv::Vec3f>(), std::vector<cv::Point2i>(), mask.data()));
+
+  // On the left patch, with every third row moved away from the plane,
+  // planeRANSAC finds the same inliers with both checks.
+  std::vector<cv::Vec3f> patch_points;
+  std::vector<cv::Point2i> patch_pixels;
+  for (size_t i = 0; i < points.size(); ++i) {
+    if (pixels[i].x >= 10) continue;
+    patch_pixels.push_back(pixels[i]);
+    patch_points.push_back(cv::Vec3f(points[i][0], points[i][1],
+                                      pixels[i].y % 3 == 0 ? 1.5 : 1));
+  }
+  LineDetectionParams params;
+  LineDetector line_detector(&params);
+  std::vector<cv::Vec3f> inliers_mean, inliers_grid;
+  line_detector.planeRANSAC(patch_points, patch_pixels, 1, &inliers_mean);
+  params.connectivity_check_ransac = ConnectivityCheck::PIXEL_GRID;
+  line_detector.planeRANSAC(patch_points, patch_pixels, 1, &inliers_grid);
+  EXPECT_EQ(inliers_mean.size(), 60u);
+  EXPECT_EQ(inliers_grid, inliers_mean);
 }
 
 TEST_F(LineDetectionTest, testFindXCoordOfPixelsOnVector) {
@@ -233,6 +585,282 @@ TEST_F(LineDetectionTest, testFindPointsInRectangle) {
   EXPECT_EQ(points.size(), 36);
 }
 
+TEST_F(LineDetectionTest, testPatchSampler) {
+  const float kNaN = std::numeric_limits<float>::quiet_NaN();
+  cv::Mat cloud(10, 10, CV_32FC3);
+  cv::Mat image(10, 10, CV_8UC3);
+  cv::Mat labels(10, 10, CV_16UC1);
+  for (int y = 0; y < cloud.rows; ++y) {
+    for (int x = 0; x < cloud.cols; ++x) {
+      cloud.at<cv::Vec3f>(y, x) = cv::Vec3f(x, y, 1);
+      image.at<cv::Vec3b>(y, x) = cv::Vec3b(10 * x, 10 * y, 7);
+      labels.at<unsigned short>(y, x) = x + 10 * y;
+    }
+  }
+  cloud.at<cv::Vec3f>(4, 5) = cv::Vec3f(kNaN, kNaN, kNaN);
+  // Rotated rectangle that is partially outside of the image.
+  std::vector<cv::Point2f> corners;
+  corners.push_back(cv::Point2f(-2.3, 3.1));
+  corners.push_back(cv::Point2f(3.2, -2.4));
+  corners.push_back(cv::Point2f(8.7, 3.1));
+  corners.push_back(cv::Point2f(3.2, 8.6));
+  std::vector<cv::Point2i> pixels;
+  findPointsInRectangle(corners, &pixels);
+
+  PatchSampler sampler;
+  PatchSamples samples;
+  sampler.setCloud(cloud);
+  sampler.setImage(image);
+  sampler.setLabels(labels);
+  EXPECT_TRUE(sampler.sample(corners, true, &samples));
+  // The samples must be the valid pixels returned by findPointsInRectangle, in
+  // the same order.
+  size_t k = 0;
+  for (auto& pixel : pixels) {
+    if (pixel.x < 0 || pixel.x >= cloud.cols || pixel.y < 0 ||
+        pixel.y >= cloud.rows) {
+      continue;
+    }
+    if (std::isnan(cloud.at<cv::Vec3f>(pixel)[0])) continue;
+    ASSERT_LT(k, samples.points.size());
+    EXPECT_EQ(samples.points[k], cloud.at<cv::Vec3f>(pixel));
+    EXPECT_EQ(samples.labels[k], labels.at<unsigned short>(pixel));
+    EXPECT_EQ(samples.colors[k], image.at<cv::Vec3b>(pixel));
+    ++k;
+  }
+  EXPECT_EQ(k, samples.points.size());
+  // The mean color must be the one of assignColorToLines.
+  LineWithPlanes line;
+  line.colors.fill(cv::Vec3b(0, 0, 0));
+  line_detector_.assignColorToLines(image, pixels, 1, &line);
+  EXPECT_EQ(samples.mean_color, line.colors[1]);
+  EXPECT_EQ(cv::Vec3b(0, 0, 0), line.colors[0]);
+
+  // A point with no depth information is only reported if required.
+  cloud.at<cv::Vec3f>(3, 3) = cv::Vec3f(0, 0, 0);
+  EXPECT_FALSE(sampler.sample(corners, true, &samples));
+  EXPECT_TRUE(sampler.sample(corners, false, &samples));
+  EXPECT_EQ(samples.points.size(), k);
+  EXPECT_EQ(samples.num_points_in_rect, k);
+
+  // With a stride, only the pixels on the grid of the stride are sampled,
+  // but all the points are counted.
+  const std::vector<cv::Vec3f> all_points = samples.points;
+  const std::vector<cv::Point2i> all_pixels = samples.pixels;
+  EXPECT_EQ(samples.pixel_step, 1);
+  sampler.setSubsampling(2, 0);
+  EXPECT_TRUE(sampler.sample(corners, false, &samples));
+  EXPECT_EQ(samples.num_points_in_rect, k);
+  EXPECT_LT(samples.points.size(), k);
+  EXPECT_EQ(samples.pixel_step, 2);
+  for (size_t i = 0; i < samples.pixels.size(); ++i) {
+    EXPECT_EQ(samples.pixels[i].x % 2, 0);
+    EXPECT_EQ(samples.pixels[i].y % 2, 0);
+    EXPECT_EQ(samples.points[i], cloud.at<cv::Vec3f>(samples.pixels[i]));
+    EXPECT_EQ(samples.labels[i], labels.at<unsigned short>(samples.pixels[i]));
+  }
+  // With a maximum number of points, the points kept are the ones on every
+  // pixel_step-th column from the first one (the rectangle is as wide as
+  // high), in their order.
+  sampler.setSubsampling(1, 5);
+  EXPECT_TRUE(sampler.sample(corners, false, &samples));
+  EXPECT_EQ(samples.num_points_in_rect, k);
+  EXPECT_LE(samples.points.size(), 5u);
+  int x_min = all_pixels[0].x;
+  for (const cv::Point2i& pixel : all_pixels) x_min = std::min(x_min, pixel.x);
+  std::vector<cv::Vec3f> points_on_columns;
+  for (size_t i = 0; i < k; ++i) {
+    if ((all_pixels[i].x - x_min) % samples.pixel_step == 0) {
+      points_on_columns.push_back(all_points[i]);
+    }
+  }
+  EXPECT_FALSE(points_on_columns.empty());
+  EXPECT_EQ(samples.points, points_on_columns);
+  EXPECT_EQ(samples.mean_color, line.colors[1]);
+}
+
+TEST_F(LineDetectionTest, testPatchSubsamplingAccuracy) {
+  // Two noisy planes meeting along the row v = 120, seen by a camera with
+  // focal length 500, and a line along the fold, across the whole image.
+  const int N = 240;
+  const int M = 640;
+  const float focal_length = 500.0f;
+  std::mt19937 generator(1);
+  std::normal_distribution<float> noise(0.0f, 0.0005f);
+  cv::Mat cloud(N, M, CV_32FC3);
+  cv::Mat cloud_noise_free(N, M, CV_32FC3);
+  for (int v = 0; v < N; ++v) {
+    for (int u = 0; u < M; ++u) {
+      const float z = 1.0f + 0.003f * std::abs(v - N / 2);
+      const cv::Vec3f point((u - M / 2) * z / focal_length,
+                            (v - N / 2) * z / focal_length, z);
+      cloud_noise_free.at<cv::Vec3f>(v, u) = point;
+      cloud.at<cv::Vec3f>(v, u) =
+          point + cv::Vec3f(noise(generator), noise(generator),
+                            noise(generator));
+    }
+  }
+  const cv::Vec4f line(10, N / 2, M - 10, N / 2);
+  const auto fitPlanes = [&](LineDetector* detector,
+                             const cv::Mat& input_cloud,
+                             std::array<cv::Vec4f, 2>* planes,
+                             size_t* num_points) {
+    const cv::Mat image;
+    LineWithPlanes line3D;
+    std::vector<cv::Vec3f> inliers_right, inliers_left;
+    std::vector<cv::Point2f> rect_right, rect_left;
+    bool right_found, left_found;
+    DetectionContext context;
+    detector->findInliersGiven2DLine(line, input_cloud, image, false, &line3D,
+                                     &inliers_right, &inliers_left,
+                                     &rect_right, &rect_left, &right_found,
+                                     &left_found, &context);
+    ASSERT_TRUE(right_found);
+    ASSERT_TRUE(left_found);
+    ASSERT_TRUE(detector->hessianNormalFormOfPlane(inliers_left,
+                                                   &(*planes)[0]));
+    ASSERT_TRUE(detector->hessianNormalFormOfPlane(inliers_right,
+                                                   &(*planes)[1]));
+    *num_points = context.patch_samples.points.size();
+  };
+  // Angle (in degrees) between the normals of two planes.
+  const auto angle = [](const cv::Vec4f& plane1, const cv::Vec4f& plane2) {
+    const double cos_angle = std::fabs(plane1[0] * plane2[0] +
+                                       plane1[1] * plane2[1] +
+                                       plane1[2] * plane2[2]);
+    return std::acos(std::min(cos_angle, 1.0)) * 180.0 / kPi;
+  };
+
+  std::array<cv::Vec4f, 2> truth, planes_full;
+  size_t num_points_full, num_points;
+  fitPlanes(&line_detector_, cloud_noise_free, &truth, &num_points);
+  fitPlanes(&line_detector_, cloud, &planes_full, &num_points_full);
+  // The planes fitted to the subsampled patches must stay within a degree of
+  // the true planes, as the ones fitted to all the points. The errors are
+  // reported in the test results.
+  const double error_full = std::max(angle(truth[0], planes_full[0]),
+                                     angle(truth[1], planes_full[1]));
+  RecordProperty("normal_error_deg_full", std::to_string(error_full));
+  EXPECT_LT(error_full, 1.0);
+  LineDetectionParams params_stride;
+  params_stride.patch_sampling_stride = 2;
+  LineDetectionParams params_max_points;
+  params_max_points.max_points_per_patch = 200;
+  for (LineDetectionParams* params : {&params_stride, &params_max_points}) {
+    LineDetector detector(params);
+    std::array<cv::Vec4f, 2> planes;
+    fitPlanes(&detector, cloud, &planes, &num_points);
+    EXPECT_LT(num_points, num_points_full);
+    const double error =
+        std::max(angle(truth[0], planes[0]), angle(truth[1], planes[1]));
+    RecordProperty(params == &params_stride ? "normal_error_deg_stride_2"
+                                            : "normal_error_deg_max_200",
+                   std::to_string(error));
+    EXPECT_LT(error, 1.0);
+  }
+  EXPECT_LE(num_points, 200u);
+}
+
+TEST_F(LineDetectionTest, testPixelGridWithMaxPointsPerPatch) {
+  // A wall (the plane 0.2 * x + z = 2) seen by a camera with focal length
+  // 500, and long lines on it. The samples kept of their rectangles are far
+  // apart in the image, but the PIXEL_GRID check must still find the plane on
+  // both sides.
+  const int N = 240;
+  const int M = 640;
+  const float focal_length = 500.0f;
+  cv::Mat cloud(N, M, CV_32FC3);
+  for (int v = 0; v < N; ++v) {
+    for (int u = 0; u < M; ++u) {
+      const cv::Vec3f ray((u - M / 2) / focal_length,
+                          (v - N / 2) / focal_length, 1.0f);
+      cloud.at<cv::Vec3f>(v, u) = ray * (2.0f / (0.2f * ray[0] + 1.0f));
+    }
+  }
+  LineDetectionParams params;
+  params.connectivity_check_ransac = ConnectivityCheck::PIXEL_GRID;
+  params.max_points_per_patch = 200;
+  LineDetector detector(&params);
+  // A horizontal, a tilted and an almost vertical line.
+  const std::vector<cv::Vec4f> lines = {cv::Vec4f(10, 60, 630, 60),
+                                        cv::Vec4f(10, 20, 600, 220),
+                                        cv::Vec4f(300, 10, 340, 230)};
+  for (size_t i = 0; i < lines.size(); ++i) {
+    const cv::Mat image;
+    LineWithPlanes line3D;
+    std::vector<cv::Vec3f> inliers_right, inliers_left;
+    std::vector<cv::Point2f> rect_right, rect_left;
+    bool right_found, left_found;
+    DetectionContext context;
+    detector.findInliersGiven2DLine(lines[i], cloud, image, false, &line3D,
+                                    &inliers_right, &inliers_left,
+                                    &rect_right, &rect_left, &right_found,
+                                    &left_found, &context);
+    EXPECT_TRUE(right_found) << i;
+    EXPECT_TRUE(left_found) << i;
+    EXPECT_LE(context.patch_samples.points.size(), 200u) << i;
+    EXPECT_GT(context.patch_samples.pixel_step,
+              params.connectivity_pixel_radius)
+        << i;
+  }
+}
+
+TEST_F(LineDetectionTest, testFuseLines2DOnTheFly) {
+  // Reference: each line is compared with all the previous clusters.
+  auto fuse_with_all_clusters = [this](const std::vector<cv::Vec4f>& lines_in,
+                                       std::vector<cv::Vec4f>* lines_out) {
+    std::list<cv::Vec4f> clusters;
+    for (const cv::Vec4f& line : lines_in) {
+      cv::Vec4f current_line = line;
+      bool is_in_cluster = false;
+      std::list<cv::Vec4f>::iterator current_it;
+      for (auto it = clusters.begin(); it != clusters.end(); ++it) {
+        if (areLinesEqual2D(current_line, *it)) {
+          *it = line_detector_.mergeLines2D(current_line, *it);
+          current_line = *it;
+          if (is_in_cluster) clusters.erase(current_it);
+          is_in_cluster = true;
+          current_it = it;
+        }
+      }
+      if (!is_in_cluster) clusters.push_back(current_line);
+    }
+    lines_out->assign(clusters.begin(), clusters.end());
+  };
+  // Chains of almost collinear segments, that are merged step by step, mixed
+  // with random segments.
+  std::default_random_engine generator(42);
+  std::uniform_real_distribution<float> position(0, 300);
+  std::uniform_real_distribution<float> angle(0, CV_PI);
+  std::uniform_real_distribution<float> jitter(-0.1, 0.1);
+  std::vector<cv::Vec4f> lines_in;
+  for (size_t i = 0; i < 500; ++i) {
+    if (i % 3 != 0) {
+      const cv::Vec4f previous = lines_in[generator() % lines_in.size()];
+      lines_in.push_back(cv::Vec4f(
+          previous[2] + jitter(generator), previous[3] + jitter(generator),
+          2 * previous[2] - previous[0] + jitter(generator),
+          2 * previous[3] - previous[1] + jitter(generator)));
+    } else {
+      const float x = position(generator);
+      const float y = position(generator);
+      const float theta = angle(generator);
+      lines_in.push_back(
+          cv::Vec4f(x, y, x + 10 * cos(theta), y + 10 * sin(theta)));
+    }
+  }
+  std::vector<cv::Vec4f> lines_out, lines_out_expected;
+  line_detector_.fuseLines2D(lines_in, &lines_out);
+  fuse_with_all_clusters(lines_in, &lines_out_expected);
+  EXPECT_LT(lines_out.size(), lines_in.size());
+  ASSERT_EQ(lines_out.size(), lines_out_expected.size());
+  for (size_t i = 0; i < lines_out.size(); ++i) {
+    for (size_t j = 0; j < 4; ++j) {
+      EXPECT_EQ(lines_out[i][j], lines_out_expected[i][j]);
+    }
+  }
+}
+
 TEST_F(LineDetectionTest, testGetPointOnPlaneIntersectionLine) {
   cv::Vec4f hessian1(1, 0, 0, 1);
   cv::Vec4f hessian2(0, 1, 0, 0);
@@ -312,6 +940,416 @@ TEST_F(LineDetectionTest, testProject2Dto3DwithPlanes) {
   EXPECT_NEAR(lines3D[0][5], 160 * scale, 1e-5);
 }
 
+TEST_F(LineDetectionTest, testProject2Dto3DwithPlanesMultiThreaded) {
+  int N = 240;
+  int M = 320;
+  double scale = 0.01;
+  cv::Mat cloud(N, M, CV_32FC3);
+  for (int i = 0; i < N; ++i) {
+    for (int j = 0; j < M; ++j) {
+      if (j <= (M / 2)) {
+        cloud.at<cv::Vec3f>(i, j) = cv::Vec3f(i * scale, j * scale, j * scale);
+      } else {
+        cloud.at<cv::Vec3f>(i, j) =
+            cv::Vec3f(i * scale, j * scale, (M - j) * scale);
+      }
+    }
+  }
+  cv::Mat image(N, M, CV_8UC3, cv::Scalar(0, 0, 0));
+  cv::Mat camera_P = (cv::Mat_<float>(3, 4) << 300, 0, 160, 0,
+                                               0, 300, 120, 0,
+                                               0, 0, 1, 0);
+  std::vector<cv::Vec4f> lines2D;
+  for (int k = 0; k < 20; ++k) {
+    lines2D.push_back(cv::Vec4f(160, 20 + 5 * k, 160, 120 + 5 * k));
+    lines2D.push_back(cv::Vec4f(60 + 10 * k, 40, 60 + 10 * k, 200));
+  }
+  LineDetectionParams params_serial;
+  params_serial.num_threads_projection = 1;
+  LineDetectionParams params_parallel;
+  params_parallel.num_threads_projection = 4;
+  LineDetector line_detector_serial(&params_serial);
+  LineDetector line_detector_parallel(&params_parallel);
+  std::vector<cv::Vec4f> lines2D_serial, lines2D_parallel;
+  std::vector<LineWithPlanes> lines3D_serial, lines3D_parallel;
+  DetectionContext context_serial, context_parallel;
+  line_detector_serial.project2Dto3DwithPlanes(cloud, image, camera_P, lines2D,
+                                               false, &context_serial,
+                                               &lines2D_serial,
+                                               &lines3D_serial);
+  line_detector_parallel.project2Dto3DwithPlanes(cloud, image, camera_P,
+                                                 lines2D, false,
+                                                 &context_parallel,
+                                                 &lines2D_parallel,
+                                                 &lines3D_parallel);
+  // The output must not depend on the number of threads.
+  ASSERT_GT(lines3D_serial.size(), 0);
+  ASSERT_EQ(lines3D_serial.size(), lines3D_parallel.size());
+  ASSERT_EQ(lines2D_serial.size(), lines2D_parallel.size());
+  for (size_t i = 0; i < lines3D_serial.size(); ++i) {
+    EXPECT_EQ(lines2D_serial[i], lines2D_parallel[i]);
+    EXPECT_EQ(lines3D_serial[i].line, lines3D_parallel[i].line);
+    EXPECT_EQ(lines3D_serial[i].type, lines3D_parallel[i].type);
+    EXPECT_EQ(lines3D_serial[i].hessians[0], lines3D_parallel[i].hessians[0]);
+    EXPECT_EQ(lines3D_serial[i].hessians[1], lines3D_parallel[i].hessians[1]);
+  }
+  LineDetectionStatistics statistics_serial =
+      line_detector_serial.get_line_detection_statistics(context_serial);
+  LineDetectionStatistics statistics_parallel =
+      line_detector_parallel.get_line_detection_statistics(context_parallel);
+  EXPECT_EQ(statistics_serial.num_discontinuity_lines,
+            statistics_parallel.num_discontinuity_lines);
+  EXPECT_EQ(statistics_serial.num_planar_lines,
+            statistics_parallel.num_planar_lines);
+  EXPECT_EQ(statistics_serial.num_edge_lines,
+            statistics_parallel.num_edge_lines);
+  EXPECT_EQ(statistics_serial.num_intersection_lines,
+            statistics_parallel.num_intersection_lines);
+  EXPECT_EQ(statistics_serial.num_lines_successfully_projected_to_3D,
+            statistics_parallel.num_lines_successfully_projected_to_3D);
+}
+
+TEST_F(LineDetectionTest, testFrameArena) {
+  FrameArena arena;
+  for (size_t frame = 0; frame < 3; ++frame) {
+    arena.resetAllocationCounter();
+    for (size_t line = 0; line < 10; ++line) {
+      ScratchVector<float> x(&arena);
+      x->resize(100 + 10 * line);
+      {
+        ScratchVector<cv::Vec3f> points(&arena);
+        points->resize(50);
+      }
+      ScratchVector<cv::Vec3f> points(&arena);
+      EXPECT_TRUE(points->empty());
+    }
+    // Once the buffers are large enough, nothing is allocated anymore.
+    if (frame == 0) {
+      EXPECT_GT(arena.num_allocations(), 0u);
+    } else {
+      EXPECT_EQ(arena.num_allocations(), 0u);
+    }
+  }
+
+  // The same frame is processed twice with the same context: the second time,
+  // all the buffers of the per-line computations are large enough.
+  int N = 240;
+  int M = 320;
+  double scale = 0.01;
+  cv::Mat cloud(N, M, CV_32FC3);
+  for (int i = 0; i < N; ++i) {
+    for (int j = 0; j < M; ++j) {
+      if (j <= (M / 2)) {
+        cloud.at<cv::Vec3f>(i, j) = cv::Vec3f(i * scale, j * scale, j * scale);
+      } else {
+        cloud.at<cv::Vec3f>(i, j) =
+            cv::Vec3f(i * scale, j * scale, (M - j) * scale);
+      }
+    }
+  }
+  cv::Mat image(N, M, CV_8UC3, cv::Scalar(0, 0, 0));
+  cv::Mat camera_P = (cv::Mat_<float>(3, 4) << 300, 0, 160, 0,
+                                               0, 300, 120, 0,
+                                               0, 0, 1, 0);
+  std::vector<cv::Vec4f> lines2D;
+  for (int k = 0; k < 20; ++k) {
+    lines2D.push_back(cv::Vec4f(160, 20 + 5 * k, 160, 120 + 5 * k));
+    lines2D.push_back(cv::Vec4f(60 + 10 * k, 40, 60 + 10 * k, 200));
+  }
+  DetectionContext context;
+  std::vector<cv::Vec4f> lines2D_first, lines2D_second;
+  std::vector<LineWithPlanes> lines3D_first, lines3D_second;
+  line_detector_.project2Dto3DwithPlanes(cloud, image, camera_P, lines2D,
+                                         false, &context, &lines2D_first,
+                                         &lines3D_first);
+  EXPECT_GT(context.statistics.num_scratch_allocations, 0);
+  line_detector_.project2Dto3DwithPlanes(cloud, image, camera_P, lines2D,
+                                         false, &context, &lines2D_second,
+                                         &lines3D_second);
+  EXPECT_EQ(context.statistics.num_scratch_allocations, 0);
+  ASSERT_GT(lines3D_first.size(), 0);
+  ASSERT_EQ(lines3D_first.size(), lines3D_second.size());
+  for (size_t i = 0; i < lines3D_first.size(); ++i) {
+    for (size_t j = 0; j < 6; ++j) {
+      EXPECT_EQ(lines3D_first[i].line[j], lines3D_second[i].line[j]);
+    }
+  }
+}
+
+TEST_F(LineDetectionTest, testGetNUniqueRandomElements) {
+  std::vector<int> in(100);
+  for (size_t i = 0; i < in.size(); ++i) in[i] = i;
+  std::default_random_engine generator(1);
+  std::vector<int> out;
+  // Few samples (stored on the stack) and many samples.
+  for (size_t num_samples : {3, 50, 99}) {
+    getNUniqueRandomElements(in, num_samples, &generator, &out);
+    ASSERT_EQ(out.size(), num_samples);
+    std::sort(out.begin(), out.end());
+    EXPECT_TRUE(std::unique(out.begin(), out.end()) == out.end());
+    EXPECT_GE(out.front(), 0);
+    EXPECT_LT(out.back(), 100);
+  }
+}
+
+TEST_F(LineDetectionTest, testLineBatch) {
+  std::vector<LineWithPlanes> lines(2);
+  for (size_t i = 0; i < lines.size(); ++i) {
+    lines[i].line = cv::Vec6f(i, 1, 2, 3, 4, 5);
+    lines[i].hessians[0] = cv::Vec4f(1, 0, 0, i);
+    lines[i].hessians[1] = cv::Vec4f(0, 1, 0, i);
+    lines[i].colors[0] = cv::Vec3b(i, 10, 20);
+    lines[i].colors[1] = cv::Vec3b(i, 30, 40);
+  }
+  lines[0].type = LineType::DISCONT;
+  lines[1].type = LineType::PLANE;
+  LineBatch batch;
+  batch.assign(lines);
+  ASSERT_EQ(batch.size(), lines.size());
+  for (size_t i = 0; i < lines.size(); ++i) {
+    const LineWithPlanes line = batch.get(i);
+    EXPECT_EQ(lines[i].line, line.line);
+    EXPECT_EQ(lines[i].hessians[0], line.hessians[0]);
+    EXPECT_EQ(lines[i].hessians[1], line.hessians[1]);
+    EXPECT_EQ(lines[i].colors[0], line.colors[0]);
+    EXPECT_EQ(lines[i].colors[1], line.colors[1]);
+    EXPECT_EQ(lines[i].type, line.type);
+  }
+  batch.clear();
+  EXPECT_TRUE(batch.empty());
+}
+
+TEST_F(LineDetectionTest, testProject2Dto3DwithPlanesSharedDetector) {
+  int N = 240;
+  int M = 320;
+  double scale = 0.01;
+  cv::Mat cloud(N, M, CV_32FC3);
+  for (int i = 0; i < N; ++i) {
+    for (int j = 0; j < M; ++j) {
+      if (j <= (M / 2)) {
+        cloud.at<cv::Vec3f>(i, j) = cv::Vec3f(i * scale, j * scale, j * scale);
+      } else {
+        cloud.at<cv::Vec3f>(i, j) =
+            cv::Vec3f(i * scale, j * scale, (M - j) * scale);
+      }
+    }
+  }
+  cv::Mat image(N, M, CV_8UC3, cv::Scalar(0, 0, 0));
+  cv::Mat camera_P = (cv::Mat_<float>(3, 4) << 300, 0, 160, 0,
+                                               0, 300, 120, 0,
+                                               0, 0, 1, 0);
+  std::vector<cv::Vec4f> lines2D;
+  for (int k = 0; k < 10; ++k) {
+    lines2D.push_back(cv::Vec4f(160, 20 + 10 * k, 160, 120 + 10 * k));
+  }
+  // Reference result, computed alone.
+  DetectionContext context_reference;
+  std::vector<cv::Vec4f> lines2D_reference;
+  std::vector<LineWithPlanes> lines3D_reference;
+  line_detector_.project2Dto3DwithPlanes(cloud, image, camera_P, lines2D,
+                                         false, &context_reference,
+                                         &lines2D_reference,
+                                         &lines3D_reference);
+  // The same detector is used by several threads, each with its own context.
+  constexpr size_t kNumThreads = 4;
+  std::vector<DetectionContext> contexts(kNumThreads);
+  std::vector<std::vector<cv::Vec4f>> lines2D_out(kNumThreads);
+  std::vector<std::vector<LineWithPlanes>> lines3D_out(kNumThreads);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < kNumThreads; ++t) {
+    threads.emplace_back([&, t]() {
+      line_detector_.project2Dto3DwithPlanes(cloud, image, camera_P, lines2D,
+                                             false, &contexts[t],
+                                             &lines2D_out[t],
+                                             &lines3D_out[t]);
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  for (size_t t = 0; t < kNumThreads; ++t) {
+    ASSERT_EQ(lines3D_out[t].size(), lines3D_reference.size());
+    for (size_t i = 0; i < lines3D_reference.size(); ++i) {
+      EXPECT_EQ(lines2D_out[t][i], lines2D_reference[i]);
+      EXPECT_EQ(lines3D_out[t][i].line, lines3D_reference[i].line);
+    }
+    EXPECT_EQ(
+        contexts[t].statistics.num_lines_successfully_projected_to_3D,
+        line_detector_.get_line_detection_statistics(context_reference)
+            .num_lines_successfully_projected_to_3D);
+  }
+}
+
+TEST_F(LineDetectionTest, testProcessFrame) {
+  int N = 240;
+  int M = 320;
+  double scale = 0.01;
+  cv::Mat cloud(N, M, CV_32FC3);
+  for (int i = 0; i < N; ++i) {
+    for (int j = 0; j < M; ++j) {
+      if (j <= (M / 2)) {
+        cloud.at<cv::Vec3f>(i, j) = cv::Vec3f(i * scale, j * scale, j * scale);
+      } else {
+        cloud.at<cv::Vec3f>(i, j) =
+            cv::Vec3f(i * scale, j * scale, (M - j) * scale);
+      }
+    }
+  }
+  cv::Mat image(N, M, CV_8UC3, cv::Scalar(0, 0, 0));
+  cv::rectangle(image, cv::Point(60, 40), cv::Point(260, 200),
+                cv::Scalar(255, 255, 255), CV_FILLED);
+  cv::Mat camera_P = (cv::Mat_<float>(3, 4) << 300, 0, 160, 0,
+                                               0, 300, 120, 0,
+                                               0, 0, 1, 0);
+  // Reference result, computed by calling the stages one by one.
+  cv::Mat gray_image;
+  cv::cvtColor(image, gray_image, CV_RGB2GRAY);
+  std::vector<cv::Vec4f> lines2D_detected, lines2D_fused;
+  line_detector_.detectLines(gray_image, line_detection::DetectorType::LSD,
+                             &lines2D_detected);
+  line_detector_.fuseLines2D(lines2D_detected, &lines2D_fused);
+  std::vector<cv::Vec4f> lines2D_projected, lines2D_reference;
+  std::vector<LineWithPlanes> lines3D_projected, lines3D_reference;
+  line_detector_.project2Dto3DwithPlanes(cloud, image, camera_P, lines2D_fused,
+                                         true, &lines2D_projected,
+                                         &lines3D_projected);
+  line_detector_.runCheckOn3DLines(cloud, camera_P, lines2D_projected,
+                                   lines3D_projected, &lines2D_reference,
+                                   &lines3D_reference);
+
+  FrameOptions options;
+  FrameResult result;
+  // The result is reused, as it would be from one frame to the next.
+  for (int frame = 0; frame < 2; ++frame) {
+    line_detector_.processFrame(image, cloud, camera_P, options, &result);
+    EXPECT_EQ(result.num_lines2D_before_fusion, lines2D_detected.size());
+    EXPECT_EQ(result.lines2D_detected, lines2D_fused);
+    EXPECT_EQ(result.num_lines3D_before_check, lines3D_projected.size());
+    ASSERT_EQ(result.lines3D.size(), lines3D_reference.size());
+    ASSERT_EQ(result.lines2D.size(), lines2D_reference.size());
+    for (size_t i = 0; i < lines3D_reference.size(); ++i) {
+      EXPECT_EQ(result.lines2D[i], lines2D_reference[i]);
+      EXPECT_EQ(result.lines3D[i].line, lines3D_reference[i].line);
+      EXPECT_EQ(result.lines3D[i].type, lines3D_reference[i].type);
+    }
+    EXPECT_GE(result.timings.total, result.timings.detection +
+                                        result.timings.fusion +
+                                        result.timings.projection +
+                                        result.timings.check);
+    // Every fused line is either rejected at one of the stages or projected.
+    const LineDetectionStatistics& statistics = result.statistics;
+    EXPECT_EQ(statistics.num_lines_rejected_by_rating +
+                  statistics.num_lines_rejected_without_planes +
+                  statistics.num_lines_rejected_on_planes +
+                  result.num_lines3D_before_check,
+              result.lines2D_detected.size());
+    EXPECT_GT(statistics.num_ransac_runs, 0);
+    EXPECT_GE(statistics.num_ransac_iterations, statistics.num_ransac_runs);
+    EXPECT_LE(statistics.max_ransac_iterations,
+              static_cast<int>(LineDetectionParams().num_iter_ransac));
+    EXPECT_LE(statistics.time_ransac, statistics.time_inlier_search);
+  }
+  // The index of the frame is part of the key of the random numbers of
+  // RANSAC, and a frame is processed the same way with the same index.
+  DetectionContext context;
+  FrameResult result_again;
+  options.frame_index = 3;
+  line_detector_.processFrame(image, cloud, camera_P, options, &result,
+                              &context);
+  EXPECT_EQ(context.ransac_key.frame, 3u);
+  line_detector_.processFrame(image, cloud, camera_P, options, &result_again,
+                              &context);
+  ASSERT_EQ(result_again.lines3D.size(), result.lines3D.size());
+  for (size_t i = 0; i < result.lines3D.size(); ++i) {
+    EXPECT_EQ(result_again.lines3D[i].line, result.lines3D[i].line);
+  }
+}
+
+TEST_F(LineDetectionTest, testProcessFrameWithTracking) {
+  // Two planes folded along the column u = 160, seen by the camera given by
+  // camera_P: the cloud is consistent with the projection, so that the 3D
+  // lines project back onto the 2D lines they were found from. Left of the
+  // column u = 60 (the left side of the rectangle drawn below) lies a wall
+  // further away, so that the left side of the rectangle is a discontinuity.
+  int N = 240;
+  int M = 320;
+  const float focal_length = 300.0f;
+  cv::Mat cloud(N, M, CV_32FC3);
+  for (int v = 0; v < N; ++v) {
+    for (int u = 0; u < M; ++u) {
+      const float z = u < 60 ? 2.0f : 1.0f + 0.004f * std::abs(u - M / 2);
+      cloud.at<cv::Vec3f>(v, u) =
+          cv::Vec3f((u - M / 2) * z / focal_length,
+                    (v - N / 2) * z / focal_length, z);
+    }
+  }
+  cv::Mat image(N, M, CV_8UC3, cv::Scalar(0, 0, 0));
+  cv::rectangle(image, cv::Point(60, 40), cv::Point(260, 200),
+                cv::Scalar(255, 255, 255), CV_FILLED);
+  cv::Mat camera_P = (cv::Mat_<float>(3, 4) << focal_length, 0, M / 2, 0,
+                                               0, focal_length, N / 2, 0,
+                                               0, 0, 1, 0);
+  FrameOptions options;
+  FrameResult reference, result;
+  line_detector_.processFrame(image, cloud, camera_P, options, &reference);
+  ASSERT_GT(reference.lines3D.size(), 0u);
+  size_t num_discont = 0;
+  for (const LineWithPlanes& line : reference.lines3D) {
+    if (line.type == LineType::DISCONT) ++num_discont;
+  }
+  ASSERT_GT(num_discont, 0u);
+
+  DetectionContext context;
+  options.track_lines = true;
+  // First frame: nothing to track yet.
+  line_detector_.processFrame(image, cloud, camera_P, options, &result,
+                              &context);
+  EXPECT_EQ(result.statistics.num_planes_tracked, 0);
+  EXPECT_EQ(result.lines3D.size(), reference.lines3D.size());
+  // Same frame again, without motion: the planes of the previous frame fit
+  // the patches, and RANSAC is run less often.
+  line_detector_.processFrame(image, cloud, camera_P, options, &result,
+                              &context);
+  EXPECT_GT(result.statistics.num_planes_tracked, 0);
+  EXPECT_LT(result.statistics.num_ransac_runs,
+            reference.statistics.num_ransac_runs);
+  // Every line can have at most one tracked plane per side, and the side
+  // without a plane of a discontinuity is never tracked.
+  EXPECT_LE(result.statistics.num_planes_tracked,
+            static_cast<int>(2 * reference.lines3D.size() - num_discont));
+  // The planes are the ones found without tracking (up to their sign).
+  ASSERT_EQ(result.lines3D.size(), reference.lines3D.size());
+  for (size_t i = 0; i < reference.lines3D.size(); ++i) {
+    EXPECT_EQ(result.lines3D[i].type, reference.lines3D[i].type);
+    for (size_t side = 0; side < 2; ++side) {
+      const cv::Vec4f& hessian = result.lines3D[i].hessians[side];
+      const cv::Vec4f& hessian_reference = reference.lines3D[i].hessians[side];
+      const float sign = hessian.dot(hessian_reference) < 0.0f ? -1.0f : 1.0f;
+      for (int k = 0; k < 4; ++k) {
+        EXPECT_NEAR(hessian[k], sign * hessian_reference[k], 1e-2);
+      }
+    }
+  }
+  // With a wrong motion, the moved planes do not fit and all the planes are
+  // fitted again: the result is the one without tracking.
+  options.transform_current_previous(2, 3) = 1.0f;
+  line_detector_.processFrame(image, cloud, camera_P, options, &result,
+                              &context);
+  EXPECT_EQ(result.statistics.num_planes_tracked, 0);
+  EXPECT_EQ(result.statistics.num_ransac_runs,
+            reference.statistics.num_ransac_runs);
+  ASSERT_EQ(result.lines3D.size(), reference.lines3D.size());
+  for (size_t i = 0; i < reference.lines3D.size(); ++i) {
+    EXPECT_EQ(result.lines3D[i].line, reference.lines3D[i].line);
+  }
+  // Without tracking, the lines kept are forgotten.
+  options.track_lines = false;
+  line_detector_.processFrame(image, cloud, camera_P, options, &result,
+                              &context);
+  EXPECT_FALSE(context.tracking.has_previous_frame);
+  EXPECT_EQ(result.statistics.num_planes_tracked, 0);
+}
+
 TEST_F(LineDetectionTest, testProjectPointOnPlane) {
   cv::Vec4f hessian(1, 0, 0, 0);
   cv::Vec3f point(456, 3, 2);
@@ -353,6 +1391,62 @@ TEST_F(LineDetectionTest, testProjectPointOnPlane) {
   EXPECT_FALSE(line_detector_.checkIfValidLineBruteForce(cloud, &line3D)) << 3;
 }*/
 
+TEST_F(LineDetectionTest, testCheckIfValidLineBruteForceWithCloudGrid) {
+  int N = 120;
+  int M = 160;
+  double scale = 0.01;
+  cv::Mat cloud(N, M, CV_32FC3);
+  for (int i = 0; i < N; ++i) {
+    for (int j = 0; j < M; ++j) {
+      if (j <= (M / 2)) {
+        cloud.at<cv::Vec3f>(i, j) = cv::Vec3f(i * scale, j * scale, j * scale);
+      } else {
+        cloud.at<cv::Vec3f>(i, j) =
+            cv::Vec3f(i * scale, j * scale, (M - j) * scale);
+      }
+    }
+  }
+  for (int i = 0; i < N; i += 7) {
+    cloud.at<cv::Vec3f>(i, 5) = cv::Vec3f(NAN, NAN, NAN);
+  }
+  // Lines between points of the cloud, and lines (partly) in empty space.
+  std::vector<LineWithPlanes> lines(40);
+  std::default_random_engine generator(1);
+  std::uniform_int_distribution<int> row(0, N - 1), col(0, M - 1);
+  for (size_t k = 0; k < lines.size(); ++k) {
+    cv::Vec3f start = cloud.at<cv::Vec3f>(row(generator), col(generator));
+    cv::Vec3f end = cloud.at<cv::Vec3f>(row(generator), col(generator));
+    if (k % 4 == 0) end += cv::Vec3f(0.0f, 0.0f, 0.5f);
+    lines[k].line = {start[0], start[1], start[2], end[0], end[1], end[2]};
+  }
+  lines[0].line = {0.1, 0, 0, 10, 0, 0};
+  lines[1].line = {0.5, 0.2, 0.2, 1, 0.7, 0.7};
+  // Lines with endpoints far outside the cloud, for which a walk along the
+  // whole segment would visit too many cells.
+  lines[2].line = {0.2, 0.3, 0.3, 1e9, 0.3, 0.3};
+  lines[3].line = {-1e15, 0.6, 0.4, 1e15, 0.6, 0.4};
+  // The voxel grid must only avoid visiting the whole cloud, without changing
+  // the result.
+  CloudVoxelGrid cloud_grid;
+  cloud_grid.compute(cloud, 0.04);
+  size_t num_valid = 0;
+  for (size_t k = 0; k < lines.size(); ++k) {
+    cv::Vec6f line_brute_force = lines[k].line;
+    cv::Vec6f line_grid = lines[k].line;
+    const bool valid_brute_force =
+        line_detector_.checkIfValidLineBruteForce(cloud, &line_brute_force);
+    EXPECT_EQ(valid_brute_force, line_detector_.checkIfValidLineBruteForce(
+                                     cloud, &line_grid, &cloud_grid))
+        << k;
+    EXPECT_EQ(line_brute_force, line_grid) << k;
+    if (valid_brute_force) ++num_valid;
+  }
+  EXPECT_GT(num_valid, 0u);
+  std::vector<LineWithPlanes> lines_out;
+  line_detector_.runCheckOn3DLines(cloud, lines, &lines_out);
+  EXPECT_EQ(num_valid, lines_out.size());
+}
+
 TEST_F(LineDetectionTest, testCheckIfValidLineDiscont) {
   int N = 240;
   int M = 320;
@@ -375,6 +1469,128 @@ TEST_F(LineDetectionTest, testCheckIfValidLineDiscont) {
   EXPECT_TRUE(line_detector_.checkIfValidLineDiscont(cloud, line2D))
       << "test 2";
   line2D = {20, 50, 300, 50};
+  // The check must give the same results with the preprocessed cloud.
+  PreprocessedCloud preprocessed_cloud;
+  preprocessed_cloud.compute(cloud);
+  std::vector<cv::Vec4f> lines2D = {{0, 0, 0, 10}, {20, 50, 70, 50},
+                                    {20, 50, 300, 50}, {150, 10, 170, 200}};
+  for (auto& line : lines2D) {
+    EXPECT_EQ(line_detector_.checkIfValidLineDiscont(cloud, line),
+              line_detector_.checkIfValidLineDiscont(cloud, line,
+                                                     &preprocessed_cloud));
+  }
+}
+
+TEST_F(LineDetectionTest, testPreprocessedCloud) {
+  const float kNaN = std::numeric_limits<float>::quiet_NaN();
+  cv::Mat cloud(12, 15, CV_32FC3);
+  for (int y = 0; y < cloud.rows; ++y) {
+    for (int x = 0; x < cloud.cols; ++x) {
+      if ((x + 2 * y) % 7 == 0) {
+        cloud.at<cv::Vec3f>(y, x) = cv::Vec3f(kNaN, kNaN, kNaN);
+      } else if ((3 * x + y) % 11 == 0) {
+        cloud.at<cv::Vec3f>(y, x) = cv::Vec3f(0, 0, 0);
+      } else {
+        cloud.at<cv::Vec3f>(y, x) = cv::Vec3f(0.1 * x, 0.2 * y, 1 + x * y);
+      }
+    }
+  }
+  PreprocessedCloud preprocessed_cloud;
+  EXPECT_FALSE(preprocessed_cloud.isComputedFor(cloud));
+  preprocessed_cloud.compute(cloud);
+  EXPECT_TRUE(preprocessed_cloud.isComputedFor(cloud));
+
+  // Brute-force counts of the box from (x_min, y_min) to (x_max, y_max).
+  auto count_in_box = [&cloud](int x_min, int y_min, int x_max, int y_max,
+                               PointCounts* counts) {
+    for (int y = std::max(y_min, 0); y <= std::min(y_max, cloud.rows - 1);
+         ++y) {
+      for (int x = std::max(x_min, 0); x <= std::min(x_max, cloud.cols - 1);
+           ++x) {
+        const cv::Vec3f& point = cloud.at<cv::Vec3f>(y, x);
+        if (std::isnan(point[0])) {
+          ++counts->num_nan;
+        } else if (checkEqualPoints(point, {0.0f, 0.0f, 0.0f})) {
+          ++counts->num_no_depth;
+        } else {
+          ++counts->num_valid;
+          counts->sum_valid += cv::Vec3d(point[0], point[1], point[2]);
+        }
+      }
+    }
+  };
+  // Boxes inside and partially outside of the cloud.
+  std::vector<cv::Vec4i> boxes = {{0, 0, 14, 11}, {3, 2, 7, 9}, {5, 5, 5, 5},
+                                  {-3, -2, 4, 3}, {10, 8, 20, 30}};
+  for (auto& box : boxes) {
+    PointCounts counts, counts_expected;
+    preprocessed_cloud.countInBox(box[0], box[1], box[2], box[3], &counts);
+    count_in_box(box[0], box[1], box[2], box[3], &counts_expected);
+    EXPECT_EQ(counts.num_valid, counts_expected.num_valid);
+    EXPECT_EQ(counts.num_no_depth, counts_expected.num_no_depth);
+    EXPECT_EQ(counts.num_nan, counts_expected.num_nan);
+    EXPECT_LT(cv::norm(counts.sum_valid - counts_expected.sum_valid), 1e-6);
+  }
+  // Spans of a rotated rectangle.
+  std::vector<cv::Point2f> corners = {{-2.3, 3.1}, {3.2, -2.4}, {8.7, 3.1},
+                                      {3.2, 8.6}};
+  int first_row;
+  std::vector<int> x_start, x_end;
+  findRowSpansInRectangle(&corners, &first_row, &x_start, &x_end);
+  PointCounts counts, counts_expected;
+  preprocessed_cloud.countInRows(first_row, x_start, x_end, &counts);
+  for (size_t i = 0; i < x_start.size(); ++i) {
+    const int y = first_row + i;
+    count_in_box(x_start[i], y, x_end[i], y, &counts_expected);
+  }
+  EXPECT_EQ(counts.num_valid, counts_expected.num_valid);
+  EXPECT_EQ(counts.num_no_depth, counts_expected.num_no_depth);
+  EXPECT_EQ(counts.num_nan, counts_expected.num_nan);
+
+  preprocessed_cloud.reset();
+  EXPECT_FALSE(preprocessed_cloud.isComputedFor(cloud));
+}
+
+TEST_F(LineDetectionTest, testFind3DlinesRatedWithNaNPoints) {
+  int N = 120;
+  int M = 160;
+  double scale = 0.01;
+  cv::Mat cloud(N, M, CV_32FC3);
+  for (int i = 0; i < N; ++i) {
+    for (int j = 0; j < M; ++j) {
+      cloud.at<cv::Vec3f>(i, j) = cv::Vec3f(j * scale, i * scale, 1.0);
+    }
+  }
+  const cv::Vec3f nan_point(NAN, NAN, NAN);
+  // The first pixels and a pixel in the middle of the first line (and of the
+  // lines next to it) are NaN.
+  for (int i = 19; i <= 21; ++i) {
+    cloud.at<cv::Vec3f>(i, 30) = nan_point;
+    cloud.at<cv::Vec3f>(i, 31) = nan_point;
+    cloud.at<cv::Vec3f>(i, 80) = nan_point;
+  }
+  // The second line (and the lines next to it) only has NaN pixels.
+  for (int i = 50; i <= 52; ++i) {
+    for (int j = 0; j < M; ++j) cloud.at<cv::Vec3f>(i, j) = nan_point;
+  }
+  std::vector<cv::Vec4f> lines2D = {{30.5, 20.5, 130.5, 20.5},
+                                    {10.5, 51.5, 150.5, 51.5}};
+  std::vector<cv::Vec6f> lines3D;
+  std::vector<double> rating;
+  line_detector_.find3DlinesRated(cloud, lines2D, &lines3D, &rating);
+  ASSERT_EQ(lines3D.size(), 2u);
+  ASSERT_EQ(rating.size(), 2u);
+  EXPECT_LT(rating[0], 1e-4);
+  EXPECT_NEAR(lines3D[0][0], 32 * scale, 1e-6);
+  EXPECT_NEAR(lines3D[0][3], 130 * scale, 1e-6);
+  EXPECT_NEAR(lines3D[0][1], 20 * scale, 1.01 * scale);
+  EXPECT_FLOAT_EQ(lines3D[0][2], 1.0);
+  EXPECT_EQ(rating[1], 1e9);
+  // The overload without rating only keeps the first line.
+  lines3D.clear();
+  line_detector_.find3DlinesRated(cloud, lines2D, &lines3D);
+  ASSERT_EQ(lines3D.size(), 1u);
+  EXPECT_NEAR(lines3D[0][0], 32 * scale, 1e-6);
 }
 
 // TODO: update to current version of the code or remove.
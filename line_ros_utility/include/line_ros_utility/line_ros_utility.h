@@ -45,8 +45,34 @@ namespace line_ros_utility {
     struct SearchTree {
         std::vector<size_t> children_right;
         std::vector<size_t> children_left;
+        // The splits of the nodes, only known for a forest loaded with
+        // TreeClassifier::loadForest: a line goes to the left child if its
+        // feature is at most the threshold.
+        std::vector<int> features;
+        std::vector<double> thresholds;
     };
 
+// Number of features of a line given to the random forest (see
+// TreeClassifier::getLineFeatures).
+    constexpr size_t kNumLineFeatures = 21;
+
+// Reads a forest in the format written by random_forest.py (with the parameter
+// ~export_path). Returns false if the forest could not be read or is invalid:
+// the children of a node must come after it and its feature must be one of the
+// kNumLineFeatures features of a line.
+    bool readForest(std::istream& stream, std::vector<SearchTree>* trees);
+
+// Passes a line, given by its features, down a tree read by readForest.
+// Output: path: Indices of the nodes the line went through, from the root to a
+//               leaf.
+    void getDecisionPath(const SearchTree& tree, const std::vector<float>& features,
+                         std::vector<uint32_t>* path);
+
+// Returns the number of nodes that are on only one of two decision paths, each
+// given as the sorted indices of its nodes.
+    size_t numNodesOnOnePath(const uint32_t* path1, const uint32_t* end1,
+                             const uint32_t* path2, const uint32_t* end2);
+
 // This function returns a vector with labels for a vector of lines. It labels
 // them after the classification into line_detection::LineType.
     std::vector<int> clusterLinesAfterClassification(
@@ -156,29 +182,50 @@ namespace line_ros_utility {
     public:
         TreeClassifier();
         // Retrieves line decision paths from the random forest for specific lines.
+        // With a forest loaded by loadForest, the lines are passed down the trees
+        // in process, otherwise the paths are requested from random_forest.py.
         void getLineDecisionPath(
                 const std::vector<line_detection::LineWithPlanes>& lines);
         // Retrieves the tree structures of all trees within the random forest.
         void getTrees();
+        // Loads the forest written by random_forest.py (with the parameter
+        // ~export_path), so that the decision paths are computed without the
+        // service. Returns false if the file could not be read.
+        bool loadForest(const std::string& path);
         // Computes the distance between all lines. The lines are the one that were
-        // given to the last call of getLineDecisionPath().
-        void computeDistanceMatrix();
-        // Recursive function to compute the distance between two data points.
-        double computeDistance(const SearchTree& tree, const cv::SparseMat& path,
-                               size_t line_idx1, size_t line_idx2, size_t idx);
+        // given to the last call of getLineDecisionPath(). The rows are distributed
+        // among num_threads threads (0: one per core).
+        void computeDistanceMatrix(size_t num_threads = 0);
+        // Returns the number of nodes that are on the decision path of only one
+        // of the two lines, averaged over the trees.
+        double computeDistance(size_t line_idx1, size_t line_idx2) const;
         cv::Mat getDistanceMatrix();
+        const line_clustering::PackedDistanceMatrix& getPackedDistanceMatrix() const;
 
     protected:
+        // Writes the features of a line in the order random_forest.py was
+        // trained with: line, hessians, colors and type.
+        static void getLineFeatures(const line_detection::LineWithPlanes& line,
+                                    std::vector<float>* features);
+        // Stores the decision paths of the lines, given as the nodes of every
+        // pair {line, tree}.
+        void setDecisionPaths(std::vector<std::vector<uint32_t>>* paths);
+
         size_t num_lines_;
         std::vector<SearchTree> trees_;
+        // Whether trees_ holds the splits (see loadForest).
+        bool forest_loaded_ = false;
         ros::ServiceClient tree_client_;
         ros::ServiceClient line_client_;
         std_msgs::Header header_;
-        // Decision paths are stored in a sparse matrix, because this matrix has
-        // n_data_points*n_nodes_in_tree entries. If a entry (i, j) is non_zero, this
-        // means that the i-th data_point went through the j-th node in the tree.
-        std::vector<cv::SparseMat> decision_paths_;
-        cv::Mat dist_matrix_;
+        // The decision path of a line in a tree is stored as the sorted indices of
+        // the nodes the line went through (a few dozens, whereas a tree has tens
+        // of thousands of nodes). The path of line i in tree k is
+        // path_nodes_[path_offsets_[i * num_trees + k]] to
+        // path_nodes_[path_offsets_[i * num_trees + k + 1] - 1].
+        std::vector<uint32_t> path_nodes_;
+        std::vector<size_t> path_offsets_;
+        line_clustering::PackedDistanceMatrix dist_matrix_;
     };
 
     class EvalData {
@@ -263,12 +310,16 @@ namespace line_ros_utility {
                                 pcl::PointCloud<pcl::PointXYZRGB>* pcl_cloud);
         // These functions perform the actual work. They are only here to make the
         // masterCallback more readable.
-        void detectLines();
-        void projectTo3D();
-        void checkLines();
+        // Detects the 2D lines, projects them to 3D and checks them. If
+        // track_lines_ is set, the planes of the previous frame are moved with
+        // the motion of the camera (from its pose in the world frame) and
+        // reused. The motion is also stored for streaming_kmeans_cluster_.
+        void processFrame(const tf::StampedTransform& camera_pose);
         void printNumberOfLines();
         void clusterKmeans();
         void clusterKmedoid();
+        // Clusters the lines with DBSCAN, which needs no number of clusters.
+        void clusterDensity();
         void initDisplay();
         void publish();
         // This is the callback that is called by the dynamic reconfigure.
@@ -529,7 +580,6 @@ namespace line_ros_utility {
         size_t iteration_;
         size_t frame_step_;
         cv::Mat cv_image_;
-        cv::Mat cv_img_gray_;
         cv::Mat cv_cloud_;
         cv::Mat cv_depth_;
         cv::Mat cv_instances_;
@@ -544,10 +594,7 @@ namespace line_ros_utility {
         std::vector<cv::Vec4f> lines2D_;
         // All the 2D lines kept (bijection with lines3D_).
         std::vector<cv::Vec4f> lines2D_kept_;
-        // A temporary variable to store the 2D lines kept.
-        std::vector<cv::Vec4f> lines2D_kept_tmp_;
         std::vector<cv::Vec<float, 6>> lines3D_;
-        std::vector<line_detection::LineWithPlanes> lines3D_temp_wp_;
         std::vector<line_detection::LineWithPlanes> lines3D_with_planes_;
         std::vector<int> labels_;
         std::vector<int> class_ids_;
@@ -575,11 +622,36 @@ namespace line_ros_utility {
         // To store parameters.
         line_detection::LineDetectionParams params_;
         size_t detector_method_;
+        bool track_lines_;
+        // Whether the lines are clustered with streaming_kmeans_cluster_,
+        // which reuses the clusters of the previous frame.
+        bool streaming_kmeans_ = false;
+        // Pose of the camera in the previous frame processed with tracking or
+        // streaming clustering, and the motion since then.
+        tf::Transform previous_camera_pose_;
+        bool has_previous_camera_pose_ = false;
+        cv::Matx44f transform_current_previous_ = cv::Matx44f::eye();
         size_t number_of_clusters_;
+        double density_max_distance_;
+        size_t density_min_neighbours_;
         size_t show_lines_or_clusters_;
         // To have the line_detection utility.
         line_detection::LineDetector line_detector_;
+        // Per-frame state of the detector, kept from one frame to the next for
+        // its buffers and for the tracking of the lines.
+        line_detection::DetectionContext detection_context_;
+        // Result of the line_detection pipeline. Its vectors are swapped with the
+        // ones above, so that they are reused from one frame to the next.
+        line_detection::FrameResult frame_result_;
+        // To sample the points (and instance labels) around the lines.
+        line_detection::PatchSampler patch_sampler_;
+        line_detection::PatchSamples patch_samples_;
         line_clustering::KMeansCluster kmeans_cluster_;
+        line_clustering::StreamingKMeansCluster streaming_kmeans_cluster_;
+        line_clustering::DBSCANCluster dbscan_cluster_;
+        // The labels of the last k-means clustering (of kmeans_cluster_ or
+        // streaming_kmeans_cluster_).
+        const std::vector<int>* kmeans_labels_ = &kmeans_cluster_.cluster_idx_;
         DisplayClusters display_clusters_;
         DisplayLines display_lines_;
         // To dynamically reconfigure parameters.
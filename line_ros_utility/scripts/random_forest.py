@@ -32,6 +32,22 @@ class RandomForestDistanceMeasure():
         self.random_forest.fit(self.data, self.labels)
         self.cvbridge = CvBridge()
 
+    def export_forest(self, path):
+        # Writes the trees with their splits, to be loaded with
+        # TreeClassifier::loadForest: the number of trees, then for every tree
+        # its number of nodes and a line per node with its children, feature
+        # and threshold (-1 and -2 for the leaves).
+        with open(path, 'w') as forest_file:
+            forest_file.write('%d\n' % len(self.random_forest.estimators_))
+            for estimator in self.random_forest.estimators_:
+                tree = estimator.tree_
+                forest_file.write('%d\n' % tree.node_count)
+                for j in range(tree.node_count):
+                    forest_file.write('%d %d %d %.17g\n' % (
+                        tree.children_left[j], tree.children_right[j],
+                        tree.feature[j], tree.threshold[j]))
+        print 'Exported the random forest to ' + path
+
     def return_trees(self, req):
         print 'Received tree request.'
         image_list = []
@@ -60,6 +76,9 @@ class RandomForestDistanceMeasure():
 def run():
     rospy.init_node('random_forest_server')
     rf = RandomForestDistanceMeasure()
+    export_path = rospy.get_param('~export_path', '')
+    if export_path:
+        rf.export_forest(export_path)
     service = rospy.Service('req_trees', TreeRequest, rf.return_trees)
     service = rospy.Service('req_decision_paths',
                             RequestDecisionPath, rf.return_decision_paths)
@@ -235,7 +235,6 @@ namespace line_ros_utility {
                 service_extract_lines_.response.lines[i].end3D.y),
             static_cast<float>(
                 service_extract_lines_.response.lines[i].end3D.z)};
-        (*lines)[i].hessians.resize(2);
         (*lines)[i].hessians[0] =
             {service_extract_lines_.response.lines[i].hessian_right[0],
              service_extract_lines_.response.lines[i].hessian_right[1],
@@ -1,6 +1,8 @@
 #include "line_ros_utility/line_ros_utility.h"
 
+#include <algorithm>
 #include <fstream>
+#include <numeric>
 #include <sstream>
 #include <cstdlib>
 
@@ -259,9 +261,14 @@ namespace line_ros_utility {
 
         // Add the parameters utility to line_detection.
         line_detector_ = line_detection::LineDetector(&params_);
-        // Retrieve trees.
+        // Retrieve trees. With an exported forest, the decision paths are computed
+        // in process and random_forest.py does not need to run.
         if (clustering_with_random_forest) {
-            tree_classifier_.getTrees();
+            std::string forest_path;
+            ros::NodeHandle("~").param<std::string>("random_forest_model", forest_path, "");
+            if (forest_path.empty() || !tree_classifier_.loadForest(forest_path)) {
+                tree_classifier_.getTrees();
+            }
         }
     }
     ListenAndPublish::~ListenAndPublish() { delete sync_; }
@@ -336,46 +343,64 @@ namespace line_ros_utility {
                 boost::bind(&ListenAndPublish::masterCallback, this, _1, _2, _3, _4, _5, _6));
     }
 
-    void ListenAndPublish::detectLines() {
-        // Detect lines on image.
-        std::vector<cv::Vec4f> lines2D_not_fused;
-
-        start_time_ = std::chrono::system_clock::now();
-        line_detector_.detectLines(cv_img_gray_, detector_method_,
-                                   &lines2D_not_fused);
-        ROS_INFO("Lines found before fusing: %lu", lines2D_not_fused.size());
-        lines2D_.clear();
-        line_detector_.fuseLines2D(lines2D_not_fused, &lines2D_);
+    void ListenAndPublish::processFrame(const tf::StampedTransform& camera_pose) {
+        line_detection::FrameOptions options;
+        options.frame_index = iteration_;
+        options.detector =
+                static_cast<line_detection::DetectorType>(detector_method_);
+        options.track_lines = track_lines_;
+        const bool use_camera_motion = track_lines_ || streaming_kmeans_;
+        if (use_camera_motion && has_previous_camera_pose_) {
+            // Transform from the previous to the current camera frame.
+            const tf::Transform motion =
+                    camera_pose.inverse() * previous_camera_pose_;
+            const tf::Matrix3x3& rotation = motion.getBasis();
+            const tf::Vector3& translation = motion.getOrigin();
+            for (int i = 0; i < 3; ++i) {
+                for (int j = 0; j < 3; ++j) {
+                    options.transform_current_previous(i, j) = rotation[i][j];
+                }
+                options.transform_current_previous(i, 3) = translation[i];
+            }
+        }
+        transform_current_previous_ = options.transform_current_previous;
+        previous_camera_pose_ = camera_pose;
+        has_previous_camera_pose_ = use_camera_motion;
+        line_detector_.processFrame(cv_image_, cv_cloud_, camera_P_, options,
+                                    &frame_result_, &detection_context_);
+        lines2D_.swap(frame_result_.lines2D_detected);
+        lines2D_kept_.swap(frame_result_.lines2D);
+        lines3D_with_planes_.swap(frame_result_.lines3D);
+        const line_detection::FrameTimings& timings = frame_result_.timings;
+        ROS_INFO("Lines found before fusing: %lu",
+                 frame_result_.num_lines2D_before_fusion);
         ROS_INFO("Lines found after fusing: %lu", lines2D_.size());
-        end_time_ = std::chrono::system_clock::now();
-        elapsed_seconds_ = end_time_ - start_time_;
-        ROS_INFO("Detecting lines 2D: %f", elapsed_seconds_.count());
-    }
-
-    void ListenAndPublish::projectTo3D() {
-        lines3D_temp_wp_.clear();
-        start_time_ = std::chrono::system_clock::now();
-        line_detector_.project2Dto3DwithPlanes(cv_cloud_, cv_image_, camera_P_,
-                                               lines2D_, true, &lines2D_kept_tmp_,
-                                               &lines3D_temp_wp_);
-        end_time_ = std::chrono::system_clock::now();
-        elapsed_seconds_ = end_time_ - start_time_;
-        ROS_INFO("Projecting to 3D: %f", elapsed_seconds_.count());
-        line_detector_.displayStatistics();
-    }
-
-    void ListenAndPublish::checkLines() {
-        lines3D_with_planes_.clear();
-        start_time_ = std::chrono::system_clock::now();
-        line_detector_.runCheckOn3DLines(cv_cloud_, camera_P_, lines2D_kept_tmp_,
-                                         lines3D_temp_wp_, &lines2D_kept_,
-                                         &lines3D_with_planes_);
-        end_time_ = std::chrono::system_clock::now();
-        elapsed_seconds_ = end_time_ - start_time_;
-        ROS_INFO("Check for valid lines: %f", elapsed_seconds_.count());
+        ROS_INFO("Detecting lines 2D: %f", timings.detection + timings.fusion);
+        ROS_INFO("Projecting to 3D: %f", timings.projection);
+        line_detector_.displayStatistics(detection_context_);
+        ROS_INFO("Lines successfully projected to 3D: %lu/%lu",
+                 frame_result_.num_lines3D_before_check, lines2D_.size());
+        ROS_INFO("Check for valid lines: %f", timings.check);
+        ROS_INFO("Lines kept after check: %lu/%lu",
+                 lines3D_with_planes_.size(),
+                 frame_result_.num_lines3D_before_check);
     }
 
     void ListenAndPublish::clusterKmeans() {
+        if (streaming_kmeans_) {
+            // The clusters of the previous frame are moved with the camera and
+            // updated with the new lines.
+            start_time_ = std::chrono::system_clock::now();
+            streaming_kmeans_cluster_.setNumberOfClusters(number_of_clusters_);
+            streaming_kmeans_cluster_.cluster(lines3D_with_planes_,
+                                              transform_current_previous_);
+            kmeans_labels_ = &streaming_kmeans_cluster_.cluster_idx_;
+            end_time_ = std::chrono::system_clock::now();
+            elapsed_seconds_ = end_time_ - start_time_;
+            ROS_INFO("Clustering: %f", elapsed_seconds_.count());
+            return;
+        }
+        kmeans_labels_ = &kmeans_cluster_.cluster_idx_;
         kmeans_cluster_.setNumberOfClusters(number_of_clusters_);
         kmeans_cluster_.setLines(lines3D_with_planes_);
         // Start the clustering.
@@ -387,6 +412,18 @@ namespace line_ros_utility {
         ROS_INFO("Clustering: %f", elapsed_seconds_.count());
     }
 
+    void ListenAndPublish::clusterDensity() {
+        dbscan_cluster_.setMaxDistance(density_max_distance_);
+        dbscan_cluster_.setMinNumNeighbours(density_min_neighbours_);
+        dbscan_cluster_.setLines(lines3D_with_planes_);
+        start_time_ = std::chrono::system_clock::now();
+        dbscan_cluster_.cluster();
+        end_time_ = std::chrono::system_clock::now();
+        elapsed_seconds_ = end_time_ - start_time_;
+        ROS_INFO("Density-based clustering: %f", elapsed_seconds_.count());
+        ROS_INFO("Clusters found: %lu", dbscan_cluster_.getNumberOfClusters());
+    }
+
     void ListenAndPublish::clusterKmedoid() {
         start_time_ = std::chrono::system_clock::now();
         tree_classifier_.getLineDecisionPath(lines3D_with_planes_);
@@ -395,8 +432,9 @@ namespace line_ros_utility {
         elapsed_seconds_ = end_time_ - start_time_;
         ROS_INFO("Retrieving distance matrix: %f", elapsed_seconds_.count());
 
-        kmedoids_cluster_.setDistanceMatrix(tree_classifier_.getDistanceMatrix());
+        kmedoids_cluster_.setDistanceMatrix(tree_classifier_.getPackedDistanceMatrix());
         kmedoids_cluster_.setK(number_of_clusters_);
+        kmedoids_cluster_.setMethod(line_clustering::KMedoidsMethod::FASTER_PAM);
         start_time_ = std::chrono::system_clock::now();
         kmedoids_cluster_.cluster();
         end_time_ = std::chrono::system_clock::now();
@@ -415,13 +453,24 @@ namespace line_ros_utility {
         display_clusters_.setFrameID(frame_id);
         if (show_lines_or_clusters_ == 0) {
             display_clusters_.setClusters(lines3D_with_planes_,
-                                          kmeans_cluster_.cluster_idx_);
+                                          *kmeans_labels_);
         } else if (show_lines_or_clusters_ == 1) {
             display_clusters_.setClusters(
                     lines3D_with_planes_, line_ros_utility::clusterLinesAfterClassification(
                             lines3D_with_planes_));
         } else if (show_lines_or_clusters_ == 2) {
             display_clusters_.setClusters(lines3D_with_planes_, labels_);
+        } else if (show_lines_or_clusters_ == 4) {
+            // The lines labeled as noise are not displayed.
+            const std::vector<int> labels = dbscan_cluster_.getLabels();
+            std::vector<line_detection::LineWithPlanes> lines_in_clusters;
+            std::vector<int> labels_in_clusters;
+            for (size_t i = 0u; i < labels.size(); ++i) {
+                if (labels[i] == line_clustering::DBSCANCluster::kNoise) continue;
+                lines_in_clusters.push_back(lines3D_with_planes_[i]);
+                labels_in_clusters.push_back(labels[i]);
+            }
+            display_clusters_.setClusters(lines_in_clusters, labels_in_clusters);
         } else {
             display_clusters_.setClusters(lines3D_with_planes_, labels_rf_kmedoids_);
         }
@@ -470,9 +519,20 @@ namespace line_ros_utility {
         params_.hough_detector_threshold = config.hough_detector_threshold;
         params_.hough_detector_minLineLength = config.hough_detector_minLineLength;
         params_.hough_detector_maxLineGap = config.hough_detector_maxLineGap;
+        params_.num_threads_detection = config.num_threads_detection;
+        params_.detection_num_tiles_x = config.detection_num_tiles_x;
+        params_.detection_num_tiles_y = config.detection_num_tiles_y;
+        params_.num_threads_projection = config.num_threads_projection;
 
         detector_method_ = config.detector;
+        track_lines_ = config.track_lines;
+        if (streaming_kmeans_ && !config.streaming_kmeans) {
+            streaming_kmeans_cluster_.reset();
+        }
+        streaming_kmeans_ = config.streaming_kmeans;
         number_of_clusters_ = config.number_of_clusters;
+        density_max_distance_ = config.density_max_distance;
+        density_min_neighbours_ = config.density_min_neighbours;
         show_lines_or_clusters_ = config.clustering;
     }
 
@@ -518,17 +578,9 @@ namespace line_ros_utility {
         camera_model.fromCameraInfo(camera_info_);
         camera_P_ = cv::Mat(camera_model.projectionMatrix());
         camera_P_.convertTo(camera_P_, CV_32F);
-        // Convert image to grayscale. That is needed for the line detection.
-        cv::cvtColor(cv_image_, cv_img_gray_, CV_RGB2GRAY);
 
         ROS_INFO("**** New Image**** Frame %lu****", iteration_);
-        detectLines();
-        projectTo3D();
-        ROS_INFO("Lines successfully projected to 3D: %lu/%lu",
-                 lines3D_temp_wp_.size(), lines2D_.size());
-        checkLines();
-        ROS_INFO("Lines kept after check: %lu/%lu",
-                 lines3D_with_planes_.size(), lines3D_temp_wp_.size());
+        processFrame(transform);
 
         CHECK_EQ(static_cast<int>(lines3D_with_planes_.size()),
                  static_cast<int>(lines2D_kept_.size()));
@@ -545,6 +597,9 @@ namespace line_ros_utility {
         if (clustering_with_random_forest) {
             clusterKmedoid();
         }
+        if (show_lines_or_clusters_ == 4) {
+            clusterDensity();
+        }
 
         extractNormalsFromLines(lines3D_with_planes_, &line_normals_);
         checkLinesOpen(lines3D_with_planes_, cv_depth_, camera_info_, &line_opens_);
@@ -1023,43 +1078,33 @@ namespace line_ros_utility {
 
         // Take rectangles and find points within them.
         std::vector<cv::Point2f> rect_left, rect_right;
-        std::vector<cv::Point2i> points_in_rect;
         // Each point in the vectors is a pair of a cv::Vec3f (coordinates) and of
         // an unsigned short representing the instance label.
         std::vector<std::pair<cv::Vec3f, unsigned short>> points_left_plane,
                 points_right_plane;
         std::vector<std::pair<cv::Vec3f, unsigned short>> valid_points_left_plane,
                 valid_points_right_plane;
-        unsigned short instance_label;
+        // Points with no depth information are not discarded here.
+        constexpr bool kDiscardIfNoDepth = false;
 
         line_detector_.getRectanglesFromLine(line_2D, &rect_left, &rect_right);
+        patch_sampler_.setCloud(cv_cloud_);
+        patch_sampler_.setLabels(instances);
         // (Left side)
-        line_detection::findPointsInRectangle(rect_left, &points_in_rect);
+        patch_sampler_.sample(rect_left, kDiscardIfNoDepth, &patch_samples_);
         points_left_plane.clear();
-        for (size_t j = 0; j < points_in_rect.size(); ++j) {
-            if (points_in_rect[j].x < 0 || points_in_rect[j].x >= instances.cols ||
-                points_in_rect[j].y < 0 || points_in_rect[j].y >= instances.rows) {
-                continue;
-            }
-            if (std::isnan(cv_cloud_.at<cv::Vec3f>(points_in_rect[j])[0])) continue;
-            instance_label = instances.at<unsigned short>(points_in_rect[j]);
+        for (size_t j = 0; j < patch_samples_.points.size(); ++j) {
             points_left_plane.push_back(
-                    std::make_pair(cv_cloud_.at<cv::Vec3f>(points_in_rect[j]),
-                                   instance_label));
+                    std::make_pair(patch_samples_.points[j],
+                                   patch_samples_.labels[j]));
         }
         // (Right side)
-        line_detection::findPointsInRectangle(rect_right, &points_in_rect);
+        patch_sampler_.sample(rect_right, kDiscardIfNoDepth, &patch_samples_);
         points_right_plane.clear();
-        for (size_t j = 0; j < points_in_rect.size(); ++j) {
-            if (points_in_rect[j].x < 0 || points_in_rect[j].x >= instances.cols ||
-                points_in_rect[j].y < 0 || points_in_rect[j].y >= instances.rows) {
-                continue;
-            }
-            if (std::isnan(cv_cloud_.at<cv::Vec3f>(points_in_rect[j])[0])) continue;
-            instance_label = instances.at<unsigned short>(points_in_rect[j]);
+        for (size_t j = 0; j < patch_samples_.points.size(); ++j) {
             points_right_plane.push_back(
-                    std::make_pair(cv_cloud_.at<cv::Vec3f>(points_in_rect[j]),
-                                   instance_label));
+                    std::make_pair(patch_samples_.points[j],
+                                   patch_samples_.labels[j]));
         }
 
         // Find which of the two sets of inliers belong to each plane, i.e., which
@@ -1690,11 +1735,14 @@ namespace line_ros_utility {
             ros::shutdown();
         }
         trees_.resize(tree_service.response.trees.size());
+        forest_loaded_ = false;
         for (size_t i = 0u; i < tree_service.response.trees.size(); ++i) {
             cv_bridge::CvImagePtr cv_ptr_ =
                     cv_bridge::toCvCopy(tree_service.response.trees[i], "64FC1");
             trees_[i].children_left.clear();
             trees_[i].children_right.clear();
+            trees_[i].features.clear();
+            trees_[i].thresholds.clear();
             for (size_t j = 0u; j < static_cast<size_t>(cv_ptr_->image.cols); ++j) {
                 trees_[i].children_left.push_back(cv_ptr_->image.at<double>(0, j));
                 trees_[i].children_right.push_back(cv_ptr_->image.at<double>(1, j));
@@ -1702,39 +1750,152 @@ namespace line_ros_utility {
         }
     }
 
+    bool readForest(std::istream& stream, std::vector<SearchTree>* trees) {
+        CHECK_NOTNULL(trees);
+        size_t num_trees;
+        if (!(stream >> num_trees) || num_trees == 0) {
+            return false;
+        }
+        trees->assign(num_trees, SearchTree());
+        for (SearchTree& tree : *trees) {
+            size_t num_nodes;
+            if (!(stream >> num_nodes) || num_nodes == 0) {
+                return false;
+            }
+            tree.children_left.resize(num_nodes);
+            tree.children_right.resize(num_nodes);
+            tree.features.resize(num_nodes);
+            tree.thresholds.resize(num_nodes);
+            for (size_t j = 0u; j < num_nodes; ++j) {
+                // The leaves have no children (-1) and no feature.
+                long left, right;
+                if (!(stream >> left >> right >> tree.features[j] >> tree.thresholds[j])) {
+                    return false;
+                }
+                const bool is_leaf = left < 0 && right < 0;
+                if (!is_leaf && (left <= static_cast<long>(j) || right <= static_cast<long>(j) ||
+                                 left >= static_cast<long>(num_nodes) ||
+                                 right >= static_cast<long>(num_nodes) ||
+                                 tree.features[j] < 0 ||
+                                 tree.features[j] >= static_cast<int>(kNumLineFeatures))) {
+                    ROS_ERROR("Invalid node %lu in the random forest.", j);
+                    return false;
+                }
+                tree.children_left[j] = static_cast<size_t>(left);
+                tree.children_right[j] = static_cast<size_t>(right);
+            }
+        }
+        return true;
+    }
+
+    void getDecisionPath(const SearchTree& tree, const std::vector<float>& features,
+                         std::vector<uint32_t>* path) {
+        CHECK_NOTNULL(path);
+        CHECK_EQ(features.size(), kNumLineFeatures);
+        path->clear();
+        size_t node = 0u;
+        path->push_back(node);
+        while (tree.children_left[node] != tree.children_right[node]) {
+            node = features[tree.features[node]] <= tree.thresholds[node]
+                           ? tree.children_left[node]
+                           : tree.children_right[node];
+            path->push_back(node);
+        }
+    }
+
+    size_t numNodesOnOnePath(const uint32_t* path1, const uint32_t* end1,
+                             const uint32_t* path2, const uint32_t* end2) {
+        // The nodes on only one of the paths are counted from the number of
+        // nodes on both, found by merging the sorted paths.
+        size_t num_different = (end1 - path1) + (end2 - path2);
+        while (path1 != end1 && path2 != end2) {
+            if (*path1 < *path2) {
+                ++path1;
+            } else if (*path2 < *path1) {
+                ++path2;
+            } else {
+                num_different -= 2u;
+                ++path1;
+                ++path2;
+            }
+        }
+        return num_different;
+    }
+
+    bool TreeClassifier::loadForest(const std::string& path) {
+        std::ifstream file(path);
+        if (!file.is_open()) {
+            ROS_ERROR("Could not open the random forest %s.", path.c_str());
+            return false;
+        }
+        std::vector<SearchTree> trees;
+        if (!readForest(file, &trees)) {
+            ROS_ERROR("Could not read the random forest %s.", path.c_str());
+            return false;
+        }
+        trees_.swap(trees);
+        forest_loaded_ = true;
+        return true;
+    }
+
+    void TreeClassifier::getLineFeatures(const line_detection::LineWithPlanes& line,
+                                         std::vector<float>* features) {
+        CHECK_NOTNULL(features);
+        features->clear();
+        for (size_t j = 0u; j < 6; ++j) {
+            features->push_back(line.line[j]);
+        }
+        for (size_t j = 0u; j < 4; ++j) {
+            features->push_back(line.hessians[0][j]);
+        }
+        for (size_t j = 0u; j < 4; ++j) {
+            features->push_back(line.hessians[1][j]);
+        }
+        for (size_t j = 0u; j < 3; ++j) {
+            features->push_back((float)line.colors[0][j]);
+        }
+        for (size_t j = 0u; j < 3; ++j) {
+            features->push_back((float)line.colors[1][j]);
+        }
+        if (line.type == line_detection::LineType::DISCONT) {
+            features->push_back(0.0);
+        } else if (line.type == line_detection::LineType::PLANE) {
+            features->push_back(1.0);
+        } else if (line.type == line_detection::LineType::EDGE) {
+            features->push_back(2.0);
+        } else {
+            features->push_back(3.0);
+        }
+        CHECK_EQ(features->size(), kNumLineFeatures);
+    }
+
     void TreeClassifier::getLineDecisionPath(
             const std::vector<line_detection::LineWithPlanes>& lines) {
-        line_ros_utility::RequestDecisionPath service;
         num_lines_ = lines.size();
+        const size_t num_trees = trees_.size();
+        std::vector<std::vector<uint32_t>> paths(num_lines_ * num_trees);
         if (num_lines_ < 1) {
+            setDecisionPaths(&paths);
             return;
         }
+        std::vector<float> features;
+        if (forest_loaded_) {
+            // Pass every line down every tree.
+            for (size_t i = 0u; i < num_lines_; ++i) {
+                getLineFeatures(lines[i], &features);
+                for (size_t k = 0u; k < num_trees; ++k) {
+                    getDecisionPath(trees_[k], features, &paths[i * num_trees + k]);
+                }
+            }
+            setDecisionPaths(&paths);
+            return;
+        }
+        line_ros_utility::RequestDecisionPath service;
         // Fill in the line.
         for (size_t i = 0u; i < num_lines_; ++i) {
-            for (size_t j = 0u; j < 6; ++j) {
-                service.request.lines.push_back(lines[i].line[j]);
-            }
-            for (size_t j = 0u; j < 4; ++j) {
-                service.request.lines.push_back(lines[i].hessians[0][j]);
-            }
-            for (size_t j = 0u; j < 4; ++j) {
-                service.request.lines.push_back(lines[i].hessians[1][j]);
-            }
-            for (size_t j = 0u; j < 3; ++j) {
-                service.request.lines.push_back((float)lines[i].colors[0][j]);
-            }
-            for (size_t j = 0u; j < 3; ++j) {
-                service.request.lines.push_back((float)lines[i].colors[1][j]);
-            }
-            if (lines[i].type == line_detection::LineType::DISCONT) {
-                service.request.lines.push_back(0.0);
-            } else if (lines[i].type == line_detection::LineType::PLANE) {
-                service.request.lines.push_back(1.0);
-            } else if (lines[i].type == line_detection::LineType::EDGE) {
-                service.request.lines.push_back(2.0);
-            } else {
-                service.request.lines.push_back(3.0);
-            }
+            getLineFeatures(lines[i], &features);
+            service.request.lines.insert(service.request.lines.end(), features.begin(),
+                                         features.end());
         }
         // Call the service.
         if (!line_client_.call(service)) {
@@ -1742,68 +1903,65 @@ namespace line_ros_utility {
             ros::shutdown();
         }
         // Make sure the data received fits the stored trees_.
-        CHECK_EQ(service.response.decision_paths.size(), trees_.size());
-        decision_paths_.resize(trees_.size());
-        // For every tree, fill in the decision paths.
-        for (size_t i = 0u; i < trees_.size(); ++i) {
+        CHECK_EQ(service.response.decision_paths.size(), num_trees);
+        // For every tree, the paths are received as pairs {line, node}.
+        for (size_t k = 0u; k < num_trees; ++k) {
             cv_bridge::CvImagePtr cv_ptr_ =
-                    cv_bridge::toCvCopy(service.response.decision_paths[i], "64FC1");
+                    cv_bridge::toCvCopy(service.response.decision_paths[k], "64FC1");
             CHECK_EQ(cv_ptr_->image.rows, 2);
-            decision_paths_[i].release();
-            int size[2] = {(int)num_lines_, 60000};
-            decision_paths_[i].create(2, size, CV_8U);
             for (size_t j = 0u; j < static_cast<size_t>(cv_ptr_->image.cols); ++j) {
-                decision_paths_[i].ref<unsigned char>(
-                        cv_ptr_->image.at<double>(0, j), cv_ptr_->image.at<double>(1, j)) = 1;
+                const size_t line = cv_ptr_->image.at<double>(0, j);
+                CHECK_LT(line, num_lines_);
+                paths[line * num_trees + k].push_back(cv_ptr_->image.at<double>(1, j));
             }
         }
+        setDecisionPaths(&paths);
     }
 
-    double TreeClassifier::computeDistance(const SearchTree& tree,
-                                           const cv::SparseMat& path,
-                                           size_t line_idx1, size_t line_idx2,
-                                           size_t idx) {
-        if (path.value<double>(line_idx1, idx) != 0 &&
-            path.value<double>(line_idx2, idx) != 0) {
-            if (tree.children_right[idx] == tree.children_left[idx]) {  // At leaves.
-                return 0.0;
-            } else {
-                return computeDistance(tree, path, line_idx1, line_idx2,
-                                       tree.children_right[idx]) +
-                       computeDistance(tree, path, line_idx1, line_idx2,
-                                       tree.children_left[idx]);
-            }
-        } else if (path.value<double>(line_idx1, idx) != 0 ||
-                   path.value<double>(line_idx2, idx) != 0) {
-            if (tree.children_right[idx] == tree.children_left[idx]) {
-                return 1.0;
-            } else {
-                return computeDistance(tree, path, line_idx1, line_idx2,
-                                       tree.children_right[idx]) +
-                       computeDistance(tree, path, line_idx1, line_idx2,
-                                       tree.children_left[idx]) +
-                       1.0;
-            }
-        } else {
-            return 0.0;
+    void TreeClassifier::setDecisionPaths(std::vector<std::vector<uint32_t>>* paths) {
+        CHECK_NOTNULL(paths);
+        path_nodes_.clear();
+        path_offsets_.resize(paths->size() + 1);
+        path_offsets_[0] = 0u;
+        for (size_t i = 0u; i < paths->size(); ++i) {
+            std::vector<uint32_t>& path = (*paths)[i];
+            std::sort(path.begin(), path.end());
+            path_nodes_.insert(path_nodes_.end(), path.begin(), path.end());
+            path_offsets_[i + 1] = path_nodes_.size();
         }
     }
 
-    void TreeClassifier::computeDistanceMatrix() {
-        dist_matrix_ = cv::Mat(num_lines_, num_lines_, CV_32FC1, 0.0f);
-        float dummy;
-        for (size_t i = 0u; i < num_lines_; ++i) {
-            for (size_t j = i + 1; j < num_lines_; ++j) {
-                dummy = 0;
-                for (size_t k = 0u; k < trees_.size(); ++k) {
-                    dummy += computeDistance(trees_[k], decision_paths_[k], i, j, 0);
-                }
-                dist_matrix_.at<float>(i, j) = dummy / (double)trees_.size();
-            }
+    double TreeClassifier::computeDistance(size_t line_idx1, size_t line_idx2) const {
+        const size_t num_trees = trees_.size();
+        if (num_trees == 0u) {
+            return 0.0;
+        }
+        size_t num_different = 0u;
+        for (size_t k = 0u; k < num_trees; ++k) {
+            const uint32_t* path1 = path_nodes_.data() + path_offsets_[line_idx1 * num_trees + k];
+            const uint32_t* end1 = path_nodes_.data() + path_offsets_[line_idx1 * num_trees + k + 1];
+            const uint32_t* path2 = path_nodes_.data() + path_offsets_[line_idx2 * num_trees + k];
+            const uint32_t* end2 = path_nodes_.data() + path_offsets_[line_idx2 * num_trees + k + 1];
+            num_different += numNodesOnOnePath(path1, end1, path2, end2);
         }
+        return num_different / static_cast<double>(num_trees);
+    }
+
+    void TreeClassifier::computeDistanceMatrix(size_t num_threads) {
+        CHECK_EQ(path_offsets_.size(), num_lines_ * trees_.size() + 1);
+        std::vector<size_t> lines(num_lines_);
+        std::iota(lines.begin(), lines.end(), 0u);
+        dist_matrix_.compute(
+                lines, [this](size_t i, size_t j) { return computeDistance(i, j); },
+                num_threads);
     }
 
-    cv::Mat TreeClassifier::getDistanceMatrix() { return dist_matrix_; }
+    cv::Mat TreeClassifier::getDistanceMatrix() { return dist_matrix_.toMat(); }
+
+    const line_clustering::PackedDistanceMatrix& TreeClassifier::getPackedDistanceMatrix()
+            const {
+        return dist_matrix_;
+    }
 
     EvalData::EvalData(const std::vector<line_detection::LineWithPlanes>& lines3D) {
         lines3D_.clear();
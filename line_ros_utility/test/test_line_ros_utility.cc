@@ -0,0 +1,93 @@
+#include <sstream>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "line_ros_utility/line_ros_utility.h"
+#include "line_ros_utility/test/testing-entrypoint.h"
+
+namespace line_ros_utility {
+
+class TreeClassifierTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    // A tree that splits on the first coordinate of the line and then on its
+    // type, followed by a tree with a single leaf. The leaves have no children
+    // and no feature (-1 and -2, as written by random_forest.py).
+    std::istringstream forest(
+        "2\n"
+        "5\n"
+        "1 2 0 0.5\n"
+        "-1 -1 -2 -2\n"
+        "3 4 20 1.5\n"
+        "-1 -1 -2 -2\n"
+        "-1 -1 -2 -2\n"
+        "1\n"
+        "-1 -1 -2 -2\n");
+    ASSERT_TRUE(readForest(forest, &trees_));
+  }
+
+  std::vector<SearchTree> trees_;
+};
+
+TEST_F(TreeClassifierTest, testReadForest) {
+  ASSERT_EQ(trees_.size(), 2u);
+  ASSERT_EQ(trees_[0].children_left.size(), 5u);
+  EXPECT_EQ(trees_[0].children_left[0], 1u);
+  EXPECT_EQ(trees_[0].children_right[0], 2u);
+  EXPECT_EQ(trees_[0].features[2], 20);
+  EXPECT_DOUBLE_EQ(trees_[0].thresholds[2], 1.5);
+  ASSERT_EQ(trees_[1].children_left.size(), 1u);
+  // The feature of a split must be one of those of a line.
+  std::vector<SearchTree> trees;
+  std::istringstream invalid_feature("1\n3\n1 2 21 0.5\n-1 -1 -2 -2\n-1 -1 -2 -2\n");
+  EXPECT_FALSE(readForest(invalid_feature, &trees));
+  std::istringstream negative_feature("1\n3\n1 2 -1 0.5\n-1 -1 -2 -2\n-1 -1 -2 -2\n");
+  EXPECT_FALSE(readForest(negative_feature, &trees));
+  // The children must come after their parent.
+  std::istringstream invalid_child("1\n3\n-1 -1 -2 -2\n0 2 0 0.5\n-1 -1 -2 -2\n");
+  EXPECT_FALSE(readForest(invalid_child, &trees));
+  std::istringstream truncated("1\n3\n1 2 0 0.5\n-1 -1 -2 -2\n");
+  EXPECT_FALSE(readForest(truncated, &trees));
+}
+
+TEST_F(TreeClassifierTest, testDecisionPaths) {
+  // Features of three lines: the first goes left at the root, the two others
+  // go right and are split by their type (DISCONT and INTERSECT).
+  std::vector<float> features[3];
+  for (std::vector<float>& line_features : features) {
+    line_features.assign(kNumLineFeatures, 0.0f);
+  }
+  features[1][0] = 1.0f;
+  features[2][0] = 1.0f;
+  features[2][20] = 3.0f;
+  std::vector<uint32_t> paths[3];
+  for (size_t i = 0; i < 3; ++i) {
+    getDecisionPath(trees_[0], features[i], &paths[i]);
+  }
+  EXPECT_EQ(paths[0], std::vector<uint32_t>({0, 1}));
+  EXPECT_EQ(paths[1], std::vector<uint32_t>({0, 2, 3}));
+  EXPECT_EQ(paths[2], std::vector<uint32_t>({0, 2, 4}));
+  std::vector<uint32_t> path_single_leaf;
+  getDecisionPath(trees_[1], features[2], &path_single_leaf);
+  EXPECT_EQ(path_single_leaf, std::vector<uint32_t>({0}));
+
+  // The distance of two lines in a tree is the number of nodes on only one of
+  // their paths.
+  auto distance = [&paths](size_t i, size_t j) {
+    return numNodesOnOnePath(paths[i].data(), paths[i].data() + paths[i].size(),
+                             paths[j].data(), paths[j].data() + paths[j].size());
+  };
+  EXPECT_EQ(distance(0, 0), 0u);
+  EXPECT_EQ(distance(0, 1), 3u);
+  EXPECT_EQ(distance(1, 0), 3u);
+  EXPECT_EQ(distance(0, 2), 3u);
+  EXPECT_EQ(distance(1, 2), 2u);
+  EXPECT_EQ(numNodesOnOnePath(paths[0].data(), paths[0].data(), paths[1].data(),
+                              paths[1].data() + paths[1].size()),
+            3u);
+}
+
+}  // namespace line_ros_utility
+
+LINE_ROS_UTILITY_TESTING_ENTRYPOINT